@@ -2,8 +2,15 @@
 #define ANOMALYDETECTOR_HPP
 
 #include "SensorData.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
 #include <vector>
 
+class ThresholdProfiles;
+class DynamicRulePipeline;
+class ShardedRulePipeline;
+
 class AnomalyDetector {
 public:
     struct AnomalyThresholds {
@@ -15,13 +22,79 @@ public:
         double maxLight = 1000.0;  // lux
     };
 
+    // Column-wise view of count readings, e.g. from a columnar store
+    struct SensorColumns {
+        const double* temperature;
+        const double* humidity;
+        const double* lightIntensity;
+        size_t count;
+        const uint32_t* sensorIds = nullptr; // Null: every reading uses the default profile
+    };
+
+    // Instruction sets the batch kernels are written for
+    enum class BatchKernel { SCALAR, SSE2, AVX2 };
+
     AnomalyDetector(); // Added default constructor
     AnomalyDetector(AnomalyThresholds thresholds); // Removed default argument
+    // Classifies each reading with the profile of its sensorId
+    AnomalyDetector(const ThresholdProfiles& profiles);
+
+    // A copy that also applies rules, their per-sensor state starting empty. A reading is then
+    // anomalous if it is out of its thresholds or any rule fires on it.
+    AnomalyDetector withRules(const DynamicRulePipeline& rules) const;
+    // A copy classifying with profiles, keeping the rules and sharing their state
+    AnomalyDetector withThresholds(const ThresholdProfiles& profiles) const;
+    // A copy with the same rules and fresh state, for replaying a history in order
+    AnomalyDetector withFreshRuleState() const;
+    // Null without rules
+    const ShardedRulePipeline* rules() const { return rules_.get(); }
+    std::vector<std::string> ruleNames() const;
+    // Rules whose verdict depends on the sensor's earlier readings (bit i for rule i)
+    uint32_t statefulRuleMask() const;
+
+    // Judges a reading on its own: the thresholds and the rules without per-sensor state
     bool isAnomalous(const SensorData& data) const;
+    // calculate_deviation_metric with the thresholds that apply to data
+    double deviation(const SensorData& data) const;
+    // isAnomalous and deviation together, with a single profile lookup
+    bool classify(const SensorData& data, double& deviation) const;
+    // classify for a reading arriving in its sensor's stream: every rule runs once, stateful
+    // ones included, and their state moves on. firedRules, if given, receives the rules' mask.
+    // Safe to call concurrently; each sensor's readings are judged in the order of the calls.
+    bool classifyIncoming(const SensorData& data, double& deviation, uint32_t* firedRules = nullptr) const;
+    // True if other was copied from this detector (or the reverse), so both classify alike
+    bool sharesThresholdsWith(const AnomalyDetector& other) const;
+    // True if both apply the same rules (or none)
+    bool sharesRulesWith(const AnomalyDetector& other) const;
+    const AnomalyThresholds& thresholdsFor(uint32_t sensorId) const;
+    const ThresholdProfiles& profiles() const { return *profiles_; }
     std::vector<SensorData> findAnomalies(const std::vector<SensorData>& dataBatch) const;
 
+    // Classifies count readings at once with branch-free compares, each on its own as isAnomalous. Bit i of anomalyBits (which
+    // must hold (count + 63) / 64 words; they are overwritten) is set if rows[i] is anomalous,
+    // and unless deviations is null, deviations[i] receives the same value as deviation(rows[i]).
+    // Readings are grouped by threshold profile and each group is classified as one batch. A
+    // kernel the CPU does not support falls back to the best one it does.
+    void classifyBatch(const SensorData* rows, size_t count, uint64_t* anomalyBits, double* deviations,
+                       BatchKernel kernel = bestBatchKernel()) const;
+    void classifyColumns(const SensorColumns& columns, uint64_t* anomalyBits, double* deviations,
+                         BatchKernel kernel = bestBatchKernel()) const;
+    // Number of anomalous readings among rows[0, count)
+    size_t countAnomalies(const SensorData* rows, size_t count) const;
+
+    // Widest kernel this CPU supports, detected once at runtime
+    static BatchKernel bestBatchKernel();
+    static const char* batchKernelName(BatchKernel kernel);
+
 private:
-    AnomalyThresholds thresholds_;
+    // Immutable once built, so copies of a detector share it and lookups need no lock
+    std::shared_ptr<const ThresholdProfiles> profiles_;
+    // Shared by copies, state and all, so every copy of a published detector moves the same
+    // per-sensor state on
+    std::shared_ptr<ShardedRulePipeline> rules_;
+
+    // Sets the bits of the rows the rules without per-sensor state flag
+    void applyStatelessRules(const SensorData* rows, size_t count, uint64_t* anomalyBits) const;
 };
 
 #endif //ANOMALYDETECTOR_HPP
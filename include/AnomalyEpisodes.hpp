@@ -0,0 +1,92 @@
+#ifndef ANOMALY_EPISODES_HPP
+#define ANOMALY_EPISODES_HPP
+
+#include "SensorData.hpp"
+#include "AnomalyDetector.hpp"
+#include "AnomalyRules.hpp"  // For RuleMetric and PerSensorStates
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <vector>
+
+// A run of out-of-threshold readings of one metric on one sensor, or of readings one rule fired
+// on, reported as a single alert instead of one row per reading
+struct AnomalyEpisode {
+    uint32_t sensorId = 0;
+    RuleMetric metric = RuleMetric::TEMPERATURE;
+    int rule = -1;               // Index of the rule in the detector's pipeline; -1 for a metric episode
+    int64_t start_ms = 0;        // First anomalous reading
+    int64_t end_ms = 0;          // Last anomalous reading so far
+    double peakDeviation = 0.0;  // Largest distance past the threshold, in the metric's units (metric episodes)
+    double peakValue = 0.0;      // Reading value at the peak
+    uint64_t count = 0;          // Anomalous readings in the episode
+    bool open = false;           // The metric has not settled back inside its thresholds yet
+};
+
+// Collapses anomalous readings into episodes as they arrive, per sensor and metric, in O(1) per
+// reading. Hysteresis on both edges keeps a value hovering at a limit from opening a new episode
+// on every crossing: an episode starts once the value is past its threshold by more than
+// entryMargin for entryReadings consecutive readings (the episode then reaches back to the first
+// of them), and ends only once it is back inside by exitMargin for exitReadings consecutive
+// readings. A rule episode starts after entryReadings consecutive readings the rule fires on and
+// lasts until exitReadings consecutive readings it does not fire on. Readings are taken in
+// arrival order; one older than the newest of its sensor still counts if it is within
+// reorderWindow_ms of it (late, or another legacy sensor sharing id 0), and is dropped beyond
+// that. Not thread-safe.
+class EpisodeTracker {
+public:
+    struct Config {
+        double entryMargin[3] = {0.0, 0.0, 0.0}; // Temperature (C), humidity (%), light (lux)
+        uint32_t entryReadings = 1;
+        double exitMargin[3] = {0.5, 2.0, 20.0};
+        uint32_t exitReadings = 3;
+        int64_t reorderWindow_ms = 60LL * 1000;
+        // A sensor silent for longer than this ends its open episodes at the last anomalous
+        // reading; 0 disables the check
+        int64_t maxGap_ms = 10LL * 60 * 1000;
+        size_t maxClosedEpisodes = 10000; // Oldest closed episodes are dropped beyond this
+    };
+
+    EpisodeTracker();
+    explicit EpisodeTracker(const Config& config);
+
+    // Feeds one reading, judged against the thresholds of its sensor; firedRules is the mask of
+    // the rules that fired on it (AnomalyDetector::classifyIncoming)
+    void update(const SensorData& reading, const AnomalyDetector::AnomalyThresholds& thresholds,
+                uint32_t firedRules = 0);
+
+    // Closed episodes in the order they ended (at most maxClosedEpisodes), then the open ones
+    std::vector<AnomalyEpisode> episodes() const;
+    const std::deque<AnomalyEpisode>& closedEpisodes() const { return closed_; }
+    // Episodes closed since the last reset, including any dropped from closedEpisodes()
+    uint64_t closedCount() const { return closedCount_; }
+    size_t openCount() const;
+
+    const Config& config() const { return config_; }
+    // Forgets every episode, open or closed
+    void reset();
+
+private:
+    struct MetricState {
+        AnomalyEpisode episode;     // Valid while episode.open, or being entered
+        uint32_t entryReadings = 0; // Consecutive readings past the entry band, while not open
+        uint32_t clearReadings = 0; // Consecutive readings inside the exit band
+    };
+    struct SensorState {
+        bool seen = false;
+        int64_t last_ms = 0;
+        std::array<MetricState, 3> metrics;
+        std::vector<MetricState> rules; // Up to the highest rule seen firing
+    };
+
+    Config config_;
+    PerSensorStates<SensorState> sensors_;
+    std::deque<AnomalyEpisode> closed_;
+    uint64_t closedCount_ = 0;
+
+    // One reading past the entry band (entering), or past the threshold of an open episode
+    void extend(MetricState& state, const SensorData& reading, bool entering, double excess, double value);
+    void close(MetricState& state);
+};
+
+#endif // ANOMALY_EPISODES_HPP
@@ -0,0 +1,273 @@
+#ifndef ANOMALY_RULES_HPP
+#define ANOMALY_RULES_HPP
+
+#include "SensorData.hpp"
+#include "AnomalyDetector.hpp"
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <variant>
+#include <vector>
+
+// Anomaly rules beyond fixed thresholds, and pipelines that run several of them per reading.
+//
+// A rule is a small struct with
+//   using State = ...;                                    // per-sensor state, std::monostate if none
+//   bool check(const SensorData& reading, State&) const;  // true if the rule fires; updates state
+//   std::string name() const;
+// and checks are defined inline here so a RulePipeline can fuse them. Stateful rules see the
+// readings of each sensor (SensorData::sensorId) separately, in the order they are evaluated.
+
+// Metric a rule looks at
+enum class RuleMetric { TEMPERATURE = 0, HUMIDITY, LIGHT_INTENSITY };
+
+inline double ruleMetricValue(const SensorData& reading, RuleMetric metric) {
+    switch (metric) {
+        case RuleMetric::TEMPERATURE: return reading.temperature;
+        case RuleMetric::HUMIDITY:    return reading.humidity;
+        default:                      return reading.lightIntensity;
+    }
+}
+
+inline const char* ruleMetricName(RuleMetric metric) {
+    switch (metric) {
+        case RuleMetric::TEMPERATURE: return "temperature";
+        case RuleMetric::HUMIDITY:    return "humidity";
+        default:                      return "lightIntensity";
+    }
+}
+
+// Fixed thresholds, with the sensor's profile (AnomalyDetector::isAnomalous)
+struct ThresholdRule {
+    using State = std::monostate;
+    AnomalyDetector detector;
+
+    bool check(const SensorData& reading, State&) const { return detector.isAnomalous(reading); }
+    std::string name() const { return "threshold"; }
+};
+
+// A metric changed faster than its limit (units per minute) since the sensor's previous reading.
+// Intervals shorter than a second count as a second, so bursts of readings are not amplified.
+// Readings that do not advance the sensor's clock are not compared and not remembered.
+struct RateOfChangeRule {
+    struct State {
+        bool hasPrevious = false;
+        SensorData previous{0, 0.0, 0.0, 0.0};
+    };
+    double maxTempPerMinute = 2.0;
+    double maxHumidityPerMinute = 10.0;
+    double maxLightPerMinute = INFINITY; // Lights switch on at once; unchecked by default
+
+    bool check(const SensorData& reading, State& state) const {
+        if (state.hasPrevious && reading.timestamp_ms <= state.previous.timestamp_ms) {
+            return false;
+        }
+        bool fired = false;
+        if (state.hasPrevious) {
+            const int64_t elapsed = reading.timestamp_ms - state.previous.timestamp_ms;
+            const double minutes = static_cast<double>(elapsed < 1000 ? 1000 : elapsed) / 60000.0;
+            fired = std::fabs(reading.temperature - state.previous.temperature) > maxTempPerMinute * minutes ||
+                    std::fabs(reading.humidity - state.previous.humidity) > maxHumidityPerMinute * minutes ||
+                    std::fabs(reading.lightIntensity - state.previous.lightIntensity) > maxLightPerMinute * minutes;
+        }
+        state.hasPrevious = true;
+        state.previous = reading;
+        return fired;
+    }
+    std::string name() const { return "rate_of_change"; }
+};
+
+// A metric has repeated exactly the same value for more than maxRepeats consecutive readings,
+// the signature of a frozen or disconnected sensor. NaN never counts as a repeat.
+struct StuckSensorRule {
+    struct State {
+        double last[3] = {NAN, NAN, NAN};
+        uint32_t repeats[3] = {0, 0, 0};
+    };
+    uint32_t maxRepeats = 10;
+
+    bool check(const SensorData& reading, State& state) const {
+        const double values[3] = {reading.temperature, reading.humidity, reading.lightIntensity};
+        bool fired = false;
+        for (int m = 0; m < 3; ++m) {
+            state.repeats[m] = (values[m] == state.last[m]) ? state.repeats[m] + 1 : 0;
+            state.last[m] = values[m];
+            fired |= state.repeats[m] > maxRepeats;
+        }
+        return fired;
+    }
+    std::string name() const { return "stuck_sensor"; }
+};
+
+// Two metrics are past their limits at the same time, e.g. hot and humid together even though
+// each is within its own thresholds
+struct CrossMetricRule {
+    using State = std::monostate;
+    struct Condition {
+        RuleMetric metric;
+        bool above;   // true: value > limit, false: value < limit
+        double limit;
+        bool holds(const SensorData& reading) const {
+            const double value = ruleMetricValue(reading, metric);
+            return above ? value > limit : value < limit;
+        }
+    };
+    Condition first{RuleMetric::TEMPERATURE, true, 28.0};
+    Condition second{RuleMetric::HUMIDITY, true, 65.0};
+
+    bool check(const SensorData& reading, State&) const { return first.holds(reading) && second.holds(reading); }
+    std::string name() const { return "cross_metric"; }
+};
+
+// State of one rule set for every sensor seen, created from a template on first use. The last
+// sensor looked up is remembered, so a run of readings from one sensor costs no hashing.
+template <typename States>
+class PerSensorStates {
+public:
+    explicit PerSensorStates(States initial = States()) : initial_(std::move(initial)) {}
+    // Copies must not share the remembered lookup
+    PerSensorStates(const PerSensorStates& other) : initial_(other.initial_), states_(other.states_) {}
+    PerSensorStates& operator=(const PerSensorStates& other) {
+        initial_ = other.initial_;
+        states_ = other.states_;
+        last_ = nullptr;
+        return *this;
+    }
+
+    States& get(uint32_t sensorId) {
+        if (last_ == nullptr || lastSensorId_ != sensorId) {
+            last_ = &states_.try_emplace(sensorId, initial_).first->second; // Nodes do not move
+            lastSensorId_ = sensorId;
+        }
+        return *last_;
+    }
+    size_t sensorCount() const { return states_.size(); }
+    // Calls fn(sensorId, states) for every sensor seen, in no particular order
+    template <typename Fn>
+    void forEach(Fn&& fn) const {
+        for (const auto& entry : states_) {
+            fn(entry.first, entry.second);
+        }
+    }
+    void clear() {
+        states_.clear();
+        last_ = nullptr;
+    }
+
+private:
+    States initial_;
+    std::unordered_map<uint32_t, States> states_;
+    States* last_ = nullptr;
+    uint32_t lastSensorId_ = 0;
+};
+
+// Rules composed at compile time: evaluate() runs every rule's check, inlined one after another
+// with no virtual or indirect calls, and returns a mask with bit i set if rule i fired. Every
+// rule runs on every reading, so stateful rules never miss one. Not thread-safe.
+//
+//   RulePipeline pipeline(ThresholdRule{detector}, RateOfChangeRule{}, StuckSensorRule{});
+//   uint32_t fired = pipeline.evaluate(reading);
+template <typename... Rules>
+class RulePipeline {
+    static_assert(sizeof...(Rules) > 0 && sizeof...(Rules) <= 32, "a pipeline holds 1 to 32 rules");
+
+public:
+    explicit RulePipeline(Rules... rules) : rules_(std::move(rules)...) {}
+
+    uint32_t evaluate(const SensorData& reading) {
+        return evaluateRules(reading, states_.get(reading.sensorId), std::index_sequence_for<Rules...>());
+    }
+    // fired[i] = evaluate(rows[i]), in order
+    void evaluate(const SensorData* rows, size_t count, uint32_t* fired) {
+        for (size_t i = 0; i < count; ++i) {
+            fired[i] = evaluate(rows[i]);
+        }
+    }
+
+    static constexpr size_t size() { return sizeof...(Rules); }
+    std::vector<std::string> ruleNames() const {
+        return std::apply([](const auto&... rule) { return std::vector<std::string>{rule.name()...}; }, rules_);
+    }
+    // Forgets the per-sensor state
+    void reset() { states_.clear(); }
+
+private:
+    using States = std::tuple<typename Rules::State...>;
+    std::tuple<Rules...> rules_;
+    PerSensorStates<States> states_;
+
+    template <size_t... I>
+    uint32_t evaluateRules(const SensorData& reading, States& states, std::index_sequence<I...>) const {
+        // | rather than || so that every rule sees every reading
+        return (0u | ... | (static_cast<uint32_t>(std::get<I>(rules_).check(reading, std::get<I>(states))) << I));
+    }
+};
+
+// The same rules assembled at runtime, e.g. from configuration. Each rule is held by value in a
+// variant and dispatched with std::visit; results match a RulePipeline of the same rules in the
+// same order. Not thread-safe.
+class DynamicRulePipeline {
+public:
+    using Rule = std::variant<ThresholdRule, RateOfChangeRule, StuckSensorRule, CrossMetricRule>;
+
+    DynamicRulePipeline() = default;
+    explicit DynamicRulePipeline(std::vector<Rule> rules);
+
+    // Appends a rule (at most 32; false beyond that) and forgets the per-sensor state
+    bool addRule(Rule rule);
+    uint32_t evaluate(const SensorData& reading);
+    void evaluate(const SensorData* rows, size_t count, uint32_t* fired);
+    // The rules without per-sensor state only, which judge a reading on its own; touches no state
+    uint32_t evaluateStateless(const SensorData& reading) const;
+
+    size_t size() const { return rules_.size(); }
+    // Bit i set if rule i keeps per-sensor state, so its verdict depends on the readings before
+    uint32_t statefulMask() const { return statefulMask_; }
+    std::vector<std::string> ruleNames() const;
+    void reset() { states_.clear(); }
+
+private:
+    using State = std::variant<std::monostate, RateOfChangeRule::State, StuckSensorRule::State>;
+    std::vector<Rule> rules_;
+    std::vector<State> initialStates_; // One per rule
+    uint32_t statefulMask_ = 0;
+    PerSensorStates<std::vector<State>> states_;
+};
+
+// A DynamicRulePipeline shared by concurrent writers. The per-sensor state is split into shards
+// by sensorId, each behind its own lock, so readings of different sensors are evaluated in
+// parallel while each sensor's readings still see its state in the order they arrive. Results
+// match the single pipeline. Thread-safe.
+class ShardedRulePipeline {
+public:
+    static constexpr size_t kDefaultShards = 16;
+
+    explicit ShardedRulePipeline(std::shared_ptr<const DynamicRulePipeline> rules, size_t shardCount = kDefaultShards);
+
+    uint32_t evaluate(const SensorData& reading);
+    uint32_t evaluateStateless(const SensorData& reading) const { return rules_->evaluateStateless(reading); }
+
+    // The rules, without any state; shared by pipelines evaluating the same rules
+    const std::shared_ptr<const DynamicRulePipeline>& rules() const { return rules_; }
+    uint32_t statefulMask() const { return rules_->statefulMask(); }
+    uint32_t statelessMask() const { return static_cast<uint32_t>((uint64_t{1} << rules_->size()) - 1) & ~statefulMask(); }
+    size_t shardCount() const { return shardCount_; }
+    void reset();
+
+private:
+    // On a cache line of its own, so writers of neighbouring shards do not contend
+    struct alignas(64) Shard {
+        std::mutex mutex;
+        DynamicRulePipeline pipeline;
+    };
+    std::shared_ptr<const DynamicRulePipeline> rules_;
+    size_t shardCount_;
+    std::unique_ptr<Shard[]> shards_;
+};
+
+#endif // ANOMALY_RULES_HPP
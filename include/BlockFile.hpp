@@ -0,0 +1,245 @@
+#ifndef BLOCK_FILE_HPP
+#define BLOCK_FILE_HPP
+
+#include "SensorData.hpp"
+#include "AnomalyDetector.hpp"
+#include "MappedFile.hpp"
+#include "GorillaCodec.hpp"
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Summary of one block of the binary file, stored as its footer: enough to tell that no reading
+// in the block can match a read, so the block is skipped unread
+struct BlockZone {
+    int64_t minTimestamp_ms = std::numeric_limits<int64_t>::max();
+    int64_t maxTimestamp_ms = std::numeric_limits<int64_t>::min();
+    // Temperature, humidity and light intensity, in RuleMetric order; NaN readings are left out
+    double minValue[3] = {std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+                          std::numeric_limits<double>::infinity()};
+    double maxValue[3] = {-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+                          -std::numeric_limits<double>::infinity()};
+    uint32_t count = 0;
+    // Under the thresholds the writer had when the block was written; thresholds may have changed
+    // since, so reads judge blocks by their value ranges instead
+    uint32_t anomalyCount = 0;
+    uint32_t minSensorId = std::numeric_limits<uint32_t>::max();
+    uint32_t maxSensorId = 0;
+
+    // Widens the ranges to cover data; anomalyCount is up to the writer
+    void add(const SensorData& data);
+    // Widens the ranges to cover other's too and adds up the counts
+    void merge(const BlockZone& other);
+};
+static_assert(sizeof(BlockZone) == 80, "BlockZone is stored as-is");
+
+// Conditions of a read; a reading matches if it meets every condition that is set
+struct ZoneFilter {
+    std::optional<std::pair<int64_t, int64_t>> timeRange; // Inclusive
+    std::optional<std::pair<double, double>> valueRange[3]; // Inclusive, in BlockZone order
+    const AnomalyDetector* anomalousOnly = nullptr; // Only readings this detector flags
+
+    bool matches(const SensorData& data) const;
+    // False if no reading summarized by zone can match
+    bool mayMatch(const BlockZone& zone) const;
+};
+
+// Layout of the binary file, version 2: a header, then blocks of blockRecords records, each
+// followed by its BlockZone. Records are appended to an unsealed tail block that gets its footer
+// once full, so the file only ever grows at the end. Version 1 files, a headerless array of
+// records, are still read. They have no zone maps and were written before readings had a sensor
+// id, so they hold 32-byte records (kLegacyRecordSize), which read as sensor 0.
+//
+// With the GORILLA encoding each block is instead an EncodedBlockHeader, the zone map and the
+// records compressed by GorillaCodec. Such blocks are written whole, so there is no tail: an
+// appender seals what it holds when closed, leaving a short block, unless it hands those
+// records back (as the WriteAheadLog's own checkpoints have it do).
+class BlockFile {
+public:
+    // How blocks store their records; fixed when the file is created
+    enum class Encoding : uint32_t {
+        RAW = 0,    // As SensorData, so they can be read in place
+        GORILLA = 1 // Compressed column by column, typically to a tenth of the size
+    };
+    struct Header {
+        char magic[8];         // kMagic; as a version 1 timestamp it would lie millions of years ahead
+        uint32_t version;
+        uint32_t headerSize;   // sizeof(Header)
+        uint32_t recordSize;   // sizeof(SensorData)
+        uint32_t blockRecords;
+        Encoding encoding;     // Zero (RAW) in files written before there was a choice
+        uint8_t reserved[36];
+    };
+    static_assert(sizeof(Header) == 64, "Header is stored as-is");
+    static constexpr char kMagic[8] = {'F', 'P', 'B', 'L', 'O', 'C', 'K', '\0'};
+    static constexpr uint32_t kVersion = 2;
+    static constexpr uint32_t kDefaultBlockRecords = 1024;
+    // SensorData without sensorId and its pad word, as version 1 files first stored it
+    static constexpr uint32_t kLegacyRecordSize = 32;
+    // GORILLA blocks are larger: a sensor's first value in a block costs the most, so the more
+    // of its readings a block holds, the better it compresses
+    static constexpr uint32_t kDefaultEncodedBlockRecords = 65536;
+
+    // Starts each GORILLA block
+    struct EncodedBlockHeader {
+        uint32_t magic;  // kEncodedBlockMagic
+        uint32_t count;  // Records in the block, 1 to blockRecords
+        uint32_t bytes;  // Size of the encoded records after the zone map
+        uint32_t crc;    // crc32 of count and bytes, then of the zone map and the encoded records
+    };
+    static constexpr uint32_t kEncodedBlockMagic = 0x4B4C4247; // "GBLK"
+
+    struct Layout {
+        bool legacy = false;       // A version 1 file
+        Encoding encoding = Encoding::RAW;
+        uint32_t blockRecords = 0;
+        uint64_t sealedBlocks = 0; // Blocks with their footer
+        uint64_t tailRecords = 0;  // Records after them; a crash may leave a full tail unsealed
+        uint64_t records = 0;
+        uint64_t validBytes = 0;   // Up to the last whole record or block; anything after is torn
+        // Of RAW blocks, which all have the same size
+        uint64_t blockBytes() const { return blockRecords * sizeof(SensorData) + sizeof(BlockZone); }
+        uint64_t blockOffset(uint64_t block) const { return sizeof(Header) + block * blockBytes(); }
+    };
+    // Reads bytes at offset of a file into out; false if they cannot be read
+    using ReadAt = std::function<bool(uint64_t offset, char* out, size_t bytes)>;
+    // Layout of a file of size bytes read through readAt. GORILLA files are walked block by
+    // block; a last block that fails its checksum counts as torn. False for a version or encoding
+    // this code does not know.
+    static bool layoutOf(const ReadAt& readAt, uint64_t size, Layout& layout);
+    // Layout of the file at path; a missing file has no records. False if it cannot be read or
+    // has an unknown version.
+    static bool readLayout(const std::string& path, Layout& layout);
+
+    // Records of one block viewed in place, with its zone map
+    struct Block {
+        SensorDataSpan rows;
+        BlockZone zone;
+        bool zoned; // False once rows are cut short, so zone no longer describes them
+    };
+    // The blocks of a mapped file in file order; the tail's zone is computed from its rows,
+    // without an anomalyCount. Empty for an unknown version, for GORILLA files and for version 1
+    // files, whose 32-byte records cannot be viewed in place.
+    static std::vector<Block> blocks(const MappedFile& file);
+
+    // Directory of the blocks of a file that is no longer appended to, tail included. Kept in
+    // an index file next to it, it lets reads find every block and its zone map without walking
+    // the file, and rule out the whole file at once by the zone of all its records.
+    struct IndexEntry {
+        uint64_t offset; // Of the block's records (RAW) or of its EncodedBlockHeader (GORILLA)
+        uint64_t count;
+        BlockZone zone;
+    };
+    struct Index {
+        Encoding encoding = Encoding::RAW;
+        uint64_t fileBytes = 0; // Size of the file indexed; a file of another size is read without
+        uint64_t records = 0;
+        BlockZone zone;         // Of every record of the file
+        std::vector<IndexEntry> blocks;
+    };
+    // Indexes the file at path. False if it cannot be read, or is a version 1 file, which has no
+    // blocks to index.
+    static bool buildIndex(const std::string& path, Index& index);
+    // Stores an index file, replacing it whole; reads one back, false if it is damaged
+    static bool writeIndex(const std::string& path, const Index& index);
+    static bool readIndex(const std::string& path, Index& index);
+
+    struct ScanStats {
+        uint64_t blocksRead = 0;
+        uint64_t blocksSkipped = 0;
+    };
+    // Hands the first maxRecords records of the file to consumer, block by block in file order.
+    // With a filter, blocks its zone maps rule out are skipped unread (they still count towards
+    // maxRecords); the rows of the other blocks are passed on unfiltered. An index of the file,
+    // if given and current, spares walking it. False if unreadable.
+    static bool scan(const std::string& path, const ZoneFilter* filter, size_t maxRecords,
+                     const std::function<void(const SensorData* rows, size_t count)>& consumer,
+                     ScanStats* stats = nullptr, const Index* index = nullptr);
+    // As scan, with each block handed over as columns; GORILLA blocks decode straight into them
+    static bool scanColumns(const std::string& path, const ZoneFilter* filter, size_t maxRecords,
+                            const std::function<void(const ColumnBatch& columns)>& consumer,
+                            ScanStats* stats = nullptr, const Index* index = nullptr);
+
+private:
+    // Start of an index file, followed by its entries
+    struct IndexHeader {
+        char magic[8];      // kIndexMagic
+        uint32_t version;
+        Encoding encoding;
+        uint64_t fileBytes;
+        uint64_t records;
+        uint64_t blocks;
+        BlockZone zone;
+        uint32_t crc;       // crc32 of the header up to here, then of the entries
+        uint32_t reserved;
+    };
+    static_assert(sizeof(IndexHeader) == 128, "IndexHeader is stored as-is");
+    static constexpr char kIndexMagic[8] = {'F', 'P', 'I', 'N', 'D', 'E', 'X', '\0'};
+
+    // One of rowConsumer and columnConsumer is set
+    static bool scanBlocks(const std::string& path, const ZoneFilter* filter, size_t maxRecords,
+                           const std::function<void(const SensorData* rows, size_t count)>& rowConsumer,
+                           const std::function<void(const ColumnBatch& columns)>& columnConsumer,
+                           ScanStats* stats, const Index* index);
+};
+
+// Block files mapped read-only, their blocks in order
+struct MappedBlocks {
+    std::vector<std::shared_ptr<const MappedFile>> files; // Keep the views valid; empty if nothing was mapped
+    std::vector<BlockFile::Block> blocks;
+    size_t records = 0;
+    uint64_t firstPosition = 0; // SegmentedFile::position of the first record
+    std::vector<SensorData> unsealed; // Readings still in the write-ahead log, which follow the blocks
+};
+
+// Appends records to a block file, sealing each block with its zone map once full. Opening
+// repairs what a crash may have left: a torn record, footer or encoded block at the end is cut
+// off, a full tail missing its footer is sealed, and a version 1 file is rewritten as blocks
+// (once), 32-byte records widened to SensorData. Not thread-safe.
+class BlockFileAppender {
+public:
+    // anomalyCount of each block is taken with detector, its stateful rules replayed over the rows
+    // appended from this appender's opening on; encoding and blockRecords (0: the
+    // default for the encoding) apply to a file this appender creates
+    BlockFileAppender(const std::string& path, const AnomalyDetector& detector,
+                      BlockFile::Encoding encoding = BlockFile::Encoding::RAW, uint32_t blockRecords = 0);
+    // Closes without syncing if still open; GORILLA records not sealed yet are lost
+    ~BlockFileAppender();
+
+    BlockFileAppender(const BlockFileAppender&) = delete;
+    BlockFileAppender& operator=(const BlockFileAppender&) = delete;
+
+    // Opens the file, creating it if missing or emptying it first if truncate is set. An
+    // existing version 2 file keeps its encoding and block size.
+    bool open(bool truncate = false);
+    // Records in the file, including those appended so far
+    uint64_t records() const { return records_; }
+    bool append(const SensorData* rows, size_t count);
+    // Seals a partial GORILLA block, then syncs and closes the file. With unsealed, the records
+    // of a partial GORILLA block are moved there instead, to be appended again later.
+    bool close(std::vector<SensorData>* unsealed = nullptr);
+
+private:
+    std::string path_;
+    AnomalyDetector detector_;
+    BlockFile::Encoding encoding_;
+    uint32_t blockRecords_;
+    int fd_ = -1;
+    uint64_t records_ = 0;
+    uint32_t tailRecords_ = 0; // Records of the unsealed block; RAW ones are all written
+    BlockZone tailZone_;
+    std::vector<SensorData> pending_; // The unsealed GORILLA block
+    std::vector<char> out_;
+
+    bool upgradeLegacy(uint64_t records);
+    // Adds the tail's footer (RAW) or the whole encoded tail (GORILLA) to out_ and starts a new
+    // block
+    void sealTail();
+};
+
+#endif // BLOCK_FILE_HPP
@@ -0,0 +1,100 @@
+#ifndef BUFFERED_APPENDER_HPP
+#define BUFFERED_APPENDER_HPP
+
+#include "SensorData.hpp"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Appends records to one file that stays open between calls. Readings collect in a buffer that
+// is written out as one frame with a single write once it is full or old enough, so a reading
+// costs a copy instead of an open/write/close. Concurrent writers are coalesced: while one of them writes a
+// batch the others keep filling the next one, which the first to need it writes next (group
+// commit). The file is opened on the first append and after close(). Thread-safe.
+class BufferedAppender {
+public:
+    // Every written batch is preceded by this header, so a reader can tell a complete batch from
+    // one cut short by a crash (see WriteAheadLog)
+    struct FrameHeader {
+        uint32_t count; // Records in the frame
+        uint32_t crc;   // crc32 of count, then of the records
+    };
+    // When written readings are forced to disk with fdatasync
+    enum class Durability {
+        NONE,      // Never; the OS writes them back in its own time
+        PERIODIC,  // At most every syncInterval_ms, from the background flusher
+        PER_BATCH  // Before append returns: every batch is written and synced (group commit)
+    };
+    struct Policy {
+        Durability durability = Durability::PERIODIC;
+        size_t bufferRecords = 1024;     // Write once this many readings are buffered...
+        int64_t flushInterval_ms = 200;  // ...or at least this often (0: only when full)
+        int64_t syncInterval_ms = 1000;
+    };
+    struct Stats {
+        uint64_t appended = 0; // Readings accepted
+        uint64_t writes = 0;   // Batches written
+        uint64_t syncs = 0;    // fdatasync calls
+    };
+
+    // With retain set, a copy of the readings appended since the file was last closed is kept
+    // for copyRetained
+    BufferedAppender(const std::string& path, const Policy& policy, bool retain = false);
+    // Writes and syncs what is buffered, then closes the file
+    ~BufferedAppender();
+
+    BufferedAppender(const BufferedAppender&) = delete;
+    BufferedAppender& operator=(const BufferedAppender&) = delete;
+
+    // Buffers count readings in order. False if the file cannot be opened or an earlier write
+    // failed; with PER_BATCH also if these readings could not be synced.
+    bool append(const SensorData* rows, size_t count);
+    // Writes every buffered reading, and syncs them too if sync is set
+    bool flush(bool sync);
+    // flush(true), then closes the file (e.g. before it is replaced); the next append reopens it
+    bool close();
+    // Appends the retained readings to rows, in file order
+    void copyRetained(std::vector<SensorData>& rows) const;
+    size_t retainedCount() const;
+
+    // Applies to readings appended from now on; what is buffered is written first
+    void setPolicy(const Policy& policy);
+    Policy policy() const;
+    Stats stats() const;
+
+private:
+    std::string path_;
+    Policy policy_;
+    mutable std::mutex mutex_;
+    std::condition_variable committed_; // A batch finished writing
+    std::condition_variable wakeFlusher_;
+
+    std::vector<SensorData> buffer_;
+    std::vector<SensorData> spare_;  // The last written batch, reused as the next buffer
+    std::vector<char> frame_;        // Header and records of the batch being written
+    bool retain_;
+    std::vector<SensorData> retained_; // Appended since the last close, if retain_
+    uint64_t appendedSeq_ = 0;       // Readings appended so far
+    uint64_t writtenSeq_ = 0;        // ...of which written
+    uint64_t durableSeq_ = 0;        // ...of which synced
+    bool writing_ = false;           // A writer holds the file outside the lock
+    bool failed_ = false;
+    int fd_ = -1;
+    Stats stats_;
+    std::chrono::steady_clock::time_point lastSync_;
+
+    std::thread flusher_;
+    bool stopping_ = false;
+
+    // Writes (and syncs if sync) until readings up to target are written (durable); caller
+    // holds lock, which is released while writing
+    bool commit(std::unique_lock<std::mutex>& lock, uint64_t target, bool sync);
+    bool openLocked();
+    void flusherLoop();
+};
+
+#endif // BUFFERED_APPENDER_HPP
@@ -7,7 +7,8 @@
 
 class Client {
 public:
-    Client(const std::string& server_ip, int server_port);
+    // Readings are tagged with sensor_id (0 = unassigned)
+    Client(const std::string& server_ip, int server_port, uint32_t sensor_id = 0);
     ~Client();
     SensorData readSensorData();
     bool connectToServer(int max_retries = 10, int retry_delay_ms = 1000);
@@ -17,6 +18,7 @@ public:
 private:
     std::string server_ip_;
     int server_port_;
+    uint32_t sensor_id_;
     int sock_;
     bool connected_;
     std::mt19937 rng_;
@@ -0,0 +1,11 @@
+#ifndef CRC32_HPP
+#define CRC32_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32 (IEEE 802.3, as used by zlib) of size bytes. Pass the result of a previous call as crc
+// to continue a checksum over several buffers.
+uint32_t crc32(const void* data, size_t size, uint32_t crc = 0);
+
+#endif // CRC32_HPP
@@ -4,57 +4,539 @@
 #include "SensorData.hpp"        
 #include "AnomalyDetector.hpp"   
 #include "QueryCommon.hpp"        // For SortCriteria and QueryResult
+#include "RollupTier.hpp"         // For downsampled history tiers
+#include "ThreadPool.hpp"         // For parallel queries
+#include "DataStorage.hpp"        // For cold files of evicted history
+#include "HistorySegment.hpp"     // For resident history segments
+#include "QueryCache.hpp"         // For cached query results
+#include "QuantileSketch.hpp"     // For approximate percentiles
+#include "FilterExpression.hpp"   // For compound filter expressions
+#include "StatisticalDetector.hpp" // For streaming statistical anomaly detection
+#include "ThresholdProfiles.hpp"  // For per-sensor thresholds
+#include "AnomalyEpisodes.hpp"    // For anomaly episodes
 #include <vector> 
 #include <mutex> 
 #include <string>  
 #include <optional>               // For optional query parameters
 #include <algorithm>              // For std::sort
-
-// Forward declaration to avoid circular dependency
-class DataStorage;
+#include <limits>                 // For open-ended value ranges
+#include <map>                    // For per-window sketches
+#include <memory>                 // For std::shared_ptr
+#include <functional>             // For query visitors
+#include <utility>                // For std::pair
+#include <deque>                  // For the recent-append window
+#include <thread>                 // For background history loading
+#include <atomic>                 // For the reload generation
 
 class DataManager {
 public:
     // Constructor takes the anomaly thresholds to internally use an AnomalyDetector
     // and for calculating deviation.
     DataManager(const AnomalyDetector::AnomalyThresholds& thresholds);
+    // Waits for a background load started by loadFromStorageInBackground
+    ~DataManager();
 
-    // Adds new sensor data to the historical log. Thread-safe.
+    // Adds new sensor data to the historical log. While history is being loaded the reading is
+    // held back and added once loading finishes. Thread-safe.
     void addSensorData(const SensorData& data);
+    // Same, for a reading already classified by an ingest stage: the anomaly flag and deviation
+    // are used as given if classifiedWith shares this manager's thresholds (it was obtained from
+    // getAnomalyDetector()), and recomputed otherwise. With storeIn, the raw reading is first
+    // stored there, together with the adding as far as persisted rollups are concerned: a
+    // checkpoint or save into the same storage counts it either in both or in neither. Thread-safe.
+    void addEnrichedData(const QueryResult& reading, const AnomalyDetector& classifiedWith,
+                         DataStorage* storeIn = nullptr);
+    // The detector readings are classified with. A reload publishes a new one through an atomic
+    // shared pointer, so fetching it per reading is a single atomic load and never waits for the
+    // data lock; the caller's reference keeps the one returned alive, and a replaced one is freed
+    // once its last reader lets go. Adding the reading still takes the data lock. Thread-safe.
+    std::shared_ptr<const AnomalyDetector> getAnomalyDetector() const;
+
+    // Inclusive value range used by the per-metric query filters
+    struct ValueRange {
+        double min = -std::numeric_limits<double>::infinity();
+        double max = std::numeric_limits<double>::infinity();
+        bool contains(double value) const { return value >= min && value <= max; }
+    };
 
     // Parameters for querying data
     struct QueryParams {
         std::optional<bool> filterAnomalousOnly; // true = only anomalous, false = only normal, nullopt = all
         SortCriteria sortBy = SortCriteria::TIMESTAMP_ASC; // Default sort order
+        std::optional<ValueRange> temperatureRange; // Only readings with temperature in range
+        std::optional<ValueRange> humidityRange;    // Only readings with humidity in range
+        std::optional<ValueRange> lightRange;       // Only readings with light intensity in range
+        std::optional<ValueRange> deviationRange;   // Only readings with deviation in range
+        // Inclusive [start, end] timestamp range. nullopt means the whole history, including any
+        // readings evicted to disk by the retention policy.
+        std::optional<std::pair<int64_t, int64_t>> timeRangeFilterMs;
+        // Compound filter such as "temp > 28 AND (hum < 35 OR light < 80)", built with
+        // FilterExpression::compile. Combined with the filters above by AND.
+        std::shared_ptr<const FilterExpression> filter;
         // Future extensions:
         // std::optional<std::string> sensorIdFilter;
-        // std::optional<std::pair<int64_t, int64_t>> timeRangeFilterMs;
     };
 
+    // Bounds on how much history stays resident in memory. Unset limits are not enforced.
+    struct RetentionPolicy {
+        std::optional<int64_t> maxAgeMs; // Evict readings older than (newest timestamp - maxAgeMs)
+        std::optional<size_t> maxCount;  // Evict once more readings than this are resident
+        std::optional<size_t> maxBytes;  // Evict once resident readings take more bytes than this
+    };
+
+    // Applies a retention policy. Readings beyond the limits are evicted, oldest timestamps first,
+    // to cold files in tierStorage (which must outlive this DataManager); queries whose time range
+    // reaches into evicted history load the overlapping cold files transparently.
+    // Thread-safe.
+    void setRetentionPolicy(const RetentionPolicy& policy, DataStorage& tierStorage);
+
     // Queries the stored sensor data based on the given parameters. Thread-safe.
     std::vector<QueryResult> queryData(const QueryParams& params);
+    // As queryData, without copying: a cached result is handed out as it is, shared with the
+    // cache. Thread-safe.
+    std::shared_ptr<const std::vector<QueryResult>> querySharedData(const QueryParams& params);
+
+    // Called once per matching row, in the requested order; return false to stop early.
+    using QueryVisitor = std::function<bool(const QueryResult&)>;
+    // Called with contiguous spans of raw readings; return false to stop early.
+    using SpanVisitor = std::function<bool(const SensorData* rows, size_t count)>;
 
-    // Save all data to DataStorage for persistence. Thread-safe.
+    // Streams the rows matching params to visitor without materializing a result vector; only
+    // pointers to matching rows are kept when an ordering step is needed. Returns the number of
+    // rows visited. Thread-safe; scans and index walks read a snapshot without holding the data
+    // lock, so the visitor may take its time or call back into this DataManager.
+    size_t visitQuery(const QueryParams& params, const QueryVisitor& visitor) const;
+
+    // Streams the raw history as spans without copying: first the resident readings, then each
+    // cold file, loaded one at a time. Returns the number of readings visited.
+    // Thread-safe; like visitQuery it visits a snapshot without holding the data lock.
+    size_t visitAllData(const SpanVisitor& visitor) const;
+
+    // Save all data to DataStorage for persistence, after any background load finishes. Thread-safe.
     void saveToStorage(DataStorage& storage);
+    // Shutdown alternative to saveToStorage when every reading was also stored in storage as it
+    // arrived (as the server does): syncs its log and persists the rollups without rewriting
+    // the binary file. Thread-safe.
+    void checkpointToStorage(DataStorage& storage);
 
-    // Load data from DataStorage to initialize historical data. Thread-safe.
+    // Load data from DataStorage to initialize historical data. Readings already evicted to cold
+    // files stay there; if no tier storage was set and storage has cold files, storage becomes
+    // the tier storage and must outlive this DataManager. Thread-safe.
     void loadFromStorage(DataStorage& storage);
 
-    // Get all historical data for external processing. Thread-safe.
+    // Fast-start alternative to loadFromStorage: the binary file is memory-mapped and served in
+    // place as a read-only base segment under the readings added afterwards, so startup costs the
+    // same whatever the size of the history; pages are read when queries first touch them.
+    // Persisted rollups are restored as usual, while rollup and quantile updates for base
+    // readings are deferred to the first query that needs them. Returns false, after falling back
+    // to loadFromStorage, if the file cannot be mapped, readings were evicted to cold files or
+    // a retention policy is set. Thread-safe.
+    bool mapFromStorage(DataStorage& storage);
+
+    // Loads history like mapFromStorage (falling back to the streaming load) on a background
+    // thread and returns immediately; storage must outlive the load. Only the records in the
+    // binary file when the call is made are loaded, since readings added afterwards arrive
+    // through addSensorData, which holds them back until the history is in place, so none is
+    // lost or counted twice. Queries meanwhile run on the history loaded so far; see
+    // getLoadStatus(). Call before readings start arriving. Thread-safe.
+    void loadFromStorageInBackground(DataStorage& storage);
+    // Blocks until a background load has finished
+    void waitForLoad();
+
+    // Progress of the current or last history load
+    struct LoadStatus {
+        bool loading = false;        // Query results only cover the history loaded so far
+        size_t loadedReadings = 0;   // Records read from the binary file
+        size_t totalReadings = 0;    // Records the load will read
+        size_t pendingReadings = 0;  // Readings added during the load, not yet applied
+    };
+    LoadStatus getLoadStatus() const;
+
+    // Get all historical data for external processing, including readings evicted to disk.
+    // Prefer visitAllData for large histories. Thread-safe.
     std::vector<SensorData> getAllData() const;
 
-    // Get the number of stored data points. Thread-safe.
+    // Get the number of data points resident in memory. Thread-safe.
     size_t getDataCount() const;
 
+    // Get the number of data points including those evicted to cold files. Thread-safe.
+    size_t getTotalDataCount() const;
+
+    // Returns downsampled buckets overlapping [start_ms, end_ms] at a width no larger than
+    // resolution_ms. Answered from the coarsest rollup tier that meets the resolution; if the
+    // resolution is finer than every tier, the raw history is aggregated instead. Thread-safe.
+    std::vector<RollupBucket> queryRollups(int64_t start_ms, int64_t end_ms, int64_t resolution_ms) const;
+
+    // GROUP BY time: count/anomaly count and min/max/sum (hence average) of every metric per
+    // bucketWidth_ms bucket, over the rows matching params (sortBy is ignored; buckets come back
+    // ordered by time). Computed in a single pass over the snapshot, folding each run of
+    // consecutive readings that share a bucket at once; only the aggregated rows are returned.
+    // Thread-safe.
+    std::vector<RollupBucket> aggregateByTime(const QueryParams& params, int64_t bucketWidth_ms) const;
+
+    // Bucket widths of the maintained rollup tiers, finest first.
+    static const std::vector<int64_t>& rollupResolutions();
+
+    // Metrics that percentile queries can be asked about
+    enum class SensorMetric { TEMPERATURE = 0, HUMIDITY, LIGHT_INTENSITY };
+
+    // Approximate value of a metric at quantile q in [0, 1] (0.95 = p95), answered from quantile
+    // sketches maintained on ingest, so no history is scanned or sorted. With a time range, the
+    // sketches of every quantile window (kQuantileWindowMs) overlapping it are merged, so whole
+    // windows are counted. Includes readings evicted to disk. nullopt when there are no readings.
+    // Thread-safe.
+    std::optional<double> approximateQuantile(SensorMetric metric, double q,
+                                              std::optional<std::pair<int64_t, int64_t>> timeRangeMs = std::nullopt) const;
+    // Same, but one value per quantile window overlapping [start_ms, end_ms], as (window start, value)
+    std::vector<std::pair<int64_t, double>> approximateQuantileByWindow(SensorMetric metric, double q,
+                                                                        int64_t start_ms, int64_t end_ms) const;
+
+    // Enables or disables the ordered per-metric indexes (temperature, humidity, light, deviation).
+    // When enabled, value-range filters and the matching sort criteria are served straight from
+    // index order instead of scanning and sorting the whole history. Thread-safe.
+    void setValueIndexesEnabled(bool enabled);
+    bool valueIndexesEnabled() const;
+
+    // Scan queries over at least this many readings run chunked on a thread pool with a
+    // parallel merge of the sorted chunks; smaller histories stay serial. Thread-safe.
+    void setParallelQueryThreshold(size_t minReadings);
+    // Worker count for parallel queries; 0 uses the hardware concurrency. Thread-safe.
+    void setQueryThreadCount(unsigned threadCount);
+
+    // Resident history is stored in fixed-capacity segments, each covering one time partition.
+    // capacity is the largest a segment is allocated at: a new one is sized by the fill seen so
+    // far, starting small, so sparse partitions do not reserve capacity rows each. Applies to
+    // segments opened from now on; existing segments keep their layout. Thread-safe.
+    void setSegmentLayout(size_t capacity, int64_t partitionMs);
+    // Number of resident segments, including the open head segment. Thread-safe.
+    size_t getSegmentCount() const;
+
+    // Resident segments are kept in timestamp order. A reading older than the newest resident
+    // one is held in a small sorted reorder buffer instead, which is merged into the segments
+    // once it holds this many readings; only the segments overlapping it are rebuilt. Thread-safe.
+    void setReorderBufferCapacity(size_t capacity);
+    // Late readings waiting in the reorder buffer. Thread-safe.
+    size_t getReorderBufferSize() const;
+
+    // Repeated queryData calls are answered from a bounded LRU result cache. If readings were only
+    // appended since a result was cached, they are merged into it instead of recomputing the
+    // whole query. maxEntries == 0 disables the cache. Thread-safe.
+    void setQueryCacheLimits(size_t maxEntries, size_t maxRows);
+    QueryCache::Stats getQueryCacheStats() const;
+
+    // Classifies readings with the thresholds profile of their sensorId instead of the thresholds
+    // given to the constructor (which become the default profile unless profiles sets its own).
+    // reloadThresholdProfiles followed by waitForReclassification. Thread-safe.
+    void setThresholdProfiles(const ThresholdProfiles& profiles);
+    // The profiles set last, even if a reload is still applying them. Thread-safe.
+    ThresholdProfiles getThresholdProfiles() const;
+
+    // Rules applied on top of the thresholds (see AnomalyRules.hpp): a reading is anomalous if it
+    // is out of its thresholds or any rule fires. The rules run once per reading as it arrives,
+    // in the detector's classifyIncoming, so the anomaly flag seen by queries, exports, rollups
+    // and episodes includes them; per-sensor rule state is sharded by sensor, so concurrent writers of
+    // different sensors do not contend. The history is reclassified as by a threshold reload,
+    // stateful rules replayed over it in history order; late readings awaiting their merge and
+    // rows read back from cold files or a mapped base are judged on their own. Threshold reloads
+    // keep the rules. Waits for the reclassification. Thread-safe.
+    void setAnomalyRules(const DynamicRulePipeline& rules);
+
+    // Hot reload: stages new threshold profiles and returns at once. A background thread
+    // reclassifies the existing history into new rollup tiers (anomaly counts) and a new
+    // deviation index; ingest and queries keep running on the current generation meanwhile, and
+    // the new one takes over in a single step once the rebuild is done. Readings added during the
+    // rebuild are folded in at that point. A later reload supersedes a pending one. Returns the
+    // generation the profiles will have. Episodes already recorded keep their thresholds.
+    // Thread-safe.
+    uint64_t reloadThresholdProfiles(const ThresholdProfiles& profiles);
+    // Waits until no reload is pending
+    void waitForReclassification();
+    // Generation of the thresholds in force: 0 for the constructor's, +1 per reload. Thread-safe.
+    uint64_t getThresholdGeneration() const;
+    bool reclassificationPending() const;
+
+    // Streaming statistical detection (see StatisticalDetector) alongside the threshold rules.
+    // Readings are scored in O(1) as addSensorData receives them, in arrival order, including
+    // those held back during a background load; history loaded from storage is not replayed.
+    // nullopt disables it. Thread-safe.
+    void setStatisticalDetection(const std::optional<StatisticalDetector::Config>& config);
+    struct StatisticalAnomaly {
+        SensorData reading;
+        StatisticalDetector::Assessment assessment;
+    };
+    // The most recent statistical anomalies, oldest first. Thread-safe.
+    std::vector<StatisticalAnomaly> getStatisticalAnomalies() const;
+    // Statistical anomalies seen since detection was enabled. Thread-safe.
+    size_t getStatisticalAnomalyCount() const;
+
+    // Anomalous readings collapsed into episodes per sensor and metric or rule (see EpisodeTracker),
+    // maintained as readings are added and as history is loaded. Rows of a memory-mapped base
+    // (mapFromStorage) are not replayed. Threshold profile changes apply from the next reading.
+    // Replaces the tracker configuration and forgets every episode. Thread-safe.
+    void setEpisodeConfig(const EpisodeTracker::Config& config);
+    // Episodes overlapping the inclusive [start, end] range (all if nullopt), closed ones in the
+    // order they ended, then the open ones. Thread-safe.
+    std::vector<AnomalyEpisode> getAnomalyEpisodes(
+        const std::optional<std::pair<int64_t, int64_t>>& timeRangeMs = std::nullopt) const;
+    // Episodes closed so far plus those still open. Thread-safe.
+    size_t getAnomalyEpisodeCount() const;
+
+    // Default for setParallelQueryThreshold()
+    static constexpr size_t kDefaultParallelQueryThreshold = 100000;
+    // Defaults for setSegmentLayout(): 64K readings or one hour, whichever fills first
+    static constexpr size_t kDefaultSegmentCapacity = 65536;
+    // Capacity of the first segment, and the least a segment is sized at by observed fill
+    static constexpr size_t kInitialSegmentCapacity = 1024;
+    static constexpr size_t kMinSegmentCapacity = 64;
+    static constexpr int64_t kDefaultSegmentPartitionMs = 60LL * 60 * 1000;
+    // Default for setReorderBufferCapacity()
+    static constexpr size_t kDefaultReorderBufferCapacity = 1024;
+    // Defaults for setQueryCacheLimits()
+    static constexpr size_t kDefaultQueryCacheEntries = 16;
+    static constexpr size_t kDefaultQueryCacheRows = 1000000;
+    // Width of the per-window quantile sketches (one day)
+    static constexpr int64_t kQuantileWindowMs = 24LL * 60 * 60 * 1000;
+    // Most appended readings a cached result can be patched with before it is recomputed
+    static constexpr size_t kQueryCacheTailWindow = 4096;
+    // Readings read per chunk by loadFromStorage
+    static constexpr size_t kLoadChunkRecords = 65536;
+    // Statistical anomalies kept for getStatisticalAnomalies()
+    static constexpr size_t kStatisticalAnomalyHistory = 256;
+
 private:
-    std::vector<SensorData> historicalData_;
-    AnomalyDetector anomalyDetector_; // Instance of AnomalyDetector for checking anomalies
-    AnomalyDetector::AnomalyThresholds thresholds_; // Store thresholds for deviation calculation
+    // Resident history: sealed segments are immutable, only headSegment_ is appended to. Queries
+    // copy the segment pointers under dataMutex_ and scan the rows after releasing it. Read in
+    // list order the segment rows are sorted by timestamp; late readings wait in reorderBuffer_
+    // (also sorted) until it is merged in. Every segment keeps the verdicts of its rows under
+    // anomalyDetector_; a threshold reload swaps in reclassified segments when it publishes.
+    std::vector<std::shared_ptr<const HistorySegment>> sealedSegments_;
+    std::shared_ptr<HistorySegment> headSegment_;
+    std::vector<SensorData> reorderBuffer_;
+    size_t residentCount_ = 0; // Includes the reorder buffer and the base rows
+    size_t segmentCapacity_ = kDefaultSegmentCapacity;
+    size_t headCapacity_ = kInitialSegmentCapacity; // Of the next head segment, at most segmentCapacity_
+    int64_t segmentPartitionMs_ = kDefaultSegmentPartitionMs;
+    size_t reorderBufferCapacity_ = kDefaultReorderBufferCapacity;
+    // Read-only base rows mapped by mapFromStorage, older than the segments and in file order
+    // (not necessarily sorted), block by block with their zone maps. Copied into the segments
+    // before retention can evict from them.
+    std::vector<std::shared_ptr<const MappedFile>> baseFiles_;
+    std::vector<BlockFile::Block> baseBlocks_;
+    // One per rollupResolutions() entry, finest first. Mutable, like the quantile sketches,
+    // so that const queries can fold in deferred base rows (see summarizeBase).
+    mutable std::vector<RollupTier> rollupTiers_;
+    AnomalyDetector anomalyDetector_; // Instance of AnomalyDetector for checking anomalies and deviation
+
+    mutable std::mutex dataMutex_; // Guards ingest and the segment lists; never held while scanning rows
+
+    // Ordered secondary indexes, one per indexable metric: while enabled, every sealed segment
+    // keeps its rows' positions sorted by each metric (see HistorySegment::order), and the base is
+    // materialized into segments. The head and the reorder buffer are sorted per query.
+    enum IndexedMetric {
+        TEMPERATURE_INDEX = HistorySegment::TEMPERATURE_COLUMN,
+        HUMIDITY_INDEX = HistorySegment::HUMIDITY_COLUMN,
+        LIGHT_INDEX = HistorySegment::LIGHT_COLUMN,
+        DEVIATION_INDEX = HistorySegment::DEVIATION_COLUMN,
+        INDEX_COUNT = HistorySegment::COLUMN_COUNT
+    };
+    bool indexesEnabled_ = false;
+
+    // Retention and disk tiering. Invariant: every reading with timestamp <= coldWatermark_
+    // lives in one of coldFiles_, every newer reading is resident.
+    std::optional<RetentionPolicy> retentionPolicy_;
+    DataStorage* tierStorage_ = nullptr;
+    std::vector<DataStorage::ColdFile> coldFiles_;
+    int64_t coldWatermark_ = std::numeric_limits<int64_t>::min();
+    int64_t newestTimestamp_ = std::numeric_limits<int64_t>::min();
+    int64_t oldestResidentTimestamp_ = std::numeric_limits<int64_t>::max();
+
+    // Parallel query state
+    size_t parallelQueryThreshold_ = kDefaultParallelQueryThreshold;
+    unsigned queryThreadCount_ = 0;
+    std::shared_ptr<ThreadPool> queryPool_; // Created lazily; shared so running queries keep it alive
+
+    // Quantile sketches per metric, for the whole history and per kQuantileWindowMs window.
+    // Like the rollups they keep summarizing readings after retention evicts them.
+    struct MetricSketches {
+        QuantileSketch metrics[3]; // Indexed by SensorMetric
+        void add(const SensorData& sd);
+    };
+    mutable MetricSketches overallSketches_;
+    mutable std::map<int64_t, MetricSketches> windowSketches_; // Keyed by window start
+    void foldIntoSketches(const SensorData& sd) const;
+
+    // Base rows not yet folded into the sketches, and into the rollup tiers those stored after
+    // the persisted rollups: the base rows from baseRollupCovered_ on or, for rollups saved
+    // without their position, those past the watermarks the tiers had when the base was mapped
+    mutable bool baseSummaryPending_ = false;
+    std::optional<uint64_t> baseRollupCovered_;
+    std::vector<int64_t> baseRollupWatermarks_;
+    // Folds pending base rows into the summaries; caller holds dataMutex_
+    void summarizeBase() const;
+    // Copies the base rows into the segments and unmaps the file; caller holds dataMutex_
+    void materializeBase();
+
+    // History loading. While loadStatus_.loading is set, addSensorData parks readings in
+    // pendingReadings_; the loader takes dataMutex_ per chunk, so queries interleave with it.
+    LoadStatus loadStatus_;
+    std::vector<QueryResult> pendingReadings_;
+    std::thread loadThread_;
+    std::mutex loadThreadMutex_; // Guards loadThread_; never held together with dataMutex_
+    // Starts a load and returns how many records of the binary file it covers
+    size_t beginLoad(DataStorage& storage);
+    // Streams up to recordLimit records of the binary file in as the resident history
+    void loadHistory(DataStorage& storage, size_t recordLimit);
+    // Maps up to recordLimit records as the base; false if mapping does not apply
+    bool mapHistory(DataStorage& storage, size_t recordLimit);
+    // Ends a load and applies the readings held back during it
+    void finishLoad();
+    // saveToStorage, or checkpointToStorage unless rewriteHistory
+    void persistToStorage(DataStorage& storage, bool rewriteHistory);
+    // Held while addEnrichedData stores and adds a reading, and while persistToStorage takes the
+    // storage position the rollups cover; taken before dataMutex_
+    std::mutex storeMutex_;
+    // addEnrichedData after classification; caller holds dataMutex_
+    void addEnrichedLocked(const QueryResult& data);
+    // Adds a classified reading once no load is in progress; caller holds dataMutex_
+    void addLocked(const QueryResult& data);
+
+    // Statistical detection, updated by addSensorData under dataMutex_
+    std::optional<StatisticalDetector> statisticalDetector_;
+    std::deque<StatisticalAnomaly> statisticalAnomalies_; // The last kStatisticalAnomalyHistory
+    size_t statisticalAnomalyCount_ = 0;
+    // Threshold reload. anomalyDetector_ changes only under dataMutex_ and is mirrored into
+    // publishedDetector_ for readers without the lock; it is only accessed with std::atomic_load
+    // and std::atomic_store, so a reload swaps it while readers hold the previous generation.
+    // While reclassifying_, readings folded into the rollup tiers are journaled so the rebuilt
+    // tiers can catch up before they replace the live ones.
+    std::shared_ptr<const AnomalyDetector> publishedDetector_;
+    uint64_t thresholdGeneration_ = 0;
+    std::optional<AnomalyDetector> stagedDetector_;
+    std::atomic<uint64_t> stagedGeneration_{0}; // Read by the rebuild to notice it was superseded
+    bool reclassifying_ = false;
+    bool reclassifyRunning_ = false; // The thread is between its start and its final update
+    std::vector<QueryResult> rollupJournal_;
+    std::thread reclassifyThread_;
+    std::mutex reclassifyThreadMutex_; // Guards reclassifyThread_; never held together with dataMutex_
+    // Body of the reclassification thread
+    void reclassifyHistory();
+    // Makes detector the one in force; caller holds dataMutex_
+    void publishDetector(const AnomalyDetector& detector);
+    // Stages change(detector in force or staged) and starts the reclassification if none runs
+    uint64_t stageDetector(const std::function<AnomalyDetector(const AnomalyDetector&)>& change);
+
+    // Anomaly episodes, updated under dataMutex_ by addLocked and loadHistory
+    EpisodeTracker episodes_;
+    void trackEpisodes(const SensorData& data, uint32_t firedRules);
+
+    // Query result cache. appendSequence_ counts readings added through addSensorData and
+    // historyEpoch_ changes whenever history is replaced, invalidating every cached result.
+    QueryCache queryCache_{kDefaultQueryCacheEntries, kDefaultQueryCacheRows};
+    uint64_t appendSequence_ = 0;
+    uint64_t historyEpoch_ = 0;
+    std::deque<QueryResult> recentAppends_; // The last kQueryCacheTailWindow appended readings, classified
 
-    mutable std::mutex dataMutex_; // Mutex to protect access to historicalData_
+    // Cache key that is equal for queries that always return the same rows in the same order
+    static std::string cacheKeyFor(const QueryParams& params);
+    // Results, which are already sorted, with the readings of tail that match params merged in;
+    // results itself if none match
+    static std::shared_ptr<const std::vector<QueryResult>> mergeTail(
+        const std::shared_ptr<const std::vector<QueryResult>>& results, const std::vector<QueryResult>& tail,
+        const QueryParams& params, const AnomalyDetector& detector);
+
+    // Point-in-time view of the history a query reads. Holding it keeps the resident segments
+    // alive, so the rows can be scanned after dataMutex_ is released.
+    struct Snapshot {
+        std::vector<std::shared_ptr<const HistorySegment>> segments;
+        std::vector<std::shared_ptr<const MappedFile>> baseFiles;
+        std::shared_ptr<const std::vector<SensorData>> lateRows; // Copy of the reorder buffer
+        // Rows visible when the snapshot was taken: the base rows, the segments in timestamp
+        // order, then lateRows
+        std::vector<SensorDataSpan> spans;
+        // Aligned with spans: the segment holding the rows (null for base and late rows), and
+        // the verdicts it keeps for them, which are under detector
+        std::vector<const HistorySegment*> spanSegments;
+        std::vector<RowVerdicts> verdicts;
+        size_t residentCount = 0;
+        bool indexed = false; // Indexes were enabled; the sealed segments are ordered
+        DataStorage* coldStorage = nullptr;
+        std::vector<DataStorage::ColdFile> coldFiles; // Cold files in the time range
+        // Thresholds in force when the snapshot was taken; the whole query classifies with them
+        // even if a reload is applied meanwhile
+        AnomalyDetector detector;
+    };
+    // Captures the rows in the query's time range (segments outside it are skipped and the
+    // sorted spans trimmed to it); caller holds dataMutex_
+    Snapshot snapshot(const QueryParams& params) const;
 
     // Helper to convert SensorData to QueryResult (calculates anomaly status and deviation)
-    QueryResult convertToQueryResult(const SensorData& sd) const;
+    static QueryResult convertToQueryResult(const SensorData& sd, const AnomalyDetector& detector);
+
+    // Chunked filter/sort on pool followed by a pairwise parallel merge over the given spans
+    static std::vector<QueryResult> queryDataParallel(const QueryParams& params, const std::vector<SensorDataSpan>& spans,
+                                                      const std::vector<RowVerdicts>& verdicts,
+                                                      const AnomalyDetector& detector, ThreadPool& pool);
+
+    // Retention helpers; callers must hold dataMutex_
+    // Stores one reading, classified with anomalyDetector_: resident, or straight into a cold
+    // file if it falls in the evicted range
+    void ingestReading(const QueryResult& data);
+    // Appends in timestamp order, or to the reorder buffer if the reading is late
+    void appendResident(const QueryResult& data);
+    // Appends to the head segment, sealing it first if it is full or the partition changed
+    void appendToHead(const QueryResult& data);
+    // Newest timestamp stored in the segments (the minimum if there are none)
+    int64_t newestSegmentTimestamp() const;
+    // Folds the reorder buffer into the segments it overlaps, leaving the others as they are
+    void mergeReorderBuffer();
+    void sealHead();
+    void clearResident();
+    // Evicts the oldest readings to a new cold file while the policy is exceeded
+    void enforceRetention();
+    // Appends readings to the newest cold file; false if there is none or the write failed
+    bool appendToNewestColdFile(const std::vector<SensorData>& data);
+    // Loads the snapshot's evicted readings matching the query's time range; needs no lock
+    static std::vector<SensorData> loadColdRows(const Snapshot& snap, const QueryParams& params);
+
+    // Index helpers
+    // A segment being sealed as sealedSegments_ keeps it: ordered while indexes are enabled;
+    // caller holds dataMutex_
+    std::shared_ptr<const HistorySegment> sealedForIndexes(const std::shared_ptr<HistorySegment>& segment) const;
+    // Orders or unorders the sealed segments to match indexesEnabled_; caller holds dataMutex_
+    void rebuildIndexes();
+    // Index an index walk over snap can be driven by for params (-1 if none); descending tells
+    // whether to walk it backwards and ordered whether results come out in sort order
+    static int indexFor(const Snapshot& snap, const QueryParams& params, bool& descending, bool& ordered);
+    // Returns true and fills results if the query could be answered from an index; needs no lock
+    static bool queryFromIndexes(const Snapshot& snap, const QueryParams& params, std::vector<QueryResult>& results);
+    // Index whose order yields sortBy (-1 if none); descending tells whether to walk it backwards
+    static int indexForSort(SortCriteria sortBy, bool& descending);
+    // Index of the first metric with a range filter (-1 if none)
+    static int rangeIndexFor(const QueryParams& params);
+    // Calls fn(row, result) for the resident rows of snap within params' range for the index's
+    // metric, until it returns false: in index order (backwards if descending) if ordered, else
+    // in no particular order. The sorted orders of the snapshot's segments are binary-searched and
+    // merged; other rows are sorted here. Needs no lock.
+    template <typename Fn>
+    static void walkIndex(const Snapshot& snap, int indexId, bool ordered, bool descending, const QueryParams& params,
+                          Fn&& fn);
+    // A matching row by reference, with its verdict
+    struct RowMatch {
+        const SensorData* row;
+        bool anomalous;
+    };
+    // Orders row references by the sort criteria without copying the rows
+    static void orderRows(std::vector<RowMatch>& rows, SortCriteria sortBy, const AnomalyDetector& detector);
+    static bool matchesFilters(const QueryResult& result, const QueryParams& params);
+    // matchesFilters plus the filter expression, for paths that visit rows one at a time
+    static bool rowMatches(const QueryResult& result, const QueryParams& params, const AnomalyDetector& detector);
+    // Calls fn(row, result) for every row of rows passing all of params' filters. A filter
+    // expression is first evaluated over the whole span into a selection bitmap, so rows it
+    // rejects are never converted. Rows without verdicts are classified with detector.
+    template <typename Fn>
+    static void scanRows(SensorDataSpan rows, RowVerdicts verdicts, const QueryParams& params,
+                         const AnomalyDetector& detector, Fn&& fn);
+    static bool inTimeRange(int64_t timestamp_ms, const QueryParams& params);
 };
 
 #endif // DATA_MANAGER_HPP
\ No newline at end of file
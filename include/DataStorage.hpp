@@ -2,31 +2,177 @@
 #define DATASTORAGE_HPP
 
 #include "SensorData.hpp"
+#include "RollupTier.hpp"
+#include "MappedFile.hpp"
+#include "AnomalyEpisodes.hpp"
+#include "WriteAheadLog.hpp"
+#include "BlockFile.hpp"
+#include "SegmentedFile.hpp"
 #include <vector>
 #include <string>
 #include <fstream>
+#include <functional>
+#include <ostream>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <limits>
+#include <optional>
 
 class DataStorage {
 public:
+    // Describes one cold file: a range of history evicted from memory by a DataManager. Plain
+    // data so the catalog can be persisted as-is.
+    struct ColdFile {
+        uint64_t id;              // The file is <binary>.cold<id>
+        int64_t minTimestamp_ms;  // Oldest reading in the file
+        int64_t maxTimestamp_ms;  // Newest reading in the file
+        uint64_t count;           // Number of readings in the file
+    };
+
+    // Renames cold files left under their former names, <binary>.seg<id> listed in
+    // <binary>.segments
     DataStorage(const std::string& binaryFilePath, const std::string& jsonReportPath);
 
-    // Appends a single data point to the binary file
+    // Appends a single data point to the binary file. Appends are logged first (see
+    // WriteAheadLog) and reach the binary file at the next checkpoint; the reads below add the
+    // logged readings from memory, so they see every stored reading without checkpointing or
+    // writing anything. Only one DataStorage may store to a file.
     bool storeData(const SensorData& data);
     // Appends a batch of data points to the binary file
     bool storeDataBatch(const std::vector<SensorData>& dataBatch);
-    // Replaces all data in the binary file with the provided batch
+    // How logged appends are buffered and synced; PERIODIC by default
+    void setAppendPolicy(const BufferedAppender::Policy& policy);
+    BufferedAppender::Policy appendPolicy() const;
+    BufferedAppender::Stats appendStats() const;
+    // Syncs every stored reading to the log
+    bool flush();
+    // Moves the logged readings to the end of the binary file without rewriting it, recovering
+    // them after a crash. Happens on its own every checkpointRecords readings and on destruction,
+    // which leave readings short of a GORILLA block in the log; reads never checkpoint.
+    bool checkpoint();
+    void setCheckpointRecords(size_t records);
+    uint64_t checkpointCount() const;
+    // Replaces all data in the binary file with the provided batch, after a checkpoint
     bool replaceAllData(const std::vector<SensorData>& dataBatch);
+    // Replaces all data in the binary file with the concatenation of the given spans. The new
+    // content is written to a temporary file that then replaces the old one, so an existing
+    // mapping of the file (see mapAllData) keeps seeing the old content.
+    bool replaceAllData(const std::vector<SensorDataSpan>& spans);
+    // Splits the binary file into rolling segment files listed in a manifest and compacts them
+    // in the background (see SegmentedFile), so old history can be backed up and dropped a file
+    // at a time; once split, the binary file stays split. Unrelated to the segments history is
+    // evicted to (writeColdFile below).
+    bool setSegmentPolicy(const SegmentedFile::Policy& policy);
+    SegmentedFile::Policy segmentPolicy() const;
+    SegmentedFile::Stats segmentStats() const;
+    // Runs one compaction pass of the segments now
+    bool compactSegments();
+    // The binary file is a block file (see BlockFile); files from before blocks are read as they
+    // are and rewritten as blocks by the first checkpoint that adds to them. Block anomaly
+    // counts are taken with this detector, the default thresholds unless set.
+    void setAnomalyDetector(const AnomalyDetector& detector);
+    // Encoding of the binary file when it is created or replaced by replaceAllData; an existing
+    // file keeps its own until then. RAW by default. GORILLA compresses readings to a fraction
+    // of their size, but its blocks cannot be mapped (see mapAllData).
+    void setStorageEncoding(BlockFile::Encoding encoding);
+    BlockFile::Encoding storageEncoding() const;
     // Loads all data from the binary file
     std::vector<SensorData> loadAllData();
+    // Loads the readings matching filter, skipping the blocks whose zone maps rule them out
+    std::vector<SensorData> loadMatching(const ZoneFilter& filter, BlockFile::ScanStats* stats = nullptr);
+    // Maps the binary file read-only, its records viewed in place block by block; a torn record
+    // at the end is ignored. The stored readings not checkpointed yet are copied into unsealed.
+    // No files if the binary file is missing, empty or has GORILLA encoded segments.
+    MappedBlocks mapAllData() const;
+    // Loads the binary file in chunks of at most chunkRecords readings, handing each chunk to
+    // consumer so callers never need the whole file in memory. Stops after maxRecords readings.
+    // firstPosition, if given, is set to the position of the first reading (see position).
+    // Returns false if unreadable.
+    bool loadDataInChunks(size_t chunkRecords, const std::function<void(std::vector<SensorData>&)>& consumer,
+                          size_t maxRecords = std::numeric_limits<size_t>::max(),
+                          uint64_t* firstPosition = nullptr);
+    // Loads the binary file one block at a time as columns, which GORILLA blocks decode straight
+    // into. Stops after maxRecords readings. Returns false if unreadable.
+    bool loadColumns(const std::function<void(const ColumnBatch&)>& consumer,
+                     size_t maxRecords = std::numeric_limits<size_t>::max());
+    // Number of whole records currently in the binary file
+    size_t recordCount() const;
+    // Readings stored since the binary file was created or last replaced, including those
+    // segment retention dropped since: the position the next stored reading will have
+    bool position(uint64_t& records) const;
+    // Receives one reading at a time from a streaming source
+    using SensorDataSink = std::function<void(const SensorData&)>;
+
     // Exports a list of anomalies to a JSON file
     bool exportAnomaliesToJson(const std::vector<SensorData>& anomalies);
+    // Streams anomalies to the JSON file: source is called once and pushes every reading into the
+    // sink it is given, so the caller never has to build an intermediate vector
+    bool exportAnomaliesToJson(const std::function<void(const SensorDataSink&)>& source);
+    // Exports anomaly episodes, one object per episode rather than per reading, to the episode
+    // report: the JSON report path with "_episodes" before its extension. Rule episodes are named
+    // from ruleNames (AnomalyDetector::ruleNames), or by index beyond it.
+    bool exportEpisodesToJson(const std::vector<AnomalyEpisode>& episodes,
+                              const std::vector<std::string>& ruleNames = {});
+    const std::string& episodeReportPath() const { return episodeReportPath_; }
+
+    // Replaces the persisted rollup buckets (stored next to the binary file with a ".rollup"
+    // suffix). coveredRecords is the position (see position) up to which the stored readings
+    // are summarized by the buckets, so those stored after them can be folded in on load.
+    bool replaceRollupData(const std::vector<RollupBucket>& buckets,
+                           std::optional<uint64_t> coveredRecords = std::nullopt);
+    // Loads all persisted rollup buckets of every tier, and the position they cover if it was
+    // stored; files from before it was are a headerless array of buckets
+    std::vector<RollupBucket> loadRollupData(std::optional<uint64_t>* coveredRecords = nullptr);
+
+    // Writes (truncating) or appends readings to the cold file with the given id. Cold files are
+    // block files (see BlockFile); a headerless one of 32-byte records from before is read
+    // as it is and rewritten as blocks by the first append.
+    bool writeColdFile(uint64_t fileId, const std::vector<SensorData>& dataBatch);
+    bool appendToColdFile(uint64_t fileId, const std::vector<SensorData>& dataBatch);
+    // Loads every reading of one cold file
+    std::vector<SensorData> loadColdFile(uint64_t fileId);
+    // Persists / loads the cold file catalog (<binary>.cold)
+    bool replaceColdCatalog(const std::vector<ColdFile>& files);
+    std::vector<ColdFile> loadColdCatalog();
 
 private:
+    // Start of the rollup file, followed by its buckets
+    struct RollupHeader {
+        char magic[8];             // kRollupMagic; as a bucket start it would lie millions of years ahead
+        uint32_t version;
+        uint32_t hasCoveredRecords;
+        uint64_t coveredRecords;
+        uint64_t reserved;
+    };
+    static_assert(sizeof(RollupHeader) == 32, "RollupHeader is stored as-is");
+    static constexpr char kRollupMagic[8] = {'F', 'P', 'R', 'O', 'L', 'L', 'U', 'P'};
+    static constexpr uint32_t kRollupVersion = 1;
+
     std::string binaryFilePath_;
     std::string jsonReportPath_;
+    std::string episodeReportPath_;
+    std::string rollupFilePath_;
+    std::string coldCatalogPath_;
+    std::unique_ptr<SegmentedFile> files_;
+    std::unique_ptr<WriteAheadLog> wal_; // Destroyed first, checkpointing into files_
+    std::mutex detectorMutex_;
+    AnomalyDetector detector_; // For the anomaly counts of cold file blocks
+
+    // Copies the logged readings the binary file does not have yet; firstPosition is the
+    // position of the first of them
+    bool unsealedReadings(std::vector<SensorData>& rows, uint64_t& firstPosition) const;
+    // How many of rows, read before a scan of the binary file that ended at position scannedEnd,
+    // the scan already handed over
+    static size_t unsealedSkip(const std::vector<SensorData>& rows, uint64_t rowsPosition, uint64_t scannedEnd);
+
+    std::string coldFilePath(uint64_t fileId) const;
+    void renameOldColdFiles();
+    // Appends records to the block file at path, emptying it first if truncate is set
+    bool writeRecords(const std::string& path, bool truncate, const std::vector<SensorData>& dataBatch);
 
-    // Helper for simple JSON generation for a single SensorData item
-    std::string sensorDataToJson(const SensorData& data) const;
+    // Helper for simple JSON generation for a single SensorData item, written straight to the stream
+    void writeSensorDataJson(std::ostream& out, const SensorData& data) const;
 };
 
 #endif //DATASTORAGE_HPP
@@ -0,0 +1,21 @@
+#ifndef FILE_IO_HPP
+#define FILE_IO_HPP
+
+#include <cstddef>
+#include <string>
+
+// Thin wrappers over POSIX (or MSVC runtime) file descriptors, for writers that need an
+// fdatasync, which streams do not offer
+
+// Opens path for appending, creating it if missing; -1 on failure
+int openForAppend(const std::string& path);
+// Writes all size bytes, retrying partial and interrupted writes
+bool writeAll(int fd, const char* data, size_t size);
+// Forces written data to disk
+bool syncFile(int fd);
+void closeFile(int fd);
+// Writes size bytes to a file next to path, syncs it and renames it over path, so a crash
+// leaves either the old content or the new one
+bool replaceFile(const std::string& path, const char* data, size_t size);
+
+#endif // FILE_IO_HPP
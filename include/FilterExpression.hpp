@@ -0,0 +1,67 @@
+#ifndef FILTER_EXPRESSION_HPP
+#define FILTER_EXPRESSION_HPP
+
+#include "SensorData.hpp"
+#include "AnomalyDetector.hpp"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Compound filter over sensor readings, e.g. "temp > 28 AND (humidity < 35 OR light < 80)".
+//
+// Grammar (keywords are case-insensitive, && || ! are accepted for AND OR NOT):
+//   expr       := term (OR term)*
+//   term       := factor (AND factor)*
+//   factor     := NOT factor | '(' expr ')' | comparison | anomalous | normal
+//   comparison := field op number        op: < <= > >= == = !=
+//   field      := temp | temperature | hum | humidity | light | deviation | dev | ts | timestamp
+//
+// The expression is compiled once into a postfix program. Evaluation is column-at-a-time: each
+// comparison runs over one field of a block of rows and produces a selection bitmap, and the
+// boolean operators combine whole 64-row bitmap words, so nothing is interpreted per row.
+class FilterExpression {
+public:
+    enum class Field { TEMPERATURE, HUMIDITY, LIGHT_INTENSITY, DEVIATION, TIMESTAMP };
+    enum class Comparison { LESS, LESS_EQUAL, GREATER, GREATER_EQUAL, EQUAL, NOT_EQUAL };
+
+    // Derived columns (deviation, anomalous) are computed with the thresholds profile of each row,
+    // unless the rows' verdicts under detector are given, index for index with the rows
+    struct Context {
+        const AnomalyDetector& detector;
+        const uint8_t* anomalous = nullptr;
+        const double* deviations = nullptr;
+    };
+
+    // Parses and compiles text. Returns nullptr and describes the problem in error on failure.
+    static std::shared_ptr<const FilterExpression> compile(const std::string& text, std::string& error);
+
+    // Fully parenthesized normal form; equal for differently spelled but identical expressions
+    const std::string& canonical() const { return canonical_; }
+
+    // Sets bit i of selection (64 rows per word, resized to fit) for each matching row i
+    void evaluate(const SensorData* rows, size_t count, const Context& context, std::vector<uint64_t>& selection) const;
+    // Single-row evaluation for paths that visit rows one at a time
+    bool matches(const SensorData& row, const Context& context) const;
+
+    // Rows evaluated per pass; a multiple of 64 so blocks start on bitmap word boundaries
+    static constexpr size_t kBlockRows = 2048;
+
+private:
+    struct Instruction {
+        enum Op { COMPARE, ANOMALOUS, AND, OR, NOT } op;
+        Field field;
+        Comparison comparison;
+        double value;
+    };
+
+    std::vector<Instruction> program_; // Postfix order
+    size_t stackDepth_ = 0;            // Bitmaps needed to run program_
+    std::string canonical_;
+
+    class Parser;
+    void evaluateBlock(const SensorData* rows, size_t count, const Context& context,
+                       std::vector<std::vector<uint64_t>>& stack, uint64_t* out) const;
+};
+
+#endif // FILTER_EXPRESSION_HPP
@@ -0,0 +1,47 @@
+#ifndef GORILLA_CODEC_HPP
+#define GORILLA_CODEC_HPP
+
+#include "SensorData.hpp"
+#include "AnomalyDetector.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Readings held column by column, as compressed blocks decode into
+struct ColumnBatch {
+    std::vector<int64_t> timestamps;
+    std::vector<double> temperature;
+    std::vector<double> humidity;
+    std::vector<double> lightIntensity;
+    std::vector<uint32_t> sensorIds;
+
+    size_t size() const { return timestamps.size(); }
+    void clear();
+    // Keeps the first count readings
+    void truncate(size_t count);
+    void reserve(size_t count);
+    void append(const SensorData* rows, size_t count);
+    SensorData row(size_t i) const;
+    // Appends the readings [first, first + count) to rows
+    void appendRows(size_t first, size_t count, std::vector<SensorData>& rows) const;
+    // Readings [first, first + count) as the anomaly detector classifies them
+    AnomalyDetector::SensorColumns columns(size_t first, size_t count) const;
+};
+
+// Compression of readings after Facebook's Gorilla. Timestamps are stored as the change of their
+// delta, a bit or two for a steady sample rate, and sensor ids as slots in the block's list of
+// sensors, one bit while sensors keep reporting in the same order. Each value is XORed with
+// the previous value of the same sensor and only the bits between the leading and trailing
+// zeros of the result are kept, so a repeated value takes one bit and a slowly changing one a
+// few more, even with many sensors interleaved. Every column is a separate byte-aligned bit
+// stream, so a block decodes one tight loop per column.
+class GorillaCodec {
+public:
+    // Appends count readings to out
+    static void encode(const SensorData* rows, size_t count, std::vector<char>& out);
+    // Decodes count readings from the size bytes at data, appending them to columns. False if
+    // the bytes end early, in which case columns may hold part of the readings.
+    static bool decode(const char* data, size_t size, size_t count, ColumnBatch& columns);
+};
+
+#endif // GORILLA_CODEC_HPP
@@ -0,0 +1,121 @@
+#ifndef HISTORY_SEGMENT_HPP
+#define HISTORY_SEGMENT_HPP
+
+#include "SensorData.hpp"
+#include "AnomalyDetector.hpp"
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Anomaly flags and deviations of a run of rows, index for index, as a HistorySegment keeps them;
+// null where the rows have none under the thresholds at hand and are to be classified
+struct RowVerdicts {
+    const uint8_t* anomalous = nullptr;
+    const double* deviations = nullptr;
+
+    RowVerdicts from(size_t offset) const {
+        return anomalous ? RowVerdicts{anomalous + offset, deviations + offset} : RowVerdicts{};
+    }
+};
+
+// Fixed-capacity block of readings covering one time partition. Storage is allocated once, so
+// appending never reallocates and published rows never move. A single writer (holding the
+// owner's append lock) appends; readers load size() and may read rows [0, size()) without any
+// lock. Once sealed by its owner a segment is never written again.
+//
+// Each row is kept with its anomaly flag and deviation under the thresholds of classifiedWith(),
+// so queries under the same thresholds need not classify the rows again. A segment never changes
+// its thresholds; after a reload the owner swaps in reclassified copies.
+//
+// A sealed segment may also keep, per indexed column, the positions of its rows in ascending
+// order of that column: 4 bytes per row and column, against the rows' 40. Index walks
+// binary-search and merge these orders across segments rather than keeping copies of the rows.
+class HistorySegment {
+public:
+    // Columns the rows can be kept sorted by, for the owner's value indexes
+    enum Column { TEMPERATURE_COLUMN = 0, HUMIDITY_COLUMN, LIGHT_COLUMN, DEVIATION_COLUMN, COLUMN_COUNT };
+
+    HistorySegment(size_t capacity, int64_t partitionStart_ms, const AnomalyDetector& classifiedWith);
+
+    HistorySegment(const HistorySegment&) = delete;
+    HistorySegment& operator=(const HistorySegment&) = delete;
+
+    size_t capacity() const { return capacity_; }
+    size_t size() const { return size_.load(std::memory_order_acquire); }
+    bool full() const { return size() >= capacity_; }
+    const SensorData* data() const { return rows_.get(); }
+    SensorDataSpan span() const { return {rows_.get(), size()}; }
+    // Verdicts of the rows, index for index: anomalous()[i] is 1 if row i is anomalous
+    const AnomalyDetector& classifiedWith() const { return classifiedWith_; }
+    const uint8_t* anomalous() const { return anomalous_.get(); }
+    const double* deviations() const { return deviations_.get(); }
+
+    // Value of row i in column; the deviation is the kept one
+    double key(Column column, size_t i) const {
+        switch (column) {
+            case TEMPERATURE_COLUMN: return rows_[i].temperature;
+            case HUMIDITY_COLUMN:    return rows_[i].humidity;
+            case LIGHT_COLUMN:       return rows_[i].lightIntensity;
+            default:                 return deviations_[i];
+        }
+    }
+    // Order of keys: NaN sorts after every number, so that it is a strict weak order
+    static bool keyLess(double a, double b) { return a < b || (!std::isnan(a) && std::isnan(b)); }
+    // Positions of the rows [0, size()) in ascending order of column, ties in row order; null
+    // unless the segment was sealed with its orders
+    const uint32_t* order(Column column) const { return orders_[column].get(); }
+    bool ordered() const { return orders_[TEMPERATURE_COLUMN] != nullptr; }
+
+    // Start of the time partition this segment was opened for
+    int64_t partitionStart() const { return partitionStart_ms_; }
+    // Timestamp bounds of the rows appended so far (meaningless while empty)
+    int64_t minTimestamp() const { return minTimestamp_ms_.load(std::memory_order_relaxed); }
+    int64_t maxTimestamp() const { return maxTimestamp_ms_.load(std::memory_order_relaxed); }
+    bool overlaps(int64_t start_ms, int64_t end_ms) const;
+
+    // Writer side, with the reading's verdict under classifiedWith(). Returns false when the
+    // segment is full.
+    bool append(const SensorData& data, bool anomalous, double deviation);
+
+    // Builds a sealed segment holding exactly the given rows, classified with detector; verdicts,
+    // if given, are theirs already and copied instead
+    static std::shared_ptr<HistorySegment> fromRows(const SensorData* rows, size_t count, int64_t partitionStart_ms,
+                                                    const AnomalyDetector& detector,
+                                                    const uint8_t* anomalous = nullptr, const double* deviations = nullptr);
+    // The rows of segment, of the same capacity, classified with detector. The first classified
+    // rows take the given verdicts, computed beforehand; the rest are classified here. The rows
+    // are shared rather than copied, so segment must not be appended to afterwards; the copy may be.
+    // The orders of a sealed segment are carried over, the deviation one sorted again.
+    static std::shared_ptr<HistorySegment> reclassified(const HistorySegment& segment, const AnomalyDetector& detector,
+                                                        const uint8_t* anomalous, const double* deviations,
+                                                        size_t classified);
+    // A sealed segment sharing the rows and verdicts of segment, with its orders if ordered is set
+    // and without any otherwise
+    static std::shared_ptr<HistorySegment> withOrders(const HistorySegment& segment, bool ordered);
+
+private:
+    HistorySegment(std::shared_ptr<SensorData[]> rows, size_t capacity, int64_t partitionStart_ms,
+                   const AnomalyDetector& classifiedWith, bool allocateVerdicts);
+
+    std::shared_ptr<SensorData[]> rows_;
+    size_t capacity_;
+    std::atomic<size_t> size_;
+    int64_t partitionStart_ms_;
+    std::atomic<int64_t> minTimestamp_ms_;
+    std::atomic<int64_t> maxTimestamp_ms_;
+    AnomalyDetector classifiedWith_;
+    std::shared_ptr<uint8_t[]> anomalous_;
+    std::shared_ptr<double[]> deviations_;
+    std::shared_ptr<const uint32_t[]> orders_[COLUMN_COUNT];
+
+    // Classifies rows [first, last) with classifiedWith_
+    void classify(size_t first, size_t last);
+    // Positions of the rows in ascending order of column
+    std::shared_ptr<const uint32_t[]> sortedBy(Column column) const;
+    // A segment sharing the rows of this one, of the same size; verdicts are up to the caller
+    std::shared_ptr<HistorySegment> sharingRows(const AnomalyDetector& classifiedWith, bool allocateVerdicts) const;
+};
+
+#endif // HISTORY_SEGMENT_HPP
@@ -0,0 +1,36 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Read-only view of a whole file. On POSIX systems the file is memory-mapped, so opening costs
+// the same regardless of its size and pages are only read (through the page cache) when touched.
+// Elsewhere the file is read into memory in a single call. The view stays valid for the lifetime
+// of the object even if the file is replaced or appended to in the meantime.
+class MappedFile {
+public:
+    // Returns nullptr if the file cannot be opened or is empty
+    static std::shared_ptr<const MappedFile> open(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    // True if the contents are mapped rather than copied
+    bool mapped() const { return mapped_; }
+
+private:
+    MappedFile() = default;
+
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+    bool mapped_ = false;
+    std::vector<char> buffer_; // Holds the contents when the file could not be mapped
+};
+
+#endif // MAPPED_FILE_HPP
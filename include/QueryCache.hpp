@@ -0,0 +1,72 @@
+#ifndef QUERY_CACHE_HPP
+#define QUERY_CACHE_HPP
+
+#include "QueryCommon.hpp"
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+// Bounded LRU cache of query results keyed by a normalized query string. Each entry remembers
+// the history epoch and append sequence it was computed at, so the owner can tell whether it is
+// still current, can be patched with newly appended readings, or must be recomputed.
+// All methods are thread-safe.
+class QueryCache {
+public:
+    struct Entry {
+        uint64_t epoch = 0;    // Bumped by the owner whenever history changes other than by appends
+        uint64_t sequence = 0; // Number of readings appended when the results were computed
+        // Shared with the callers the entry was handed to, so a hit copies no rows
+        std::shared_ptr<const std::vector<QueryResult>> results;
+    };
+
+    struct Stats {
+        uint64_t hits = 0;             // Served unchanged
+        uint64_t incrementalHits = 0;  // Served after merging newly appended readings
+        uint64_t misses = 0;           // Recomputed from scratch
+        uint64_t evictions = 0;        // Entries dropped to stay within bounds
+        size_t entries = 0;
+        size_t cachedRows = 0;
+    };
+
+    // maxEntries == 0 disables caching. maxRows bounds the total number of cached result rows;
+    // a single result larger than that is never cached.
+    QueryCache(size_t maxEntries, size_t maxRows);
+
+    bool enabled() const;
+    void setLimits(size_t maxEntries, size_t maxRows);
+
+    // Returns the entry, its results shared rather than copied, and marks it most recently used
+    std::optional<Entry> lookup(const std::string& key);
+    // Inserts or replaces an entry, evicting least recently used entries to stay within bounds
+    void store(const std::string& key, Entry entry);
+    void clear();
+
+    void recordHit(bool incremental);
+    void recordMiss();
+    Stats stats() const;
+
+private:
+    using LruList = std::list<std::string>; // Most recently used first
+    struct Slot {
+        Entry entry;
+        LruList::iterator lruPosition;
+    };
+
+    mutable std::mutex mutex_;
+    size_t maxEntries_;
+    size_t maxRows_;
+    size_t cachedRows_ = 0;
+    std::map<std::string, Slot> slots_;
+    LruList lru_;
+    Stats stats_;
+
+    void erase(std::map<std::string, Slot>::iterator it);
+    void shrinkToLimits(); // Caller holds mutex_
+};
+
+#endif // QUERY_CACHE_HPP
@@ -28,9 +28,12 @@ enum class SortCriteria {
 struct QueryResult : public SensorData {
     bool isAnomalousFlag;
     double deviationValue; // Value representing how far off the data is from normal thresholds.
+    // Rules of the detector's pipeline that fired when the reading arrived (bit i for rule i);
+    // only set on the ingest path, 0 for rows read back from the history
+    uint32_t firedRules;
 
-    QueryResult(const SensorData& sd, bool isAnomalous, double deviation)
-        : SensorData(sd), isAnomalousFlag(isAnomalous), deviationValue(deviation) {} 
+    QueryResult(const SensorData& sd, bool isAnomalous, double deviation, uint32_t fired = 0)
+        : SensorData(sd), isAnomalousFlag(isAnomalous), deviationValue(deviation), firedRules(fired) {} 
 
     // Extended toString method to include anomaly status and deviation.
     std::string queryResultToString() const {
@@ -0,0 +1,73 @@
+#ifndef ROLLUP_TIER_HPP
+#define ROLLUP_TIER_HPP
+
+#include "SensorData.hpp"
+#include <cstdint>
+#include <map>
+#include <vector>
+
+// Min/max/sum of one metric inside a rollup bucket.
+struct MetricSummary {
+    double min;
+    double max;
+    double sum;
+};
+
+// One downsampled time bucket. Plain data so DataStorage can persist it as-is.
+struct RollupBucket {
+    int64_t bucketStart_ms;   // Aligned start of the bucket (multiple of bucketWidth_ms)
+    int64_t bucketWidth_ms;   // Width of the tier this bucket belongs to
+    int64_t lastTimestamp_ms; // Newest reading folded into this bucket
+    uint64_t count;           // Number of readings in the bucket
+    uint64_t anomalyCount;    // Number of anomalous readings in the bucket
+    MetricSummary temperature;
+    MetricSummary humidity;
+    MetricSummary lightIntensity;
+
+    double averageTemperature() const { return count ? temperature.sum / count : 0.0; }
+    double averageHumidity() const { return count ? humidity.sum / count : 0.0; }
+    double averageLightIntensity() const { return count ? lightIntensity.sum / count : 0.0; }
+
+    // Folds a single reading into the bucket.
+    void add(const SensorData& data, bool isAnomalous);
+    // Folds another bucket of the same time span into this one.
+    void merge(const RollupBucket& other);
+};
+
+// A single resolution level (e.g. 1 minute) of downsampled history.
+// Buckets are kept ordered by start time so range lookups are a tree walk.
+class RollupTier {
+public:
+    explicit RollupTier(int64_t bucketWidth_ms);
+
+    int64_t bucketWidth() const { return bucketWidth_ms_; }
+
+    // Folds a reading into the bucket covering its timestamp.
+    void add(const SensorData& data, bool isAnomalous);
+    // Restores a previously persisted bucket (merged if the bucket already exists).
+    void restoreBucket(const RollupBucket& bucket);
+    // Keeps what a bucket of an earlier build of this tier summarized beyond the readings folded
+    // in since: restored whole if none fell in it, otherwise kept in place of the rebuilt one
+    // if it counted more readings, its anomalies among those readings (previousAnomalies) swapped
+    // for the rebuilt ones.
+    void carryOver(const RollupBucket& bucket, uint64_t previousAnomalies);
+    // Returns the buckets overlapping [start_ms, end_ms], ordered by time.
+    std::vector<RollupBucket> query(int64_t start_ms, int64_t end_ms) const;
+    // Returns every bucket, ordered by time.
+    std::vector<RollupBucket> allBuckets() const;
+
+    // Newest reading timestamp folded into this tier (INT64_MIN when empty).
+    int64_t latestTimestamp() const { return latestTimestamp_ms_; }
+    size_t bucketCount() const { return buckets_.size(); }
+    void clear();
+
+    // Floor-aligns a timestamp to a bucket width (works for negative timestamps too).
+    static int64_t alignTimestamp(int64_t timestamp_ms, int64_t bucketWidth_ms);
+
+private:
+    int64_t bucketWidth_ms_;
+    int64_t latestTimestamp_ms_;
+    std::map<int64_t, RollupBucket> buckets_; // keyed by bucketStart_ms
+};
+
+#endif // ROLLUP_TIER_HPP
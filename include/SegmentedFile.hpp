@@ -0,0 +1,176 @@
+#ifndef SEGMENTED_FILE_HPP
+#define SEGMENTED_FILE_HPP
+
+#include "SensorData.hpp"
+#include "AnomalyDetector.hpp"
+#include "BlockFile.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The binary file a WriteAheadLog checkpoints into (the base), either one block file or, once
+// split, a series of block files (segments) listed in a manifest, <base>.manifest, so history
+// can be backed up and trimmed a file at a time. Readings go to the last, active segment; when
+// it has grown past the policy's size or age, the next checkpoint seals it and starts a new one,
+// <base>.<id>. Sealed segments are never appended to again, so a background compaction thread
+// can rewrite them without holding up appends: it indexes each one (see BlockFile::Index),
+// drops the segments retention rules out and merges runs of small ones, publishing every change
+// by replacing the manifest. Readers work on a snapshot of the manifest, whose segment files stay
+// on disk until the last snapshot holding them is gone. Thread-safe.
+class SegmentedFile {
+public:
+    struct Policy {
+        std::optional<uint64_t> maxSegmentBytes; // Start a new segment once the active one is this large...
+        std::optional<int64_t> maxSegmentAgeMs;  // ...or was started this long ago
+        uint64_t mergeBelowBytes = 1 << 20;      // Merge runs of adjacent sealed segments smaller than this
+        std::optional<int64_t> retainMs;         // Drop sealed segments all of whose readings are older than now - retainMs
+        std::optional<uint64_t> retainBytes;     // Drop the oldest sealed segments while all of them take more bytes than this
+        bool backgroundCompaction = true;        // Compact on a thread of its own after each roll...
+        int64_t compactionInterval_ms = 60000;   // ...and this often (0: only after rolls)
+    };
+    // One segment as listed in the manifest
+    struct ManifestEntry {
+        uint64_t id;          // 0 is the base file itself, which became the first segment
+        uint64_t records;     // Of a sealed segment; the active one is measured instead
+        uint64_t bytes;       // Likewise
+        int64_t created_ms;   // Wall clock time the segment was started
+        uint32_t sealed;      // No more readings are appended to it
+        uint32_t indexed;     // Its index file (<segment>.idx) was written and zone is set
+        BlockZone zone;       // Of every reading of an indexed segment
+    };
+    static_assert(sizeof(ManifestEntry) == 120, "ManifestEntry is stored as-is");
+    // Start of the manifest, followed by its entries, oldest segment first
+    struct ManifestHeader {
+        char magic[8];            // kManifestMagic
+        uint32_t version;
+        uint32_t crc;             // crc32 of the rest of the header, then of the entries
+        uint64_t nextId;
+        uint64_t droppedRecords;  // Dropped by retention; counted in position() all the same
+        uint64_t entries;
+    };
+    static constexpr char kManifestMagic[8] = {'F', 'P', 'M', 'A', 'N', 'I', 'F', '\0'};
+    static constexpr uint32_t kManifestVersion = 1;
+
+    // A segment as a reader sees it
+    struct Segment {
+        ManifestEntry entry;
+        std::string path;
+        std::shared_ptr<const BlockFile::Index> index; // Null until compaction indexed it
+        std::shared_ptr<const void> pin;               // Keeps the file on disk
+    };
+    struct Stats {
+        uint64_t segments = 0;
+        uint64_t rolls = 0;    // Active segments sealed for a new one
+        uint64_t indexed = 0;  // Index files written
+        uint64_t merged = 0;   // Segments merged into others
+        uint64_t dropped = 0;  // Segments dropped by retention
+    };
+
+    // Splits the base if <base>.manifest exists
+    explicit SegmentedFile(const std::string& basePath);
+    // Stops the compaction thread
+    ~SegmentedFile();
+
+    SegmentedFile(const SegmentedFile&) = delete;
+    SegmentedFile& operator=(const SegmentedFile&) = delete;
+
+    // Splits the base into segments, unless it already is, making the current base file the
+    // first one, and applies policy. The policy is not stored; a base split earlier is read as
+    // segments but only rolls over and is compacted once a policy is set again.
+    bool setPolicy(const Policy& policy);
+    Policy policy() const;
+    bool segmented() const;
+    Stats stats() const;
+
+    // Thresholds the anomaly counts of blocks written from now on are taken with
+    void setAnomalyDetector(const AnomalyDetector& detector);
+    // Encoding of segments created from now on, merged ones included; existing ones keep their own
+    void setEncoding(BlockFile::Encoding encoding);
+    BlockFile::Encoding encoding() const;
+
+    // For the WriteAheadLog, which checkpoints one at a time. Opens the active segment for
+    // appending, first starting a new one if the policy says so; precedingRecords is set to
+    // position() as of before the active segment. Null on failure.
+    std::unique_ptr<BlockFileAppender> openActive(uint64_t& precedingRecords);
+    // Readings appended to the base since it was created or last replaced, those retention
+    // dropped included, so it only ever grows between replacements
+    bool position(uint64_t& records) const;
+    // Replaces every reading with the concatenation of spans: written aside and swapped in once
+    // complete, so mappings and snapshots of the old files keep their content
+    bool replace(const std::vector<SensorDataSpan>& spans);
+
+    // The segments in order; with a single file, that file as the one active segment.
+    // droppedRecords, if given, is set to the position() of their first reading.
+    std::vector<Segment> snapshot(uint64_t* droppedRecords = nullptr) const;
+    // Readings of every segment in order, as BlockFile::scan and scanColumns hand them over;
+    // with a filter, sealed segments whose zone rules them out are skipped unopened.
+    // firstPosition, if given, is set to the position() of the first reading before any is
+    // handed over.
+    bool scan(const ZoneFilter* filter, size_t maxRecords,
+              const std::function<void(const SensorData* rows, size_t count)>& consumer,
+              BlockFile::ScanStats* stats = nullptr, uint64_t* firstPosition = nullptr) const;
+    bool scanColumns(const ZoneFilter* filter, size_t maxRecords,
+                     const std::function<void(const ColumnBatch& columns)>& consumer,
+                     BlockFile::ScanStats* stats = nullptr, uint64_t* firstPosition = nullptr) const;
+    // Whole readings in all segments
+    bool records(uint64_t& records) const;
+
+    // Runs one compaction pass now, besides the background ones; false if a step failed
+    bool compact();
+
+    const std::string& path() const { return basePath_; }
+
+private:
+    class SegmentFile;
+    struct Slot {
+        ManifestEntry entry;
+        std::shared_ptr<SegmentFile> file;
+        std::shared_ptr<const BlockFile::Index> index;
+    };
+
+    std::string basePath_;
+    std::string manifestPath_;
+    mutable std::mutex mutex_;          // Guards everything below but the compaction thread
+    std::mutex compactionMutex_;        // One compaction pass at a time
+    bool segmented_ = false;
+    bool damaged_ = false;              // The manifest could not be read; nothing is read or written
+    Policy policy_;
+    AnomalyDetector detector_;
+    BlockFile::Encoding encoding_ = BlockFile::Encoding::RAW;
+    uint64_t nextId_ = 1;
+    uint64_t droppedRecords_ = 0;
+    std::vector<Slot> slots_;           // Oldest first; the last is the active segment
+    Stats stats_;
+
+    std::thread compactor_;
+    std::condition_variable wakeCompactor_;
+    bool stopping_ = false;
+
+    std::string segmentPath(uint64_t id) const;
+    Slot newSlot(uint64_t id) const;
+    bool loadManifest();
+    // Callers hold mutex_
+    bool writeManifestLocked();
+    bool positionLocked(uint64_t& records) const;
+    // Seals the active segment and starts a new one; caller holds mutex_
+    bool rollLocked();
+    // Removes segment files the manifest does not list, left by a crash during compaction
+    void removeOrphans();
+    bool scanSegments(const ZoneFilter* filter, size_t maxRecords,
+                      const std::function<bool(const Segment& segment, size_t maxRecords)>& scanOne,
+                      BlockFile::ScanStats* stats, uint64_t* firstPosition = nullptr) const;
+    // Compaction steps
+    bool indexSealed();
+    bool applyRetention();
+    bool mergeSmall();
+    void compactorLoop();
+};
+
+#endif // SEGMENTED_FILE_HPP
@@ -4,6 +4,7 @@
 #include <string>
 #include <chrono>
 #include <cstdint> // For int64_t
+#include <cstddef> // For size_t
 #include <sstream> // For toString
 #include <iomanip> // For std::fixed and std::setprecision
 
@@ -12,6 +13,10 @@ struct SensorData {
     double temperature;
     double humidity;
     double lightIntensity;
+    // Sensor or room the reading comes from; selects its threshold profile. 0 = unassigned,
+    // classified with the default thresholds.
+    uint32_t sensorId = 0;
+    uint32_t reserved = 0; // Pads the record to 40 bytes so no uninitialized bytes are persisted
 
     // Helper to convert from time_point
     static int64_t time_point_to_ms(const std::chrono::system_clock::time_point& tp) {
@@ -32,6 +37,9 @@ struct SensorData {
             << ", Temp: " << temperature << " C"
             << ", Humidity: " << humidity << " %"
             << ", Light: " << lightIntensity << " lux";
+        if (sensorId != 0) {
+            oss << ", Sensor: " << sensorId;
+        }
         return oss.str();
     }
 
@@ -40,8 +48,18 @@ struct SensorData {
         return timestamp_ms == other.timestamp_ms &&
                temperature == other.temperature && // Consider using epsilon comparison for doubles if needed
                humidity == other.humidity &&
-               lightIntensity == other.lightIntensity;
+               lightIntensity == other.lightIntensity &&
+               sensorId == other.sensorId;
     }
 };
 
+// Non-owning view of contiguous readings (C++17 stand-in for std::span<const SensorData>)
+struct SensorDataSpan {
+    const SensorData* data;
+    size_t size;
+
+    const SensorData* begin() const { return data; }
+    const SensorData* end() const { return data + size; }
+};
+
 #endif //SENSORDATA_HPP
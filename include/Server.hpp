@@ -3,9 +3,11 @@
 #include <vector>
 #include <atomic>
 #include <functional>
+#include <optional>
 #include "SensorData.hpp"
 #include "DataManager.hpp"
 #include "DataStorage.hpp"
+#include "AnomalyDetector.hpp"
 
 class Server {
 public:
@@ -15,8 +17,13 @@ public:
     void start();
     void stop();
     
-    // Callback for when data is received
-    void setDataCallback(std::function<void(const SensorData&)> callback);
+    // Callback for when data is received. Each reading is classified once on arrival; the
+    // callback, the DataManager and the DataStorage all get the same enriched record.
+    void setDataCallback(std::function<void(const QueryResult&)> callback);
+    // Thresholds readings are classified with. By default the DataManager's current detector is
+    // fetched per reading, so threshold reloads apply at once and the DataManager can take the
+    // flags as they are. Call before start().
+    void setAnomalyDetector(const AnomalyDetector& detector);
     
 private:
     int server_fd;
@@ -27,7 +34,8 @@ private:
     // Data processing components
     DataManager* dataManager_;
     DataStorage* dataStorage_;
-    std::function<void(const SensorData&)> dataCallback_;
+    std::function<void(const QueryResult&)> dataCallback_;
+    std::optional<AnomalyDetector> detector_; // Overrides the DataManager's detector
     
     void acceptClients();
     void handleClient(int client_socket);
@@ -0,0 +1,74 @@
+#ifndef STATISTICAL_DETECTOR_HPP
+#define STATISTICAL_DETECTOR_HPP
+
+#include "SensorData.hpp"
+#include <cstddef>
+#include <vector>
+
+// Streaming statistical anomaly detector. Where AnomalyDetector checks fixed thresholds, this one
+// keeps a running baseline of each metric (temperature, humidity, light) and flags a reading whose
+// z-score against that baseline exceeds zThreshold: 29.9 C after a warm morning is normal, a 6 C
+// jump from 20 C is not. Each reading updates the state in O(1) time and memory, so nothing is
+// ever rescanned. Not thread-safe; callers serialize update().
+class StatisticalDetector {
+public:
+    enum class Method {
+        EWMA,          // Exponentially weighted mean and variance, weight alpha on the newest reading
+        ROLLING_WINDOW // Mean and variance of the last windowSize readings
+    };
+
+    struct Config {
+        Method method = Method::EWMA;
+        double alpha = 0.05;       // EWMA smoothing factor in (0, 1]
+        size_t windowSize = 60;    // Rolling window length in readings
+        double zThreshold = 3.0;   // |z| above this is anomalous
+        size_t warmupReadings = 30; // Readings seen before any verdict is given
+        // Noise floor per metric (degrees Celsius, percentage, lux): the standard deviation used
+        // for z-scores is never below it, so a perfectly flat signal does not make every small
+        // wobble anomalous
+        double minStdDev[3] = {0.5, 2.0, 20.0};
+    };
+
+    // Verdict on one reading, measured against the baseline before the reading was folded in
+    struct Assessment {
+        bool warmedUp = false;   // False during warm-up; anomalous is then always false
+        bool anomalous = false;
+        double zScores[3] = {0.0, 0.0, 0.0}; // Temperature, humidity, light; 0 for NaN readings
+        double mean[3] = {0.0, 0.0, 0.0};    // Baseline the reading was compared with
+        double stdDev[3] = {0.0, 0.0, 0.0};
+    };
+
+    StatisticalDetector();
+    explicit StatisticalDetector(const Config& config);
+
+    // Scores data against the current baseline, then folds it in. Anomalous readings are folded
+    // in as well, so a lasting change of level becomes the new normal at a rate set by alpha
+    // (or windowSize).
+    Assessment update(const SensorData& data);
+    // Scores data without changing the baseline
+    Assessment assess(const SensorData& data) const;
+
+    // Forgets every reading seen
+    void reset();
+    size_t observedCount() const { return observed_; }
+    const Config& config() const { return config_; }
+
+private:
+    // Running mean and variance of one metric
+    struct MetricState {
+        size_t count = 0;
+        double mean = 0.0;
+        double m2 = 0.0; // Sum of squared deviations (rolling window); EWMA keeps the variance here
+        std::vector<double> window; // Ring buffer of the last windowSize values (rolling window)
+        size_t next = 0;
+    };
+
+    Config config_;
+    size_t observed_ = 0;
+    MetricState metrics_[3];
+
+    double variance(const MetricState& state) const;
+    void fold(MetricState& state, double value);
+};
+
+#endif // STATISTICAL_DETECTOR_HPP
@@ -0,0 +1,37 @@
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// Minimal fixed-size worker pool used to fan query work out across cores.
+class ThreadPool {
+public:
+    // threadCount == 0 picks std::thread::hardware_concurrency() (at least 1).
+    explicit ThreadPool(unsigned threadCount = 0);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    unsigned size() const { return static_cast<unsigned>(workers_.size()); }
+
+    // Runs task(i) for every i in [0, count) on the pool and blocks until all of them finished.
+    // The first exception thrown by a task is rethrown in the caller.
+    void parallelFor(size_t count, const std::function<void(size_t)>& task);
+
+private:
+    std::vector<std::thread> workers_;
+    std::queue<std::function<void()>> tasks_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    bool stopping_;
+
+    void workerLoop();
+};
+
+#endif // THREAD_POOL_HPP
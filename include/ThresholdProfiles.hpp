@@ -0,0 +1,72 @@
+#ifndef THRESHOLD_PROFILES_HPP
+#define THRESHOLD_PROFILES_HPP
+
+#include "AnomalyDetector.hpp"
+#include <cstdint>
+#include <vector>
+
+// Anomaly thresholds per sensor or room, keyed by SensorData::sensorId, with a default profile
+// for sensor 0 and for every sensor without a profile of its own. The profiles sit in one dense
+// array, indexed through a flat open-addressing table of (sensorId, index) pairs with linear
+// probing, so a lookup is a multiply, a shift and a short probe over adjacent 8-byte slots. The
+// table is at most half full. Lookups never allocate; readers share an instance once it is built.
+class ThresholdProfiles {
+public:
+    using Thresholds = AnomalyDetector::AnomalyThresholds;
+
+    ThresholdProfiles();
+    explicit ThresholdProfiles(const Thresholds& defaults);
+
+    // Adds or replaces the profile of sensorId; sensorId 0 replaces the default profile
+    void set(uint32_t sensorId, const Thresholds& thresholds);
+    // Drops the profile of sensorId, which falls back to the default. False if it had none.
+    bool erase(uint32_t sensorId);
+
+    const Thresholds& defaults() const { return profiles_[0]; }
+    // Thresholds that apply to sensorId
+    const Thresholds& lookup(uint32_t sensorId) const { return profiles_[profileIndex(sensorId)]; }
+    // Dense index of the profile that applies to sensorId, 0 for the default profile; use with
+    // profile() to group readings that share thresholds
+    uint32_t profileIndex(uint32_t sensorId) const {
+        if (sensorId == 0 || sensorIds_.size() == 1) {
+            return 0;
+        }
+        const size_t mask = slots_.size() - 1;
+        for (size_t i = slotOf(sensorId); ; i = (i + 1) & mask) {
+            if (slots_[i].sensorId == sensorId) {
+                return slots_[i].profile;
+            }
+            if (slots_[i].sensorId == 0) {
+                return 0;
+            }
+        }
+    }
+    const Thresholds& profile(uint32_t index) const { return profiles_[index]; }
+
+    // Number of sensors with a profile of their own
+    size_t size() const { return sensorIds_.size() - 1; }
+    bool empty() const { return size() == 0; }
+    // Sensors with a profile of their own, in no particular order
+    std::vector<uint32_t> sensorIds() const { return std::vector<uint32_t>(sensorIds_.begin() + 1, sensorIds_.end()); }
+
+private:
+    struct Slot {
+        uint32_t sensorId; // 0 marks an empty slot
+        uint32_t profile;  // Index into profiles_
+    };
+    std::vector<Slot> slots_;            // Power-of-two size
+    std::vector<Thresholds> profiles_;   // profiles_[0] is the default
+    std::vector<uint32_t> sensorIds_;    // sensorIds_[i] owns profiles_[i]; sensorIds_[0] = 0
+
+    size_t slotOf(uint32_t sensorId) const {
+        // Fibonacci hashing: the top bits of the product are well mixed even for sequential ids
+        const uint32_t bits = static_cast<uint32_t>(slotBits_);
+        return static_cast<size_t>((sensorId * 2654435769u) >> (32 - bits));
+    }
+    size_t slotBits_ = 0;
+    // Slot holding sensorId, or slots_.size() if it has none
+    size_t findSlot(uint32_t sensorId) const;
+    void rehash(size_t slotBits);
+};
+
+#endif // THRESHOLD_PROFILES_HPP
@@ -0,0 +1,98 @@
+#ifndef WRITE_AHEAD_LOG_HPP
+#define WRITE_AHEAD_LOG_HPP
+
+#include "SensorData.hpp"
+#include "BufferedAppender.hpp"
+#include "AnomalyDetector.hpp"
+#include "BlockFile.hpp"
+#include "SegmentedFile.hpp"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+// Log in front of a block file or its segments (the base, see BlockFile and SegmentedFile).
+// Appends go to <base>.wal as
+// CRC-checked frames through a BufferedAppender, and a checkpoint moves the logged readings to
+// the end of the base, so the base is only ever appended to, never rewritten. A checkpoint runs
+// once checkpointRecords readings were logged and when the log is destroyed, leaving readings
+// short of a whole GORILLA block in the log, or when asked for. Reads do not checkpoint: they
+// get the logged readings the base does not have yet from memory (see read). The first
+// checkpoint or read also recovers from a crash, replaying the frames that did not reach the
+// base yet. A frame cut short or corrupted ends the log: it and anything after it are dropped.
+// One WriteAheadLog per base file. Thread-safe.
+class WriteAheadLog {
+public:
+    // Start of the log file. baseRecords is the position of the base (see SegmentedFile) when the
+    // log was started, so a checkpoint interrupted after appending to the base is not replayed
+    // twice.
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t baseRecords;
+    };
+    static constexpr uint32_t kMagic = 0x4C415746; // "FWAL"
+    static constexpr uint32_t kVersion = 1;
+
+    // base must outlive the log
+    WriteAheadLog(SegmentedFile& base, const BufferedAppender::Policy& policy, size_t checkpointRecords = 65536);
+    // Checkpoints, keeping readings short of a GORILLA block in the log
+    ~WriteAheadLog();
+
+    WriteAheadLog(const WriteAheadLog&) = delete;
+    WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+    // Logs count readings; durable according to the append policy
+    bool append(const SensorData* rows, size_t count);
+    // Syncs every logged reading to disk
+    bool flush();
+    // Moves every logged reading to the base and removes the log. False if the base could not
+    // be written, in which case the log is kept for the next attempt.
+    bool checkpoint();
+    // Checkpoints, then calls replace with appends held back; replace swaps in a new base
+    bool replaceBase(const std::function<bool()>& replace);
+    // Calls read with the logged readings the base does not have yet, in order, while no
+    // checkpoint can move them to the base (appends go on meanwhile), so read sees the base and
+    // these readings as one. False if a log left by a crash cannot be recovered, or if read
+    // returns false.
+    bool read(const std::function<bool(const std::vector<SensorData>& unsealed)>& read);
+    // As read, for callers that only need to know how many readings the base does not have yet
+    bool readCount(const std::function<bool(uint64_t unsealed)>& read);
+
+    void setPolicy(const BufferedAppender::Policy& policy) { appender_.setPolicy(policy); }
+    BufferedAppender::Policy policy() const { return appender_.policy(); }
+    BufferedAppender::Stats stats() const { return appender_.stats(); }
+    void setCheckpointRecords(size_t records) { checkpointRecords_ = records > 0 ? records : 1; }
+    uint64_t checkpointCount() const { return checkpoints_; }
+    const std::string& path() const { return walPath_; }
+
+private:
+    SegmentedFile& base_;
+    std::string walPath_;
+    BufferedAppender appender_;
+    // Appends share it; checkpoints, which close and remove the log, take it exclusively
+    mutable std::shared_mutex mutex_;
+    bool recovered_ = false;   // The log found on disk was checkpointed
+    bool logOpen_ = false;     // The log file exists with its header
+    uint64_t logPosition_ = 0; // Position in the base of the first reading in the log
+    bool partlyInBase_ = false; // A checkpoint failed after appending some of the log to the base
+    // Readings the log held when it was last opened by a checkpoint, before the appended ones
+    std::vector<SensorData> carried_;
+    std::atomic<uint64_t> logged_{0}; // Readings appended since the last checkpoint
+    std::atomic<size_t> checkpointRecords_;
+    std::atomic<uint64_t> checkpoints_{0};
+
+    // Callers hold mutex_ exclusively. Unless whole, readings short of a GORILLA block are kept
+    // in the log instead of being written to the base as a short block.
+    bool checkpointLocked(bool whole);
+    // Takes lock (on mutex_) once a log left by a crash is recovered; inBase is set to the number
+    // of logged readings a checkpoint that did not finish got into the base already
+    bool lockForRead(std::shared_lock<std::shared_mutex>& lock, uint64_t& inBase);
+    bool openLogLocked();
+    // Replaces the log with one holding rows on top of a base at position baseRecords
+    bool restartLog(uint64_t baseRecords, const std::vector<SensorData>& rows);
+};
+
+#endif // WRITE_AHEAD_LOG_HPP
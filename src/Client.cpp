@@ -27,7 +27,7 @@
 SensorData SensorData::fromString(const std::string& dataStr) {
     SensorData data = {0, 0.0, 0.0, 0.0};
     
-    // Parse format: "Timestamp (ms): 1640995200000, Temp: 22.50 C, Humidity: 45.30 %, Light: 500.00 lux"
+    // Parse format: "Timestamp (ms): 1640995200000, Temp: 22.50 C, Humidity: 45.30 %, Light: 500.00 lux[, Sensor: 7]"
     std::istringstream iss(dataStr);
     std::string token;
     
@@ -50,6 +50,12 @@ SensorData SensorData::fromString(const std::string& dataStr) {
         // Parse light intensity
         while (iss >> token && token != "Light:") {}
         iss >> data.lightIntensity;
+        iss >> token; // "lux" or "lux,"
+
+        // Parse the sensor id, sent only by clients that have one
+        if (iss >> token && token == "Sensor:") {
+            iss >> data.sensorId;
+        }
         
     } catch (const std::exception& e) {
         std::cerr << "Error parsing sensor data: " << e.what() << std::endl;
@@ -59,8 +65,8 @@ SensorData SensorData::fromString(const std::string& dataStr) {
     return data;
 }
 
-Client::Client(const std::string& server_ip, int server_port)
-    : server_ip_(server_ip), server_port_(server_port), sock_(INVALID_SOCKET), connected_(false) {
+Client::Client(const std::string& server_ip, int server_port, uint32_t sensor_id)
+    : server_ip_(server_ip), server_port_(server_port), sensor_id_(sensor_id), sock_(INVALID_SOCKET), connected_(false) {
     std::random_device rd;
     rng_ = std::mt19937(rd());
     temp_dist_ = std::uniform_real_distribution<double>(18.0, 40.0);
@@ -96,6 +102,7 @@ SensorData Client::readSensorData() {
     data.temperature = temp_dist_(rng_);
     data.humidity = hum_dist_(rng_);
     data.lightIntensity = light_dist_(rng_);
+    data.sensorId = sensor_id_;
     data.timestamp_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
                          std::chrono::system_clock::now().time_since_epoch())
                          .count();
@@ -20,10 +20,14 @@ Server::~Server() {
     stop();
 }
 
-void Server::setDataCallback(std::function<void(const SensorData&)> callback) {
+void Server::setDataCallback(std::function<void(const QueryResult&)> callback) {
     dataCallback_ = callback;
 }
 
+void Server::setAnomalyDetector(const AnomalyDetector& detector) {
+    detector_ = detector;
+}
+
 void Server::start() {
 #ifdef _WIN32
     WSADATA wsaData;
@@ -113,19 +117,32 @@ void Server::processReceivedData(const std::string& dataStr) {
             return;
         }
         
+        // Classify once, thresholds and rules together; everything below reuses the flag, the
+        // deviation and the fired rules. The data manager's detector is published immutable, so
+        // it is shared rather than copied, and held until the reading is added.
+        static const AnomalyDetector kDefaultDetector;
+        std::shared_ptr<const AnomalyDetector> published;
+        if (!detector_ && dataManager_) {
+            published = dataManager_->getAnomalyDetector();
+        }
+        const AnomalyDetector& detector = detector_ ? *detector_ : (published ? *published : kDefaultDetector);
+        double deviation = 0.0;
+        uint32_t firedRules = 0;
+        bool isAnomalous = detector.classifyIncoming(sensorData, deviation, &firedRules);
+        QueryResult enriched(sensorData, isAnomalous, deviation, firedRules);
+
         // Call the registered callback if available
         if (dataCallback_) {
-            dataCallback_(sensorData);
+            dataCallback_(enriched);
         }
         
-        // Store data using DataManager if available
+        // Store data using DataManager if available, and in DataStorage if available (the raw
+        // reading; flags follow the thresholds). Both at once, so checkpointed rollups agree with
+        // the storage position they record.
         if (dataManager_) {
-            dataManager_->addSensorData(sensorData);
-        }
-        
-        // Store data using DataStorage if available
-        if (dataStorage_) {
-            dataStorage_->storeData(sensorData);
+            dataManager_->addEnrichedData(enriched, detector, dataStorage_);
+        } else if (dataStorage_) {
+            dataStorage_->storeData(enriched);
         }
         
         std::cout << "Processed sensor data: " << sensorData.toString() << std::endl;
@@ -1,29 +1,114 @@
 #include "AnomalyDetector.hpp"
+#include "ThresholdProfiles.hpp"
+#include "AnomalyRules.hpp"
+#include "QueryCommon.hpp" // For calculate_deviation_metric
+#include <algorithm> // For std::min
 
 // Constructor with custom thresholds
-AnomalyDetector::AnomalyDetector(AnomalyThresholds thresholds) : thresholds_(thresholds) {}
+AnomalyDetector::AnomalyDetector(AnomalyThresholds thresholds)
+    : profiles_(std::make_shared<const ThresholdProfiles>(thresholds)) {}
 
 // Default constructor using default-initialized AnomalyThresholds
-AnomalyDetector::AnomalyDetector() : thresholds_(AnomalyThresholds()) {} // Or simply thresholds_() or thresholds_{}
+AnomalyDetector::AnomalyDetector() : AnomalyDetector(AnomalyThresholds()) {}
+
+AnomalyDetector::AnomalyDetector(const ThresholdProfiles& profiles)
+    : profiles_(std::make_shared<const ThresholdProfiles>(profiles)) {}
+
+AnomalyDetector AnomalyDetector::withRules(const DynamicRulePipeline& rules) const {
+    AnomalyDetector copy(*this);
+    copy.rules_.reset();
+    if (rules.size() > 0) {
+        auto stateless = std::make_shared<DynamicRulePipeline>(rules);
+        stateless->reset();
+        copy.rules_ = std::make_shared<ShardedRulePipeline>(std::move(stateless));
+    }
+    return copy;
+}
+
+AnomalyDetector AnomalyDetector::withThresholds(const ThresholdProfiles& profiles) const {
+    AnomalyDetector copy(*this);
+    copy.profiles_ = std::make_shared<const ThresholdProfiles>(profiles);
+    return copy;
+}
+
+AnomalyDetector AnomalyDetector::withFreshRuleState() const {
+    AnomalyDetector copy(*this);
+    if (rules_) {
+        copy.rules_ = std::make_shared<ShardedRulePipeline>(rules_->rules(), rules_->shardCount());
+    }
+    return copy;
+}
+
+std::vector<std::string> AnomalyDetector::ruleNames() const {
+    return rules_ ? rules_->rules()->ruleNames() : std::vector<std::string>();
+}
+
+uint32_t AnomalyDetector::statefulRuleMask() const {
+    return rules_ ? rules_->statefulMask() : 0;
+}
+
+bool AnomalyDetector::sharesThresholdsWith(const AnomalyDetector& other) const {
+    return profiles_ == other.profiles_ && sharesRulesWith(other);
+}
+
+bool AnomalyDetector::sharesRulesWith(const AnomalyDetector& other) const {
+    // The rules are compared, not their state: a replaying copy judges alike
+    return (rules_ ? rules_->rules().get() : nullptr) == (other.rules_ ? other.rules_->rules().get() : nullptr);
+}
+
+const AnomalyDetector::AnomalyThresholds& AnomalyDetector::thresholdsFor(uint32_t sensorId) const {
+    return profiles_->lookup(sensorId);
+}
 
 bool AnomalyDetector::isAnomalous(const SensorData& data) const {
-    if (data.temperature < thresholds_.minTemp || data.temperature > thresholds_.maxTemp) {
+    const AnomalyThresholds& thresholds = profiles_->lookup(data.sensorId);
+    if (data.temperature < thresholds.minTemp || data.temperature > thresholds.maxTemp) {
         return true;
     }
-    if (data.humidity < thresholds_.minHumidity || data.humidity > thresholds_.maxHumidity) {
+    if (data.humidity < thresholds.minHumidity || data.humidity > thresholds.maxHumidity) {
         return true;
     }
-    if (data.lightIntensity < thresholds_.minLight || data.lightIntensity > thresholds_.maxLight) {
+    if (data.lightIntensity < thresholds.minLight || data.lightIntensity > thresholds.maxLight) {
         return true;
     }
-    return false;
+    return rules_ && rules_->evaluateStateless(data) != 0;
+}
+
+double AnomalyDetector::deviation(const SensorData& data) const {
+    return calculate_deviation_metric(data, profiles_->lookup(data.sensorId));
+}
+
+bool AnomalyDetector::classify(const SensorData& data, double& deviation) const {
+    deviation = calculate_deviation_metric(data, profiles_->lookup(data.sensorId));
+    // A metric outside its range always adds a positive amount (the difference of two distinct
+    // doubles is never zero), and NaN metrics add nothing and are never anomalous
+    return deviation > 0.0 || (rules_ && rules_->evaluateStateless(data) != 0);
+}
+
+bool AnomalyDetector::classifyIncoming(const SensorData& data, double& deviation, uint32_t* firedRules) const {
+    deviation = calculate_deviation_metric(data, profiles_->lookup(data.sensorId));
+    const uint32_t fired = rules_ ? rules_->evaluate(data) : 0;
+    if (firedRules) {
+        *firedRules = fired;
+    }
+    return deviation > 0.0 || fired != 0;
 }
 
 std::vector<SensorData> AnomalyDetector::findAnomalies(const std::vector<SensorData>& dataBatch) const {
     std::vector<SensorData> anomalies;
-    for (const auto& data : dataBatch) {
-        if (isAnomalous(data)) {
-            anomalies.push_back(data);
+    // Classified a block at a time by the batch kernel; only set bits are visited
+    const size_t kBlockRows = 4096;
+    uint64_t bits[kBlockRows / 64];
+    for (size_t start = 0; start < dataBatch.size(); start += kBlockRows) {
+        size_t count = std::min(kBlockRows, dataBatch.size() - start);
+        classifyBatch(dataBatch.data() + start, count, bits, nullptr);
+        for (size_t w = 0; w < (count + 63) / 64; ++w) {
+            uint64_t word = bits[w];
+            for (size_t bit = 0; word != 0; ++bit, word >>= 1) { // Empty words are skipped outright
+                if (word & 1) {
+                    anomalies.push_back(dataBatch[start + w * 64 + bit]);
+                }
+            }
         }
     }
     return anomalies;
@@ -0,0 +1,164 @@
+#include "AnomalyEpisodes.hpp"
+#include <algorithm>
+#include <cmath>
+
+EpisodeTracker::EpisodeTracker() : EpisodeTracker(Config()) {}
+
+EpisodeTracker::EpisodeTracker(const Config& config) : config_(config) {
+    config_.entryReadings = std::max<uint32_t>(config_.entryReadings, 1);
+    config_.exitReadings = std::max<uint32_t>(config_.exitReadings, 1);
+    config_.reorderWindow_ms = std::max<int64_t>(config_.reorderWindow_ms, 0);
+}
+
+void EpisodeTracker::update(const SensorData& reading, const AnomalyDetector::AnomalyThresholds& thresholds,
+                            uint32_t firedRules) {
+    SensorState& sensor = sensors_.get(reading.sensorId);
+    if (sensor.seen && reading.timestamp_ms < sensor.last_ms - config_.reorderWindow_ms) {
+        return; // Too late to belong to the episodes still being tracked
+    }
+    const bool silent = sensor.seen && config_.maxGap_ms > 0 && reading.timestamp_ms - sensor.last_ms > config_.maxGap_ms;
+    sensor.last_ms = sensor.seen ? std::max(sensor.last_ms, reading.timestamp_ms) : reading.timestamp_ms;
+    sensor.seen = true;
+
+    const double limits[3][2] = {{thresholds.minTemp, thresholds.maxTemp},
+                                 {thresholds.minHumidity, thresholds.maxHumidity},
+                                 {thresholds.minLight, thresholds.maxLight}};
+    for (int m = 0; m < 3; ++m) {
+        MetricState& state = sensor.metrics[m];
+        if (silent) {
+            // Whatever happened while the sensor was away is not one episode
+            if (state.episode.open) {
+                close(state);
+            }
+            state.entryReadings = 0;
+        }
+        const double value = ruleMetricValue(reading, static_cast<RuleMetric>(m));
+        if (std::isnan(value)) {
+            continue; // Neither anomalous nor settled
+        }
+
+        // Same comparisons as AnomalyDetector::isAnomalous
+        const double excess = std::max(limits[m][0] - value, value - limits[m][1]);
+        if (excess > config_.entryMargin[m] || (excess > 0.0 && state.episode.open)) {
+            if (!state.episode.open && state.entryReadings == 0) {
+                state.episode = AnomalyEpisode();
+                state.episode.metric = static_cast<RuleMetric>(m);
+            }
+            extend(state, reading, !state.episode.open, excess, value);
+        } else if (!state.episode.open) {
+            state.entryReadings = 0; // The run past the entry band is broken
+        } else {
+            // Inside the thresholds but within the margin of them still counts against settling
+            const bool settled = value >= limits[m][0] + config_.exitMargin[m] &&
+                                 value <= limits[m][1] - config_.exitMargin[m];
+            state.clearReadings = settled ? state.clearReadings + 1 : 0;
+            if (state.clearReadings >= config_.exitReadings) {
+                close(state);
+            }
+        }
+    }
+
+    size_t ruleCount = sensor.rules.size();
+    for (uint32_t higher = ruleCount < 32 ? firedRules >> ruleCount : 0; higher != 0; higher >>= 1) {
+        ++ruleCount;
+    }
+    sensor.rules.resize(ruleCount);
+    for (size_t r = 0; r < ruleCount; ++r) {
+        MetricState& state = sensor.rules[r];
+        if (silent) {
+            if (state.episode.open) {
+                close(state);
+            }
+            state.entryReadings = 0;
+        }
+        if (firedRules & (1u << r)) {
+            if (!state.episode.open && state.entryReadings == 0) {
+                state.episode = AnomalyEpisode();
+                state.episode.rule = static_cast<int>(r);
+            }
+            extend(state, reading, !state.episode.open, 0.0, 0.0);
+        } else if (!state.episode.open) {
+            state.entryReadings = 0;
+        } else if (++state.clearReadings >= config_.exitReadings) {
+            close(state);
+        }
+    }
+}
+
+void EpisodeTracker::extend(MetricState& state, const SensorData& reading, bool entering, double excess, double value) {
+    AnomalyEpisode& episode = state.episode;
+    if (episode.count == 0) {
+        episode.sensorId = reading.sensorId;
+        episode.start_ms = episode.end_ms = reading.timestamp_ms;
+    }
+    // A late reading can reach back before the start
+    episode.start_ms = std::min(episode.start_ms, reading.timestamp_ms);
+    episode.end_ms = std::max(episode.end_ms, reading.timestamp_ms);
+    ++episode.count;
+    if (excess > episode.peakDeviation) {
+        episode.peakDeviation = excess;
+        episode.peakValue = value;
+    }
+    state.clearReadings = 0;
+    if (entering && ++state.entryReadings >= config_.entryReadings) {
+        episode.open = true;
+        state.entryReadings = 0;
+    }
+}
+
+void EpisodeTracker::close(MetricState& state) {
+    state.episode.open = false;
+    closed_.push_back(state.episode);
+    ++closedCount_;
+    if (closed_.size() > config_.maxClosedEpisodes) {
+        closed_.pop_front();
+    }
+    state = MetricState();
+}
+
+std::vector<AnomalyEpisode> EpisodeTracker::episodes() const {
+    std::vector<AnomalyEpisode> result(closed_.begin(), closed_.end());
+    const size_t closedEnd = result.size();
+    sensors_.forEach([&](uint32_t, const SensorState& sensor) {
+        for (const auto& state : sensor.metrics) {
+            if (state.episode.open) {
+                result.push_back(state.episode);
+            }
+        }
+        for (const auto& state : sensor.rules) {
+            if (state.episode.open) {
+                result.push_back(state.episode);
+            }
+        }
+    });
+    // Open episodes in a stable order, oldest first
+    std::sort(result.begin() + closedEnd, result.end(), [](const AnomalyEpisode& a, const AnomalyEpisode& b) {
+        if (a.start_ms != b.start_ms) {
+            return a.start_ms < b.start_ms;
+        }
+        if (a.sensorId != b.sensorId) {
+            return a.sensorId < b.sensorId;
+        }
+        return a.rule != b.rule ? a.rule < b.rule : a.metric < b.metric;
+    });
+    return result;
+}
+
+size_t EpisodeTracker::openCount() const {
+    size_t count = 0;
+    sensors_.forEach([&](uint32_t, const SensorState& sensor) {
+        for (const auto& state : sensor.metrics) {
+            count += state.episode.open ? 1 : 0;
+        }
+        for (const auto& state : sensor.rules) {
+            count += state.episode.open ? 1 : 0;
+        }
+    });
+    return count;
+}
+
+void EpisodeTracker::reset() {
+    sensors_.clear();
+    closed_.clear();
+    closedCount_ = 0;
+}
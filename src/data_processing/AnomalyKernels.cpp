@@ -0,0 +1,453 @@
+// Batch classification kernels for AnomalyDetector. Every kernel computes, per reading,
+//   anomalous = any metric outside [min, max]
+//   deviation = sum over metrics of (min - v if v < min, else v - max if v > max, else 0)
+// with compares turned into masks and selects instead of branches, so results match
+// isAnomalous and calculate_deviation_metric exactly (NaN compares false in both).
+#include "AnomalyDetector.hpp"
+#include "ThresholdProfiles.hpp"
+#include "AnomalyRules.hpp"
+#include <algorithm>
+#include <cstddef> // For offsetof
+
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE2__))
+#define FINPRO_HAS_SSE2 1
+#include <emmintrin.h>
+#endif
+// The AVX2 kernel is compiled with a per-function target attribute, so the rest of the build
+// does not need -mavx2 and the code still runs on older CPUs
+#if defined(FINPRO_HAS_SSE2) && (defined(__GNUC__) || defined(__clang__))
+#define FINPRO_HAS_AVX2 1
+#include <immintrin.h>
+#define FINPRO_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace {
+    struct Bounds {
+        double lo[3];
+        double hi[3];
+    };
+
+    Bounds boundsOf(const AnomalyDetector::AnomalyThresholds& t) {
+        return {{t.minTemp, t.minHumidity, t.minLight}, {t.maxTemp, t.maxHumidity, t.maxLight}};
+    }
+
+    // The row kernels read each SensorData as doubles: {timestamp bits, temperature, humidity,
+    // light} followed by the sensor id words, kRowStride doubles in all
+    static_assert(offsetof(SensorData, temperature) == sizeof(double) &&
+                  offsetof(SensorData, humidity) == 2 * sizeof(double) &&
+                  offsetof(SensorData, lightIntensity) == 3 * sizeof(double) &&
+                  sizeof(SensorData) % sizeof(double) == 0,
+                  "row kernels assume SensorData is laid out as doubles");
+    const size_t kRowStride = sizeof(SensorData) / sizeof(double);
+
+    // Readings laid out as rows (SensorData) or as three columns
+    struct RowInput {
+        const SensorData* rows;
+        double temperature(size_t i) const { return rows[i].temperature; }
+        double humidity(size_t i) const { return rows[i].humidity; }
+        double light(size_t i) const { return rows[i].lightIntensity; }
+        uint32_t sensorId(size_t i) const { return rows[i].sensorId; }
+        RowInput from(size_t first) const { return {rows + first}; }
+    };
+    struct ColumnInput {
+        const double* columns[3];
+        const uint32_t* sensorIds; // May be null
+        double temperature(size_t i) const { return columns[0][i]; }
+        double humidity(size_t i) const { return columns[1][i]; }
+        double light(size_t i) const { return columns[2][i]; }
+        uint32_t sensorId(size_t i) const { return sensorIds ? sensorIds[i] : 0; }
+        ColumnInput from(size_t first) const {
+            return {{columns[0] + first, columns[1] + first, columns[2] + first}, sensorIds ? sensorIds + first : nullptr};
+        }
+    };
+
+    inline double deviationOf(double v, double lo, double hi, bool& anomalous) {
+        const bool below = v < lo;
+        const bool above = v > hi;
+        anomalous |= below | above;
+        return below ? lo - v : (above ? v - hi : 0.0);
+    }
+
+    // Rows [first, count) one at a time; also the whole job of the scalar kernel
+    template <typename Input>
+    void classifyTail(const Input& in, size_t first, size_t count, const Bounds& b, uint64_t* bits, double* deviations) {
+        for (size_t i = first; i < count; ++i) {
+            bool anomalous = false;
+            double deviation = deviationOf(in.temperature(i), b.lo[0], b.hi[0], anomalous);
+            deviation += deviationOf(in.humidity(i), b.lo[1], b.hi[1], anomalous);
+            deviation += deviationOf(in.light(i), b.lo[2], b.hi[2], anomalous);
+            bits[i >> 6] |= static_cast<uint64_t>(anomalous) << (i & 63);
+            if (deviations) {
+                deviations[i] = deviation;
+            }
+        }
+    }
+
+    // Runs step(i) for i = 0, width, 2 * width, ... while a whole step fits in count; each
+    // step returns width anomaly bits, gathered into a register and stored a word at a time.
+    // Returns the first row left for classifyTail.
+    template <size_t width, typename Step>
+    size_t packSteps(size_t count, uint64_t* bits, Step&& step) {
+        size_t i = 0;
+        uint64_t word = 0;
+        for (; i + width <= count; i += width) {
+            word |= static_cast<uint64_t>(step(i)) << (i & 63);
+            if ((i & 63) == 64 - width) {
+                bits[i >> 6] = word;
+                word = 0;
+            }
+        }
+        if (i & 63) {
+            bits[i >> 6] = word; // Partial word; classifyTail ORs in the rest
+        }
+        return i;
+    }
+
+#ifdef FINPRO_HAS_SSE2
+    // select(mask, a, b): b where mask is set, a elsewhere (SSE2 has no blendv)
+    inline __m128d select128(__m128d mask, __m128d a, __m128d b) {
+        return _mm_or_pd(_mm_and_pd(mask, b), _mm_andnot_pd(mask, a));
+    }
+
+    struct Bounds128 {
+        __m128d lo[3];
+        __m128d hi[3];
+        explicit Bounds128(const Bounds& b) {
+            for (int m = 0; m < 3; ++m) {
+                lo[m] = _mm_set1_pd(b.lo[m]);
+                hi[m] = _mm_set1_pd(b.hi[m]);
+            }
+        }
+    };
+
+    // Two readings per step; metrics[m] holds metric m of both. Returns their anomaly bits.
+    inline int classify2(const __m128d metrics[3], const Bounds128& b, double* deviations) {
+        __m128d anomalous = _mm_setzero_pd();
+        __m128d deviation = _mm_setzero_pd();
+        for (int m = 0; m < 3; ++m) {
+            const __m128d below = _mm_cmplt_pd(metrics[m], b.lo[m]);
+            const __m128d above = _mm_cmpgt_pd(metrics[m], b.hi[m]);
+            anomalous = _mm_or_pd(anomalous, _mm_or_pd(below, above));
+            __m128d d = select128(above, _mm_setzero_pd(), _mm_sub_pd(metrics[m], b.hi[m]));
+            d = select128(below, d, _mm_sub_pd(b.lo[m], metrics[m]));
+            deviation = _mm_add_pd(deviation, d);
+        }
+        if (deviations) {
+            _mm_storeu_pd(deviations, deviation);
+        }
+        return _mm_movemask_pd(anomalous);
+    }
+
+    void classifyRowsSse2(const SensorData* rows, size_t count, const Bounds& b, uint64_t* bits, double* deviations) {
+        const Bounds128 bounds(b);
+        size_t i = packSteps<2>(count, bits, [&](size_t i) {
+            // The first four doubles of each row are {timestamp, temperature, humidity, light}
+            const double* base = reinterpret_cast<const double*>(rows + i);
+            const __m128d head0 = _mm_loadu_pd(base);     // timestamp bits, temperature
+            const __m128d tail0 = _mm_loadu_pd(base + 2); // humidity, light
+            const __m128d head1 = _mm_loadu_pd(base + kRowStride);
+            const __m128d tail1 = _mm_loadu_pd(base + kRowStride + 2);
+            const __m128d metrics[3] = {_mm_unpackhi_pd(head0, head1), _mm_unpacklo_pd(tail0, tail1),
+                                        _mm_unpackhi_pd(tail0, tail1)};
+            return classify2(metrics, bounds, deviations ? deviations + i : nullptr);
+        });
+        classifyTail(RowInput{rows}, i, count, b, bits, deviations);
+    }
+
+    void classifyColumnsSse2(const ColumnInput& in, size_t count, const Bounds& b, uint64_t* bits, double* deviations) {
+        const Bounds128 bounds(b);
+        size_t i = packSteps<2>(count, bits, [&](size_t i) {
+            const __m128d metrics[3] = {_mm_loadu_pd(in.columns[0] + i), _mm_loadu_pd(in.columns[1] + i),
+                                        _mm_loadu_pd(in.columns[2] + i)};
+            return classify2(metrics, bounds, deviations ? deviations + i : nullptr);
+        });
+        classifyTail(in, i, count, b, bits, deviations);
+    }
+#endif
+
+#ifdef FINPRO_HAS_AVX2
+    struct Bounds256 {
+        __m256d lo[3];
+        __m256d hi[3];
+    };
+
+    FINPRO_TARGET_AVX2
+    inline Bounds256 broadcast256(const Bounds& b) {
+        Bounds256 out;
+        for (int m = 0; m < 3; ++m) {
+            out.lo[m] = _mm256_set1_pd(b.lo[m]);
+            out.hi[m] = _mm256_set1_pd(b.hi[m]);
+        }
+        return out;
+    }
+
+    // Four readings per step; metrics[m] holds metric m of all four. Returns their anomaly bits.
+    FINPRO_TARGET_AVX2
+    inline int classify4(const __m256d metrics[3], const Bounds256& b, double* deviations) {
+        __m256d anomalous = _mm256_setzero_pd();
+        __m256d deviation = _mm256_setzero_pd();
+        for (int m = 0; m < 3; ++m) {
+            const __m256d below = _mm256_cmp_pd(metrics[m], b.lo[m], _CMP_LT_OQ);
+            const __m256d above = _mm256_cmp_pd(metrics[m], b.hi[m], _CMP_GT_OQ);
+            anomalous = _mm256_or_pd(anomalous, _mm256_or_pd(below, above));
+            __m256d d = _mm256_blendv_pd(_mm256_setzero_pd(), _mm256_sub_pd(metrics[m], b.hi[m]), above);
+            d = _mm256_blendv_pd(d, _mm256_sub_pd(b.lo[m], metrics[m]), below);
+            deviation = _mm256_add_pd(deviation, d);
+        }
+        if (deviations) {
+            _mm256_storeu_pd(deviations, deviation);
+        }
+        return _mm256_movemask_pd(anomalous);
+    }
+
+    // The step loops are written out rather than going through packSteps, whose lambda would
+    // not inherit the AVX2 target
+    FINPRO_TARGET_AVX2
+    void classifyRowsAvx2(const SensorData* rows, size_t count, const Bounds& b, uint64_t* bits, double* deviations) {
+        const Bounds256 bounds = broadcast256(b);
+        size_t i = 0;
+        uint64_t word = 0;
+        for (; i + 4 <= count; i += 4) {
+            // Load the first four doubles of four rows and transpose them into columns
+            const double* base = reinterpret_cast<const double*>(rows + i);
+            const __m256d r0 = _mm256_loadu_pd(base);
+            const __m256d r1 = _mm256_loadu_pd(base + kRowStride);
+            const __m256d r2 = _mm256_loadu_pd(base + 2 * kRowStride);
+            const __m256d r3 = _mm256_loadu_pd(base + 3 * kRowStride);
+            const __m256d lo01 = _mm256_unpacklo_pd(r0, r1); // ts0 ts1 h0 h1
+            const __m256d hi01 = _mm256_unpackhi_pd(r0, r1); // t0 t1 l0 l1
+            const __m256d lo23 = _mm256_unpacklo_pd(r2, r3); // ts2 ts3 h2 h3
+            const __m256d hi23 = _mm256_unpackhi_pd(r2, r3); // t2 t3 l2 l3
+            const __m256d metrics[3] = {_mm256_permute2f128_pd(hi01, hi23, 0x20),
+                                        _mm256_permute2f128_pd(lo01, lo23, 0x31),
+                                        _mm256_permute2f128_pd(hi01, hi23, 0x31)};
+            word |= static_cast<uint64_t>(classify4(metrics, bounds, deviations ? deviations + i : nullptr)) << (i & 63);
+            if ((i & 63) == 60) {
+                bits[i >> 6] = word;
+                word = 0;
+            }
+        }
+        if (i & 63) {
+            bits[i >> 6] = word;
+        }
+        classifyTail(RowInput{rows}, i, count, b, bits, deviations);
+    }
+
+    FINPRO_TARGET_AVX2
+    void classifyColumnsAvx2(const ColumnInput& in, size_t count, const Bounds& b, uint64_t* bits, double* deviations) {
+        const Bounds256 bounds = broadcast256(b);
+        size_t i = 0;
+        uint64_t word = 0;
+        for (; i + 4 <= count; i += 4) {
+            const __m256d metrics[3] = {_mm256_loadu_pd(in.columns[0] + i), _mm256_loadu_pd(in.columns[1] + i),
+                                        _mm256_loadu_pd(in.columns[2] + i)};
+            word |= static_cast<uint64_t>(classify4(metrics, bounds, deviations ? deviations + i : nullptr)) << (i & 63);
+            if ((i & 63) == 60) {
+                bits[i >> 6] = word;
+                word = 0;
+            }
+        }
+        if (i & 63) {
+            bits[i >> 6] = word;
+        }
+        classifyTail(in, i, count, b, bits, deviations);
+    }
+#endif
+
+    // Requested kernel, or the widest supported one below it
+    AnomalyDetector::BatchKernel usableKernel(AnomalyDetector::BatchKernel requested) {
+        return std::min(requested, AnomalyDetector::bestBatchKernel());
+    }
+
+    // One batch under a single set of bounds; bits must be zeroed
+    void classifyWithBounds(const RowInput& in, size_t count, const Bounds& b, uint64_t* bits, double* deviations,
+                            AnomalyDetector::BatchKernel kernel) {
+        switch (kernel) {
+#ifdef FINPRO_HAS_AVX2
+            case AnomalyDetector::BatchKernel::AVX2:
+                classifyRowsAvx2(in.rows, count, b, bits, deviations);
+                return;
+#endif
+#ifdef FINPRO_HAS_SSE2
+            case AnomalyDetector::BatchKernel::SSE2:
+                classifyRowsSse2(in.rows, count, b, bits, deviations);
+                return;
+#endif
+            default:
+                classifyTail(in, 0, count, b, bits, deviations);
+                return;
+        }
+    }
+
+    void classifyWithBounds(const ColumnInput& in, size_t count, const Bounds& b, uint64_t* bits, double* deviations,
+                            AnomalyDetector::BatchKernel kernel) {
+        switch (kernel) {
+#ifdef FINPRO_HAS_AVX2
+            case AnomalyDetector::BatchKernel::AVX2:
+                classifyColumnsAvx2(in, count, b, bits, deviations);
+                return;
+#endif
+#ifdef FINPRO_HAS_SSE2
+            case AnomalyDetector::BatchKernel::SSE2:
+                classifyColumnsSse2(in, count, b, bits, deviations);
+                return;
+#endif
+            default:
+                classifyTail(in, 0, count, b, bits, deviations);
+                return;
+        }
+    }
+
+    // Rows per grouping pass; a multiple of 64 so every pass starts on a bitmap word
+    const size_t kGroupRows = 256;
+
+    // Classifies readings that may belong to different threshold profiles. Each pass looks up
+    // the profile of every reading once; a pass on a single profile (the common case: one
+    // sensor, or none with a profile) runs the kernel in place, otherwise the readings are
+    // ordered by profile and each profile's readings are gathered into columns, classified as
+    // one batch and scattered back.
+    template <typename Input>
+    void classifyByProfile(const Input& in, size_t count, const ThresholdProfiles& profiles, uint64_t* bits,
+                           double* deviations, AnomalyDetector::BatchKernel kernel) {
+        if (profiles.empty()) {
+            classifyWithBounds(in, count, boundsOf(profiles.defaults()), bits, deviations, kernel);
+            return;
+        }
+
+        uint32_t profileOf[kGroupRows];
+        uint16_t order[kGroupRows];
+        double columns[3][kGroupRows];
+        uint64_t groupBits[kGroupRows / 64];
+        double groupDeviations[kGroupRows];
+        for (size_t start = 0; start < count; start += kGroupRows) {
+            const size_t n = std::min(kGroupRows, count - start);
+            const Input pass = in.from(start);
+            uint64_t* passBits = bits + start / 64;
+            double* passDeviations = deviations ? deviations + start : nullptr;
+
+            bool single = true;
+            for (size_t i = 0; i < n; ++i) {
+                profileOf[i] = profiles.profileIndex(pass.sensorId(i));
+                single &= profileOf[i] == profileOf[0];
+            }
+            if (single) {
+                classifyWithBounds(pass, n, boundsOf(profiles.profile(profileOf[0])), passBits, passDeviations, kernel);
+                continue;
+            }
+
+            for (size_t i = 0; i < n; ++i) {
+                order[i] = static_cast<uint16_t>(i);
+            }
+            std::sort(order, order + n, [&](uint16_t a, uint16_t b) {
+                return profileOf[a] < profileOf[b] || (profileOf[a] == profileOf[b] && a < b);
+            });
+            for (size_t first = 0; first < n;) {
+                const uint32_t profile = profileOf[order[first]];
+                size_t last = first;
+                for (; last < n && profileOf[order[last]] == profile; ++last) {
+                    columns[0][last - first] = pass.temperature(order[last]);
+                    columns[1][last - first] = pass.humidity(order[last]);
+                    columns[2][last - first] = pass.light(order[last]);
+                }
+                const size_t groupSize = last - first;
+                std::fill(groupBits, groupBits + (groupSize + 63) / 64, uint64_t{0});
+                classifyWithBounds(ColumnInput{{columns[0], columns[1], columns[2]}, nullptr}, groupSize,
+                                   boundsOf(profiles.profile(profile)), groupBits,
+                                   passDeviations ? groupDeviations : nullptr, kernel);
+                for (size_t k = 0; k < groupSize; ++k) {
+                    const size_t row = order[first + k];
+                    passBits[row >> 6] |= ((groupBits[k >> 6] >> (k & 63)) & 1) << (row & 63);
+                    if (passDeviations) {
+                        passDeviations[row] = groupDeviations[k];
+                    }
+                }
+                first = last;
+            }
+        }
+    }
+
+    size_t popcount64(uint64_t word) {
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<size_t>(__builtin_popcountll(word));
+#else
+        size_t n = 0;
+        for (; word != 0; word &= word - 1) {
+            ++n;
+        }
+        return n;
+#endif
+    }
+}
+
+AnomalyDetector::BatchKernel AnomalyDetector::bestBatchKernel() {
+    static const BatchKernel best = [] {
+#if defined(FINPRO_HAS_AVX2)
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2") ? BatchKernel::AVX2 : BatchKernel::SSE2;
+#elif defined(FINPRO_HAS_SSE2)
+        return BatchKernel::SSE2; // Part of every x86-64 CPU
+#else
+        return BatchKernel::SCALAR;
+#endif
+    }();
+    return best;
+}
+
+const char* AnomalyDetector::batchKernelName(BatchKernel kernel) {
+    switch (kernel) {
+        case BatchKernel::AVX2: return "avx2";
+        case BatchKernel::SSE2: return "sse2";
+        default:                return "scalar";
+    }
+}
+
+void AnomalyDetector::classifyBatch(const SensorData* rows, size_t count, uint64_t* anomalyBits, double* deviations,
+                                    BatchKernel kernel) const {
+    std::fill(anomalyBits, anomalyBits + (count + 63) / 64, uint64_t{0});
+    classifyByProfile(RowInput{rows}, count, *profiles_, anomalyBits, deviations, usableKernel(kernel));
+    applyStatelessRules(rows, count, anomalyBits);
+}
+
+void AnomalyDetector::classifyColumns(const SensorColumns& columns, uint64_t* anomalyBits, double* deviations,
+                                      BatchKernel kernel) const {
+    std::fill(anomalyBits, anomalyBits + (columns.count + 63) / 64, uint64_t{0});
+    const ColumnInput in{{columns.temperature, columns.humidity, columns.lightIntensity}, columns.sensorIds};
+    classifyByProfile(in, columns.count, *profiles_, anomalyBits, deviations, usableKernel(kernel));
+    if (rules_ && rules_->statelessMask() != 0) {
+        for (size_t i = 0; i < columns.count; ++i) {
+            if ((anomalyBits[i / 64] >> (i % 64)) & 1) {
+                continue;
+            }
+            const SensorData row{0, columns.temperature[i], columns.humidity[i], columns.lightIntensity[i],
+                                 columns.sensorIds ? columns.sensorIds[i] : 0u};
+            if (rules_->evaluateStateless(row) != 0) {
+                anomalyBits[i / 64] |= uint64_t{1} << (i % 64);
+            }
+        }
+    }
+}
+
+void AnomalyDetector::applyStatelessRules(const SensorData* rows, size_t count, uint64_t* anomalyBits) const {
+    if (!rules_ || rules_->statelessMask() == 0) {
+        return;
+    }
+    // Rows already out of their thresholds need no rule
+    for (size_t i = 0; i < count; ++i) {
+        if (!((anomalyBits[i / 64] >> (i % 64)) & 1) && rules_->evaluateStateless(rows[i]) != 0) {
+            anomalyBits[i / 64] |= uint64_t{1} << (i % 64);
+        }
+    }
+}
+
+size_t AnomalyDetector::countAnomalies(const SensorData* rows, size_t count) const {
+    uint64_t bits[16]; // 1024 rows per pass
+    size_t anomalies = 0;
+    for (size_t start = 0; start < count; start += 1024) {
+        size_t n = std::min<size_t>(1024, count - start);
+        classifyBatch(rows + start, n, bits, nullptr);
+        for (size_t w = 0; w < (n + 63) / 64; ++w) {
+            anomalies += popcount64(bits[w]);
+        }
+    }
+    return anomalies;
+}
@@ -0,0 +1,92 @@
+#include "AnomalyRules.hpp"
+#include <algorithm>
+#include <type_traits>
+
+DynamicRulePipeline::DynamicRulePipeline(std::vector<Rule> rules) {
+    for (auto& rule : rules) {
+        addRule(std::move(rule));
+    }
+}
+
+bool DynamicRulePipeline::addRule(Rule rule) {
+    if (rules_.size() >= 32) {
+        return false; // The fired mask has one bit per rule
+    }
+    initialStates_.push_back(std::visit([](const auto& r) -> State {
+        return typename std::decay_t<decltype(r)>::State();
+    }, rule));
+    if (!std::holds_alternative<std::monostate>(initialStates_.back())) {
+        statefulMask_ |= 1u << rules_.size();
+    }
+    rules_.push_back(std::move(rule));
+    states_ = PerSensorStates<std::vector<State>>(initialStates_);
+    return true;
+}
+
+uint32_t DynamicRulePipeline::evaluate(const SensorData& reading) {
+    std::vector<State>& states = states_.get(reading.sensorId);
+    uint32_t fired = 0;
+    for (size_t i = 0; i < rules_.size(); ++i) {
+        const bool ruleFired = std::visit([&](const auto& rule) {
+            return rule.check(reading, std::get<typename std::decay_t<decltype(rule)>::State>(states[i]));
+        }, rules_[i]);
+        fired |= static_cast<uint32_t>(ruleFired) << i;
+    }
+    return fired;
+}
+
+void DynamicRulePipeline::evaluate(const SensorData* rows, size_t count, uint32_t* fired) {
+    for (size_t i = 0; i < count; ++i) {
+        fired[i] = evaluate(rows[i]);
+    }
+}
+
+uint32_t DynamicRulePipeline::evaluateStateless(const SensorData& reading) const {
+    uint32_t fired = 0;
+    std::monostate none;
+    for (size_t i = 0; i < rules_.size(); ++i) {
+        if (statefulMask_ & (1u << i)) {
+            continue;
+        }
+        const bool ruleFired = std::visit([&](const auto& rule) {
+            if constexpr (std::is_same_v<typename std::decay_t<decltype(rule)>::State, std::monostate>) {
+                return rule.check(reading, none);
+            }
+            return false;
+        }, rules_[i]);
+        fired |= static_cast<uint32_t>(ruleFired) << i;
+    }
+    return fired;
+}
+
+std::vector<std::string> DynamicRulePipeline::ruleNames() const {
+    std::vector<std::string> names;
+    for (const auto& rule : rules_) {
+        names.push_back(std::visit([](const auto& r) { return r.name(); }, rule));
+    }
+    return names;
+}
+
+ShardedRulePipeline::ShardedRulePipeline(std::shared_ptr<const DynamicRulePipeline> rules, size_t shardCount)
+    : rules_(std::move(rules)), shardCount_(std::max<size_t>(shardCount, 1)), shards_(new Shard[shardCount_]) {
+    for (size_t i = 0; i < shardCount_; ++i) {
+        shards_[i].pipeline = *rules_;
+        shards_[i].pipeline.reset();
+    }
+}
+
+uint32_t ShardedRulePipeline::evaluate(const SensorData& reading) {
+    if (rules_->statefulMask() == 0) {
+        return rules_->evaluateStateless(reading); // No state to guard
+    }
+    Shard& shard = shards_[reading.sensorId % shardCount_];
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    return shard.pipeline.evaluate(reading);
+}
+
+void ShardedRulePipeline::reset() {
+    for (size_t i = 0; i < shardCount_; ++i) {
+        std::lock_guard<std::mutex> lock(shards_[i].mutex);
+        shards_[i].pipeline.reset();
+    }
+}
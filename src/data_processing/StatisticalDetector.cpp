@@ -0,0 +1,98 @@
+#include "StatisticalDetector.hpp"
+#include <algorithm>
+#include <cmath>
+
+namespace {
+    double metricOf(const SensorData& data, int m) {
+        return m == 0 ? data.temperature : (m == 1 ? data.humidity : data.lightIntensity);
+    }
+}
+
+StatisticalDetector::StatisticalDetector() : StatisticalDetector(Config()) {}
+
+StatisticalDetector::StatisticalDetector(const Config& config) : config_(config) {
+    config_.alpha = std::min(1.0, std::max(config_.alpha, 1e-6));
+    config_.windowSize = std::max<size_t>(config_.windowSize, 2);
+    reset();
+}
+
+void StatisticalDetector::reset() {
+    observed_ = 0;
+    for (auto& state : metrics_) {
+        state = MetricState();
+        if (config_.method == Method::ROLLING_WINDOW) {
+            state.window.reserve(config_.windowSize);
+        }
+    }
+}
+
+double StatisticalDetector::variance(const MetricState& state) const {
+    if (config_.method == Method::EWMA) {
+        return state.m2;
+    }
+    return state.count > 1 ? state.m2 / static_cast<double>(state.count - 1) : 0.0;
+}
+
+void StatisticalDetector::fold(MetricState& state, double value) {
+    if (config_.method == Method::EWMA) {
+        if (state.count++ == 0) {
+            state.mean = value; // The first reading is the baseline
+            return;
+        }
+        // Incremental exponentially weighted mean and variance
+        const double diff = value - state.mean;
+        const double increment = config_.alpha * diff;
+        state.mean += increment;
+        state.m2 = (1.0 - config_.alpha) * (state.m2 + diff * increment);
+        return;
+    }
+
+    if (state.window.size() < config_.windowSize) {
+        // Filling the window: Welford's update
+        state.window.push_back(value);
+        ++state.count;
+        const double diff = value - state.mean;
+        state.mean += diff / static_cast<double>(state.count);
+        state.m2 += diff * (value - state.mean);
+        return;
+    }
+    // Full window: the oldest value leaves as the new one enters, in place of it in the ring
+    const double oldest = state.window[state.next];
+    state.window[state.next] = value;
+    state.next = (state.next + 1) % state.window.size();
+    const double oldMean = state.mean;
+    state.mean += (value - oldest) / static_cast<double>(state.count);
+    state.m2 += (value - oldest) * (value - state.mean + oldest - oldMean);
+    state.m2 = std::max(state.m2, 0.0); // Rounding can leave it a hair below zero
+}
+
+StatisticalDetector::Assessment StatisticalDetector::assess(const SensorData& data) const {
+    Assessment result;
+    result.warmedUp = observed_ >= config_.warmupReadings;
+    for (int m = 0; m < 3; ++m) {
+        const MetricState& state = metrics_[m];
+        result.mean[m] = state.mean;
+        result.stdDev[m] = std::sqrt(variance(state));
+        const double value = metricOf(data, m);
+        if (state.count == 0 || std::isnan(value)) {
+            continue;
+        }
+        result.zScores[m] = (value - state.mean) / std::max(result.stdDev[m], config_.minStdDev[m]);
+        if (result.warmedUp && std::fabs(result.zScores[m]) > config_.zThreshold) {
+            result.anomalous = true;
+        }
+    }
+    return result;
+}
+
+StatisticalDetector::Assessment StatisticalDetector::update(const SensorData& data) {
+    Assessment result = assess(data);
+    ++observed_;
+    for (int m = 0; m < 3; ++m) {
+        const double value = metricOf(data, m);
+        if (!std::isnan(value)) {
+            fold(metrics_[m], value);
+        }
+    }
+    return result;
+}
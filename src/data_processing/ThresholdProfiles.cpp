@@ -0,0 +1,106 @@
+#include "ThresholdProfiles.hpp"
+#include <algorithm>
+
+namespace {
+    // Smallest table: 8 slots
+    const size_t kMinSlotBits = 3;
+}
+
+ThresholdProfiles::ThresholdProfiles() : ThresholdProfiles(Thresholds()) {}
+
+ThresholdProfiles::ThresholdProfiles(const Thresholds& defaults) : profiles_{defaults}, sensorIds_{0} {}
+
+size_t ThresholdProfiles::findSlot(uint32_t sensorId) const {
+    if (slots_.empty()) {
+        return 0;
+    }
+    const size_t mask = slots_.size() - 1;
+    for (size_t i = slotOf(sensorId); ; i = (i + 1) & mask) {
+        if (slots_[i].sensorId == sensorId) {
+            return i;
+        }
+        if (slots_[i].sensorId == 0) {
+            return slots_.size();
+        }
+    }
+}
+
+void ThresholdProfiles::rehash(size_t slotBits) {
+    slotBits_ = slotBits;
+    slots_.assign(size_t{1} << slotBits, Slot{0, 0});
+    const size_t mask = slots_.size() - 1;
+    for (uint32_t profile = 1; profile < sensorIds_.size(); ++profile) {
+        size_t i = slotOf(sensorIds_[profile]);
+        while (slots_[i].sensorId != 0) {
+            i = (i + 1) & mask;
+        }
+        slots_[i] = {sensorIds_[profile], profile};
+    }
+}
+
+void ThresholdProfiles::set(uint32_t sensorId, const Thresholds& thresholds) {
+    if (sensorId == 0) {
+        profiles_[0] = thresholds;
+        return;
+    }
+    size_t slot = findSlot(sensorId);
+    if (slot < slots_.size()) {
+        profiles_[slots_[slot].profile] = thresholds;
+        return;
+    }
+
+    profiles_.push_back(thresholds);
+    sensorIds_.push_back(sensorId);
+    // Keep the table at most half full so probes stay short and always reach an empty slot
+    size_t slotBits = std::max(slotBits_, kMinSlotBits);
+    while ((size_t{1} << slotBits) < 2 * size()) {
+        ++slotBits;
+    }
+    if (slotBits != slotBits_) {
+        rehash(slotBits);
+        return;
+    }
+    const size_t mask = slots_.size() - 1;
+    size_t i = slotOf(sensorId);
+    while (slots_[i].sensorId != 0) {
+        i = (i + 1) & mask;
+    }
+    slots_[i] = {sensorId, static_cast<uint32_t>(profiles_.size() - 1)};
+}
+
+bool ThresholdProfiles::erase(uint32_t sensorId) {
+    if (sensorId == 0) {
+        return false;
+    }
+    size_t slot = findSlot(sensorId);
+    if (slot >= slots_.size()) {
+        return false;
+    }
+
+    // Keep profiles_ dense: the last profile moves into the freed index
+    const uint32_t freed = slots_[slot].profile;
+    const uint32_t last = static_cast<uint32_t>(profiles_.size() - 1);
+    if (freed != last) {
+        profiles_[freed] = profiles_[last];
+        sensorIds_[freed] = sensorIds_[last];
+        slots_[findSlot(sensorIds_[freed])].profile = freed;
+    }
+    profiles_.pop_back();
+    sensorIds_.pop_back();
+
+    // Backward-shift deletion: pull later entries of the probe run into the gap, so lookups
+    // can keep stopping at the first empty slot without tombstones
+    const size_t mask = slots_.size() - 1;
+    size_t gap = slot;
+    for (size_t i = (gap + 1) & mask; slots_[i].sensorId != 0; i = (i + 1) & mask) {
+        const size_t home = slotOf(slots_[i].sensorId);
+        // The entry may move back to the gap unless its home lies cyclically in (gap, i]
+        const bool homeInRange = (gap <= i) ? (home > gap && home <= i) : (home > gap || home <= i);
+        if (!homeInRange) {
+            slots_[gap] = slots_[i];
+            gap = i;
+        }
+    }
+    slots_[gap] = Slot{0, 0};
+    return true;
+}
@@ -6,6 +6,8 @@
 #include "Server.hpp"
 #include "Client.hpp"
 #include "DataStorage.hpp"
+#include "StatisticalDetector.hpp"
+#include "AnomalyRules.hpp"
 
 #include <iostream>
 #include <string>
@@ -14,14 +16,14 @@
 #include <iomanip>
 #include <chrono>
 #include <thread>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <mutex>
+#include <algorithm>
 
-// Helper function to print query results neatly
-void printQueryResults(const std::vector<QueryResult>& results) {
-    if (results.empty()) {
-        std::cout << "No data matching the specified criteria.\n";
-        return;
-    }
-
+// Helper functions to print query results neatly, one row at a time
+void printQueryHeader() {
     std::cout << "\n--- Query Results --- \n";
     std::cout << std::left
               << std::setw(20) << "Timestamp (ms)"
@@ -31,30 +33,147 @@ void printQueryResults(const std::vector<QueryResult>& results) {
               << std::setw(12) << "Anomalous"
               << std::setw(12) << "Deviation" << std::endl;
     std::cout << std::string(90, '-') << std::endl;
+}
 
-    for (const auto& qr : results) {
+void printQueryRow(const QueryResult& qr) {
+    std::cout << std::left
+              << std::setw(20) << qr.timestamp_ms
+              << std::fixed << std::setprecision(2)
+              << std::setw(12) << qr.temperature
+              << std::setw(12) << qr.humidity
+              << std::setw(15) << qr.lightIntensity
+              << std::setw(12) << (qr.isAnomalousFlag ? "YES" : "NO")
+              << std::setw(12) << qr.deviationValue << '\n';
+}
+
+// Streams the query straight from DataManager to the console without building a result vector
+void printQueryResults(const DataManager& dataManager, const DataManager::QueryParams& params) {
+    bool headerPrinted = false;
+    size_t rows = dataManager.visitQuery(params, [&](const QueryResult& qr) {
+        if (!headerPrinted) {
+            printQueryHeader();
+            headerPrinted = true;
+        }
+        printQueryRow(qr);
+        return true;
+    });
+
+    if (rows == 0) {
+        std::cout << "No data matching the specified criteria.\n";
+        return;
+    }
+    std::cout << std::string(90, '-') << std::endl << std::endl;
+}
+
+// Helper function to print rollup buckets neatly
+void printRollupBuckets(const std::vector<RollupBucket>& buckets) {
+    if (buckets.empty()) {
+        std::cout << "No data in the requested time range.\n";
+        return;
+    }
+
+    std::cout << "\n--- Trend (bucket width " << buckets.front().bucketWidth_ms << " ms) --- \n";
+    std::cout << std::left
+              << std::setw(20) << "Bucket start (ms)"
+              << std::setw(10) << "Count"
+              << std::setw(12) << "Anomalies"
+              << std::setw(12) << "Avg T (C)"
+              << std::setw(12) << "Avg H (%)"
+              << std::setw(12) << "Avg L (lx)" << std::endl;
+    std::cout << std::string(78, '-') << std::endl;
+
+    for (const auto& bucket : buckets) {
         std::cout << std::left
-                  << std::setw(20) << qr.timestamp_ms
+                  << std::setw(20) << bucket.bucketStart_ms
+                  << std::setw(10) << bucket.count
+                  << std::setw(12) << bucket.anomalyCount
                   << std::fixed << std::setprecision(2)
-                  << std::setw(12) << qr.temperature
-                  << std::setw(12) << qr.humidity
-                  << std::setw(15) << qr.lightIntensity
-                  << std::setw(12) << (qr.isAnomalousFlag ? "YES" : "NO")
-                  << std::setw(12) << qr.deviationValue << std::endl;
+                  << std::setw(12) << bucket.averageTemperature()
+                  << std::setw(12) << bucket.averageHumidity()
+                  << std::setw(12) << bucket.averageLightIntensity() << std::endl;
+    }
+    std::cout << std::string(78, '-') << std::endl << std::endl;
+}
+
+// Helper function to print GROUP BY time results as min/avg/max per metric
+void printAggregateBuckets(const std::vector<RollupBucket>& buckets) {
+    if (buckets.empty()) {
+        std::cout << "No data matching the specified criteria.\n";
+        return;
+    }
+
+    auto summary = [](const MetricSummary& metric, double average) {
+        std::ostringstream oss;
+        oss << std::fixed << std::setprecision(1) << metric.min << "/" << average << "/" << metric.max;
+        return oss.str();
+    };
+
+    std::cout << "\n--- Aggregates (bucket width " << buckets.front().bucketWidth_ms << " ms, min/avg/max) --- \n";
+    std::cout << std::left
+              << std::setw(20) << "Bucket start (ms)"
+              << std::setw(8) << "Count"
+              << std::setw(11) << "Anomalies"
+              << std::setw(22) << "Temp (C)"
+              << std::setw(22) << "Hum (%)"
+              << std::setw(22) << "Light (lx)" << std::endl;
+    std::cout << std::string(105, '-') << std::endl;
+
+    for (const auto& bucket : buckets) {
+        std::cout << std::left
+                  << std::setw(20) << bucket.bucketStart_ms
+                  << std::setw(8) << bucket.count
+                  << std::setw(11) << bucket.anomalyCount
+                  << std::setw(22) << summary(bucket.temperature, bucket.averageTemperature())
+                  << std::setw(22) << summary(bucket.humidity, bucket.averageHumidity())
+                  << std::setw(22) << summary(bucket.lightIntensity, bucket.averageLightIntensity()) << std::endl;
+    }
+    std::cout << std::string(105, '-') << std::endl << std::endl;
+}
+
+// Parses durations such as "500", "30s", "15m", "1h" or "7d" into milliseconds. Returns -1 if invalid.
+int64_t parseDurationMs(const std::string& text) {
+    if (text.empty()) {
+        return -1;
+    }
+    int64_t multiplier = 1;
+    std::string number = text;
+    switch (text.back()) {
+        case 's': multiplier = 1000LL; break;
+        case 'm': multiplier = 60LL * 1000; break;
+        case 'h': multiplier = 60LL * 60 * 1000; break;
+        case 'd': multiplier = 24LL * 60 * 60 * 1000; break;
+        default: break;
+    }
+    if (multiplier != 1) {
+        number.pop_back();
+    }
+    try {
+        size_t consumed = 0;
+        long long value = std::stoll(number, &consumed);
+        if (consumed != number.size() || value <= 0) {
+            return -1;
+        }
+        return value * multiplier;
+    } catch (const std::exception&) {
+        return -1;
     }
-    std::cout << std::string(90, '-') << std::endl << std::endl;
 }
 
 void displayHelp() {
     std::cout << "\nSmart Classroom Monitoring CLI\n";
     std::cout << "--------------------------------\n";
     std::cout << "Available Commands:\n";
-    std::cout << "  add <timestamp_ms> <temp> <humidity> <light_intensity>\n";
+    std::cout << "  add <timestamp_ms> <temp> <humidity> <light_intensity> [sensor_id]\n";
     std::cout << "    Adds a new sensor reading. Timestamp is milliseconds since epoch.\n";
     std::cout << "    Example: add 1678886400000 25.5 50.2 300.0\n\n";
-    std::cout << "  query [anomalous | normal] [sort <criteria>]\n";
+    std::cout << "  query [anomalous | normal] [where <expression>] [time <start_ms> <end_ms>] [range <metric> <min> <max>]... [sort <criteria>]\n";
     std::cout << "    Queries stored sensor data. All parts are optional.\n";
     std::cout << "    - [anomalous | normal]: Filter by anomaly status.\n";
+    std::cout << "    - [where <expression>]: Compound filter with AND, OR, NOT and parentheses over\n";
+    std::cout << "        temp, hum, light, dev, ts (compared with < <= > >= == !=), anomalous, normal.\n";
+    std::cout << "    - [time <start_ms> <end_ms>]: Inclusive timestamp filter.\n";
+    std::cout << "    - [range <metric> <min> <max>]: Inclusive value filter, repeatable.\n";
+    std::cout << "        metric is temp, hum, light or dev; use * for an open bound.\n";
     std::cout << "    - [sort <criteria>]: Sort results. Criteria include:\n";
     std::cout << "        ts_asc, ts_desc (timestamp)\n";
     std::cout << "        temp_asc, temp_desc (temperature)\n";
@@ -62,7 +181,35 @@ void displayHelp() {
     std::cout << "        light_asc, light_desc (light intensity)\n";
     std::cout << "        dev_asc, dev_desc (deviation magnitude)\n";
     std::cout << "    Example: query anomalous sort dev_desc\n";
-    std::cout << "    Example: query sort ts_asc\n\n";
+    std::cout << "    Example: query sort ts_asc\n";
+    std::cout << "    Example: query range temp 35 * sort temp_desc\n";
+    std::cout << "    Example: query where temp > 28 AND (hum < 35 OR light < 80) sort dev_desc\n\n";
+    std::cout << "  profile [<sensor_id> <min_temp> <max_temp> <min_hum> <max_hum> <min_light> <max_light> | <sensor_id> reset]\n";
+    std::cout << "    Lists, sets or removes the anomaly thresholds of one sensor/room (0 = the default).\n";
+    std::cout << "    Example: profile 12 10 35 20 80 50 2000\n\n";
+    std::cout << "  episodes [export] [<start_ms> <end_ms>]\n";
+    std::cout << "    Lists anomaly episodes: runs of out-of-threshold readings per sensor and metric.\n";
+    std::cout << "    'export' writes them to anomaly_report_episodes.json instead.\n";
+    std::cout << "    Example: episodes 1678886400000 1710508800000\n\n";
+    std::cout << "  index <on | off>\n";
+    std::cout << "    Enables/disables ordered per-metric indexes for range filters and value sorts.\n\n";
+    std::cout << "  retention <count | age | bytes> <limit>\n";
+    std::cout << "    Bounds readings kept in memory; older ones move to cold files on disk and stay queryable.\n";
+    std::cout << "    Example: retention count 100000\n";
+    std::cout << "    Example: retention age 7d\n\n";
+    std::cout << "  trend <resolution> [<start_ms> <end_ms>]\n";
+    std::cout << "    Shows per-bucket count/average over time, served from rollup tiers.\n";
+    std::cout << "    Resolution accepts ms or a unit suffix: s, m, h, d.\n";
+    std::cout << "    Example: trend 1h\n";
+    std::cout << "    Example: trend 1d 1678886400000 1710508800000\n\n";
+    std::cout << "  aggregate <width> [time <start_ms> <end_ms>] [where <expression>]\n";
+    std::cout << "    Count and min/avg/max of every metric per bucket of the given width.\n";
+    std::cout << "    Example: aggregate 15m time 1678886400000 1678972800000\n";
+    std::cout << "    Example: aggregate 1h where anomalous\n\n";
+    std::cout << "  percentile <temp | hum | light> <p> [daily] [<start_ms> <end_ms>]\n";
+    std::cout << "    Approximate percentile from streaming sketches, overall or per day.\n";
+    std::cout << "    Example: percentile temp 95\n";
+    std::cout << "    Example: percentile hum 99 daily\n\n";
     std::cout << "  save   - Manually save all data to storage.\n";
     std::cout << "  status - Show data count and storage status.\n";
     std::cout << "  help   - Shows this help message.\n";
@@ -77,18 +224,43 @@ int runServerMode(int port) {
     DataManager dataManager(thresholds);
     DataStorage dataStorage("sensor_data.bin", "anomaly_report.json");
     
-    // Load existing data from storage into DataManager
-    std::cout << "Loading existing data from storage..." << std::endl;
-    dataManager.loadFromStorage(dataStorage);
-    std::cout << "DataManager now contains " << dataManager.getDataCount() << " data points." << std::endl;
+    // Besides the fixed thresholds, readings that change too fast, frozen sensors and hot and
+    // humid rooms are anomalies. The detector runs the rules once per reading as the server
+    // classifies it, so the flag is stored, queried and exported with them; rule state is kept
+    // per sensor, sharded, so clients on separate threads do not wait on one another.
+    dataManager.setAnomalyRules(DynamicRulePipeline({RateOfChangeRule{}, StuckSensorRule{}, CrossMetricRule{}}));
+    const std::vector<std::string> ruleNames = dataManager.getAnomalyDetector()->ruleNames();
+
+    // Load existing data from storage on a background thread so sensors can connect right away;
+    // readings received meanwhile are applied once the history is in place
+    std::cout << "Loading existing data from storage in the background..." << std::endl;
+    dataManager.loadFromStorageInBackground(dataStorage);
     
     Server server(port, &dataManager, &dataStorage);
     
-    // Set up real-time anomaly notification
-    server.setDataCallback([&](const SensorData& data) {
-        AnomalyDetector detector(thresholds);
-        if (detector.isAnomalous(data)) {
-            std::cout << "ANOMALY DETECTED: " << data.toString() << std::endl;
+    // Set up real-time anomaly notification: the server has already classified the reading; sudden
+    // changes are judged against the running baseline of the whole stream, the one state shared
+    // by every client
+    StatisticalDetector statisticalDetector;
+    std::mutex statisticalMutex;
+    server.setDataCallback([&](const QueryResult& data) {
+        StatisticalDetector::Assessment assessment;
+        {
+            std::lock_guard<std::mutex> lock(statisticalMutex);
+            assessment = statisticalDetector.update(data);
+        }
+        if (data.isAnomalousFlag) {
+            std::string firedNames = data.deviationValue > 0.0 ? "threshold" : "";
+            for (size_t i = 0; i < ruleNames.size(); ++i) {
+                if (data.firedRules & (1u << i)) {
+                    firedNames += (firedNames.empty() ? "" : ", ") + ruleNames[i];
+                }
+            }
+            std::cout << "ANOMALY DETECTED (" << firedNames << "): " << data.toString() << std::endl;
+        } else if (assessment.anomalous) {
+            std::cout << "SUDDEN CHANGE DETECTED (z = " << std::fixed << std::setprecision(1)
+                      << assessment.zScores[0] << " / " << assessment.zScores[1] << " / " << assessment.zScores[2]
+                      << std::defaultfloat << "): " << data.toString() << std::endl;
         } else {
             std::cout << "Normal reading: " << data.toString() << std::endl;
         }
@@ -100,34 +272,47 @@ int runServerMode(int port) {
     std::cin.get();
     
     server.stop();
+    dataManager.waitForLoad();
+    std::cout << "DataManager now contains " << dataManager.getDataCount() << " data points." << std::endl;
+    BufferedAppender::Stats appendStats = dataStorage.appendStats();
+    std::cout << "Stored " << appendStats.appended << " readings in " << appendStats.writes << " writes ("
+              << appendStats.syncs << " syncs)" << std::endl;
     
-    // Save all data from DataManager to storage before shutdown
-    std::cout << "Saving all data to storage..." << std::endl;
-    dataManager.saveToStorage(dataStorage);
+    // Every reading was logged as it arrived, so shutdown only syncs the log instead of
+    // rewriting the binary file
+    std::cout << "Syncing storage..." << std::endl;
+    dataManager.checkpointToStorage(dataStorage);
     
-    // Export anomalies to JSON
+    // Export anomalies to JSON, streamed row by row from DataManager into the report
     DataManager::QueryParams params;
     params.filterAnomalousOnly = true;
-    auto anomalies = dataManager.queryData(params);
+    size_t exportedCount = 0;
+    dataStorage.exportAnomaliesToJson([&](const DataStorage::SensorDataSink& sink) {
+        exportedCount = dataManager.visitQuery(params, [&](const QueryResult& result) {
+            sink(result);
+            return true;
+        });
+    });
     
-    if (!anomalies.empty()) {
-        std::vector<SensorData> anomalyData;
-        for (const auto& result : anomalies) {
-            anomalyData.push_back(static_cast<SensorData>(result));
-        }
-        dataStorage.exportAnomaliesToJson(anomalyData);
-        std::cout << "Exported " << anomalies.size() << " anomalies to anomaly_report.json" << std::endl;
+    if (exportedCount > 0) {
+        std::cout << "Exported " << exportedCount << " anomalies to anomaly_report.json" << std::endl;
+    }
+    // The same anomalies collapsed into episodes, a far shorter report
+    std::vector<AnomalyEpisode> episodes = dataManager.getAnomalyEpisodes();
+    if (!episodes.empty() && dataStorage.exportEpisodesToJson(episodes, ruleNames)) {
+        std::cout << "Exported " << episodes.size() << " anomaly episodes to " << dataStorage.episodeReportPath()
+                  << std::endl;
     }
     
     return 0;
 }
 
 // Client mode function
-int runClientMode(const std::string& serverIp, int serverPort) {
+int runClientMode(const std::string& serverIp, int serverPort, uint32_t sensorId) {
     std::cout << "Starting Smart Classroom Monitoring Client" << std::endl;
     std::cout << "Connecting to server at " << serverIp << ":" << serverPort << std::endl;
     
-    Client client(serverIp, serverPort);
+    Client client(serverIp, serverPort, sensorId);
     
     if (!client.connectToServer(3, 1000)) {
         std::cerr << "Failed to connect to server. Exiting." << std::endl;
@@ -159,7 +344,7 @@ void printUsage(const char* programName) {
     std::cout << "Usage:\n";
     std::cout << "  " << programName << "                    - Interactive CLI mode\n";
     std::cout << "  " << programName << " server <port>      - Run as server\n";
-    std::cout << "  " << programName << " client <ip> <port> - Run as client\n";
+    std::cout << "  " << programName << " client <ip> <port> [sensor_id] - Run as client\n";
     std::cout << "\nExamples:\n";
     std::cout << "  " << programName << " server 8080\n";
     std::cout << "  " << programName << " client 127.0.0.1 8080\n";
@@ -178,14 +363,19 @@ int main(int argc, char* argv[]) {
             }
             return runServerMode(port);
         }
-        else if (mode == "client" && argc == 4) {
+        else if (mode == "client" && (argc == 4 || argc == 5)) {
             std::string serverIp = argv[2];
             int port = std::atoi(argv[3]);
             if (port <= 0 || port > 65535) {
                 std::cerr << "Error: Invalid port number. Must be between 1 and 65535." << std::endl;
                 return 1;
             }
-            return runClientMode(serverIp, port);
+            long long sensorId = (argc == 5) ? std::atoll(argv[4]) : 0;
+            if (sensorId < 0 || sensorId > std::numeric_limits<uint32_t>::max()) {
+                std::cerr << "Error: Invalid sensor id." << std::endl;
+                return 1;
+            }
+            return runClientMode(serverIp, port, static_cast<uint32_t>(sensorId));
         }
         else {
             printUsage(argv[0]);
@@ -198,11 +388,12 @@ int main(int argc, char* argv[]) {
     
     AnomalyDetector::AnomalyThresholds currentThresholds;
     DataManager dataManager(currentThresholds);
+    dataManager.setStatisticalDetection(StatisticalDetector::Config());
     DataStorage dataStorage("sensor_data.bin", "anomaly_report.json");
 
-    // Load existing data from storage
+    // Map existing data from storage (falls back to a full load when it cannot be mapped)
     std::cout << "Loading existing data from storage..." << std::endl;
-    dataManager.loadFromStorage(dataStorage);
+    dataManager.mapFromStorage(dataStorage);
     
     // Add some initial demo data if no data exists
     if (dataManager.getDataCount() == 0) {
@@ -242,22 +433,78 @@ int main(int argc, char* argv[]) {
         } else if (command == "add") {
             SensorData newData;
             if (!(ss >> newData.timestamp_ms >> newData.temperature >> newData.humidity >> newData.lightIntensity)) {
-                std::cerr << "Error: Invalid 'add' command format. Please use: add <ts_ms> <temp> <hum> <light>\n";
+                std::cerr << "Error: Invalid 'add' command format. Please use: add <ts_ms> <temp> <hum> <light> [sensor_id]\n";
                 continue;
             }
+            ss >> newData.sensorId; // Optional; stays 0 when absent
             dataManager.addSensorData(newData);
             std::cout << "Sensor data added: " << newData.toString() << std::endl;
 
         } else if (command == "query") {
             DataManager::QueryParams queryParams;
             std::string token;
+            std::string pendingToken; // Keyword that ended a 'where' expression
             bool proceed_with_query = true;
 
-            while (ss >> token) {
-                if (token == "anomalous") {
+            while (!pendingToken.empty() || ss >> token) {
+                if (!pendingToken.empty()) {
+                    token.swap(pendingToken);
+                    pendingToken.clear();
+                }
+                if (token == "where") {
+                    // The expression runs until the next query keyword or the end of the line
+                    std::string expressionText, word;
+                    while (ss >> word) {
+                        if (word == "sort" || word == "time" || word == "range") {
+                            pendingToken = word;
+                            break;
+                        }
+                        expressionText += word + " ";
+                    }
+                    std::string error;
+                    queryParams.filter = FilterExpression::compile(expressionText, error);
+                    if (!queryParams.filter) {
+                        std::cerr << "Error: Invalid filter expression: " << error << ". Query aborted.\n";
+                        proceed_with_query = false;
+                        break;
+                    }
+                } else if (token == "anomalous") {
                     queryParams.filterAnomalousOnly = true;
                 } else if (token == "normal") {
                     queryParams.filterAnomalousOnly = false;
+                } else if (token == "time") {
+                    int64_t startMs = 0, endMs = 0;
+                    if (!(ss >> startMs >> endMs)) {
+                        std::cerr << "Error: Usage is 'time <start_ms> <end_ms>'. Query aborted.\n";
+                        proceed_with_query = false;
+                        break;
+                    }
+                    queryParams.timeRangeFilterMs = std::make_pair(startMs, endMs);
+                } else if (token == "range") {
+                    std::string metricStr, minStr, maxStr;
+                    if (!(ss >> metricStr >> minStr >> maxStr)) {
+                        std::cerr << "Error: Usage is 'range <metric> <min> <max>'. Query aborted.\n";
+                        proceed_with_query = false;
+                        break;
+                    }
+                    DataManager::ValueRange range;
+                    try {
+                        if (minStr != "*") range.min = std::stod(minStr);
+                        if (maxStr != "*") range.max = std::stod(maxStr);
+                    } catch (const std::exception&) {
+                        std::cerr << "Error: Invalid range bounds '" << minStr << " " << maxStr << "'. Query aborted.\n";
+                        proceed_with_query = false;
+                        break;
+                    }
+                    if (metricStr == "temp") queryParams.temperatureRange = range;
+                    else if (metricStr == "hum") queryParams.humidityRange = range;
+                    else if (metricStr == "light") queryParams.lightRange = range;
+                    else if (metricStr == "dev") queryParams.deviationRange = range;
+                    else {
+                        std::cerr << "Error: Invalid range metric '" << metricStr << "'. Query aborted.\n";
+                        proceed_with_query = false;
+                        break;
+                    }
                 } else if (token == "sort") {
                     std::string criteriaStr;
                     if (!(ss >> criteriaStr)) {
@@ -287,10 +534,290 @@ int main(int argc, char* argv[]) {
                     break;
                 }
             }            if (proceed_with_query) { 
-                std::vector<QueryResult> results = dataManager.queryData(queryParams);
-                printQueryResults(results);
+                printQueryResults(dataManager, queryParams);
             }
 
+        } else if (command == "profile") {
+            const char* usage = "Usage: profile [<sensor_id> <min_temp> <max_temp> <min_hum> <max_hum> <min_light> <max_light> | <sensor_id> reset]\n";
+            ThresholdProfiles profiles = dataManager.getThresholdProfiles();
+            auto printProfile = [](uint32_t sensorId, const AnomalyDetector::AnomalyThresholds& t) {
+                std::cout << std::setw(10) << sensorId << "  temp " << t.minTemp << ".." << t.maxTemp
+                          << "  hum " << t.minHumidity << ".." << t.maxHumidity
+                          << "  light " << t.minLight << ".." << t.maxLight << std::endl;
+            };
+            long long sensorId = 0;
+            if (!(ss >> sensorId)) {
+                std::cout << "\n    Sensor  Thresholds (sensor 0 = default)" << std::endl;
+                printProfile(0, profiles.defaults());
+                std::vector<uint32_t> ids = profiles.sensorIds();
+                std::sort(ids.begin(), ids.end());
+                for (uint32_t id : ids) {
+                    printProfile(id, profiles.lookup(id));
+                }
+                std::cout << std::endl;
+                continue;
+            }
+            if (sensorId < 0 || sensorId > std::numeric_limits<uint32_t>::max()) {
+                std::cerr << "Error: Invalid sensor id. " << usage;
+                continue;
+            }
+            std::vector<std::string> args;
+            for (std::string arg; ss >> arg;) {
+                args.push_back(arg);
+            }
+            if (args.size() == 1 && args[0] == "reset") {
+                if (!profiles.erase(static_cast<uint32_t>(sensorId))) {
+                    std::cerr << "Sensor " << sensorId << " has no profile of its own." << std::endl;
+                    continue;
+                }
+            } else {
+                AnomalyDetector::AnomalyThresholds t;
+                try {
+                    if (args.size() != 6) throw std::invalid_argument("expected six limits");
+                    t.minTemp = std::stod(args[0]);
+                    t.maxTemp = std::stod(args[1]);
+                    t.minHumidity = std::stod(args[2]);
+                    t.maxHumidity = std::stod(args[3]);
+                    t.minLight = std::stod(args[4]);
+                    t.maxLight = std::stod(args[5]);
+                } catch (const std::exception&) {
+                    std::cerr << "Error: Invalid thresholds. " << usage;
+                    continue;
+                }
+                if (t.minTemp > t.maxTemp || t.minHumidity > t.maxHumidity || t.minLight > t.maxLight) {
+                    std::cerr << "Error: Each minimum must not exceed its maximum. " << usage;
+                    continue;
+                }
+                profiles.set(static_cast<uint32_t>(sensorId), t);
+            }
+            // Applied without stopping ingest; history is reclassified in the background
+            uint64_t generation = dataManager.reloadThresholdProfiles(profiles);
+            std::cout << "Thresholds for sensor " << sensorId << " updated (generation " << generation
+                      << "); reclassifying history in the background." << std::endl;
+
+        } else if (command == "episodes") {
+            std::vector<std::string> args;
+            for (std::string arg; ss >> arg;) {
+                args.push_back(arg);
+            }
+            const bool exportEpisodes = !args.empty() && args[0] == "export";
+            if (exportEpisodes) {
+                args.erase(args.begin());
+            }
+            std::optional<std::pair<int64_t, int64_t>> range;
+            try {
+                if (args.size() == 2) {
+                    range = std::make_pair(std::stoll(args[0]), std::stoll(args[1]));
+                }
+            } catch (const std::exception&) {}
+            if (!args.empty() && !range) {
+                std::cerr << "Error: Usage is 'episodes [export] [<start_ms> <end_ms>]'.\n";
+                continue;
+            }
+            std::vector<AnomalyEpisode> episodes = dataManager.getAnomalyEpisodes(range);
+            if (exportEpisodes) {
+                if (dataStorage.exportEpisodesToJson(episodes, dataManager.getAnomalyDetector()->ruleNames())) {
+                    std::cout << "Exported " << episodes.size() << " episodes to " << dataStorage.episodeReportPath()
+                              << std::endl;
+                } else {
+                    std::cerr << "Error: Could not write " << dataStorage.episodeReportPath() << std::endl;
+                }
+                continue;
+            }
+            if (episodes.empty()) {
+                std::cout << "No anomaly episodes." << std::endl;
+                continue;
+            }
+            const std::vector<std::string> ruleNames = dataManager.getAnomalyDetector()->ruleNames();
+            std::cout << std::fixed << std::setprecision(2);
+            for (const auto& episode : episodes) {
+                if (episode.rule >= 0) {
+                    const size_t rule = static_cast<size_t>(episode.rule);
+                    std::cout << "Sensor " << episode.sensorId << " rule "
+                              << (rule < ruleNames.size() ? ruleNames[rule] : std::to_string(rule)) << ": "
+                              << episode.start_ms << " - " << episode.end_ms << ", " << episode.count << " readings"
+                              << (episode.open ? ", ongoing" : "") << std::endl;
+                    continue;
+                }
+                std::cout << "Sensor " << episode.sensorId << " " << ruleMetricName(episode.metric) << ": "
+                          << episode.start_ms << " - " << episode.end_ms << ", " << episode.count
+                          << " readings, peak " << episode.peakValue << " (" << episode.peakDeviation
+                          << " past the limit)" << (episode.open ? ", ongoing" : "") << std::endl;
+            }
+            std::cout.unsetf(std::ios_base::floatfield);
+
+        } else if (command == "index") {
+            std::string mode;
+            ss >> mode;
+            if (mode == "on" || mode == "off") {
+                dataManager.setValueIndexesEnabled(mode == "on");
+                std::cout << "Value indexes " << (mode == "on" ? "enabled." : "disabled.") << std::endl;
+            } else {
+                std::cerr << "Error: Usage is 'index <on | off>'.\n";
+            }
+
+        } else if (command == "retention") {
+            std::string kind, limitStr;
+            if (!(ss >> kind >> limitStr)) {
+                std::cerr << "Error: Usage is 'retention <count | age | bytes> <limit>'.\n";
+                continue;
+            }
+            DataManager::RetentionPolicy policy;
+            if (kind == "age") {
+                int64_t ageMs = parseDurationMs(limitStr);
+                if (ageMs > 0) policy.maxAgeMs = ageMs;
+            } else if (kind == "count" || kind == "bytes") {
+                try {
+                    unsigned long long limit = std::stoull(limitStr);
+                    if (kind == "count") policy.maxCount = static_cast<size_t>(limit);
+                    else policy.maxBytes = static_cast<size_t>(limit);
+                } catch (const std::exception&) {}
+            }
+            if (!policy.maxAgeMs && !policy.maxCount && !policy.maxBytes) {
+                std::cerr << "Error: Invalid retention '" << kind << " " << limitStr << "'.\n";
+                continue;
+            }
+            dataManager.setRetentionPolicy(policy, dataStorage);
+            std::cout << "Retention policy applied. Readings in memory: " << dataManager.getDataCount()
+                      << " of " << dataManager.getTotalDataCount() << std::endl;
+
+        } else if (command == "trend") {
+            std::string resolutionStr;
+            if (!(ss >> resolutionStr)) {
+                std::cerr << "Error: Missing resolution. Usage: trend <resolution> [<start_ms> <end_ms>]\n";
+                continue;
+            }
+            int64_t resolutionMs = parseDurationMs(resolutionStr);
+            if (resolutionMs <= 0) {
+                std::cerr << "Error: Invalid resolution '" << resolutionStr << "'. Example: 1h\n";
+                continue;
+            }
+            int64_t startMs = std::numeric_limits<int64_t>::min();
+            int64_t endMs = std::numeric_limits<int64_t>::max();
+            int64_t rangeStart = 0, rangeEnd = 0;
+            if (ss >> rangeStart) {
+                if (!(ss >> rangeEnd)) {
+                    std::cerr << "Error: Missing end timestamp. Usage: trend <resolution> [<start_ms> <end_ms>]\n";
+                    continue;
+                }
+                startMs = rangeStart;
+                endMs = rangeEnd;
+            }
+            printRollupBuckets(dataManager.queryRollups(startMs, endMs, resolutionMs));
+
+        } else if (command == "aggregate") {
+            const char* usage = "Usage: aggregate <width> [time <start_ms> <end_ms>] [where <expression>]\n";
+            std::string widthStr;
+            if (!(ss >> widthStr)) {
+                std::cerr << "Error: Missing bucket width. " << usage;
+                continue;
+            }
+            int64_t widthMs = parseDurationMs(widthStr);
+            if (widthMs <= 0) {
+                std::cerr << "Error: Invalid bucket width '" << widthStr << "'. Example: 15m\n";
+                continue;
+            }
+
+            DataManager::QueryParams params;
+            std::string token;
+            bool valid = true;
+            while (valid && ss >> token) {
+                if (token == "time") {
+                    int64_t startMs = 0, endMs = 0;
+                    if (ss >> startMs >> endMs) {
+                        params.timeRangeFilterMs = std::make_pair(startMs, endMs);
+                    } else {
+                        std::cerr << "Error: Invalid time range. " << usage;
+                        valid = false;
+                    }
+                } else if (token == "where") {
+                    std::string rest, error;
+                    std::getline(ss, rest); // The expression runs to the end of the line
+                    params.filter = FilterExpression::compile(rest, error);
+                    if (!params.filter) {
+                        std::cerr << "Error: Invalid filter expression: " << error << "\n";
+                        valid = false;
+                    }
+                } else {
+                    std::cerr << "Error: Unexpected '" << token << "'. " << usage;
+                    valid = false;
+                }
+            }
+            if (valid) {
+                printAggregateBuckets(dataManager.aggregateByTime(params, widthMs));
+            }
+
+        } else if (command == "percentile") {
+            const char* usage = "Usage: percentile <temp|hum|light> <p> [daily] [<start_ms> <end_ms>]\n";
+            std::string metricStr, percentileStr;
+            if (!(ss >> metricStr >> percentileStr)) {
+                std::cerr << "Error: Missing arguments. " << usage;
+                continue;
+            }
+            DataManager::SensorMetric metric;
+            if (metricStr == "temp") metric = DataManager::SensorMetric::TEMPERATURE;
+            else if (metricStr == "hum") metric = DataManager::SensorMetric::HUMIDITY;
+            else if (metricStr == "light") metric = DataManager::SensorMetric::LIGHT_INTENSITY;
+            else {
+                std::cerr << "Error: Invalid metric '" << metricStr << "'. " << usage;
+                continue;
+            }
+            double percentile = 0.0;
+            try {
+                percentile = std::stod(percentileStr);
+            } catch (const std::exception&) {
+                percentile = -1.0;
+            }
+            if (percentile < 0.0 || percentile > 100.0) {
+                std::cerr << "Error: Percentile must be between 0 and 100. " << usage;
+                continue;
+            }
+
+            bool daily = false;
+            std::string token;
+            std::optional<std::pair<int64_t, int64_t>> timeRange;
+            bool valid = true;
+            while (valid && ss >> token) {
+                if (token == "daily") {
+                    daily = true;
+                    continue;
+                }
+                std::string endStr;
+                try {
+                    if (!(ss >> endStr)) throw std::invalid_argument("missing end");
+                    timeRange = std::make_pair(std::stoll(token), std::stoll(endStr));
+                } catch (const std::exception&) {
+                    std::cerr << "Error: Invalid time range. " << usage;
+                    valid = false;
+                }
+            }
+            if (!valid) {
+                continue;
+            }
+
+            double q = percentile / 100.0;
+            std::cout << std::fixed << std::setprecision(2);
+            if (daily) {
+                int64_t startMs = timeRange ? timeRange->first : std::numeric_limits<int64_t>::min();
+                int64_t endMs = timeRange ? timeRange->second : std::numeric_limits<int64_t>::max();
+                auto windows = dataManager.approximateQuantileByWindow(metric, q, startMs, endMs);
+                if (windows.empty()) {
+                    std::cout << "No data found for the given range." << std::endl;
+                }
+                for (const auto& window : windows) {
+                    std::cout << "  day starting " << window.first << " ms: p" << percentileStr << " " << metricStr
+                              << " ~ " << window.second << std::endl;
+                }
+            } else {
+                std::optional<double> value = dataManager.approximateQuantile(metric, q, timeRange);
+                if (value) {
+                    std::cout << "p" << percentileStr << " " << metricStr << " ~ " << *value << " (approximate)" << std::endl;
+                } else {
+                    std::cout << "No data found for the given range." << std::endl;
+                }
+            }
+            std::cout.unsetf(std::ios_base::floatfield);
+
         } else if (command == "save") {
             std::cout << "Saving all data to storage..." << std::endl;
             dataManager.saveToStorage(dataStorage);
@@ -299,13 +826,29 @@ int main(int argc, char* argv[]) {
         } else if (command == "status") {
             std::cout << "\n--- System Status ---" << std::endl;
             std::cout << "Data points in memory: " << dataManager.getDataCount() << std::endl;
+            std::cout << "Data points in total (incl. evicted to disk): " << dataManager.getTotalDataCount() << std::endl;
+            DataManager::LoadStatus loadStatus = dataManager.getLoadStatus();
+            if (loadStatus.loading) {
+                std::cout << "History still loading: " << loadStatus.loadedReadings << " of " << loadStatus.totalReadings
+                          << " readings (results below are partial)" << std::endl;
+            }
             
-            // Check anomaly count
+            // Check anomaly count (counted by visiting, nothing is copied)
             DataManager::QueryParams anomalyParams;
             anomalyParams.filterAnomalousOnly = true;
-            auto anomalies = dataManager.queryData(anomalyParams);
-            std::cout << "Anomalous data points: " << anomalies.size() << std::endl;
-            std::cout << "Normal data points: " << (dataManager.getDataCount() - anomalies.size()) << std::endl;
+            size_t anomalyCount = dataManager.visitQuery(anomalyParams, [](const QueryResult&) { return true; });
+            std::cout << "Anomalous data points: " << anomalyCount << std::endl;
+            std::cout << "Normal data points: " << (dataManager.getTotalDataCount() - anomalyCount) << std::endl;
+            std::cout << "Sudden changes in readings added this session: " << dataManager.getStatisticalAnomalyCount()
+                      << std::endl;
+            std::cout << "Anomaly episodes: " << dataManager.getAnomalyEpisodeCount() << std::endl;
+            std::cout << "Threshold generation: " << dataManager.getThresholdGeneration()
+                      << (dataManager.reclassificationPending() ? " (reclassifying history for a newer one)" : "")
+                      << std::endl;
+            QueryCache::Stats cacheStats = dataManager.getQueryCacheStats();
+            std::cout << "Query cache: " << cacheStats.hits << " hits, " << cacheStats.incrementalHits
+                      << " incremental hits, " << cacheStats.misses << " misses, " << cacheStats.entries
+                      << " entries (" << cacheStats.cachedRows << " rows)" << std::endl;
             std::cout << "Storage files: sensor_data.bin, anomaly_report.json" << std::endl;
             std::cout << "-------------------------\n" << std::endl;
 
@@ -1,114 +1,2262 @@
 #include "DataManager.hpp" // Corresponding header
 #include "DataStorage.hpp" // For storage operations
 #include <iostream>        // For potential debug logging
+#include <sstream>         // For cache keys
+#include <iomanip>         // For std::setprecision
+#include <iterator>        // For std::back_inserter
+
+namespace {
+    // Strict weak ordering of query results for a given sort criteria
+    struct ResultComparator {
+        SortCriteria sortBy;
+
+        bool operator()(const QueryResult& a, const QueryResult& b) const {
+            switch (sortBy) {
+                case SortCriteria::TIMESTAMP_ASC:
+                    return a.timestamp_ms < b.timestamp_ms;
+                case SortCriteria::TIMESTAMP_DESC:
+                    return a.timestamp_ms > b.timestamp_ms;
+                case SortCriteria::TEMP_ASC:
+                    return a.temperature < b.temperature;
+                case SortCriteria::TEMP_DESC:
+                    return a.temperature > b.temperature;
+                case SortCriteria::HUMIDITY_ASC:
+                    return a.humidity < b.humidity;
+                case SortCriteria::HUMIDITY_DESC:
+                    return a.humidity > b.humidity;
+                case SortCriteria::LIGHT_ASC:
+                    return a.lightIntensity < b.lightIntensity;
+                case SortCriteria::LIGHT_DESC:
+                    return a.lightIntensity > b.lightIntensity;
+                case SortCriteria::DEVIATION_ASC:
+                    return a.deviationValue < b.deviationValue;
+                case SortCriteria::DEVIATION_DESC:
+                    return a.deviationValue > b.deviationValue;
+                default: // Default to timestamp ascending
+                    return a.timestamp_ms < b.timestamp_ms;
+            }
+        }
+    };
+
+    // Most ascending runs mergeTimestampRuns merges before falling back to a full sort
+    const size_t kMaxTimestampRuns = 8;
+
+    // Rows scanned from history come out as a few ascending timestamp runs: evicted rows, the
+    // mapped base file (one run per save, plus late readings), the segments and the reorder
+    // buffer. Merges the runs pairwise; returns false, leaving the range untouched, if there are
+    // more than kMaxTimestampRuns of them.
+    template <typename It, typename Earlier>
+    bool mergeTimestampRuns(It first, It last, Earlier earlier, bool descending) {
+        std::vector<It> bounds = {first};
+        while (bounds.back() != last) {
+            if (bounds.size() > kMaxTimestampRuns) {
+                return false;
+            }
+            bounds.push_back(std::is_sorted_until(bounds.back(), last, earlier));
+        }
+        while (bounds.size() > 2) {
+            std::vector<It> merged;
+            for (size_t i = 0; i + 2 < bounds.size(); i += 2) {
+                std::inplace_merge(bounds[i], bounds[i + 1], bounds[i + 2], earlier);
+                merged.push_back(bounds[i]);
+            }
+            if (bounds.size() % 2 == 0) {
+                merged.push_back(bounds[bounds.size() - 2]); // Odd run out, carried to the next round
+            }
+            merged.push_back(last);
+            bounds.swap(merged);
+        }
+        if (descending) {
+            std::reverse(first, last);
+        }
+        return true;
+    }
+
+    void sortResults(std::vector<QueryResult>& results, SortCriteria sortBy) {
+        if (sortBy == SortCriteria::TIMESTAMP_ASC || sortBy == SortCriteria::TIMESTAMP_DESC) {
+            auto earlier = [](const QueryResult& a, const QueryResult& b) { return a.timestamp_ms < b.timestamp_ms; };
+            if (mergeTimestampRuns(results.begin(), results.end(), earlier, sortBy == SortCriteria::TIMESTAMP_DESC)) {
+                return;
+            }
+        }
+        std::sort(results.begin(), results.end(), ResultComparator{sortBy});
+    }
+
+    // Narrows a timestamp-sorted span to the rows inside the query's time range
+    SensorDataSpan trimToTimeRange(SensorDataSpan rows, const std::optional<std::pair<int64_t, int64_t>>& range) {
+        if (!range) {
+            return rows;
+        }
+        const SensorData* first = std::lower_bound(rows.begin(), rows.end(), range->first,
+            [](const SensorData& sd, int64_t ts) { return sd.timestamp_ms < ts; });
+        const SensorData* last = std::upper_bound(first, rows.end(), range->second,
+            [](int64_t ts, const SensorData& sd) { return ts < sd.timestamp_ms; });
+        return {first, static_cast<size_t>(std::max<ptrdiff_t>(last - first, 0))};
+    }
+
+    bool earlierReading(const SensorData& a, const SensorData& b) {
+        return a.timestamp_ms < b.timestamp_ms;
+    }
+
+    // Calls fn with the pieces of spans covering rows [begin, end) of their concatenation, and
+    // the verdicts of each piece (verdicts is aligned with spans)
+    template <typename Fn>
+    void forEachSubspan(const std::vector<SensorDataSpan>& spans, const std::vector<RowVerdicts>& verdicts,
+                        size_t begin, size_t end, Fn&& fn) {
+        size_t offset = 0;
+        for (size_t s = 0; s < spans.size(); ++s) {
+            const SensorDataSpan& span = spans[s];
+            if (offset >= end) {
+                return;
+            }
+            size_t spanEnd = offset + span.size;
+            if (spanEnd > begin) {
+                size_t first = begin > offset ? begin - offset : 0;
+                size_t last = std::min(end, spanEnd) - offset;
+                fn(SensorDataSpan{span.data + first, last - first}, verdicts[s].from(first));
+            }
+            offset = spanEnd;
+        }
+    }
+
+    // Folds rows (all inside bucket's time span) into bucket. Four independent lanes per metric
+    // break the dependency chains of the sums and min/max so the loop pipelines and vectorizes.
+    // anomalous, if given, holds the rows' flags; otherwise they are counted with detector.
+    void accumulateRun(const SensorData* rows, const uint8_t* anomalous, size_t count, const AnomalyDetector& detector,
+                       RollupBucket& bucket) {
+        struct Lanes {
+            double sum[4] = {0.0, 0.0, 0.0, 0.0};
+            double min[4];
+            double max[4];
+        } lanes[3];
+        const double first[3] = {rows[0].temperature, rows[0].humidity, rows[0].lightIntensity};
+        for (int m = 0; m < 3; ++m) {
+            std::fill(lanes[m].min, lanes[m].min + 4, first[m]);
+            std::fill(lanes[m].max, lanes[m].max + 4, first[m]);
+        }
+
+        int64_t lastTimestamp = rows[0].timestamp_ms;
+        for (size_t i = 0; i < count; ++i) {
+            const SensorData& sd = rows[i];
+            const size_t lane = i & 3;
+            const double values[3] = {sd.temperature, sd.humidity, sd.lightIntensity};
+            for (int m = 0; m < 3; ++m) {
+                lanes[m].sum[lane] += values[m];
+                lanes[m].min[lane] = std::min(lanes[m].min[lane], values[m]);
+                lanes[m].max[lane] = std::max(lanes[m].max[lane], values[m]);
+            }
+            lastTimestamp = std::max(lastTimestamp, sd.timestamp_ms);
+        }
+
+        RollupBucket run = bucket;
+        run.count = count;
+        if (anomalous) {
+            run.anomalyCount = 0;
+            for (size_t i = 0; i < count; ++i) {
+                run.anomalyCount += anomalous[i];
+            }
+        } else {
+            run.anomalyCount = detector.countAnomalies(rows, count);
+        }
+        run.lastTimestamp_ms = lastTimestamp;
+        MetricSummary* summaries[3] = {&run.temperature, &run.humidity, &run.lightIntensity};
+        for (int m = 0; m < 3; ++m) {
+            const Lanes& l = lanes[m];
+            summaries[m]->sum = (l.sum[0] + l.sum[1]) + (l.sum[2] + l.sum[3]);
+            summaries[m]->min = std::min(std::min(l.min[0], l.min[1]), std::min(l.min[2], l.min[3]));
+            summaries[m]->max = std::max(std::max(l.max[0], l.max[1]), std::max(l.max[2], l.max[3]));
+        }
+        bucket.merge(run);
+    }
+
+    // Verdict under detector of a reading that classifyIncoming judged with classifiedWith. Its
+    // stateful rule hits are kept if detector applies the same rules; running them again would
+    // count the reading twice in their state.
+    QueryResult reclassifiedArrival(const QueryResult& reading, const AnomalyDetector& classifiedWith,
+                                    const AnomalyDetector& detector) {
+        double deviation = 0.0;
+        detector.classify(reading, deviation);
+        uint32_t fired = detector.rules() ? detector.rules()->evaluateStateless(reading) : 0;
+        if (detector.sharesRulesWith(classifiedWith)) {
+            fired |= reading.firedRules & detector.statefulRuleMask();
+        }
+        return QueryResult(reading, deviation > 0.0 || fired != 0, deviation, fired);
+    }
+
+    // Number of rows, which are sorted by timestamp, at or below cutoff
+    size_t rowsUpTo(SensorDataSpan rows, int64_t cutoff) {
+        return static_cast<size_t>(std::upper_bound(rows.begin(), rows.end(), cutoff, [](int64_t timestamp, const SensorData& sd) {
+            return timestamp < sd.timestamp_ms;
+        }) - rows.begin());
+    }
+}
 
 // Constructor
 DataManager::DataManager(const AnomalyDetector::AnomalyThresholds& thresholds)
-    : anomalyDetector_(thresholds), thresholds_(thresholds) {
-    // The anomalyDetector_ is initialized with the provided thresholds.
-    // thresholds_ is also stored separately if calculate_deviation_metric needs it directly.
+    : anomalyDetector_(thresholds) {
+    // The anomalyDetector_ is initialized with the provided thresholds as the default profile.
+    publishDetector(anomalyDetector_);
+    for (int64_t width : rollupResolutions()) {
+        rollupTiers_.emplace_back(width);
+    }
+}
+
+const std::vector<int64_t>& DataManager::rollupResolutions() {
+    // 1 minute, 1 hour, 1 day
+    static const std::vector<int64_t> resolutions = {60LL * 1000, 60LL * 60 * 1000, 24LL * 60 * 60 * 1000};
+    return resolutions;
+}
+
+DataManager::~DataManager() {
+    {
+        // A pending reload is abandoned rather than finished
+        std::lock_guard<std::mutex> lock(dataMutex_);
+        stagedDetector_.reset();
+        ++stagedGeneration_;
+    }
+    waitForReclassification();
+    waitForLoad(); // The loader thread uses this object
+}
+
+void DataManager::addSensorData(const SensorData& data) {
+    // Classified before taking the lock, against the thresholds and rules currently published
+    const std::shared_ptr<const AnomalyDetector> detector = getAnomalyDetector();
+    double deviation = 0.0;
+    uint32_t firedRules = 0;
+    bool isAnomalous = detector->classifyIncoming(data, deviation, &firedRules);
+    addEnrichedData(QueryResult(data, isAnomalous, deviation, firedRules), *detector);
+}
+
+void DataManager::addEnrichedData(const QueryResult& reading, const AnomalyDetector& classifiedWith,
+                                  DataStorage* storeIn) {
+    std::unique_lock<std::mutex> storeLock(storeMutex_, std::defer_lock);
+    if (storeIn) {
+        storeLock.lock();
+        storeIn->storeData(reading); // The raw reading; flags follow the thresholds
+    }
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    if (anomalyDetector_.sharesThresholdsWith(classifiedWith)) {
+        addEnrichedLocked(reading);
+        return;
+    }
+    // Classified with other thresholds (e.g. profiles changed since the caller classified it)
+    addEnrichedLocked(reclassifiedArrival(reading, classifiedWith, anomalyDetector_));
+}
+
+std::shared_ptr<const AnomalyDetector> DataManager::getAnomalyDetector() const {
+    return std::atomic_load_explicit(&publishedDetector_, std::memory_order_acquire);
+}
+
+void DataManager::addEnrichedLocked(const QueryResult& data) {
+    if (statisticalDetector_) {
+        // Scored on arrival, so detection does not wait for a background load
+        StatisticalDetector::Assessment assessment = statisticalDetector_->update(data);
+        if (assessment.anomalous) {
+            ++statisticalAnomalyCount_;
+            statisticalAnomalies_.push_back({data, assessment});
+            if (statisticalAnomalies_.size() > kStatisticalAnomalyHistory) {
+                statisticalAnomalies_.pop_front();
+            }
+        }
+    }
+    if (loadStatus_.loading) {
+        // Held back until the history is in place, then added in arrival order
+        pendingReadings_.push_back(data);
+        loadStatus_.pendingReadings = pendingReadings_.size();
+        return;
+    }
+    addLocked(data);
+}
+
+void DataManager::setStatisticalDetection(const std::optional<StatisticalDetector::Config>& config) {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    statisticalDetector_.reset();
+    if (config) {
+        statisticalDetector_.emplace(*config);
+    }
+    statisticalAnomalies_.clear();
+    statisticalAnomalyCount_ = 0;
+}
+
+std::vector<DataManager::StatisticalAnomaly> DataManager::getStatisticalAnomalies() const {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    return std::vector<StatisticalAnomaly>(statisticalAnomalies_.begin(), statisticalAnomalies_.end());
+}
+
+size_t DataManager::getStatisticalAnomalyCount() const {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    return statisticalAnomalyCount_;
+}
+
+void DataManager::setEpisodeConfig(const EpisodeTracker::Config& config) {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    episodes_ = EpisodeTracker(config);
+}
+
+std::vector<AnomalyEpisode> DataManager::getAnomalyEpisodes(
+    const std::optional<std::pair<int64_t, int64_t>>& timeRangeMs) const {
+    std::vector<AnomalyEpisode> result;
+    {
+        std::lock_guard<std::mutex> lock(dataMutex_);
+        result = episodes_.episodes();
+    }
+    if (timeRangeMs) {
+        result.erase(std::remove_if(result.begin(), result.end(), [&](const AnomalyEpisode& episode) {
+            return episode.end_ms < timeRangeMs->first || episode.start_ms > timeRangeMs->second;
+        }), result.end());
+    }
+    return result;
+}
+
+size_t DataManager::getAnomalyEpisodeCount() const {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    return episodes_.closedCount() + episodes_.openCount();
+}
+
+void DataManager::trackEpisodes(const SensorData& data, uint32_t firedRules) {
+    episodes_.update(data, anomalyDetector_.thresholdsFor(data.sensorId), firedRules);
+}
+
+void DataManager::addLocked(const QueryResult& data) {
+    for (auto& tier : rollupTiers_) {
+        tier.add(data, data.isAnomalousFlag);
+    }
+    if (reclassifying_) {
+        rollupJournal_.push_back(data);
+    }
+    foldIntoSketches(data);
+    trackEpisodes(data, data.firedRules);
+    ingestReading(data);
+
+    // Remember the reading so cached query results can be patched instead of recomputed
+    ++appendSequence_;
+    recentAppends_.push_back(data);
+    if (recentAppends_.size() > kQueryCacheTailWindow) {
+        recentAppends_.pop_front();
+    }
+    // For debugging:
+    // std::cout << "DataManager: Added data - Timestamp: " << data.timestamp_ms << std::endl;
+}
+
+void DataManager::ingestReading(const QueryResult& data) {
+    newestTimestamp_ = std::max(newestTimestamp_, data.timestamp_ms);
+
+    // A late reading inside the evicted time range goes straight to disk to keep the invariant
+    if (data.timestamp_ms <= coldWatermark_ && appendToNewestColdFile({data})) {
+        return;
+    }
+
+    appendResident(data);
+    enforceRetention();
+}
+
+void DataManager::appendResident(const QueryResult& data) {
+    ++residentCount_;
+    oldestResidentTimestamp_ = std::min(oldestResidentTimestamp_, data.timestamp_ms);
+    if (data.timestamp_ms >= newestSegmentTimestamp()) {
+        appendToHead(data); // In order, the common case
+        return;
+    }
+
+    // Late reading: kept aside in order so the segments never need sorting; classified again
+    // when merged in, which is rare
+    auto at = std::upper_bound(reorderBuffer_.begin(), reorderBuffer_.end(), data, earlierReading);
+    reorderBuffer_.insert(at, static_cast<const SensorData&>(data));
+    if (reorderBuffer_.size() >= reorderBufferCapacity_) {
+        mergeReorderBuffer();
+    }
+}
+
+void DataManager::appendToHead(const QueryResult& data) {
+    int64_t partition = RollupTier::alignTimestamp(data.timestamp_ms, segmentPartitionMs_);
+    if (headSegment_ && (headSegment_->full() || partition > headSegment_->partitionStart())) {
+        // The next head is sized by the fill seen: twice as large if this one filled up before
+        // its partition ended, else a quarter larger than this partition turned out
+        const size_t size = headSegment_->size();
+        headCapacity_ = headSegment_->full() ? 2 * headSegment_->capacity() : std::max(size + size / 4, kMinSegmentCapacity);
+        headCapacity_ = std::min(headCapacity_, segmentCapacity_);
+        sealHead();
+    }
+    if (!headSegment_) {
+        // Allocated once, so appends never move rows a reader may be scanning
+        headSegment_ = std::make_shared<HistorySegment>(headCapacity_, partition, anomalyDetector_);
+    }
+    headSegment_->append(data, data.isAnomalousFlag, data.deviationValue);
+}
+
+int64_t DataManager::newestSegmentTimestamp() const {
+    // Segments are in timestamp order, so the newest row is in the last non-empty one
+    if (headSegment_ && headSegment_->size() > 0) {
+        return headSegment_->maxTimestamp();
+    }
+    if (!sealedSegments_.empty()) {
+        return sealedSegments_.back()->maxTimestamp();
+    }
+    return std::numeric_limits<int64_t>::min();
+}
+
+void DataManager::mergeReorderBuffer() {
+    if (reorderBuffer_.empty()) {
+        return;
+    }
+
+    // Each late reading goes into the first segment reaching up to it, so only the segments the
+    // late readings fall into are rebuilt, however old they are; the rest are kept as they are.
+    // Readers holding the old segments keep them alive until they are done.
+    // The segment rows keep their verdicts; only the late readings are classified.
+    auto late = reorderBuffer_.cbegin();
+    auto mergeLate = [&](const HistorySegment* segment, std::vector<SensorData>::const_iterator lateEnd) {
+        const size_t size = segment ? segment->size() : 0;
+        std::vector<QueryResult> merged;
+        merged.reserve(size + static_cast<size_t>(lateEnd - late));
+        size_t i = 0;
+        auto takeSegmentRow = [&]() {
+            merged.emplace_back(segment->data()[i], segment->anomalous()[i] != 0, segment->deviations()[i]);
+            ++i;
+        };
+        for (; late != lateEnd; ++late) {
+            while (i < size && !earlierReading(*late, segment->data()[i])) {
+                takeSegmentRow(); // Ties keep the segment row first
+            }
+            merged.push_back(convertToQueryResult(*late, anomalyDetector_));
+        }
+        while (i < size) {
+            takeSegmentRow();
+        }
+        return merged;
+    };
+    std::vector<std::shared_ptr<const HistorySegment>> segments;
+    segments.reserve(sealedSegments_.size());
+    for (auto& segment : sealedSegments_) {
+        auto lateEnd = std::upper_bound(late, reorderBuffer_.cend(), segment->maxTimestamp(),
+                                        [](int64_t timestamp, const SensorData& data) { return timestamp < data.timestamp_ms; });
+        if (lateEnd == late) {
+            segments.push_back(std::move(segment));
+            continue;
+        }
+        // Split into segments of at most segmentCapacity_, evenly so each has room for the next
+        // late readings, or a segment they keep falling into would grow and be copied whole on
+        // every merge
+        std::vector<QueryResult> merged = mergeLate(segment.get(), lateEnd);
+        const size_t pieces = (merged.size() + segmentCapacity_ - 1) / segmentCapacity_;
+        for (size_t p = 0, first = 0; p < pieces; ++p) {
+            const size_t end = merged.size() * (p + 1) / pieces;
+            auto rebuilt = std::make_shared<HistorySegment>(end - first, segment->partitionStart(), anomalyDetector_);
+            for (; first < end; ++first) {
+                rebuilt->append(merged[first], merged[first].isAnomalousFlag, merged[first].deviationValue);
+            }
+            segments.push_back(sealedForIndexes(rebuilt));
+        }
+    }
+    sealedSegments_.swap(segments);
+    if (late != reorderBuffer_.cend()) {
+        // The rest are older than the newest row of the head, which is rebuilt through appendToHead
+        std::vector<QueryResult> merged = mergeLate(headSegment_.get(), reorderBuffer_.cend());
+        headSegment_.reset();
+        for (const auto& sd : merged) {
+            appendToHead(sd);
+        }
+    }
+    reorderBuffer_.clear();
+}
+
+void DataManager::setReorderBufferCapacity(size_t capacity) {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    reorderBufferCapacity_ = capacity > 0 ? capacity : 1;
+    if (reorderBuffer_.size() >= reorderBufferCapacity_) {
+        mergeReorderBuffer();
+    }
+}
+
+size_t DataManager::getReorderBufferSize() const {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    return reorderBuffer_.size();
+}
+
+void DataManager::sealHead() {
+    if (!headSegment_) {
+        return;
+    }
+    if (headSegment_->size() > 0) {
+        std::shared_ptr<HistorySegment> sealed = headSegment_;
+        if (headSegment_->size() < headSegment_->capacity() / 2) {
+            // The partition ended early; keep only the rows in use. Readers still holding the
+            // old head keep it alive until they are done.
+            sealed = HistorySegment::fromRows(headSegment_->data(), headSegment_->size(), headSegment_->partitionStart(),
+                                              anomalyDetector_, headSegment_->anomalous(), headSegment_->deviations());
+        }
+        sealedSegments_.push_back(sealedForIndexes(sealed));
+    }
+    headSegment_.reset();
+}
+
+void DataManager::clearResident() {
+    sealedSegments_.clear();
+    headSegment_.reset();
+    reorderBuffer_.clear();
+    baseFiles_.clear();
+    baseBlocks_.clear();
+    baseSummaryPending_ = false;
+    residentCount_ = 0;
+    oldestResidentTimestamp_ = std::numeric_limits<int64_t>::max();
+}
+
+void DataManager::setSegmentLayout(size_t capacity, int64_t partitionMs) {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    segmentCapacity_ = capacity > 0 ? capacity : 1;
+    segmentPartitionMs_ = partitionMs > 0 ? partitionMs : 1;
+    headCapacity_ = std::min(kInitialSegmentCapacity, segmentCapacity_);
+}
+
+size_t DataManager::getSegmentCount() const {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    return sealedSegments_.size() + (headSegment_ ? 1 : 0);
+}
+
+DataManager::Snapshot DataManager::snapshot(const QueryParams& params) const {
+    Snapshot snap;
+    snap.detector = anomalyDetector_;
+    snap.indexed = indexesEnabled_;
+    if (!baseBlocks_.empty()) {
+        // File order is not guaranteed to be sorted, so base blocks cannot be trimmed to the
+        // range; blocks whose zone maps rule out every row are left out
+        ZoneFilter zoneFilter;
+        zoneFilter.timeRange = params.timeRangeFilterMs;
+        const std::optional<ValueRange>* ranges[3] = {&params.temperatureRange, &params.humidityRange,
+                                                      &params.lightRange};
+        for (int m = 0; m < 3; ++m) {
+            if (*ranges[m]) {
+                zoneFilter.valueRange[m] = std::make_pair((*ranges[m])->min, (*ranges[m])->max);
+            }
+        }
+        if (params.filterAnomalousOnly == true) {
+            zoneFilter.anomalousOnly = &snap.detector;
+        }
+        snap.baseFiles = baseFiles_;
+        for (const auto& block : baseBlocks_) {
+            if (block.zoned && !zoneFilter.mayMatch(block.zone)) {
+                continue;
+            }
+            snap.spans.push_back(block.rows);
+            snap.spanSegments.push_back(nullptr);
+            snap.verdicts.emplace_back();
+            snap.residentCount += block.rows.size;
+        }
+    }
+    auto take = [&](const std::shared_ptr<const HistorySegment>& segment) {
+        if (segment->size() == 0) {
+            return;
+        }
+        if (params.timeRangeFilterMs &&
+            !segment->overlaps(params.timeRangeFilterMs->first, params.timeRangeFilterMs->second)) {
+            return; // Segment lies entirely outside the requested time range
+        }
+        SensorDataSpan span = trimToTimeRange(segment->span(), params.timeRangeFilterMs);
+        if (span.size == 0) {
+            return;
+        }
+        RowVerdicts verdicts;
+        if (segment->classifiedWith().sharesThresholdsWith(snap.detector)) {
+            verdicts = RowVerdicts{segment->anomalous(), segment->deviations()}.from(span.data - segment->data());
+        }
+        snap.segments.push_back(segment);
+        snap.spans.push_back(span);
+        snap.spanSegments.push_back(segment.get());
+        snap.verdicts.push_back(verdicts);
+        snap.residentCount += span.size;
+    };
+    for (const auto& segment : sealedSegments_) {
+        take(segment);
+    }
+    if (headSegment_) {
+        take(headSegment_);
+    }
+    // The reorder buffer is small and changes in place, so it is copied
+    SensorDataSpan late = trimToTimeRange({reorderBuffer_.data(), reorderBuffer_.size()}, params.timeRangeFilterMs);
+    if (late.size > 0) {
+        snap.lateRows = std::make_shared<const std::vector<SensorData>>(late.begin(), late.end());
+        snap.spans.push_back({snap.lateRows->data(), snap.lateRows->size()});
+        snap.spanSegments.push_back(nullptr);
+        snap.verdicts.emplace_back();
+        snap.residentCount += late.size;
+    }
+
+    snap.coldStorage = tierStorage_;
+    if (tierStorage_) {
+        for (const auto& file : coldFiles_) {
+            if (params.timeRangeFilterMs && (file.maxTimestamp_ms < params.timeRangeFilterMs->first ||
+                                             file.minTimestamp_ms > params.timeRangeFilterMs->second)) {
+                continue;
+            }
+            snap.coldFiles.push_back(file);
+        }
+    }
+    return snap;
+}
+
+void DataManager::setRetentionPolicy(const RetentionPolicy& policy, DataStorage& tierStorage) {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    retentionPolicy_ = policy;
+    tierStorage_ = &tierStorage;
+    enforceRetention();
+}
+
+void DataManager::enforceRetention() {
+    if (!retentionPolicy_ || !tierStorage_ || residentCount_ == 0) {
+        return;
+    }
+    const RetentionPolicy& policy = *retentionPolicy_;
+    // Eviction works on the segments, so mapped base rows are brought in first
+    materializeBase();
+
+    // Size limits evict down to 90% of the limit so eviction is amortized over many appends
+    size_t resident = residentCount_;
+    size_t keep = resident;
+    if (policy.maxCount && resident > *policy.maxCount) {
+        keep = std::min(keep, *policy.maxCount * 9 / 10);
+    }
+    if (policy.maxBytes && resident * sizeof(SensorData) > *policy.maxBytes) {
+        keep = std::min(keep, *policy.maxBytes / sizeof(SensorData) * 9 / 10);
+    }
+
+    const bool overAge = policy.maxAgeMs && oldestResidentTimestamp_ < newestTimestamp_ - *policy.maxAgeMs;
+    if (keep == resident && !overAge) {
+        return;
+    }
+    // With the late readings merged in, every resident reading is in the segments, in order
+    mergeReorderBuffer();
+
+    // Everything with timestamp <= cutoff gets evicted
+    int64_t cutoff = std::numeric_limits<int64_t>::min();
+    if (keep < resident) {
+        // The cutoff is the timestamp of the reading at that position in timestamp order
+        size_t position = resident - keep - 1;
+        std::vector<std::shared_ptr<const HistorySegment>> segments = sealedSegments_;
+        if (headSegment_) {
+            segments.push_back(headSegment_);
+        }
+        for (const auto& segment : segments) {
+            if (position < segment->size()) {
+                cutoff = segment->data()[position].timestamp_ms;
+                break;
+            }
+            position -= segment->size();
+        }
+    }
+    if (overAge) {
+        cutoff = std::max(cutoff, newestTimestamp_ - *policy.maxAgeMs - 1);
+    }
+    if (cutoff == std::numeric_limits<int64_t>::min()) {
+        return;
+    }
+
+    // Segments entirely at or below the cutoff are dropped whole and segments entirely above it
+    // are kept as they are; only segments straddling the cutoff are rebuilt from their kept rows,
+    // the sorted rows after the evicted ones, which keep their verdicts. Nothing is published
+    // until the evicted rows are safely on disk.
+    std::vector<SensorData> evicted;
+    std::vector<std::shared_ptr<const HistorySegment>> keptSegments;
+    for (const auto& segment : sealedSegments_) {
+        if (segment->minTimestamp() > cutoff) {
+            keptSegments.push_back(segment);
+            continue;
+        }
+        const SensorDataSpan rows = segment->span();
+        const size_t split = rowsUpTo(rows, cutoff);
+        evicted.insert(evicted.end(), rows.data, rows.data + split);
+        if (split < rows.size) {
+            keptSegments.push_back(sealedForIndexes(
+                HistorySegment::fromRows(rows.data + split, rows.size - split, segment->partitionStart(), anomalyDetector_,
+                                         segment->anomalous() + split, segment->deviations() + split)));
+        }
+    }
+    std::shared_ptr<HistorySegment> keptHead = headSegment_;
+    if (headSegment_ && headSegment_->minTimestamp() <= cutoff) {
+        const SensorDataSpan rows = headSegment_->span();
+        const size_t split = rowsUpTo(rows, cutoff);
+        evicted.insert(evicted.end(), rows.data, rows.data + split);
+        keptHead.reset();
+        if (split < rows.size) {
+            keptHead = std::make_shared<HistorySegment>(headSegment_->capacity(), headSegment_->partitionStart(), anomalyDetector_);
+            for (size_t i = split; i < rows.size; ++i) {
+                keptHead->append(rows.data[i], headSegment_->anomalous()[i] != 0, headSegment_->deviations()[i]);
+            }
+        }
+    }
+    if (evicted.empty()) {
+        return; // Already in timestamp order
+    }
+
+    DataStorage::ColdFile info{};
+    info.id = coldFiles_.empty() ? 0 : coldFiles_.back().id + 1;
+    info.minTimestamp_ms = evicted.front().timestamp_ms;
+    info.maxTimestamp_ms = evicted.back().timestamp_ms;
+    info.count = evicted.size();
+    std::vector<DataStorage::ColdFile> catalog = coldFiles_;
+    catalog.push_back(info);
+    if (!tierStorage_->writeColdFile(info.id, evicted) || !tierStorage_->replaceColdCatalog(catalog)) {
+        std::cerr << "DataManager: Failed to evict " << evicted.size() << " readings to disk; keeping them in memory." << std::endl;
+        return; // Nothing was dropped yet, so history stays intact
+    }
+    coldFiles_.swap(catalog);
+    coldWatermark_ = std::max(coldWatermark_, info.maxTimestamp_ms);
+
+    sealedSegments_.swap(keptSegments);
+    headSegment_ = keptHead;
+    residentCount_ -= evicted.size();
+    oldestResidentTimestamp_ = std::numeric_limits<int64_t>::max();
+    for (const auto& segment : sealedSegments_) {
+        oldestResidentTimestamp_ = std::min(oldestResidentTimestamp_, segment->minTimestamp());
+    }
+    if (headSegment_) {
+        oldestResidentTimestamp_ = std::min(oldestResidentTimestamp_, headSegment_->minTimestamp());
+    }
+}
+
+bool DataManager::appendToNewestColdFile(const std::vector<SensorData>& data) {
+    if (coldFiles_.empty() || !tierStorage_ || data.empty()) {
+        return false;
+    }
+    std::vector<DataStorage::ColdFile> catalog = coldFiles_;
+    DataStorage::ColdFile& newest = catalog.back();
+    for (const auto& sd : data) {
+        newest.minTimestamp_ms = std::min(newest.minTimestamp_ms, sd.timestamp_ms);
+        newest.maxTimestamp_ms = std::max(newest.maxTimestamp_ms, sd.timestamp_ms);
+    }
+    newest.count += data.size();
+    if (!tierStorage_->appendToColdFile(newest.id, data) || !tierStorage_->replaceColdCatalog(catalog)) {
+        return false;
+    }
+    coldFiles_.swap(catalog);
+    return true;
+}
+
+std::vector<SensorData> DataManager::loadColdRows(const Snapshot& snap, const QueryParams& params) {
+    std::vector<SensorData> rows;
+    for (const auto& file : snap.coldFiles) {
+        std::vector<SensorData> fileRows = snap.coldStorage->loadColdFile(file.id);
+        // Late readings appended after the snapshot was taken are not part of it
+        size_t count = std::min<size_t>(fileRows.size(), file.count);
+        for (size_t i = 0; i < count; ++i) {
+            if (inTimeRange(fileRows[i].timestamp_ms, params)) {
+                rows.push_back(fileRows[i]);
+            }
+        }
+    }
+    // Cold files are written sorted, but late readings appended to them afterwards are not
+    if (!std::is_sorted(rows.begin(), rows.end(), earlierReading)) {
+        std::stable_sort(rows.begin(), rows.end(), earlierReading);
+    }
+    return rows;
+}
+
+QueryResult DataManager::convertToQueryResult(const SensorData& sd, const AnomalyDetector& detector) {
+    // calculate_deviation_metric with the thresholds profile of the reading's sensor
+    double deviation = 0.0;
+    bool isAnomalous = detector.classify(sd, deviation);
+    return QueryResult(sd, isAnomalous, deviation);
+}
+
+bool DataManager::inTimeRange(int64_t timestamp_ms, const QueryParams& params) {
+    return !params.timeRangeFilterMs ||
+           (timestamp_ms >= params.timeRangeFilterMs->first && timestamp_ms <= params.timeRangeFilterMs->second);
+}
+
+bool DataManager::matchesFilters(const QueryResult& result, const QueryParams& params) {
+    if (!inTimeRange(result.timestamp_ms, params)) {
+        return false;
+    }
+    if (params.filterAnomalousOnly.has_value() && params.filterAnomalousOnly.value() != result.isAnomalousFlag) {
+        return false;
+    }
+    if (params.temperatureRange && !params.temperatureRange->contains(result.temperature)) {
+        return false;
+    }
+    if (params.humidityRange && !params.humidityRange->contains(result.humidity)) {
+        return false;
+    }
+    if (params.lightRange && !params.lightRange->contains(result.lightIntensity)) {
+        return false;
+    }
+    if (params.deviationRange && !params.deviationRange->contains(result.deviationValue)) {
+        return false;
+    }
+    return true;
+}
+
+bool DataManager::rowMatches(const QueryResult& result, const QueryParams& params, const AnomalyDetector& detector) {
+    if (!matchesFilters(result, params)) {
+        return false;
+    }
+    const uint8_t anomalous = result.isAnomalousFlag; // Classified with detector already
+    return !params.filter || params.filter->matches(result, {detector, &anomalous, &result.deviationValue});
+}
+
+template <typename Fn>
+void DataManager::scanRows(SensorDataSpan rows, RowVerdicts verdicts, const QueryParams& params,
+                           const AnomalyDetector& detector, Fn&& fn) {
+    std::vector<uint64_t> selection;
+    if (params.filter) {
+        params.filter->evaluate(rows.data, rows.size, {detector, verdicts.anomalous, verdicts.deviations}, selection);
+    }
+
+    // Anomaly flags and deviations are the stored verdicts or come from the batch kernel, one
+    // block at a time
+    const size_t kBlockRows = FilterExpression::kBlockRows;
+    uint64_t anomalyBits[kBlockRows / 64];
+    double deviations[kBlockRows];
+    for (size_t start = 0; start < rows.size; start += kBlockRows) {
+        const size_t count = std::min(kBlockRows, rows.size - start);
+        if (!verdicts.anomalous) {
+            detector.classifyBatch(rows.data + start, count, anomalyBits, deviations);
+        }
+        for (size_t w = 0; w < (count + 63) / 64; ++w) {
+            uint64_t word = params.filter ? selection[start / 64 + w] : ~uint64_t{0};
+            const size_t first = w * 64;
+            for (size_t bit = 0; word != 0 && first + bit < count; ++bit, word >>= 1) { // Empty words are skipped outright
+                if (word & 1) {
+                    const size_t i = first + bit;
+                    const SensorData& sd = rows.data[start + i];
+                    QueryResult item = verdicts.anomalous
+                                           ? QueryResult(sd, verdicts.anomalous[start + i] != 0, verdicts.deviations[start + i])
+                                           : QueryResult(sd, (anomalyBits[w] >> bit) & 1, deviations[i]);
+                    if (matchesFilters(item, params)) {
+                        fn(sd, item);
+                    }
+                }
+            }
+        }
+    }
+}
+
+std::shared_ptr<const HistorySegment> DataManager::sealedForIndexes(const std::shared_ptr<HistorySegment>& segment) const {
+    if (!indexesEnabled_) {
+        return segment;
+    }
+    // Sorted once here; a sealed segment never changes, so its orders stay valid
+    return HistorySegment::withOrders(*segment, true);
+}
+
+void DataManager::rebuildIndexes() {
+    if (indexesEnabled_) {
+        materializeBase(); // Mapped base blocks have no orders
+    }
+    for (auto& segment : sealedSegments_) {
+        if (segment->ordered() != indexesEnabled_) {
+            // Readers holding the old segment keep it alive; the rows and verdicts are shared
+            segment = HistorySegment::withOrders(*segment, indexesEnabled_);
+        }
+    }
+}
+
+void DataManager::setValueIndexesEnabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    if (indexesEnabled_ == enabled) {
+        return;
+    }
+    indexesEnabled_ = enabled;
+    rebuildIndexes(); // Sorts the existing history when enabling, frees the orders when disabling
+}
+
+void DataManager::setThresholdProfiles(const ThresholdProfiles& profiles) {
+    reloadThresholdProfiles(profiles);
+    waitForReclassification();
+}
+
+uint64_t DataManager::reloadThresholdProfiles(const ThresholdProfiles& profiles) {
+    return stageDetector([&](const AnomalyDetector& detector) { return detector.withThresholds(profiles); });
+}
+
+void DataManager::setAnomalyRules(const DynamicRulePipeline& rules) {
+    stageDetector([&](const AnomalyDetector& detector) { return detector.withRules(rules); });
+    waitForReclassification();
+}
+
+uint64_t DataManager::stageDetector(const std::function<AnomalyDetector(const AnomalyDetector&)>& change) {
+    uint64_t generation = 0;
+    bool startThread = false;
+    {
+        std::lock_guard<std::mutex> lock(dataMutex_);
+        // Changes made by a reload still pending are kept
+        stagedDetector_ = change(stagedDetector_ ? *stagedDetector_ : anomalyDetector_);
+        generation = ++stagedGeneration_;
+        // A rebuild still running for an older reload notices it was superseded and starts over
+        // with these profiles, so at most one thread ever reclassifies
+        startThread = !reclassifyRunning_;
+        reclassifyRunning_ = true;
+    }
+    if (startThread) {
+        std::lock_guard<std::mutex> lock(reclassifyThreadMutex_);
+        if (reclassifyThread_.joinable()) {
+            reclassifyThread_.join(); // Finished; it cleared reclassifyRunning_ on its way out
+        }
+        reclassifyThread_ = std::thread([this]() { reclassifyHistory(); });
+    }
+    return generation;
+}
+
+void DataManager::waitForReclassification() {
+    std::lock_guard<std::mutex> lock(reclassifyThreadMutex_);
+    if (reclassifyThread_.joinable()) {
+        reclassifyThread_.join();
+    }
+}
+
+uint64_t DataManager::getThresholdGeneration() const {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    return thresholdGeneration_;
+}
+
+bool DataManager::reclassificationPending() const {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    return stagedDetector_.has_value();
+}
+
+void DataManager::publishDetector(const AnomalyDetector& detector) {
+    anomalyDetector_ = detector;
+    // Readers still holding the previous one keep it alive until they are done
+    std::atomic_store_explicit(&publishedDetector_, std::make_shared<const AnomalyDetector>(detector),
+                               std::memory_order_release);
+}
+
+void DataManager::reclassifyHistory() {
+    waitForLoad(); // History being loaded is classified as it arrives, with the current thresholds
+    while (true) {
+        AnomalyDetector detector;
+        uint64_t generation = 0;
+        uint64_t epoch = 0;
+        Snapshot snap;
+        {
+            std::lock_guard<std::mutex> lock(dataMutex_);
+            if (!stagedDetector_) {
+                reclassifyRunning_ = false; // Abandoned
+                break;
+            }
+            detector = *stagedDetector_;
+            generation = stagedGeneration_;
+            summarizeBase(); // The base rows must be in the tiers being replaced, too
+            snap = snapshot(QueryParams{});
+            epoch = historyEpoch_;
+            reclassifying_ = true;
+            rollupJournal_.clear();
+        }
+
+        // Classify the history a block at a time, without the lock. The anomalies the live tiers
+        // counted among the same rows are tallied too, for the buckets kept below, and the
+        // segments get reclassified copies sharing their rows (and their value orders, the
+        // deviation one sorted again), swapped in once published.
+        std::vector<RollupTier> tiers;
+        for (int64_t width : rollupResolutions()) {
+            tiers.emplace_back(width);
+        }
+        std::vector<std::map<int64_t, uint64_t>> previousAnomalies(tiers.size()); // Keyed by bucket start
+        auto tallyPrevious = [&](const SensorData& data) {
+            for (size_t t = 0; t < tiers.size(); ++t) {
+                ++previousAnomalies[t][RollupTier::alignTimestamp(data.timestamp_ms, tiers[t].bucketWidth())];
+            }
+        };
+        const size_t kBlockRows = FilterExpression::kBlockRows;
+        uint64_t anomalyBits[kBlockRows / 64];
+        uint64_t previousBits[kBlockRows / 64];
+        double deviations[kBlockRows];
+        bool superseded = false;
+        // Stateful rules depend on the readings before, so they are replayed over the history in
+        // order, from empty state, rather than judged row by row
+        const bool replayRules = detector.statefulRuleMask() != 0;
+        const AnomalyDetector replay = detector.withFreshRuleState();
+        // previous holds the rows' stored verdicts, if any; the new ones go to out, if given
+        auto classifyRows = [&](const SensorData* rows, size_t count, RowVerdicts previous,
+                                uint8_t* outAnomalous, double* outDeviations) {
+            for (size_t start = 0; start < count && !superseded; start += kBlockRows) {
+                const size_t block = std::min(kBlockRows, count - start);
+                detector.classifyBatch(rows + start, block, anomalyBits, deviations);
+                for (size_t i = 0; replayRules && i < block; ++i) {
+                    double deviation = 0.0;
+                    if (replay.classifyIncoming(rows[start + i], deviation)) {
+                        anomalyBits[i / 64] |= uint64_t{1} << (i % 64);
+                    }
+                }
+                if (!previous.anomalous) {
+                    snap.detector.classifyBatch(rows + start, block, previousBits, nullptr);
+                }
+                for (size_t i = 0; i < block; ++i) {
+                    const bool isAnomalous = (anomalyBits[i / 64] >> (i % 64)) & 1;
+                    for (auto& tier : tiers) {
+                        tier.add(rows[start + i], isAnomalous);
+                    }
+                    if (previous.anomalous ? previous.anomalous[start + i] != 0 : (previousBits[i / 64] >> (i % 64)) & 1) {
+                        tallyPrevious(rows[start + i]);
+                    }
+                    if (outAnomalous) {
+                        outAnomalous[start + i] = isAnomalous ? 1 : 0;
+                        outDeviations[start + i] = deviations[i];
+                    }
+                }
+                superseded = stagedGeneration_ != generation;
+            }
+        };
+        for (const auto& file : snap.coldFiles) {
+            std::vector<SensorData> rows = snap.coldStorage->loadColdFile(file.id);
+            classifyRows(rows.data(), std::min<size_t>(rows.size(), file.count), {}, nullptr, nullptr);
+        }
+        std::map<const HistorySegment*, std::shared_ptr<HistorySegment>> reclassifiedSegments;
+        std::vector<uint8_t> segmentAnomalous;
+        std::vector<double> segmentDeviations;
+        for (size_t s = 0; s < snap.spans.size(); ++s) {
+            const SensorDataSpan& span = snap.spans[s];
+            const HistorySegment* segment = snap.spanSegments[s];
+            if (!segment) {
+                classifyRows(span.data, span.size, snap.verdicts[s], nullptr, nullptr);
+                continue;
+            }
+            // Untrimmed, so the span is the whole segment as of the snapshot
+            segmentAnomalous.resize(span.size);
+            segmentDeviations.resize(span.size);
+            classifyRows(span.data, span.size, snap.verdicts[s], segmentAnomalous.data(), segmentDeviations.data());
+            if (!superseded) {
+                reclassifiedSegments[segment] = HistorySegment::reclassified(*segment, detector, segmentAnomalous.data(),
+                                                                             segmentDeviations.data(), span.size);
+            }
+        }
+
+        std::lock_guard<std::mutex> lock(dataMutex_);
+        reclassifying_ = false;
+        if (superseded || stagedGeneration_ != generation || historyEpoch_ != epoch) {
+            continue; // A newer reload, or history replaced meanwhile: rebuild from scratch
+        }
+
+        // Catch up with the readings added during the rebuild, then switch everything at once
+        for (const auto& data : rollupJournal_) {
+            const bool isAnomalous = reclassifiedArrival(data, anomalyDetector_, detector).isAnomalousFlag;
+            for (auto& tier : tiers) {
+                tier.add(data, isAnomalous);
+            }
+            if (data.isAnomalousFlag) {
+                tallyPrevious(data);
+            }
+        }
+        // Only the ranges with readings at hand are recomputed. Buckets summarizing readings
+        // that are gone (restored from the rollup file, dropped by segment retention or evicted
+        // without cold storage) keep them, with their old verdicts.
+        for (size_t t = 0; t < tiers.size() && t < rollupTiers_.size(); ++t) {
+            for (const auto& bucket : rollupTiers_[t].allBuckets()) {
+                auto previous = previousAnomalies[t].find(bucket.bucketStart_ms);
+                tiers[t].carryOver(bucket, previous == previousAnomalies[t].end() ? 0 : previous->second);
+            }
+        }
+        rollupTiers_ = std::move(tiers);
+        const AnomalyDetector previousDetector = anomalyDetector_;
+        publishDetector(detector);
+        // Segments rebuilt or appended to since the snapshot are (partly) classified here; with
+        // stateful rules, their new rows continue the replay
+        auto reclassified = [&](const HistorySegment& segment) {
+            auto it = reclassifiedSegments.find(&segment);
+            const size_t classified = it == reclassifiedSegments.end() ? 0 : it->second->size();
+            if (classified > 0 && classified == segment.size()) {
+                return it->second;
+            }
+            if (!replayRules) {
+                return classified == 0 ? HistorySegment::reclassified(segment, detector, nullptr, nullptr, 0)
+                                       : HistorySegment::reclassified(segment, detector, it->second->anomalous(),
+                                                                      it->second->deviations(), classified);
+            }
+            segmentAnomalous.resize(segment.size());
+            segmentDeviations.resize(segment.size());
+            for (size_t i = 0; i < segment.size(); ++i) {
+                if (i < classified) {
+                    segmentAnomalous[i] = it->second->anomalous()[i];
+                    segmentDeviations[i] = it->second->deviations()[i];
+                } else {
+                    segmentAnomalous[i] = replay.classifyIncoming(segment.data()[i], segmentDeviations[i]) ? 1 : 0;
+                }
+            }
+            return HistorySegment::reclassified(segment, detector, segmentAnomalous.data(), segmentDeviations.data(),
+                                                segment.size());
+        };
+        for (auto& segment : sealedSegments_) {
+            segment = reclassified(*segment);
+        }
+        if (headSegment_) {
+            headSegment_ = reclassified(*headSegment_);
+        }
+        for (auto& pending : pendingReadings_) {
+            pending = reclassifiedArrival(pending, previousDetector, detector);
+        }
+        std::vector<QueryResult>().swap(rollupJournal_);
+        stagedDetector_.reset();
+        thresholdGeneration_ = generation;
+        // Cached results carry the old classification
+        ++historyEpoch_;
+        recentAppends_.clear();
+        queryCache_.clear();
+        reclassifyRunning_ = false;
+        break;
+    }
+}
+
+ThresholdProfiles DataManager::getThresholdProfiles() const {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    return stagedDetector_ ? stagedDetector_->profiles() : anomalyDetector_.profiles();
+}
+
+bool DataManager::valueIndexesEnabled() const {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    return indexesEnabled_;
+}
+
+int DataManager::indexForSort(SortCriteria sortBy, bool& descending) {
+    descending = false;
+    switch (sortBy) {
+        case SortCriteria::TEMP_ASC:       return TEMPERATURE_INDEX;
+        case SortCriteria::TEMP_DESC:      descending = true; return TEMPERATURE_INDEX;
+        case SortCriteria::HUMIDITY_ASC:   return HUMIDITY_INDEX;
+        case SortCriteria::HUMIDITY_DESC:  descending = true; return HUMIDITY_INDEX;
+        case SortCriteria::LIGHT_ASC:      return LIGHT_INDEX;
+        case SortCriteria::LIGHT_DESC:     descending = true; return LIGHT_INDEX;
+        case SortCriteria::DEVIATION_ASC:  return DEVIATION_INDEX;
+        case SortCriteria::DEVIATION_DESC: descending = true; return DEVIATION_INDEX;
+        default:                           return -1;
+    }
+}
+
+int DataManager::rangeIndexFor(const QueryParams& params) {
+    if (params.temperatureRange) return TEMPERATURE_INDEX;
+    if (params.humidityRange) return HUMIDITY_INDEX;
+    if (params.lightRange) return LIGHT_INDEX;
+    if (params.deviationRange) return DEVIATION_INDEX;
+    return -1;
+}
+
+int DataManager::indexFor(const Snapshot& snap, const QueryParams& params, bool& descending, bool& ordered) {
+    descending = false;
+    ordered = false;
+    if (!snap.indexed || !snap.coldFiles.empty()) {
+        return -1; // Indexes only cover resident readings
+    }
+    // An index whose order matches the sort criteria makes the sort step unnecessary;
+    // otherwise a range filter can still narrow the candidates before sorting
+    int sortIndex = indexForSort(params.sortBy, descending);
+    if (sortIndex >= 0) {
+        ordered = true;
+        return sortIndex;
+    }
+    descending = false;
+    return rangeIndexFor(params);
+}
+
+template <typename Fn>
+void DataManager::walkIndex(const Snapshot& snap, int indexId, bool ordered, bool descending, const QueryParams& params,
+                            Fn&& fn) {
+    const std::optional<ValueRange>* ranges[INDEX_COUNT] = {
+        &params.temperatureRange, &params.humidityRange, &params.lightRange, &params.deviationRange
+    };
+    const std::optional<ValueRange>& range = *ranges[indexId];
+    if (range && range->min > range->max) {
+        return; // Empty range, nothing to walk
+    }
+    const auto column = static_cast<HistorySegment::Column>(indexId);
+    const auto keyLess = &HistorySegment::keyLess;
+
+    // Each span becomes a run of positions in ascending key order, all within the range. Of a
+    // sealed segment, positions outside the window of rows the snapshot sees are skipped.
+    struct Run {
+        const SensorData* rows;
+        RowVerdicts verdicts;
+        const uint32_t* first;
+        const uint32_t* last;
+        size_t windowBegin;
+        size_t windowEnd;
+    };
+    auto key = [column](const Run& run, uint32_t position) {
+        switch (column) {
+            case HistorySegment::TEMPERATURE_COLUMN: return run.rows[position].temperature;
+            case HistorySegment::HUMIDITY_COLUMN:    return run.rows[position].humidity;
+            case HistorySegment::LIGHT_COLUMN:       return run.rows[position].lightIntensity;
+            default:                                 return run.verdicts.deviations[position];
+        }
+    };
+    std::vector<Run> runs;
+    // Rows without a sorted order (the head, late rows) are sorted here, and classified if need be
+    std::deque<std::vector<uint32_t>> localOrders;
+    std::deque<std::vector<uint8_t>> localAnomalous;
+    std::deque<std::vector<double>> localDeviations;
+    for (size_t s = 0; s < snap.spans.size(); ++s) {
+        const SensorDataSpan& span = snap.spans[s];
+        const HistorySegment* segment = snap.spanSegments[s];
+        if (segment && segment->ordered() && snap.verdicts[s].anomalous) {
+            Run run{segment->data(), {segment->anomalous(), segment->deviations()}, segment->order(column), nullptr,
+                    static_cast<size_t>(span.data - segment->data()), 0};
+            run.windowEnd = run.windowBegin + span.size;
+            run.last = run.first + segment->size();
+            if (range) {
+                run.first = std::lower_bound(run.first, run.last, range->min, [&](uint32_t position, double value) {
+                    return keyLess(key(run, position), value);
+                });
+                run.last = std::upper_bound(run.first, run.last, range->max, [&](double value, uint32_t position) {
+                    return keyLess(value, key(run, position));
+                });
+            }
+            runs.push_back(run);
+            continue;
+        }
+        Run run{span.data, snap.verdicts[s], nullptr, nullptr, 0, span.size};
+        if (!run.verdicts.anomalous) {
+            localAnomalous.emplace_back(span.size);
+            localDeviations.emplace_back(span.size);
+            for (size_t i = 0; i < span.size; ++i) {
+                localAnomalous.back()[i] = snap.detector.classify(span.data[i], localDeviations.back()[i]) ? 1 : 0;
+            }
+            run.verdicts = {localAnomalous.back().data(), localDeviations.back().data()};
+        }
+        std::vector<uint32_t>& order = localOrders.emplace_back();
+        for (uint32_t i = 0; i < span.size; ++i) {
+            const double value = key(run, i);
+            if (!range || (!keyLess(value, range->min) && !keyLess(range->max, value))) {
+                order.push_back(i);
+            }
+        }
+        std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+            return keyLess(key(run, a), key(run, b));
+        });
+        run.first = order.data();
+        run.last = order.data() + order.size();
+        runs.push_back(run);
+    }
+
+    auto emit = [&](const Run& run, uint32_t position) {
+        const SensorData& sd = run.rows[position];
+        return fn(sd, QueryResult(sd, run.verdicts.anomalous[position] != 0, run.verdicts.deviations[position]));
+    };
+    if (!ordered) {
+        for (const Run& run : runs) {
+            for (const uint32_t* it = run.first; it != run.last; ++it) {
+                if (*it >= run.windowBegin && *it < run.windowEnd && !emit(run, *it)) {
+                    return;
+                }
+            }
+        }
+        return;
+    }
+
+    // k-way merge of the runs on a heap; equal keys come out in span order, which is timestamp
+    // order, or the reverse when descending
+    std::vector<size_t> taken(runs.size(), 0);
+    auto current = [&](size_t r) {
+        const Run& run = runs[r];
+        return descending ? run.last[-1 - static_cast<ptrdiff_t>(taken[r])] : run.first[taken[r]];
+    };
+    // Skips positions outside the run's window; false once the run is used up
+    auto settle = [&](size_t r) {
+        const Run& run = runs[r];
+        for (const size_t count = run.last - run.first; taken[r] < count; ++taken[r]) {
+            const uint32_t position = current(r);
+            if (position >= run.windowBegin && position < run.windowEnd) {
+                return true;
+            }
+        }
+        return false;
+    };
+    auto after = [&](size_t a, size_t b) { // Whether b comes out before a
+        const double ka = key(runs[a], current(a));
+        const double kb = key(runs[b], current(b));
+        if (descending) {
+            return keyLess(ka, kb) || (!keyLess(kb, ka) && a < b);
+        }
+        return keyLess(kb, ka) || (!keyLess(ka, kb) && b < a);
+    };
+    std::vector<size_t> heap;
+    for (size_t r = 0; r < runs.size(); ++r) {
+        if (settle(r)) {
+            heap.push_back(r);
+        }
+    }
+    std::make_heap(heap.begin(), heap.end(), after);
+    while (!heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), after);
+        const size_t r = heap.back();
+        if (!emit(runs[r], current(r))) {
+            return;
+        }
+        ++taken[r];
+        if (settle(r)) {
+            std::push_heap(heap.begin(), heap.end(), after);
+        } else {
+            heap.pop_back();
+        }
+    }
 }
 
-void DataManager::addSensorData(const SensorData& data) {
-    std::lock_guard<std::mutex> lock(dataMutex_); // RAII style lock
-    historicalData_.push_back(data);
-    // For debugging:
-    // std::cout << "DataManager: Added data - Timestamp: " << data.timestamp_ms << std::endl;
+bool DataManager::queryFromIndexes(const Snapshot& snap, const QueryParams& params, std::vector<QueryResult>& results) {
+    bool descending = false;
+    bool ordered = false;
+    const int indexId = indexFor(snap, params, descending, ordered);
+    if (indexId < 0) {
+        return false; // Nothing an index can help with
+    }
+    walkIndex(snap, indexId, ordered, descending, params, [&](const SensorData&, const QueryResult& item) {
+        if (rowMatches(item, params, snap.detector)) {
+            results.push_back(item);
+        }
+        return true;
+    });
+    if (!ordered) {
+        sortResults(results, params.sortBy);
+    }
+    return true;
 }
 
-QueryResult DataManager::convertToQueryResult(const SensorData& sd) const {
-    // AnomalyDetector::isAnomalous is const, so it can be called here.
-    bool isAnomalous = anomalyDetector_.isAnomalous(sd);
-    // calculate_deviation_metric is a free function in QueryCommon.hpp
-    double deviation = calculate_deviation_metric(sd, thresholds_);
-    return QueryResult(sd, isAnomalous, deviation);
+size_t DataManager::visitQuery(const QueryParams& params, const QueryVisitor& visitor) const {
+    Snapshot snap;
+    {
+        std::lock_guard<std::mutex> lock(dataMutex_);
+        snap = snapshot(params);
+    }
+    size_t visited = 0;
+
+    // Only references to the matching rows are gathered and ordered, never copies. Their flags
+    // are kept, for those set by stateful rules when the rows arrived.
+    std::vector<RowMatch> matches;
+    auto emitMatches = [&]() {
+        orderRows(matches, params.sortBy, snap.detector);
+        for (const RowMatch& match : matches) { // Already filtered
+            ++visited;
+            if (!visitor(QueryResult(*match.row, match.anomalous, snap.detector.deviation(*match.row)))) {
+                break;
+            }
+        }
+        return visited;
+    };
+
+    // Index walks and scans read the snapshot without the lock; the segments it holds never
+    // move or change
+    bool descending = false;
+    bool ordered = false;
+    const int indexId = indexFor(snap, params, descending, ordered);
+    if (indexId >= 0) {
+        if (ordered) { // Rows come out of a matching index already in order
+            walkIndex(snap, indexId, true, descending, params, [&](const SensorData&, const QueryResult& item) {
+                if (!rowMatches(item, params, snap.detector)) {
+                    return true;
+                }
+                ++visited;
+                return visitor(item);
+            });
+            return visited;
+        }
+        walkIndex(snap, indexId, false, false, params, [&](const SensorData& sd, const QueryResult& item) {
+            if (rowMatches(item, params, snap.detector)) {
+                matches.push_back({&sd, item.isAnomalousFlag});
+            }
+            return true;
+        });
+        return emitMatches();
+    }
+
+    std::vector<SensorData> coldRows = loadColdRows(snap, params);
+    auto collectSpan = [&](SensorDataSpan rows, RowVerdicts verdicts) {
+        scanRows(rows, verdicts, params, snap.detector, [&](const SensorData& sd, const QueryResult& item) {
+            matches.push_back({&sd, item.isAnomalousFlag});
+        });
+    };
+    collectSpan({coldRows.data(), coldRows.size()}, {}); // Evicted readings are older, so they come first
+    for (size_t i = 0; i < snap.spans.size(); ++i) {
+        collectSpan(snap.spans[i], snap.verdicts[i]);
+    }
+    return emitMatches();
+}
+
+size_t DataManager::visitAllData(const SpanVisitor& visitor) const {
+    Snapshot snap;
+    {
+        std::lock_guard<std::mutex> lock(dataMutex_);
+        snap = snapshot(QueryParams{});
+    }
+    size_t visited = 0;
+    for (const auto& span : snap.spans) {
+        visited += span.size;
+        if (!visitor(span.data, span.size)) {
+            return visited;
+        }
+    }
+    for (const auto& file : snap.coldFiles) {
+        // Only one cold file is held in memory at a time
+        std::vector<SensorData> rows = snap.coldStorage->loadColdFile(file.id);
+        size_t count = std::min<size_t>(rows.size(), file.count);
+        if (count == 0) {
+            continue;
+        }
+        visited += count;
+        if (!visitor(rows.data(), count)) {
+            break;
+        }
+    }
+    return visited;
+}
+
+void DataManager::orderRows(std::vector<RowMatch>& rows, SortCriteria sortBy, const AnomalyDetector& detector) {
+    switch (sortBy) {
+        case SortCriteria::TIMESTAMP_ASC:
+        case SortCriteria::TIMESTAMP_DESC: {
+            // Scans yield rows in storage order, which is timestamp order apart from the late rows
+            auto earlier = [](const RowMatch& a, const RowMatch& b) { return a.row->timestamp_ms < b.row->timestamp_ms; };
+            bool descending = (sortBy == SortCriteria::TIMESTAMP_DESC);
+            if (!mergeTimestampRuns(rows.begin(), rows.end(), earlier, descending)) {
+                std::stable_sort(rows.begin(), rows.end(), earlier);
+                if (descending) {
+                    std::reverse(rows.begin(), rows.end());
+                }
+            }
+            return;
+        }
+        case SortCriteria::DEVIATION_ASC:
+        case SortCriteria::DEVIATION_DESC: {
+            // Deviation is derived, so compute each key once instead of inside the comparator
+            std::vector<std::pair<double, RowMatch>> keyed;
+            keyed.reserve(rows.size());
+            for (const RowMatch& match : rows) {
+                keyed.emplace_back(detector.deviation(*match.row), match);
+            }
+            bool ascending = (sortBy == SortCriteria::DEVIATION_ASC);
+            std::sort(keyed.begin(), keyed.end(), [ascending](const auto& a, const auto& b) {
+                return ascending ? a.first < b.first : a.first > b.first;
+            });
+            for (size_t i = 0; i < keyed.size(); ++i) {
+                rows[i] = keyed[i].second;
+            }
+            return;
+        }
+        default: {
+            double SensorData::*field = &SensorData::temperature;
+            bool ascending = true;
+            switch (sortBy) {
+                case SortCriteria::TEMP_DESC:     ascending = false; break;
+                case SortCriteria::HUMIDITY_ASC:  field = &SensorData::humidity; break;
+                case SortCriteria::HUMIDITY_DESC: field = &SensorData::humidity; ascending = false; break;
+                case SortCriteria::LIGHT_ASC:     field = &SensorData::lightIntensity; break;
+                case SortCriteria::LIGHT_DESC:    field = &SensorData::lightIntensity; ascending = false; break;
+                default: break;
+            }
+            std::sort(rows.begin(), rows.end(), [field, ascending](const RowMatch& a, const RowMatch& b) {
+                return ascending ? a.row->*field < b.row->*field : a.row->*field > b.row->*field;
+            });
+            return;
+        }
+    }
 }
 
 std::vector<QueryResult> DataManager::queryData(const QueryParams& params) {
-    std::lock_guard<std::mutex> lock(dataMutex_); // Ensure thread-safe read access
+    return *querySharedData(params);
+}
+
+std::shared_ptr<const std::vector<QueryResult>> DataManager::querySharedData(const QueryParams& params) {
+    std::string cacheKey;
+    std::optional<QueryCache::Entry> cached;
+    if (queryCache_.enabled()) {
+        cacheKey = cacheKeyFor(params);
+        cached = queryCache_.lookup(cacheKey);
+    }
 
+    Snapshot snap;
+    std::shared_ptr<ThreadPool> pool;
+    std::vector<QueryResult> tail;
     std::vector<QueryResult> processedResults;
-    processedResults.reserve(historicalData_.size());
+    bool useIndexes = false;
+    uint64_t epoch = 0;
+    uint64_t sequence = 0;
+    {
+        std::lock_guard<std::mutex> lock(dataMutex_); // Only held while taking the snapshot
+        epoch = historyEpoch_;
+        sequence = appendSequence_;
+        snap.detector = anomalyDetector_; // The tail path takes no snapshot but filters with it
+
+        // A cached result is reused as-is if nothing changed, or patched with the readings
+        // appended since if they are still in the recent-append window
+        if (cached && cached->epoch == epoch && sequence - cached->sequence <= recentAppends_.size()) {
+            size_t missing = static_cast<size_t>(sequence - cached->sequence);
+            if (missing == 0) {
+                queryCache_.recordHit(false);
+                return cached->results;
+            }
+            tail.assign(recentAppends_.end() - missing, recentAppends_.end());
+        } else {
+            snap = snapshot(params);
 
-    // Step 1: Convert SensorData to QueryResult and apply filters
-    for (const auto& sensor_data_point : historicalData_) {
-        QueryResult query_result_item = convertToQueryResult(sensor_data_point);
+            // Indexes only cover resident readings, so they can only answer queries that do not
+            // reach into evicted history; the walk reads the snapshot once the lock is released
+            bool descending = false;
+            bool ordered = false;
+            useIndexes = indexFor(snap, params, descending, ordered) >= 0;
 
-        // Apply filter: filterAnomalousOnly
-        if (params.filterAnomalousOnly.has_value()) {
-            if (params.filterAnomalousOnly.value() != query_result_item.isAnomalousFlag) {
-                continue; // Skip if it doesn't match the anomalous filter
+            size_t candidates = snap.residentCount;
+            for (const auto& file : snap.coldFiles) {
+                candidates += file.count;
+            }
+            if (!useIndexes && candidates >= parallelQueryThreshold_) {
+                if (!queryPool_) {
+                    queryPool_ = std::make_shared<ThreadPool>(queryThreadCount_);
+                }
+                pool = queryPool_;
             }
         }
-        
-        // Apply other filters (e.g., sensorId, timeRange) here if they were added to QueryParams
+    }
 
-        processedResults.push_back(query_result_item);
+    if (!tail.empty()) {
+        std::shared_ptr<const std::vector<QueryResult>> patched = mergeTail(cached->results, tail, params, snap.detector);
+        queryCache_.recordHit(true);
+        queryCache_.store(cacheKey, {epoch, sequence, patched});
+        return patched;
+    }
+    if (!cacheKey.empty()) {
+        queryCache_.recordMiss();
     }
 
-    // Step 2: Sort the filtered results
-    std::sort(processedResults.begin(), processedResults.end(),
-        [&](const QueryResult& a, const QueryResult& b) {
-            switch (params.sortBy) {
-                case SortCriteria::TIMESTAMP_ASC:
-                    return a.timestamp_ms < b.timestamp_ms;
-                case SortCriteria::TIMESTAMP_DESC:
-                    return a.timestamp_ms > b.timestamp_ms;
-                case SortCriteria::TEMP_ASC:
-                    return a.temperature < b.temperature;
-                case SortCriteria::TEMP_DESC:
-                    return a.temperature > b.temperature;
-                case SortCriteria::HUMIDITY_ASC:
-                    return a.humidity < b.humidity;
-                case SortCriteria::HUMIDITY_DESC:
-                    return a.humidity > b.humidity;
-                case SortCriteria::LIGHT_ASC:
-                    return a.lightIntensity < b.lightIntensity;
-                case SortCriteria::LIGHT_DESC:
-                    return a.lightIntensity > b.lightIntensity;
-                case SortCriteria::DEVIATION_ASC:
-                    return a.deviationValue < b.deviationValue;
-                case SortCriteria::DEVIATION_DESC:
-                    return a.deviationValue > b.deviationValue;
-                default: // Default to timestamp ascending
-                    return a.timestamp_ms < b.timestamp_ms;
+    if (useIndexes) {
+        queryFromIndexes(snap, params, processedResults);
+    } else {
+        // Evicted readings in the query's time range are loaded from disk. They are older than
+        // the resident ones, so they go first.
+        std::vector<SensorData> coldRows = loadColdRows(snap, params);
+        std::vector<SensorDataSpan> spans;
+        spans.push_back({coldRows.data(), coldRows.size()});
+        spans.insert(spans.end(), snap.spans.begin(), snap.spans.end());
+        std::vector<RowVerdicts> verdicts(1); // Cold rows are classified as they are scanned
+        verdicts.insert(verdicts.end(), snap.verdicts.begin(), snap.verdicts.end());
+
+        if (pool) {
+            processedResults = queryDataParallel(params, spans, verdicts, snap.detector, *pool);
+        } else {
+            processedResults.reserve(coldRows.size() + snap.residentCount);
+
+            // Step 1: Convert SensorData to QueryResult and apply filters (filterAnomalousOnly,
+            // time range, the per-metric value ranges and the filter expression)
+            for (size_t i = 0; i < spans.size(); ++i) {
+                scanRows(spans[i], verdicts[i], params, snap.detector, [&](const SensorData&, const QueryResult& query_result_item) {
+                    processedResults.push_back(query_result_item);
+                });
             }
+
+            // Step 2: Sort the filtered results; timestamp order only needs the late rows merged in
+            sortResults(processedResults, params.sortBy);
+        }
+    }
+
+    auto results = std::make_shared<const std::vector<QueryResult>>(std::move(processedResults));
+    if (!cacheKey.empty()) {
+        queryCache_.store(cacheKey, {epoch, sequence, results});
+    }
+    return results;
+}
+
+std::shared_ptr<const std::vector<QueryResult>> DataManager::mergeTail(
+    const std::shared_ptr<const std::vector<QueryResult>>& results, const std::vector<QueryResult>& tail,
+    const QueryParams& params, const AnomalyDetector& detector) {
+    std::vector<QueryResult> additions;
+    for (const auto& item : tail) { // Classified when they were added
+        if (rowMatches(item, params, detector)) {
+            additions.push_back(item);
+        }
+    }
+    if (additions.empty()) {
+        return results; // Still current; the new entry shares the old rows
+    }
+    sortResults(additions, params.sortBy);
+    // The cached rows are shared with earlier callers, so the merge goes to a new vector
+    auto merged = std::make_shared<std::vector<QueryResult>>();
+    merged->reserve(results->size() + additions.size());
+    std::merge(results->begin(), results->end(), additions.begin(), additions.end(), std::back_inserter(*merged),
+               ResultComparator{params.sortBy});
+    return merged;
+}
+
+std::string DataManager::cacheKeyFor(const QueryParams& params) {
+    std::ostringstream key;
+    key << std::setprecision(17) << "sort=" << static_cast<int>(params.sortBy);
+    if (params.filterAnomalousOnly) {
+        key << ";anomalous=" << *params.filterAnomalousOnly;
+    }
+    if (params.timeRangeFilterMs) {
+        if (params.timeRangeFilterMs->first > params.timeRangeFilterMs->second) {
+            key << ";time=empty";
+        } else {
+            key << ";time=" << params.timeRangeFilterMs->first << ',' << params.timeRangeFilterMs->second;
+        }
+    }
+    const std::pair<const char*, const std::optional<ValueRange>*> ranges[] = {
+        {"temp", &params.temperatureRange}, {"hum", &params.humidityRange},
+        {"light", &params.lightRange}, {"dev", &params.deviationRange}
+    };
+    for (const auto& named : ranges) {
+        if (!named.second->has_value()) {
+            continue;
+        }
+        const ValueRange& range = named.second->value();
+        if (range.min > range.max) {
+            key << ';' << named.first << "=empty";
+        } else if (range.min != -std::numeric_limits<double>::infinity() ||
+                   range.max != std::numeric_limits<double>::infinity()) {
+            key << ';' << named.first << '=' << range.min << ',' << range.max;
+        } // An unbounded range filters nothing, so it keys the same as no range
+    }
+    if (params.filter) {
+        key << ";where=" << params.filter->canonical();
+    }
+    return key.str();
+}
+
+void DataManager::setQueryCacheLimits(size_t maxEntries, size_t maxRows) {
+    queryCache_.setLimits(maxEntries, maxRows);
+}
+
+QueryCache::Stats DataManager::getQueryCacheStats() const {
+    return queryCache_.stats();
+}
+
+std::vector<QueryResult> DataManager::queryDataParallel(const QueryParams& params, const std::vector<SensorDataSpan>& spans,
+                                                        const std::vector<RowVerdicts>& verdicts,
+                                                        const AnomalyDetector& detector, ThreadPool& pool) {
+    size_t total = 0;
+    for (const auto& span : spans) {
+        total += span.size;
+    }
+    const size_t chunkCount = std::max<size_t>(1, std::min<size_t>(pool.size(), total));
+    ResultComparator comparator{params.sortBy};
+
+    // Step 1: Convert, filter and sort each chunk independently
+    std::vector<std::vector<QueryResult>> runs(chunkCount);
+    pool.parallelFor(chunkCount, [&](size_t chunk) {
+        size_t begin = chunk * total / chunkCount;
+        size_t end = (chunk + 1) * total / chunkCount;
+        std::vector<QueryResult>& run = runs[chunk];
+        run.reserve(end - begin);
+        forEachSubspan(spans, verdicts, begin, end, [&](SensorDataSpan rows, RowVerdicts rowVerdicts) {
+            scanRows(rows, rowVerdicts, params, detector, [&](const SensorData&, const QueryResult& item) {
+                run.push_back(item);
+            });
+        });
+        sortResults(run, params.sortBy);
+    });
+
+    // Step 2: Concatenate the sorted runs, remembering where each one starts
+    std::vector<QueryResult> results;
+    std::vector<size_t> bounds = {0};
+    size_t matched = 0;
+    for (const auto& run : runs) {
+        matched += run.size();
+    }
+    results.reserve(matched);
+    for (auto& run : runs) {
+        results.insert(results.end(), std::make_move_iterator(run.begin()), std::make_move_iterator(run.end()));
+        bounds.push_back(results.size());
+        std::vector<QueryResult>().swap(run); // Release chunk memory early
+    }
+
+    // Step 3: Merge neighbouring runs pairwise, one parallel round at a time
+    while (bounds.size() > 2) {
+        size_t pairCount = (bounds.size() - 1) / 2;
+        pool.parallelFor(pairCount, [&](size_t pair) {
+            std::inplace_merge(results.begin() + bounds[2 * pair],
+                               results.begin() + bounds[2 * pair + 1],
+                               results.begin() + bounds[2 * pair + 2],
+                               comparator);
         });
+        std::vector<size_t> merged;
+        for (size_t i = 0; i < bounds.size(); i += 2) {
+            merged.push_back(bounds[i]);
+        }
+        if (merged.back() != bounds.back()) {
+            merged.push_back(bounds.back()); // Odd run out, carried to the next round
+        }
+        bounds.swap(merged);
+    }
+    return results;
+}
 
-    return processedResults;
+void DataManager::setParallelQueryThreshold(size_t minReadings) {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    parallelQueryThreshold_ = minReadings;
+}
+
+void DataManager::setQueryThreadCount(unsigned threadCount) {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    queryThreadCount_ = threadCount;
+    queryPool_.reset(); // Recreated with the new size on the next parallel query
 }
 
 void DataManager::saveToStorage(DataStorage& storage) {
-    std::lock_guard<std::mutex> lock(dataMutex_); // Ensure thread-safe access
-    
-    if (!historicalData_.empty()) {
-        // Save all data in batch for efficiency, replacing existing file content
-        storage.replaceAllData(historicalData_);
-        std::cout << "DataManager: Saved " << historicalData_.size() << " data points to storage." << std::endl;
+    persistToStorage(storage, true);
+}
+
+void DataManager::checkpointToStorage(DataStorage& storage) {
+    persistToStorage(storage, false);
+}
+
+void DataManager::persistToStorage(DataStorage& storage, bool rewriteHistory) {
+    waitForLoad(); // A partly loaded history must not replace the file
+    std::optional<uint64_t> coveredRecords;
+    Snapshot snap;
+    std::vector<RollupBucket> buckets;
+    {
+        // Readings stored through addEnrichedData are added under storeMutex_ too, so the
+        // position and the rollups cover the same ones. Ingest may continue while the file is
+        // written.
+        std::lock_guard<std::mutex> storeLock(storeMutex_);
+        uint64_t position = 0;
+        if (!rewriteHistory && storage.position(position)) {
+            coveredRecords = position;
+        }
+        std::lock_guard<std::mutex> lock(dataMutex_);
+        if (residentCount_ == 0 && coldFiles_.empty()) {
+            return;
+        }
+        summarizeBase(); // The persisted rollups must cover the base rows
+        snap = snapshot(QueryParams{});
+        for (const auto& tier : rollupTiers_) {
+            std::vector<RollupBucket> tierBuckets = tier.allBuckets();
+            buckets.insert(buckets.end(), tierBuckets.begin(), tierBuckets.end());
+        }
+    }
+    storage.setAnomalyDetector(snap.detector); // For the anomaly counts of the blocks written
+
+    if (rewriteHistory) {
+        // Save all resident data segment by segment, replacing existing file content.
+        // Evicted readings already live in their cold files.
+        if (storage.replaceAllData(snap.spans)) {
+            coveredRecords = snap.residentCount;
+        }
+    } else {
+        // Every reading is in the file or its log already, which reads take them from. The log
+        // is synced and left to checkpoint on its own, so the file gets no short block.
+        storage.flush();
+    }
+
+    // Persist the rollup tiers alongside the raw data so summaries survive raw data aging out
+    storage.replaceRollupData(buckets, coveredRecords);
+    if (rewriteHistory) {
+        std::cout << "DataManager: Saved " << snap.residentCount << " data points to storage." << std::endl;
+    } else {
+        std::cout << "DataManager: Synced storage with " << snap.residentCount << " data points resident."
+                  << std::endl;
     }
 }
 
 void DataManager::loadFromStorage(DataStorage& storage) {
-    std::lock_guard<std::mutex> lock(dataMutex_); // Ensure thread-safe access
-    
-    // Load all data from storage
-    std::vector<SensorData> loadedData = storage.loadAllData();
-    
-    if (!loadedData.empty()) {
-        // Replace current data with loaded data
-        historicalData_ = std::move(loadedData);
-        std::cout << "DataManager: Loaded " << historicalData_.size() << " data points from storage." << std::endl;
-    } else {
+    waitForLoad();
+    size_t recordLimit = beginLoad(storage);
+    loadHistory(storage, recordLimit);
+    finishLoad();
+}
+
+bool DataManager::mapFromStorage(DataStorage& storage) {
+    waitForLoad();
+    size_t recordLimit = beginLoad(storage);
+    bool mapped = mapHistory(storage, recordLimit);
+    if (!mapped) {
+        loadHistory(storage, recordLimit);
+    }
+    finishLoad();
+    return mapped;
+}
+
+void DataManager::loadFromStorageInBackground(DataStorage& storage) {
+    waitForLoad();
+    size_t recordLimit = beginLoad(storage);
+    std::lock_guard<std::mutex> lock(loadThreadMutex_);
+    loadThread_ = std::thread([this, &storage, recordLimit]() {
+        if (!mapHistory(storage, recordLimit)) {
+            loadHistory(storage, recordLimit);
+        }
+        finishLoad();
+    });
+}
+
+void DataManager::waitForLoad() {
+    std::lock_guard<std::mutex> lock(loadThreadMutex_);
+    if (loadThread_.joinable()) {
+        loadThread_.join();
+    }
+}
+
+DataManager::LoadStatus DataManager::getLoadStatus() const {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    return loadStatus_;
+}
+
+size_t DataManager::beginLoad(DataStorage& storage) {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    // The server keeps appending to the file while history loads; those readings also arrive
+    // through addSensorData, so only the records present now belong to the history
+    size_t recordLimit = storage.recordCount();
+    loadStatus_ = LoadStatus{};
+    loadStatus_.loading = true;
+    loadStatus_.totalReadings = recordLimit;
+    return recordLimit;
+}
+
+void DataManager::finishLoad() {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    loadStatus_.loading = false;
+    // Readings that arrived during the load are newer than the history, in arrival order
+    for (const auto& data : pendingReadings_) {
+        addLocked(data);
+    }
+    std::vector<QueryResult>().swap(pendingReadings_);
+    loadStatus_.pendingReadings = 0;
+}
+
+void DataManager::loadHistory(DataStorage& storage, size_t recordLimit) {
+    int64_t evictedUpTo = std::numeric_limits<int64_t>::min();
+    std::vector<int64_t> rollupWatermarks;
+    std::vector<DataStorage::ColdFile> evictedFiles;
+    DataStorage* coldFileStorage = nullptr;
+    AnomalyDetector replay; // Runs the stateful rules over the history in order
+    {
+        std::lock_guard<std::mutex> lock(dataMutex_);
+        coldFileStorage = tierStorage_ ? tierStorage_ : &storage;
+        replay = anomalyDetector_.withFreshRuleState();
+    }
+    uint32_t firedRules = 0;
+    double deviation = 0.0;
+    // Files are read before taking the lock that ingest needs
+    std::vector<DataStorage::ColdFile> catalog = coldFileStorage->loadColdCatalog();
+    std::optional<uint64_t> coveredRecords;
+    std::vector<RollupBucket> persistedBuckets = storage.loadRollupData(&coveredRecords);
+    uint64_t endPosition = 0;
+    if (coveredRecords && (!storage.position(endPosition) || *coveredRecords > endPosition)) {
+        coveredRecords.reset(); // The file was replaced without them
+    }
+    {
+        std::lock_guard<std::mutex> lock(dataMutex_);
+
+        // Cold files written by an earlier run hold every reading up to their newest timestamp
+        coldFiles_ = std::move(catalog);
+        if (!tierStorage_ && !coldFiles_.empty()) {
+            tierStorage_ = &storage;
+        }
+        coldWatermark_ = std::numeric_limits<int64_t>::min();
+        for (const auto& file : coldFiles_) {
+            coldWatermark_ = std::max(coldWatermark_, file.maxTimestamp_ms);
+        }
+        evictedUpTo = coldWatermark_;
+        evictedFiles = coldFiles_;
+        coldFileStorage = tierStorage_;
+
+        // History is replaced wholesale, so no cached query result is valid any more
+        ++historyEpoch_;
+        recentAppends_.clear();
+        if (recordLimit > 0) {
+            // Replace current data with loaded data
+            clearResident();
+            rebuildIndexes();
+        }
+
+        // Restore persisted rollups; raw readings stored after they were saved are folded in
+        // while loading below, told by their position in the file or, for rollups saved without
+        // one, by being newer than what each tier had seen.
+        for (auto& tier : rollupTiers_) {
+            tier.clear();
+            for (const auto& bucket : persistedBuckets) {
+                tier.restoreBucket(bucket);
+            }
+            rollupWatermarks.push_back(tier.latestTimestamp());
+        }
+
+        // Quantile sketches are not persisted; rebuild them from the cold files and from
+        // the resident readings while loading below
+        overallSketches_ = MetricSketches{};
+        windowSketches_.clear();
+        // Episodes are replayed from the whole history below, oldest cold files first
+        episodes_ = EpisodeTracker(episodes_.config());
+        baseSummaryPending_ = false; // A base that is not replaced below is folded with the resident rows
+    }
+
+    // The lock is only held per cold file and per chunk, so queries keep running on the history
+    // loaded so far
+    for (const auto& file : evictedFiles) {
+        std::vector<SensorData> rows = coldFileStorage->loadColdFile(file.id);
+        std::lock_guard<std::mutex> lock(dataMutex_);
+        for (size_t i = 0; i < std::min<size_t>(rows.size(), file.count); ++i) {
+            replay.classifyIncoming(rows[i], deviation, &firedRules);
+            foldIntoSketches(rows[i]);
+            trackEpisodes(rows[i], firedRules);
+        }
+    }
+
+    // Stream the binary file in chunks so the retention policy bounds memory during startup too
+    uint64_t position = 0; // Of the next reading; set by the load before the first chunk
+    storage.loadDataInChunks(kLoadChunkRecords, [&](std::vector<SensorData>& chunk) {
+        std::lock_guard<std::mutex> lock(dataMutex_);
+        for (const auto& data : chunk) {
+            ++loadStatus_.loadedReadings;
+            // Evicted readings went through the replay with their cold file
+            const bool evicted = data.timestamp_ms <= evictedUpTo;
+            firedRules = 0;
+            const bool isAnomalous = evicted ? replay.classify(data, deviation)
+                                             : replay.classifyIncoming(data, deviation, &firedRules);
+            const QueryResult item(data, isAnomalous, deviation, firedRules);
+            const bool stored = coveredRecords && position++ >= *coveredRecords;
+            for (size_t t = 0; t < rollupTiers_.size(); ++t) {
+                if (coveredRecords ? stored : data.timestamp_ms > rollupWatermarks[t]) {
+                    rollupTiers_[t].add(data, item.isAnomalousFlag);
+                }
+            }
+            if (evicted) {
+                continue; // Already in a cold file
+            }
+            foldIntoSketches(data);
+            trackEpisodes(data, firedRules);
+            ingestReading(item);
+        }
+        ++historyEpoch_; // Results cached before this chunk are missing its readings
+    }, recordLimit, &position);
+
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    if (recordLimit == 0) {
+        // Nothing replaced the resident history, so it still needs to be summarized
+        for (const auto& span : snapshot(QueryParams{}).spans) {
+            for (const auto& data : span) {
+                replay.classifyIncoming(data, deviation, &firedRules);
+                foldIntoSketches(data);
+                trackEpisodes(data, firedRules);
+            }
+        }
         std::cout << "DataManager: No data found in storage or storage is empty." << std::endl;
+    } else {
+        std::cout << "DataManager: Loaded " << residentCount_ << " data points from storage." << std::endl;
+    }
+}
+
+bool DataManager::mapHistory(DataStorage& storage, size_t recordLimit) {
+    // Files are read before taking the lock that ingest needs
+    MappedBlocks mapped = storage.mapAllData();
+    const bool evicted = !storage.loadColdCatalog().empty();
+    std::optional<uint64_t> coveredRecords;
+    std::vector<RollupBucket> persistedBuckets = storage.loadRollupData(&coveredRecords);
+    uint64_t endPosition = 0;
+    if (coveredRecords && (!storage.position(endPosition) || *coveredRecords > endPosition)) {
+        coveredRecords.reset(); // The file was replaced without them
+    }
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    // Evicted readings may still be in the file, and retention would copy the base right back
+    if (mapped.files.empty() || recordLimit == 0 || retentionPolicy_ || evicted) {
+        return false;
+    }
+    ++historyEpoch_; // History is replaced wholesale
+    recentAppends_.clear();
+    clearResident();
+    coldFiles_.clear();
+    coldWatermark_ = std::numeric_limits<int64_t>::min();
+
+    baseFiles_ = mapped.files;
+    baseBlocks_.clear();
+    size_t remaining = recordLimit;
+    for (auto& block : mapped.blocks) {
+        if (remaining == 0) {
+            break;
+        }
+        if (block.rows.size > remaining) {
+            // Only part of the block is kept, so its zone map no longer describes it
+            block.rows.size = remaining;
+            block.zoned = false;
+        }
+        remaining -= block.rows.size;
+        baseBlocks_.push_back(block);
+    }
+    residentCount_ = recordLimit - remaining;
+    loadStatus_.loadedReadings = residentCount_;
+
+    // Persisted rollups are restored now; the base rows stored after them and the quantile
+    // sketches wait until a query needs them
+    baseRollupCovered_.reset();
+    if (coveredRecords) {
+        baseRollupCovered_ = *coveredRecords > mapped.firstPosition ? *coveredRecords - mapped.firstPosition : 0;
+    }
+    baseRollupWatermarks_.clear();
+    for (auto& tier : rollupTiers_) {
+        tier.clear();
+        for (const auto& bucket : persistedBuckets) {
+            tier.restoreBucket(bucket);
+        }
+        baseRollupWatermarks_.push_back(tier.latestTimestamp());
+    }
+    overallSketches_ = MetricSketches{};
+    windowSketches_.clear();
+    baseSummaryPending_ = true;
+
+    // Stored readings not checkpointed into the file yet follow the base as resident rows
+    uint64_t position = mapped.firstPosition + mapped.records;
+    for (size_t i = 0; i < std::min(mapped.unsealed.size(), remaining); ++i, ++position) {
+        const QueryResult item = convertToQueryResult(mapped.unsealed[i], anomalyDetector_);
+        for (size_t t = 0; t < rollupTiers_.size(); ++t) {
+            if (coveredRecords ? position >= *coveredRecords : item.timestamp_ms > baseRollupWatermarks_[t]) {
+                rollupTiers_[t].add(item, item.isAnomalousFlag);
+            }
+        }
+        foldIntoSketches(item);
+        trackEpisodes(item, item.firedRules);
+        ingestReading(item);
+        ++loadStatus_.loadedReadings;
+    }
+    rebuildIndexes(); // Only reads the base when indexes are enabled
+
+    std::cout << "DataManager: Mapped " << residentCount_ << " data points from storage"
+              << (mapped.files.front()->mapped() ? "." : " (read into memory).") << std::endl;
+    return true;
+}
+
+void DataManager::summarizeBase() const {
+    if (!baseSummaryPending_) {
+        return;
+    }
+    baseSummaryPending_ = false;
+    uint64_t index = 0;
+    for (const auto& block : baseBlocks_) {
+        for (const auto& data : block.rows) {
+            bool isAnomalous = anomalyDetector_.isAnomalous(data);
+            const bool stored = baseRollupCovered_ && index++ >= *baseRollupCovered_;
+            for (size_t t = 0; t < rollupTiers_.size(); ++t) {
+                if (baseRollupCovered_ ? stored : data.timestamp_ms > baseRollupWatermarks_[t]) {
+                    rollupTiers_[t].add(data, isAnomalous);
+                }
+            }
+            foldIntoSketches(data);
+        }
+    }
+}
+
+void DataManager::materializeBase() {
+    if (baseFiles_.empty()) {
+        return;
+    }
+    summarizeBase(); // Summarized once, wherever the rows end up
+
+    std::vector<SensorData> baseRows;
+    for (const auto& block : baseBlocks_) {
+        baseRows.insert(baseRows.end(), block.rows.begin(), block.rows.end());
+    }
+    std::stable_sort(baseRows.begin(), baseRows.end(), earlierReading);
+    for (const auto& sd : baseRows) {
+        newestTimestamp_ = std::max(newestTimestamp_, sd.timestamp_ms);
+        oldestResidentTimestamp_ = std::min(oldestResidentTimestamp_, sd.timestamp_ms);
+    }
+
+    // Readings added since mapping are usually newer than the base, but need not be. They keep
+    // their verdicts; the base rows are classified once, here.
+    mergeReorderBuffer();
+    std::vector<QueryResult> baseResults;
+    baseResults.reserve(baseRows.size());
+    for (const auto& sd : baseRows) {
+        baseResults.push_back(convertToQueryResult(sd, anomalyDetector_));
+    }
+    std::vector<QueryResult> segmentRows;
+    std::vector<std::shared_ptr<const HistorySegment>> segments = sealedSegments_;
+    if (headSegment_) {
+        segments.push_back(headSegment_);
+    }
+    for (const auto& segment : segments) {
+        for (size_t i = 0; i < segment->size(); ++i) {
+            segmentRows.emplace_back(segment->data()[i], segment->anomalous()[i] != 0, segment->deviations()[i]);
+        }
+    }
+    std::vector<QueryResult> merged;
+    merged.reserve(baseResults.size() + segmentRows.size());
+    std::merge(baseResults.begin(), baseResults.end(), segmentRows.begin(), segmentRows.end(), std::back_inserter(merged),
+               earlierReading);
+
+    sealedSegments_.clear();
+    headSegment_.reset();
+    baseFiles_.clear();
+    baseBlocks_.clear();
+    for (const auto& sd : merged) {
+        appendToHead(sd); // residentCount_ already includes every row
+    }
+}
+
+void DataManager::MetricSketches::add(const SensorData& sd) {
+    metrics[static_cast<int>(SensorMetric::TEMPERATURE)].add(sd.temperature);
+    metrics[static_cast<int>(SensorMetric::HUMIDITY)].add(sd.humidity);
+    metrics[static_cast<int>(SensorMetric::LIGHT_INTENSITY)].add(sd.lightIntensity);
+}
+
+void DataManager::foldIntoSketches(const SensorData& sd) const {
+    overallSketches_.add(sd);
+    windowSketches_[RollupTier::alignTimestamp(sd.timestamp_ms, kQuantileWindowMs)].add(sd);
+}
+
+std::optional<double> DataManager::approximateQuantile(SensorMetric metric, double q,
+                                                       std::optional<std::pair<int64_t, int64_t>> timeRangeMs) const {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    summarizeBase();
+    const int metricIndex = static_cast<int>(metric);
+    if (!timeRangeMs) {
+        const QuantileSketch& sketch = overallSketches_.metrics[metricIndex];
+        return sketch.empty() ? std::nullopt : std::optional<double>(sketch.quantile(q));
+    }
+    if (timeRangeMs->first > timeRangeMs->second) {
+        return std::nullopt;
+    }
+
+    QuantileSketch merged;
+    auto it = windowSketches_.lower_bound(RollupTier::alignTimestamp(timeRangeMs->first, kQuantileWindowMs));
+    auto last = windowSketches_.upper_bound(timeRangeMs->second);
+    for (; it != last; ++it) {
+        merged.merge(it->second.metrics[metricIndex]);
     }
+    return merged.empty() ? std::nullopt : std::optional<double>(merged.quantile(q));
+}
+
+std::vector<std::pair<int64_t, double>> DataManager::approximateQuantileByWindow(SensorMetric metric, double q,
+                                                                                 int64_t start_ms, int64_t end_ms) const {
+    std::lock_guard<std::mutex> lock(dataMutex_);
+    summarizeBase();
+    std::vector<std::pair<int64_t, double>> result;
+    if (start_ms > end_ms) {
+        return result;
+    }
+    auto it = windowSketches_.lower_bound(RollupTier::alignTimestamp(start_ms, kQuantileWindowMs));
+    auto last = windowSketches_.upper_bound(end_ms);
+    for (; it != last; ++it) {
+        const QuantileSketch& sketch = it->second.metrics[static_cast<int>(metric)];
+        if (!sketch.empty()) {
+            result.emplace_back(it->first, sketch.quantile(q));
+        }
+    }
+    return result;
 }
 
 std::vector<SensorData> DataManager::getAllData() const {
-    std::lock_guard<std::mutex> lock(dataMutex_); // Ensure thread-safe read access
-    return historicalData_; // Return a copy of the data
+    Snapshot snap;
+    {
+        std::lock_guard<std::mutex> lock(dataMutex_); // Ensure thread-safe read access
+        snap = snapshot(QueryParams{});
+    }
+    std::vector<SensorData> allData = loadColdRows(snap, QueryParams{});
+    allData.reserve(allData.size() + snap.residentCount);
+    for (const auto& span : snap.spans) {
+        allData.insert(allData.end(), span.begin(), span.end());
+    }
+    return allData; // Return a copy of the data
 }
 
 size_t DataManager::getDataCount() const {
     std::lock_guard<std::mutex> lock(dataMutex_); // Ensure thread-safe read access
-    return historicalData_.size();
-}
\ No newline at end of file
+    return residentCount_;
+}
+
+size_t DataManager::getTotalDataCount() const {
+    std::lock_guard<std::mutex> lock(dataMutex_); // Ensure thread-safe read access
+    size_t total = residentCount_;
+    for (const auto& file : coldFiles_) {
+        total += file.count;
+    }
+    return total;
+}
+
+std::vector<RollupBucket> DataManager::aggregateByTime(const QueryParams& params, int64_t bucketWidth_ms) const {
+    std::vector<RollupBucket> result;
+    if (bucketWidth_ms <= 0) {
+        return result;
+    }
+    Snapshot snap;
+    {
+        std::lock_guard<std::mutex> lock(dataMutex_); // Only held while taking the snapshot
+        snap = snapshot(params);
+    }
+    std::vector<SensorData> coldRows = loadColdRows(snap, params);
+    std::vector<SensorDataSpan> spans;
+    spans.push_back({coldRows.data(), coldRows.size()});
+    spans.insert(spans.end(), snap.spans.begin(), snap.spans.end());
+    std::vector<RowVerdicts> verdicts(1);
+    verdicts.insert(verdicts.end(), snap.verdicts.begin(), snap.verdicts.end());
+
+    std::map<int64_t, RollupBucket> buckets;
+    auto bucketFor = [&](int64_t timestamp_ms) -> RollupBucket& {
+        int64_t start = RollupTier::alignTimestamp(timestamp_ms, bucketWidth_ms);
+        auto it = buckets.find(start);
+        if (it == buckets.end()) {
+            RollupBucket bucket{};
+            bucket.bucketStart_ms = start;
+            bucket.bucketWidth_ms = bucketWidth_ms;
+            it = buckets.emplace(start, bucket).first;
+        }
+        return it->second;
+    };
+
+    const bool rowFilters = params.filterAnomalousOnly || params.temperatureRange || params.humidityRange ||
+                            params.lightRange || params.deviationRange || params.filter;
+    for (size_t s = 0; s < spans.size(); ++s) {
+        const SensorDataSpan& span = spans[s];
+        if (rowFilters) {
+            // Rows are picked individually; consecutive rows usually share the current bucket
+            RollupBucket* current = nullptr;
+            scanRows(span, verdicts[s], params, snap.detector, [&](const SensorData& sd, const QueryResult& item) {
+                if (!current || sd.timestamp_ms < current->bucketStart_ms ||
+                    sd.timestamp_ms - current->bucketStart_ms >= bucketWidth_ms) {
+                    current = &bucketFor(sd.timestamp_ms);
+                }
+                current->add(sd, item.isAnomalousFlag);
+            });
+            continue;
+        }
+
+        // Spans are sorted by timestamp, so each bucket is one contiguous run per span, folded
+        // in a single call
+        size_t i = 0;
+        while (i < span.size) {
+            if (!inTimeRange(span.data[i].timestamp_ms, params)) {
+                ++i;
+                continue;
+            }
+            RollupBucket& bucket = bucketFor(span.data[i].timestamp_ms);
+            size_t end = i + 1;
+            while (end < span.size && span.data[end].timestamp_ms >= bucket.bucketStart_ms &&
+                   span.data[end].timestamp_ms - bucket.bucketStart_ms < bucketWidth_ms &&
+                   inTimeRange(span.data[end].timestamp_ms, params)) {
+                ++end;
+            }
+            accumulateRun(span.data + i, verdicts[s].from(i).anomalous, end - i, snap.detector, bucket);
+            i = end;
+        }
+    }
+
+    result.reserve(buckets.size());
+    for (const auto& entry : buckets) {
+        result.push_back(entry.second);
+    }
+    return result;
+}
+
+std::vector<RollupBucket> DataManager::queryRollups(int64_t start_ms, int64_t end_ms, int64_t resolution_ms) const {
+    QueryParams rangeParams;
+    rangeParams.timeRangeFilterMs = std::make_pair(start_ms, end_ms);
+    Snapshot snap;
+    {
+        std::lock_guard<std::mutex> lock(dataMutex_); // Ensure thread-safe read access
+        summarizeBase();
+
+        // Tiers are ordered finest first, so the last one that fits is the coarsest usable tier
+        const RollupTier* bestTier = nullptr;
+        for (const auto& tier : rollupTiers_) {
+            if (tier.bucketWidth() <= resolution_ms) {
+                bestTier = &tier;
+            }
+        }
+        if (bestTier) {
+            return bestTier->query(start_ms, end_ms);
+        }
+        snap = snapshot(rangeParams);
+    }
+
+    // Requested resolution is finer than every tier: aggregate the raw history on the fly
+    RollupTier adHocTier(resolution_ms);
+    for (const auto& data : loadColdRows(snap, rangeParams)) {
+        adHocTier.add(data, snap.detector.isAnomalous(data));
+    }
+    for (const auto& span : snap.spans) {
+        for (const auto& data : span) {
+            if (inTimeRange(data.timestamp_ms, rangeParams)) {
+                adHocTier.add(data, snap.detector.isAnomalous(data));
+            }
+        }
+    }
+    return adHocTier.allBuckets();
+}
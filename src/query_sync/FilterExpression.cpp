@@ -0,0 +1,417 @@
+#include "FilterExpression.hpp"
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+    // Nesting depth up to which matches() runs on a fixed-size boolean stack
+    const size_t kMaxRowStackDepth = 64;
+
+    using Field = FilterExpression::Field;
+    using Comparison = FilterExpression::Comparison;
+
+    // Gathers one field of a block of rows into a contiguous column
+    void loadColumn(const SensorData* rows, size_t count, Field field, const FilterExpression::Context& context,
+                    double* column) {
+        switch (field) {
+            case Field::TEMPERATURE:
+                for (size_t i = 0; i < count; ++i) column[i] = rows[i].temperature;
+                break;
+            case Field::HUMIDITY:
+                for (size_t i = 0; i < count; ++i) column[i] = rows[i].humidity;
+                break;
+            case Field::LIGHT_INTENSITY:
+                for (size_t i = 0; i < count; ++i) column[i] = rows[i].lightIntensity;
+                break;
+            case Field::DEVIATION: {
+                if (context.deviations) {
+                    std::copy(context.deviations, context.deviations + count, column);
+                    break;
+                }
+                // The batch kernel computes the deviation of the whole block
+                uint64_t anomalyBits[FilterExpression::kBlockRows / 64]; // count never exceeds a block
+                context.detector.classifyBatch(rows, count, anomalyBits, column);
+                break;
+            }
+            case Field::TIMESTAMP: // Millisecond timestamps are far below 2^53, so doubles hold them exactly
+                for (size_t i = 0; i < count; ++i) column[i] = static_cast<double>(rows[i].timestamp_ms);
+                break;
+        }
+    }
+
+    // Packs cmp(column[i], value) into bitmap words; the loop body is branch-free per row
+    template <typename Cmp>
+    void compareColumn(const double* column, size_t count, double value, uint64_t* bits, Cmp cmp) {
+        for (size_t base = 0; base < count; base += 64) {
+            size_t n = std::min<size_t>(64, count - base);
+            uint64_t word = 0;
+            for (size_t j = 0; j < n; ++j) {
+                word |= static_cast<uint64_t>(cmp(column[base + j], value)) << j;
+            }
+            bits[base / 64] = word;
+        }
+    }
+
+    void compareColumn(const double* column, size_t count, Comparison comparison, double value, uint64_t* bits) {
+        switch (comparison) {
+            case Comparison::LESS:          compareColumn(column, count, value, bits, std::less<double>()); break;
+            case Comparison::LESS_EQUAL:    compareColumn(column, count, value, bits, std::less_equal<double>()); break;
+            case Comparison::GREATER:       compareColumn(column, count, value, bits, std::greater<double>()); break;
+            case Comparison::GREATER_EQUAL: compareColumn(column, count, value, bits, std::greater_equal<double>()); break;
+            case Comparison::EQUAL:         compareColumn(column, count, value, bits, std::equal_to<double>()); break;
+            case Comparison::NOT_EQUAL:     compareColumn(column, count, value, bits, std::not_equal_to<double>()); break;
+        }
+    }
+
+    bool compareValue(double lhs, Comparison comparison, double rhs) {
+        switch (comparison) {
+            case Comparison::LESS:          return lhs < rhs;
+            case Comparison::LESS_EQUAL:    return lhs <= rhs;
+            case Comparison::GREATER:       return lhs > rhs;
+            case Comparison::GREATER_EQUAL: return lhs >= rhs;
+            case Comparison::EQUAL:         return lhs == rhs;
+            case Comparison::NOT_EQUAL:     return lhs != rhs;
+        }
+        return false;
+    }
+
+    const char* fieldName(Field field) {
+        switch (field) {
+            case Field::TEMPERATURE:     return "temperature";
+            case Field::HUMIDITY:        return "humidity";
+            case Field::LIGHT_INTENSITY: return "light";
+            case Field::DEVIATION:       return "deviation";
+            case Field::TIMESTAMP:       return "timestamp";
+        }
+        return "?";
+    }
+
+    const char* comparisonName(Comparison comparison) {
+        switch (comparison) {
+            case Comparison::LESS:          return "<";
+            case Comparison::LESS_EQUAL:    return "<=";
+            case Comparison::GREATER:       return ">";
+            case Comparison::GREATER_EQUAL: return ">=";
+            case Comparison::EQUAL:         return "==";
+            case Comparison::NOT_EQUAL:     return "!=";
+        }
+        return "?";
+    }
+
+    // Shortest decimal form that reads back as the same double
+    std::string formatNumber(double value) {
+        for (int precision = 15; precision <= 17; ++precision) {
+            std::ostringstream oss;
+            oss.precision(precision);
+            oss << value;
+            if (std::strtod(oss.str().c_str(), nullptr) == value || precision == 17) {
+                return oss.str();
+            }
+        }
+        return std::string();
+    }
+}
+
+// Recursive-descent parser that emits the postfix program while building the canonical text
+class FilterExpression::Parser {
+public:
+    Parser(const std::string& text, FilterExpression& target) : text_(text), target_(target) {}
+
+    // Throws std::invalid_argument describing the first syntax error
+    void parse() {
+        tokenize();
+        target_.canonical_ = parseOr();
+        if (peek().type != TokenType::END) {
+            fail("Unexpected '" + peek().text + "'");
+        }
+    }
+
+private:
+    enum class TokenType { WORD, NUMBER, SYMBOL, END };
+    struct Token {
+        TokenType type;
+        std::string text; // Lower-cased for words
+        double number;
+        size_t position;
+    };
+
+    const std::string& text_;
+    FilterExpression& target_;
+    std::vector<Token> tokens_;
+    size_t next_ = 0;
+
+    [[noreturn]] void fail(const std::string& message) const {
+        throw std::invalid_argument(message + " at position " + std::to_string(peek().position + 1));
+    }
+
+    void tokenize() {
+        size_t i = 0;
+        while (i < text_.size()) {
+            char c = text_[i];
+            if (std::isspace(static_cast<unsigned char>(c))) {
+                ++i;
+                continue;
+            }
+            bool signedNumber = (c == '-' || c == '+') && i + 1 < text_.size() &&
+                                (std::isdigit(static_cast<unsigned char>(text_[i + 1])) || text_[i + 1] == '.');
+            if (std::isdigit(static_cast<unsigned char>(c)) || c == '.' || signedNumber) {
+                const char* begin = text_.c_str() + i;
+                char* end = nullptr;
+                double value = std::strtod(begin, &end);
+                if (end == begin) {
+                    throw std::invalid_argument("Invalid number at position " + std::to_string(i + 1));
+                }
+                tokens_.push_back({TokenType::NUMBER, std::string(begin, static_cast<const char*>(end)), value, i});
+                i += static_cast<size_t>(end - begin);
+                continue;
+            }
+            if (std::isalpha(static_cast<unsigned char>(c)) || c == '_') {
+                size_t start = i;
+                std::string word;
+                while (i < text_.size() && (std::isalnum(static_cast<unsigned char>(text_[i])) || text_[i] == '_')) {
+                    word += static_cast<char>(std::tolower(static_cast<unsigned char>(text_[i])));
+                    ++i;
+                }
+                tokens_.push_back({TokenType::WORD, word, 0.0, start});
+                continue;
+            }
+            static const char* symbols[] = {"<=", ">=", "==", "!=", "&&", "||", "<", ">", "=", "!", "(", ")"};
+            bool matched = false;
+            for (const char* symbol : symbols) {
+                size_t length = std::char_traits<char>::length(symbol);
+                if (text_.compare(i, length, symbol) == 0) {
+                    tokens_.push_back({TokenType::SYMBOL, symbol, 0.0, i});
+                    i += length;
+                    matched = true;
+                    break;
+                }
+            }
+            if (!matched) {
+                throw std::invalid_argument(std::string("Unexpected character '") + c + "' at position " + std::to_string(i + 1));
+            }
+        }
+        tokens_.push_back({TokenType::END, "end of expression", 0.0, text_.size()});
+    }
+
+    const Token& peek() const { return tokens_[std::min(next_, tokens_.size() - 1)]; }
+
+    bool accept(const char* word, const char* symbol) {
+        const Token& token = peek();
+        if ((token.type == TokenType::WORD && token.text == word) ||
+            (symbol && token.type == TokenType::SYMBOL && token.text == symbol)) {
+            ++next_;
+            return true;
+        }
+        return false;
+    }
+
+    void emit(Instruction::Op op) {
+        target_.program_.push_back({op, Field::TEMPERATURE, Comparison::EQUAL, 0.0});
+    }
+
+    std::string parseOr() {
+        std::string left = parseAnd();
+        while (accept("or", "||")) {
+            std::string right = parseAnd();
+            emit(Instruction::OR);
+            left = "(" + left + " OR " + right + ")";
+        }
+        return left;
+    }
+
+    std::string parseAnd() {
+        std::string left = parseFactor();
+        while (accept("and", "&&")) {
+            std::string right = parseFactor();
+            emit(Instruction::AND);
+            left = "(" + left + " AND " + right + ")";
+        }
+        return left;
+    }
+
+    std::string parseFactor() {
+        if (accept("not", "!")) {
+            std::string operand = parseFactor();
+            emit(Instruction::NOT);
+            return "NOT " + operand;
+        }
+        if (accept("", "(")) {
+            std::string inner = parseOr();
+            if (!accept("", ")")) {
+                fail("Expected ')'");
+            }
+            return inner;
+        }
+        if (accept("anomalous", nullptr)) {
+            emit(Instruction::ANOMALOUS);
+            return "anomalous";
+        }
+        if (accept("normal", nullptr)) {
+            emit(Instruction::ANOMALOUS);
+            emit(Instruction::NOT);
+            return "NOT anomalous";
+        }
+        return parseComparison();
+    }
+
+    std::string parseComparison() {
+        const Token& fieldToken = peek();
+        if (fieldToken.type != TokenType::WORD) {
+            fail("Expected a field name, 'anomalous' or 'normal' but found '" + fieldToken.text + "'");
+        }
+        Field field;
+        const std::string& name = fieldToken.text;
+        if (name == "temp" || name == "temperature") field = Field::TEMPERATURE;
+        else if (name == "hum" || name == "humidity") field = Field::HUMIDITY;
+        else if (name == "light" || name == "lightintensity" || name == "light_intensity") field = Field::LIGHT_INTENSITY;
+        else if (name == "dev" || name == "deviation") field = Field::DEVIATION;
+        else if (name == "ts" || name == "timestamp") field = Field::TIMESTAMP;
+        else fail("Unknown field '" + name + "'");
+        ++next_;
+
+        const Token& opToken = peek();
+        Comparison comparison;
+        if (opToken.type != TokenType::SYMBOL) fail("Expected a comparison operator");
+        if (opToken.text == "<") comparison = Comparison::LESS;
+        else if (opToken.text == "<=") comparison = Comparison::LESS_EQUAL;
+        else if (opToken.text == ">") comparison = Comparison::GREATER;
+        else if (opToken.text == ">=") comparison = Comparison::GREATER_EQUAL;
+        else if (opToken.text == "==" || opToken.text == "=") comparison = Comparison::EQUAL;
+        else if (opToken.text == "!=") comparison = Comparison::NOT_EQUAL;
+        else fail("Expected a comparison operator but found '" + opToken.text + "'");
+        ++next_;
+
+        const Token& valueToken = peek();
+        if (valueToken.type != TokenType::NUMBER) {
+            fail("Expected a number but found '" + valueToken.text + "'");
+        }
+        double value = valueToken.number;
+        ++next_;
+
+        target_.program_.push_back({Instruction::COMPARE, field, comparison, value});
+        return std::string(fieldName(field)) + " " + comparisonName(comparison) + " " + formatNumber(value);
+    }
+};
+
+std::shared_ptr<const FilterExpression> FilterExpression::compile(const std::string& text, std::string& error) {
+    auto expression = std::make_shared<FilterExpression>();
+    try {
+        Parser(text, *expression).parse();
+    } catch (const std::invalid_argument& e) {
+        error = e.what();
+        return nullptr;
+    }
+
+    // Bitmaps needed at once while running the postfix program
+    size_t depth = 0;
+    for (const auto& instruction : expression->program_) {
+        if (instruction.op == Instruction::COMPARE || instruction.op == Instruction::ANOMALOUS) {
+            expression->stackDepth_ = std::max(expression->stackDepth_, ++depth);
+        } else if (instruction.op != Instruction::NOT) {
+            --depth;
+        }
+    }
+    return expression;
+}
+
+void FilterExpression::evaluate(const SensorData* rows, size_t count, const Context& context,
+                                std::vector<uint64_t>& selection) const {
+    selection.assign((count + 63) / 64, 0);
+    std::vector<std::vector<uint64_t>> stack(stackDepth_, std::vector<uint64_t>(kBlockRows / 64));
+    for (size_t start = 0; start < count; start += kBlockRows) {
+        size_t blockRows = std::min(kBlockRows, count - start);
+        Context block{context.detector, context.anomalous ? context.anomalous + start : nullptr,
+                      context.deviations ? context.deviations + start : nullptr};
+        evaluateBlock(rows + start, blockRows, block, stack, selection.data() + start / 64);
+    }
+}
+
+void FilterExpression::evaluateBlock(const SensorData* rows, size_t count, const Context& context,
+                                     std::vector<std::vector<uint64_t>>& stack, uint64_t* out) const {
+    const size_t words = (count + 63) / 64;
+    const uint64_t tailMask = (count % 64) ? ((uint64_t{1} << (count % 64)) - 1) : ~uint64_t{0};
+    double column[kBlockRows];
+    size_t top = 0;
+
+    for (const auto& instruction : program_) {
+        switch (instruction.op) {
+            case Instruction::COMPARE:
+                loadColumn(rows, count, instruction.field, context, column);
+                compareColumn(column, count, instruction.comparison, instruction.value, stack[top++].data());
+                break;
+            case Instruction::ANOMALOUS:
+                if (context.anomalous) {
+                    uint64_t* bits = stack[top++].data();
+                    std::fill(bits, bits + words, 0);
+                    for (size_t i = 0; i < count; ++i) {
+                        bits[i / 64] |= static_cast<uint64_t>(context.anomalous[i] != 0) << (i % 64);
+                    }
+                    break;
+                }
+                context.detector.classifyBatch(rows, count, stack[top++].data(), nullptr);
+                break;
+            case Instruction::AND: {
+                --top;
+                uint64_t* lhs = stack[top - 1].data();
+                const uint64_t* rhs = stack[top].data();
+                for (size_t w = 0; w < words; ++w) lhs[w] &= rhs[w];
+                break;
+            }
+            case Instruction::OR: {
+                --top;
+                uint64_t* lhs = stack[top - 1].data();
+                const uint64_t* rhs = stack[top].data();
+                for (size_t w = 0; w < words; ++w) lhs[w] |= rhs[w];
+                break;
+            }
+            case Instruction::NOT: {
+                uint64_t* bits = stack[top - 1].data();
+                for (size_t w = 0; w < words; ++w) bits[w] = ~bits[w];
+                bits[words - 1] &= tailMask; // Rows past the end never match
+                break;
+            }
+        }
+    }
+    std::copy(stack[0].begin(), stack[0].begin() + words, out);
+}
+
+bool FilterExpression::matches(const SensorData& row, const Context& context) const {
+    if (stackDepth_ > kMaxRowStackDepth) {
+        // Deeply nested expressions are rare enough to go through a one-row bitmap evaluation
+        std::vector<uint64_t> selection;
+        evaluate(&row, 1, context, selection);
+        return selection[0] & 1;
+    }
+
+    // Same program on booleans
+    bool stack[kMaxRowStackDepth];
+    size_t top = 0;
+    for (const auto& instruction : program_) {
+        switch (instruction.op) {
+            case Instruction::COMPARE: {
+                double value = 0.0;
+                loadColumn(&row, 1, instruction.field, context, &value);
+                stack[top++] = compareValue(value, instruction.comparison, instruction.value);
+                break;
+            }
+            case Instruction::ANOMALOUS:
+                stack[top++] = context.anomalous ? context.anomalous[0] != 0 : context.detector.isAnomalous(row);
+                break;
+            case Instruction::AND:
+                --top;
+                stack[top - 1] = stack[top - 1] && stack[top];
+                break;
+            case Instruction::OR:
+                --top;
+                stack[top - 1] = stack[top - 1] || stack[top];
+                break;
+            case Instruction::NOT:
+                stack[top - 1] = !stack[top - 1];
+                break;
+        }
+    }
+    return stack[0];
+}
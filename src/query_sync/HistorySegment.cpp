@@ -0,0 +1,127 @@
+#include "HistorySegment.hpp"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <numeric>
+
+HistorySegment::HistorySegment(size_t capacity, int64_t partitionStart_ms, const AnomalyDetector& classifiedWith)
+    : HistorySegment(std::shared_ptr<SensorData[]>(new SensorData[capacity > 0 ? capacity : 1]), capacity,
+                     partitionStart_ms, classifiedWith, true) {}
+
+HistorySegment::HistorySegment(std::shared_ptr<SensorData[]> rows, size_t capacity, int64_t partitionStart_ms,
+                               const AnomalyDetector& classifiedWith, bool allocateVerdicts)
+    : rows_(std::move(rows)),
+      capacity_(capacity > 0 ? capacity : 1),
+      size_(0),
+      partitionStart_ms_(partitionStart_ms),
+      minTimestamp_ms_(std::numeric_limits<int64_t>::max()),
+      maxTimestamp_ms_(std::numeric_limits<int64_t>::min()),
+      classifiedWith_(classifiedWith),
+      anomalous_(allocateVerdicts ? new uint8_t[capacity_] : nullptr),
+      deviations_(allocateVerdicts ? new double[capacity_] : nullptr) {}
+
+bool HistorySegment::overlaps(int64_t start_ms, int64_t end_ms) const {
+    return size() > 0 && minTimestamp() <= end_ms && maxTimestamp() >= start_ms;
+}
+
+bool HistorySegment::append(const SensorData& data, bool anomalous, double deviation) {
+    size_t index = size_.load(std::memory_order_relaxed);
+    if (index >= capacity_) {
+        return false;
+    }
+    rows_[index] = data;
+    anomalous_[index] = anomalous ? 1 : 0;
+    deviations_[index] = deviation;
+    if (data.timestamp_ms < minTimestamp()) {
+        minTimestamp_ms_.store(data.timestamp_ms, std::memory_order_relaxed);
+    }
+    if (data.timestamp_ms > maxTimestamp()) {
+        maxTimestamp_ms_.store(data.timestamp_ms, std::memory_order_relaxed);
+    }
+    size_.store(index + 1, std::memory_order_release); // Publishes the row to lock-free readers
+    return true;
+}
+
+void HistorySegment::classify(size_t first, size_t last) {
+    // The batch kernel, a block at a time
+    const size_t kBlockRows = 2048;
+    uint64_t anomalyBits[kBlockRows / 64];
+    for (size_t start = first; start < last; start += kBlockRows) {
+        const size_t count = std::min(kBlockRows, last - start);
+        classifiedWith_.classifyBatch(rows_.get() + start, count, anomalyBits, deviations_.get() + start);
+        for (size_t i = 0; i < count; ++i) {
+            anomalous_[start + i] = (anomalyBits[i / 64] >> (i % 64)) & 1;
+        }
+    }
+}
+
+std::shared_ptr<HistorySegment> HistorySegment::fromRows(const SensorData* rows, size_t count, int64_t partitionStart_ms,
+                                                         const AnomalyDetector& detector,
+                                                         const uint8_t* anomalous, const double* deviations) {
+    auto segment = std::make_shared<HistorySegment>(count, partitionStart_ms, detector);
+    if (anomalous && deviations) {
+        for (size_t i = 0; i < count; ++i) {
+            segment->append(rows[i], anomalous[i] != 0, deviations[i]);
+        }
+        return segment;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        segment->append(rows[i], false, 0.0);
+    }
+    segment->classify(0, count);
+    return segment;
+}
+
+std::shared_ptr<HistorySegment> HistorySegment::sharingRows(const AnomalyDetector& classifiedWith,
+                                                            bool allocateVerdicts) const {
+    std::shared_ptr<HistorySegment> copy(
+        new HistorySegment(rows_, capacity_, partitionStart_ms_, classifiedWith, allocateVerdicts));
+    // Loaded before the bounds: rows appended meanwhile may widen them, never narrow them
+    const size_t size = this->size();
+    copy->minTimestamp_ms_.store(minTimestamp(), std::memory_order_relaxed);
+    copy->maxTimestamp_ms_.store(maxTimestamp(), std::memory_order_relaxed);
+    copy->size_.store(size, std::memory_order_relaxed); // Published along with the copy
+    return copy;
+}
+
+std::shared_ptr<const uint32_t[]> HistorySegment::sortedBy(Column column) const {
+    const size_t count = size();
+    uint32_t* order = new uint32_t[count > 0 ? count : 1];
+    std::shared_ptr<const uint32_t[]> owner(order);
+    std::iota(order, order + count, 0u);
+    std::stable_sort(order, order + count, [&](uint32_t a, uint32_t b) { return keyLess(key(column, a), key(column, b)); });
+    return owner;
+}
+
+std::shared_ptr<HistorySegment> HistorySegment::reclassified(const HistorySegment& segment, const AnomalyDetector& detector,
+                                                             const uint8_t* anomalous, const double* deviations,
+                                                             size_t classified) {
+    std::shared_ptr<HistorySegment> copy = segment.sharingRows(detector, true);
+    const size_t size = copy->size();
+    classified = std::min(classified, size);
+    if (classified > 0) {
+        std::memcpy(copy->anomalous_.get(), anomalous, classified);
+        std::memcpy(copy->deviations_.get(), deviations, classified * sizeof(double));
+    }
+    copy->classify(classified, size);
+    if (segment.ordered()) {
+        for (int column = 0; column < DEVIATION_COLUMN; ++column) {
+            copy->orders_[column] = segment.orders_[column];
+        }
+        copy->orders_[DEVIATION_COLUMN] = copy->sortedBy(DEVIATION_COLUMN);
+    }
+    return copy;
+}
+
+std::shared_ptr<HistorySegment> HistorySegment::withOrders(const HistorySegment& segment, bool ordered) {
+    std::shared_ptr<HistorySegment> copy = segment.sharingRows(segment.classifiedWith_, false);
+    copy->anomalous_ = segment.anomalous_;
+    copy->deviations_ = segment.deviations_;
+    if (ordered) {
+        for (int column = 0; column < COLUMN_COUNT; ++column) {
+            copy->orders_[column] = segment.ordered() ? segment.orders_[column]
+                                                      : copy->sortedBy(static_cast<Column>(column));
+        }
+    }
+    return copy;
+}
@@ -0,0 +1,129 @@
+#include "QuantileSketch.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <utility>
+
+namespace {
+    // Lower levels shrink geometrically but never below this many samples
+    const size_t kMinLevelCapacity = 8;
+}
+
+QuantileSketch::QuantileSketch(uint32_t k)
+    : k_(std::max<uint32_t>(k, kMinLevelCapacity)),
+      count_(0),
+      min_(std::numeric_limits<double>::quiet_NaN()),
+      max_(std::numeric_limits<double>::quiet_NaN()),
+      promoteOdd_(false),
+      levels_(1) {}
+
+void QuantileSketch::add(double value) {
+    if (std::isnan(value)) {
+        return; // Has no rank
+    }
+    min_ = (count_ == 0) ? value : std::min(min_, value);
+    max_ = (count_ == 0) ? value : std::max(max_, value);
+    ++count_;
+    levels_[0].push_back(value);
+    if (levels_[0].size() >= levelCapacity(0)) {
+        compress();
+    }
+}
+
+void QuantileSketch::merge(const QuantileSketch& other) {
+    if (other.count_ == 0) {
+        return;
+    }
+    min_ = (count_ == 0) ? other.min_ : std::min(min_, other.min_);
+    max_ = (count_ == 0) ? other.max_ : std::max(max_, other.max_);
+    count_ += other.count_;
+    if (levels_.size() < other.levels_.size()) {
+        levels_.resize(other.levels_.size());
+    }
+    for (size_t h = 0; h < other.levels_.size(); ++h) {
+        levels_[h].insert(levels_[h].end(), other.levels_[h].begin(), other.levels_[h].end());
+    }
+    compress();
+}
+
+size_t QuantileSketch::levelCapacity(size_t level) const {
+    // The top level gets k samples, each level below two thirds of the one above it
+    size_t depth = levels_.size() - 1 - level;
+    double capacity = std::ceil(k_ * std::pow(2.0 / 3.0, static_cast<double>(depth)));
+    return std::max(kMinLevelCapacity, static_cast<size_t>(capacity));
+}
+
+size_t QuantileSketch::totalCapacity() const {
+    size_t total = 0;
+    for (size_t h = 0; h < levels_.size(); ++h) {
+        total += levelCapacity(h);
+    }
+    return total;
+}
+
+size_t QuantileSketch::retainedSamples() const {
+    size_t total = 0;
+    for (const auto& level : levels_) {
+        total += level.size();
+    }
+    return total;
+}
+
+void QuantileSketch::compress() {
+    while (retainedSamples() >= totalCapacity()) {
+        // Compact the lowest level that is over its capacity
+        size_t h = 0;
+        while (h < levels_.size() && levels_[h].size() < levelCapacity(h)) {
+            ++h;
+        }
+        if (h == levels_.size()) {
+            return;
+        }
+        if (h + 1 == levels_.size()) {
+            levels_.emplace_back(); // Capacities of the lower levels shrink accordingly
+        }
+
+        std::vector<double>& level = levels_[h];
+        std::sort(level.begin(), level.end());
+        // With an odd count the smallest sample stays behind so the promoted weight is exact
+        size_t first = level.size() % 2;
+        std::vector<double>& next = levels_[h + 1];
+        for (size_t i = first + (promoteOdd_ ? 1 : 0); i < level.size(); i += 2) {
+            next.push_back(level[i]);
+        }
+        promoteOdd_ = !promoteOdd_;
+        level.resize(first);
+    }
+}
+
+double QuantileSketch::quantile(double q) const {
+    if (count_ == 0) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    q = std::min(1.0, std::max(0.0, q));
+    if (q == 0.0) {
+        return min_;
+    }
+    if (q == 1.0) {
+        return max_;
+    }
+
+    std::vector<std::pair<double, uint64_t>> weighted;
+    weighted.reserve(retainedSamples());
+    for (size_t h = 0; h < levels_.size(); ++h) {
+        for (double value : levels_[h]) {
+            weighted.emplace_back(value, uint64_t{1} << h);
+        }
+    }
+    std::sort(weighted.begin(), weighted.end());
+
+    double target = q * static_cast<double>(count_);
+    uint64_t cumulative = 0;
+    for (const auto& sample : weighted) {
+        cumulative += sample.second;
+        if (static_cast<double>(cumulative) >= target) {
+            return sample.first;
+        }
+    }
+    return max_;
+}
@@ -0,0 +1,84 @@
+#include "QueryCache.hpp"
+#include <utility>
+
+QueryCache::QueryCache(size_t maxEntries, size_t maxRows)
+    : maxEntries_(maxEntries), maxRows_(maxRows) {}
+
+bool QueryCache::enabled() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return maxEntries_ > 0;
+}
+
+void QueryCache::setLimits(size_t maxEntries, size_t maxRows) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    maxEntries_ = maxEntries;
+    maxRows_ = maxRows;
+    shrinkToLimits();
+}
+
+std::optional<QueryCache::Entry> QueryCache::lookup(const std::string& key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = slots_.find(key);
+    if (it == slots_.end()) {
+        return std::nullopt;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lruPosition);
+    return it->second.entry;
+}
+
+void QueryCache::store(const std::string& key, Entry entry) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto existing = slots_.find(key);
+    if (existing != slots_.end()) {
+        erase(existing);
+    }
+    if (maxEntries_ == 0 || !entry.results || entry.results->size() > maxRows_) {
+        return; // Too big to be worth keeping; it would evict everything else
+    }
+    cachedRows_ += entry.results->size();
+    lru_.push_front(key);
+    slots_.emplace(key, Slot{std::move(entry), lru_.begin()});
+    shrinkToLimits();
+}
+
+void QueryCache::clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    slots_.clear();
+    lru_.clear();
+    cachedRows_ = 0;
+}
+
+void QueryCache::recordHit(bool incremental) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (incremental) {
+        ++stats_.incrementalHits;
+    } else {
+        ++stats_.hits;
+    }
+}
+
+void QueryCache::recordMiss() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++stats_.misses;
+}
+
+QueryCache::Stats QueryCache::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats result = stats_;
+    result.entries = slots_.size();
+    result.cachedRows = cachedRows_;
+    return result;
+}
+
+void QueryCache::erase(std::map<std::string, Slot>::iterator it) {
+    cachedRows_ -= it->second.entry.results->size();
+    lru_.erase(it->second.lruPosition);
+    slots_.erase(it);
+}
+
+void QueryCache::shrinkToLimits() {
+    while (!lru_.empty() && (slots_.size() > maxEntries_ || cachedRows_ > maxRows_)) {
+        erase(slots_.find(lru_.back()));
+        ++stats_.evictions;
+    }
+}
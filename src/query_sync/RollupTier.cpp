@@ -0,0 +1,136 @@
+#include "RollupTier.hpp"
+#include <algorithm>
+#include <limits>
+
+namespace {
+    void foldMetric(MetricSummary& summary, double value, bool first) {
+        if (first) {
+            summary = {value, value, value};
+            return;
+        }
+        summary.min = std::min(summary.min, value);
+        summary.max = std::max(summary.max, value);
+        summary.sum += value;
+    }
+
+    void mergeMetric(MetricSummary& summary, const MetricSummary& other) {
+        summary.min = std::min(summary.min, other.min);
+        summary.max = std::max(summary.max, other.max);
+        summary.sum += other.sum;
+    }
+}
+
+void RollupBucket::add(const SensorData& data, bool isAnomalous) {
+    bool first = (count == 0);
+    foldMetric(temperature, data.temperature, first);
+    foldMetric(humidity, data.humidity, first);
+    foldMetric(lightIntensity, data.lightIntensity, first);
+    lastTimestamp_ms = first ? data.timestamp_ms : std::max(lastTimestamp_ms, data.timestamp_ms);
+    ++count;
+    if (isAnomalous) {
+        ++anomalyCount;
+    }
+}
+
+void RollupBucket::merge(const RollupBucket& other) {
+    if (other.count == 0) {
+        return;
+    }
+    if (count == 0) {
+        *this = other;
+        return;
+    }
+    mergeMetric(temperature, other.temperature);
+    mergeMetric(humidity, other.humidity);
+    mergeMetric(lightIntensity, other.lightIntensity);
+    lastTimestamp_ms = std::max(lastTimestamp_ms, other.lastTimestamp_ms);
+    count += other.count;
+    anomalyCount += other.anomalyCount;
+}
+
+RollupTier::RollupTier(int64_t bucketWidth_ms)
+    : bucketWidth_ms_(bucketWidth_ms > 0 ? bucketWidth_ms : 1),
+      latestTimestamp_ms_(std::numeric_limits<int64_t>::min()) {}
+
+int64_t RollupTier::alignTimestamp(int64_t timestamp_ms, int64_t bucketWidth_ms) {
+    int64_t start = (timestamp_ms / bucketWidth_ms) * bucketWidth_ms;
+    if (start > timestamp_ms) { // Integer division truncates towards zero for negatives
+        // Open-ended ranges pass INT64_MIN; clamp instead of overflowing below it
+        start = (start < std::numeric_limits<int64_t>::min() + bucketWidth_ms)
+                    ? std::numeric_limits<int64_t>::min() : start - bucketWidth_ms;
+    }
+    return start;
+}
+
+void RollupTier::add(const SensorData& data, bool isAnomalous) {
+    int64_t start = alignTimestamp(data.timestamp_ms, bucketWidth_ms_);
+    auto it = buckets_.find(start);
+    if (it == buckets_.end()) {
+        RollupBucket bucket{};
+        bucket.bucketStart_ms = start;
+        bucket.bucketWidth_ms = bucketWidth_ms_;
+        it = buckets_.emplace(start, bucket).first;
+    }
+    it->second.add(data, isAnomalous);
+    latestTimestamp_ms_ = std::max(latestTimestamp_ms_, data.timestamp_ms);
+}
+
+void RollupTier::restoreBucket(const RollupBucket& bucket) {
+    if (bucket.bucketWidth_ms != bucketWidth_ms_ || bucket.count == 0) {
+        return;
+    }
+    auto it = buckets_.find(bucket.bucketStart_ms);
+    if (it == buckets_.end()) {
+        buckets_.emplace(bucket.bucketStart_ms, bucket);
+    } else {
+        it->second.merge(bucket);
+    }
+    latestTimestamp_ms_ = std::max(latestTimestamp_ms_, bucket.lastTimestamp_ms);
+}
+
+void RollupTier::carryOver(const RollupBucket& bucket, uint64_t previousAnomalies) {
+    if (bucket.bucketWidth_ms != bucketWidth_ms_ || bucket.count == 0) {
+        return;
+    }
+    auto it = buckets_.find(bucket.bucketStart_ms);
+    if (it == buckets_.end()) {
+        restoreBucket(bucket);
+        return;
+    }
+    if (bucket.count <= it->second.count) {
+        return; // Every reading it summarized was folded in again
+    }
+    RollupBucket kept = bucket;
+    kept.anomalyCount -= std::min(previousAnomalies, bucket.anomalyCount);
+    kept.anomalyCount += it->second.anomalyCount;
+    kept.lastTimestamp_ms = std::max(bucket.lastTimestamp_ms, it->second.lastTimestamp_ms);
+    it->second = kept;
+}
+
+std::vector<RollupBucket> RollupTier::query(int64_t start_ms, int64_t end_ms) const {
+    std::vector<RollupBucket> result;
+    if (start_ms > end_ms) {
+        return result;
+    }
+    // The bucket containing start_ms may begin before it, so start from its aligned start.
+    auto it = buckets_.lower_bound(alignTimestamp(start_ms, bucketWidth_ms_));
+    auto last = buckets_.upper_bound(end_ms);
+    for (; it != last; ++it) {
+        result.push_back(it->second);
+    }
+    return result;
+}
+
+std::vector<RollupBucket> RollupTier::allBuckets() const {
+    std::vector<RollupBucket> result;
+    result.reserve(buckets_.size());
+    for (const auto& entry : buckets_) {
+        result.push_back(entry.second);
+    }
+    return result;
+}
+
+void RollupTier::clear() {
+    buckets_.clear();
+    latestTimestamp_ms_ = std::numeric_limits<int64_t>::min();
+}
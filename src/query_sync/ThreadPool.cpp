@@ -0,0 +1,72 @@
+#include "ThreadPool.hpp"
+#include <future>
+#include <memory>
+
+ThreadPool::ThreadPool(unsigned threadCount) : stopping_(false) {
+    if (threadCount == 0) {
+        threadCount = std::thread::hardware_concurrency();
+    }
+    if (threadCount == 0) {
+        threadCount = 1; // hardware_concurrency() may report 0 when unknown
+    }
+    for (unsigned i = 0; i < threadCount; ++i) {
+        workers_.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_) {
+        if (worker.joinable()) worker.join();
+    }
+}
+
+void ThreadPool::workerLoop() {
+    while (true) {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+            if (stopping_ && tasks_.empty()) {
+                return;
+            }
+            task = std::move(tasks_.front());
+            tasks_.pop();
+        }
+        task();
+    }
+}
+
+void ThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& task) {
+    if (count == 0) {
+        return;
+    }
+    if (count == 1) {
+        task(0); // Not worth a round trip through the queue
+        return;
+    }
+
+    std::vector<std::future<void>> pending;
+    pending.reserve(count);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < count; ++i) {
+            auto packaged = std::make_shared<std::packaged_task<void()>>([&task, i] { task(i); });
+            pending.push_back(packaged->get_future());
+            tasks_.emplace([packaged] { (*packaged)(); });
+        }
+    }
+    cv_.notify_all();
+
+    // Wait for everything before rethrowing so no task outlives the caller's references
+    for (auto& future : pending) {
+        future.wait();
+    }
+    for (auto& future : pending) {
+        future.get();
+    }
+}
@@ -0,0 +1,703 @@
+#include "BlockFile.hpp"
+#include "AnomalyRules.hpp"  // For ruleMetricValue
+#include "ThresholdProfiles.hpp"
+#include "FileIO.hpp"
+#include "Crc32.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+namespace {
+    BlockFile::ReadAt streamReader(std::ifstream& in) {
+        return [&in](uint64_t offset, char* out, size_t bytes) {
+            in.clear();
+            in.seekg(static_cast<std::streamoff>(offset));
+            in.read(out, static_cast<std::streamsize>(bytes));
+            return static_cast<size_t>(in.gcount()) == bytes;
+        };
+    }
+
+    BlockFile::ReadAt memoryReader(const char* data, uint64_t size) {
+        return [data, size](uint64_t offset, char* out, size_t bytes) {
+            if (offset > size || bytes > size - offset) {
+                return false;
+            }
+            std::memcpy(out, data + offset, bytes);
+            return true;
+        };
+    }
+
+    // True if some reading within zone's ranges would be out of its sensor's thresholds, or may
+    // be flagged by a rule, which the ranges cannot tell
+    bool mayBeAnomalous(const BlockZone& zone, const AnomalyDetector& detector) {
+        if (detector.rules() && detector.rules()->statelessMask() != 0) {
+            return true;
+        }
+        auto outside = [&](const AnomalyDetector::AnomalyThresholds& t) {
+            return zone.minValue[0] < t.minTemp || zone.maxValue[0] > t.maxTemp ||
+                   zone.minValue[1] < t.minHumidity || zone.maxValue[1] > t.maxHumidity ||
+                   zone.minValue[2] < t.minLight || zone.maxValue[2] > t.maxLight;
+        };
+        if (zone.minSensorId == zone.maxSensorId) {
+            return outside(detector.thresholdsFor(zone.minSensorId));
+        }
+        // Any profile of a sensor in the block's id range may apply
+        const ThresholdProfiles& profiles = detector.profiles();
+        if (outside(profiles.defaults())) {
+            return true;
+        }
+        for (uint32_t sensorId : profiles.sensorIds()) {
+            if (sensorId >= zone.minSensorId && sensorId <= zone.maxSensorId && outside(profiles.lookup(sensorId))) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Anomalous readings among rows, which arrive in this order: stateful rules see them as the
+    // sensor's stream
+    size_t countIncoming(const AnomalyDetector& detector, const SensorData* rows, size_t count) {
+        if (detector.statefulRuleMask() == 0) {
+            return detector.countAnomalies(rows, count);
+        }
+        size_t anomalies = 0;
+        double deviation = 0.0;
+        for (size_t i = 0; i < count; ++i) {
+            anomalies += detector.classifyIncoming(rows[i], deviation) ? 1 : 0;
+        }
+        return anomalies;
+    }
+
+    // Records of a version 1 file as readings first stored them, before they had a sensor id
+    struct LegacyRecord {
+        int64_t timestamp_ms;
+        double temperature;
+        double humidity;
+        double lightIntensity;
+    };
+    static_assert(sizeof(LegacyRecord) == BlockFile::kLegacyRecordSize, "LegacyRecord was stored as-is");
+}
+
+void BlockZone::add(const SensorData& data) {
+    minTimestamp_ms = std::min(minTimestamp_ms, data.timestamp_ms);
+    maxTimestamp_ms = std::max(maxTimestamp_ms, data.timestamp_ms);
+    for (int m = 0; m < 3; ++m) {
+        const double value = ruleMetricValue(data, static_cast<RuleMetric>(m));
+        // Comparisons are false for NaN, which therefore never widens a range
+        if (value < minValue[m]) {
+            minValue[m] = value;
+        }
+        if (value > maxValue[m]) {
+            maxValue[m] = value;
+        }
+    }
+    ++count;
+    minSensorId = std::min(minSensorId, data.sensorId);
+    maxSensorId = std::max(maxSensorId, data.sensorId);
+}
+
+void BlockZone::merge(const BlockZone& other) {
+    minTimestamp_ms = std::min(minTimestamp_ms, other.minTimestamp_ms);
+    maxTimestamp_ms = std::max(maxTimestamp_ms, other.maxTimestamp_ms);
+    for (int m = 0; m < 3; ++m) {
+        minValue[m] = std::min(minValue[m], other.minValue[m]);
+        maxValue[m] = std::max(maxValue[m], other.maxValue[m]);
+    }
+    // Saturating, so a zone of many records never wraps around to an empty one
+    count = static_cast<uint32_t>(std::min<uint64_t>(uint64_t{count} + other.count, UINT32_MAX));
+    anomalyCount = static_cast<uint32_t>(std::min<uint64_t>(uint64_t{anomalyCount} + other.anomalyCount, UINT32_MAX));
+    minSensorId = std::min(minSensorId, other.minSensorId);
+    maxSensorId = std::max(maxSensorId, other.maxSensorId);
+}
+
+bool ZoneFilter::matches(const SensorData& data) const {
+    if (timeRange && (data.timestamp_ms < timeRange->first || data.timestamp_ms > timeRange->second)) {
+        return false;
+    }
+    for (int m = 0; m < 3; ++m) {
+        if (valueRange[m]) {
+            const double value = ruleMetricValue(data, static_cast<RuleMetric>(m));
+            if (!(value >= valueRange[m]->first && value <= valueRange[m]->second)) {
+                return false;
+            }
+        }
+    }
+    return !anomalousOnly || anomalousOnly->isAnomalous(data);
+}
+
+bool ZoneFilter::mayMatch(const BlockZone& zone) const {
+    if (zone.count == 0) {
+        return false;
+    }
+    if (timeRange && (zone.maxTimestamp_ms < timeRange->first || zone.minTimestamp_ms > timeRange->second)) {
+        return false;
+    }
+    for (int m = 0; m < 3; ++m) {
+        // A metric that is NaN throughout has an empty range and matches no value range
+        if (valueRange[m] && (zone.maxValue[m] < valueRange[m]->first || zone.minValue[m] > valueRange[m]->second)) {
+            return false;
+        }
+    }
+    return !anomalousOnly || mayBeAnomalous(zone, *anomalousOnly);
+}
+
+bool BlockFile::layoutOf(const ReadAt& readAt, uint64_t size, Layout& layout) {
+    layout = Layout();
+    layout.blockRecords = kDefaultBlockRecords;
+    if (size == 0) {
+        return true;
+    }
+    char magic[sizeof(kMagic)] = {};
+    if (size < sizeof(kMagic) || !readAt(0, magic, sizeof(magic)) || std::memcmp(magic, kMagic, sizeof(kMagic)) != 0) {
+        layout.legacy = true;
+        layout.records = size / BlockFile::kLegacyRecordSize;
+        layout.validBytes = layout.records * BlockFile::kLegacyRecordSize;
+        return true;
+    }
+    if (size < sizeof(Header)) {
+        return true; // Header cut short: nothing was stored after it yet
+    }
+    Header header;
+    if (!readAt(0, reinterpret_cast<char*>(&header), sizeof(Header))) {
+        return false;
+    }
+    if (header.version != kVersion || header.headerSize != sizeof(Header) ||
+        header.recordSize != sizeof(SensorData) || header.blockRecords == 0 ||
+        (header.encoding != Encoding::RAW && header.encoding != Encoding::GORILLA)) {
+        return false;
+    }
+    layout.encoding = header.encoding;
+    layout.blockRecords = header.blockRecords;
+    layout.validBytes = sizeof(Header);
+    if (header.encoding == Encoding::GORILLA) {
+        // Blocks vary in size, so they are walked by their headers
+        uint64_t offset = sizeof(Header);
+        EncodedBlockHeader block;
+        while (size - offset >= sizeof(block) + sizeof(BlockZone) &&
+               readAt(offset, reinterpret_cast<char*>(&block), sizeof(block)) && block.magic == kEncodedBlockMagic &&
+               block.count > 0 && block.count <= header.blockRecords &&
+               block.bytes <= size - offset - sizeof(block) - sizeof(BlockZone)) {
+            const uint64_t blockEnd = offset + sizeof(block) + sizeof(BlockZone) + block.bytes;
+            if (blockEnd == size) {
+                // Only the last block can have been cut short or half written
+                std::vector<char> body(sizeof(BlockZone) + block.bytes);
+                if (!readAt(offset + sizeof(block), body.data(), body.size()) ||
+                    crc32(body.data(), body.size(), crc32(&block.count, 2 * sizeof(uint32_t))) != block.crc) {
+                    break;
+                }
+            }
+            ++layout.sealedBlocks;
+            layout.records += block.count;
+            layout.validBytes = offset = blockEnd;
+        }
+        return true;
+    }
+    const uint64_t body = size - sizeof(Header);
+    layout.sealedBlocks = body / layout.blockBytes();
+    layout.tailRecords = std::min<uint64_t>((body % layout.blockBytes()) / sizeof(SensorData), header.blockRecords);
+    layout.records = layout.sealedBlocks * header.blockRecords + layout.tailRecords;
+    layout.validBytes = layout.blockOffset(layout.sealedBlocks) + layout.tailRecords * sizeof(SensorData);
+    return true;
+}
+
+bool BlockFile::readLayout(const std::string& path, Layout& layout) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        std::error_code error;
+        layout = Layout();
+        layout.blockRecords = kDefaultBlockRecords;
+        return !fs::exists(path, error) && !error; // Missing is empty, unreadable is an error
+    }
+    const uint64_t size = static_cast<uint64_t>(in.tellg());
+    return layoutOf(streamReader(in), size, layout);
+}
+
+std::vector<BlockFile::Block> BlockFile::blocks(const MappedFile& file) {
+    std::vector<Block> result;
+    Layout layout;
+    if (!layoutOf(memoryReader(file.data(), file.size()), file.size(), layout) || layout.records == 0 ||
+        layout.encoding != Encoding::RAW) {
+        return result;
+    }
+    if (layout.legacy) {
+        return result; // 32-byte records have to be widened first
+    }
+    const size_t recordBytes = layout.blockRecords * sizeof(SensorData);
+    for (uint64_t b = 0; b < layout.sealedBlocks; ++b) {
+        const char* start = file.data() + layout.blockOffset(b);
+        Block block{{reinterpret_cast<const SensorData*>(start), layout.blockRecords}, BlockZone(), true};
+        std::memcpy(&block.zone, start + recordBytes, sizeof(BlockZone));
+        result.push_back(block);
+    }
+    if (layout.tailRecords > 0) {
+        const char* start = file.data() + layout.blockOffset(layout.sealedBlocks);
+        Block block{{reinterpret_cast<const SensorData*>(start), static_cast<size_t>(layout.tailRecords)}, BlockZone(), true};
+        for (const auto& data : block.rows) {
+            block.zone.add(data);
+        }
+        result.push_back(block);
+    }
+    return result;
+}
+
+bool BlockFile::buildIndex(const std::string& path, Index& index) {
+    index = Index();
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        return false;
+    }
+    const uint64_t size = static_cast<uint64_t>(in.tellg());
+    const ReadAt readAt = streamReader(in);
+    Layout layout;
+    if (!layoutOf(readAt, size, layout) || layout.legacy) {
+        return false;
+    }
+    index.encoding = layout.encoding;
+    index.fileBytes = size;
+    index.records = layout.records;
+    if (layout.encoding == Encoding::GORILLA) {
+        for (uint64_t offset = sizeof(Header); offset < layout.validBytes;) {
+            EncodedBlockHeader block;
+            IndexEntry entry{offset, 0, BlockZone()};
+            if (!readAt(offset, reinterpret_cast<char*>(&block), sizeof(block)) ||
+                !readAt(offset + sizeof(block), reinterpret_cast<char*>(&entry.zone), sizeof(BlockZone))) {
+                return false;
+            }
+            entry.count = block.count;
+            index.blocks.push_back(entry);
+            offset += sizeof(block) + sizeof(BlockZone) + block.bytes;
+        }
+    } else {
+        for (uint64_t b = 0; b < layout.sealedBlocks; ++b) {
+            IndexEntry entry{layout.blockOffset(b), layout.blockRecords, BlockZone()};
+            if (!readAt(entry.offset + layout.blockRecords * sizeof(SensorData), reinterpret_cast<char*>(&entry.zone),
+                        sizeof(BlockZone))) {
+                return false;
+            }
+            index.blocks.push_back(entry);
+        }
+        if (layout.tailRecords > 0) {
+            // The tail has no footer; its zone is taken from its rows, without an anomalyCount
+            IndexEntry entry{layout.blockOffset(layout.sealedBlocks), layout.tailRecords, BlockZone()};
+            std::vector<SensorData> tail(static_cast<size_t>(layout.tailRecords));
+            if (!readAt(entry.offset, reinterpret_cast<char*>(tail.data()), tail.size() * sizeof(SensorData))) {
+                return false;
+            }
+            for (const auto& data : tail) {
+                entry.zone.add(data);
+            }
+            index.blocks.push_back(entry);
+        }
+    }
+    for (const auto& entry : index.blocks) {
+        index.zone.merge(entry.zone);
+    }
+    return true;
+}
+
+bool BlockFile::writeIndex(const std::string& path, const Index& index) {
+    IndexHeader header{};
+    std::memcpy(header.magic, kIndexMagic, sizeof(header.magic));
+    header.version = kVersion;
+    header.encoding = index.encoding;
+    header.fileBytes = index.fileBytes;
+    header.records = index.records;
+    header.blocks = index.blocks.size();
+    header.zone = index.zone;
+    const size_t entryBytes = index.blocks.size() * sizeof(IndexEntry);
+    header.crc = crc32(index.blocks.data(), entryBytes, crc32(&header, offsetof(IndexHeader, crc)));
+    std::vector<char> out(sizeof(header) + entryBytes);
+    std::memcpy(out.data(), &header, sizeof(header));
+    if (entryBytes > 0) {
+        std::memcpy(out.data() + sizeof(header), index.blocks.data(), entryBytes);
+    }
+    return replaceFile(path, out.data(), out.size());
+}
+
+bool BlockFile::readIndex(const std::string& path, Index& index) {
+    index = Index();
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        return false;
+    }
+    const uint64_t size = static_cast<uint64_t>(in.tellg());
+    in.seekg(0);
+    IndexHeader header;
+    if (size < sizeof(header) || !in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) != 0 || header.version != kVersion ||
+        header.blocks != (size - sizeof(header)) / sizeof(IndexEntry)) {
+        return false;
+    }
+    index.blocks.resize(static_cast<size_t>(header.blocks));
+    const size_t entryBytes = index.blocks.size() * sizeof(IndexEntry);
+    if (!in.read(reinterpret_cast<char*>(index.blocks.data()), static_cast<std::streamsize>(entryBytes)) ||
+        crc32(index.blocks.data(), entryBytes, crc32(&header, offsetof(IndexHeader, crc))) != header.crc) {
+        index = Index();
+        return false;
+    }
+    index.encoding = header.encoding;
+    index.fileBytes = header.fileBytes;
+    index.records = header.records;
+    index.zone = header.zone;
+    return true;
+}
+
+bool BlockFile::scan(const std::string& path, const ZoneFilter* filter, size_t maxRecords,
+                     const std::function<void(const SensorData* rows, size_t count)>& consumer, ScanStats* stats,
+                     const Index* index) {
+    return scanBlocks(path, filter, maxRecords, consumer, nullptr, stats, index);
+}
+
+bool BlockFile::scanColumns(const std::string& path, const ZoneFilter* filter, size_t maxRecords,
+                            const std::function<void(const ColumnBatch& columns)>& consumer, ScanStats* stats,
+                            const Index* index) {
+    return scanBlocks(path, filter, maxRecords, nullptr, consumer, stats, index);
+}
+
+bool BlockFile::scanBlocks(const std::string& path, const ZoneFilter* filter, size_t maxRecords,
+                           const std::function<void(const SensorData* rows, size_t count)>& rowConsumer,
+                           const std::function<void(const ColumnBatch& columns)>& columnConsumer, ScanStats* stats,
+                           const Index* index) {
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        return false;
+    }
+    const uint64_t size = static_cast<uint64_t>(in.tellg());
+    const ReadAt readAt = streamReader(in);
+    if (index) {
+        // Only an index of the file as it is now describes it
+        Header header;
+        if (index->fileBytes != size || !readAt(0, reinterpret_cast<char*>(&header), sizeof(header)) ||
+            std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.encoding != index->encoding) {
+            index = nullptr;
+        }
+    }
+    Layout layout;
+    if (!index && !layoutOf(readAt, size, layout)) {
+        return false;
+    }
+
+    std::vector<SensorData> rows;
+    ColumnBatch columns;
+    std::vector<char> encoded;
+    std::vector<LegacyRecord> legacyRows;
+    // Hands count rows of rows or columns, whichever holds them, to the consumer
+    auto deliver = [&](bool inColumns, size_t count) {
+        if (stats) {
+            ++stats->blocksRead;
+        }
+        if (rowConsumer) {
+            if (inColumns) {
+                rows.clear();
+                columns.appendRows(0, count, rows);
+            }
+            rowConsumer(rows.data(), count);
+        } else {
+            if (!inColumns) {
+                columns.clear();
+                columns.append(rows.data(), count);
+            }
+            columns.truncate(count);
+            columnConsumer(columns);
+        }
+    };
+    auto readRows = [&](uint64_t offset, size_t count) {
+        rows.resize(count);
+        if (!readAt(offset, reinterpret_cast<char*>(rows.data()), count * sizeof(SensorData))) {
+            return false; // Shrunk under us
+        }
+        deliver(false, count);
+        return true;
+    };
+    auto skipped = [&]() {
+        if (stats) {
+            ++stats->blocksSkipped;
+        }
+    };
+    // Reads the GORILLA block at offset and hands over its first count records, unless its zone
+    // map is ruled out by zoneFilter; next is set to the offset after it. False if damaged.
+    auto readEncoded = [&](uint64_t offset, size_t count, const ZoneFilter* zoneFilter, uint64_t& next) {
+        EncodedBlockHeader block;
+        BlockZone zone;
+        if (!readAt(offset, reinterpret_cast<char*>(&block), sizeof(block)) ||
+            !readAt(offset + sizeof(block), reinterpret_cast<char*>(&zone), sizeof(BlockZone))) {
+            return false;
+        }
+        const uint64_t payload = offset + sizeof(block) + sizeof(BlockZone);
+        next = payload + block.bytes;
+        if (zoneFilter && !zoneFilter->mayMatch(zone)) {
+            skipped();
+            return true;
+        }
+        encoded.resize(block.bytes);
+        if (!readAt(payload, encoded.data(), encoded.size()) ||
+            crc32(encoded.data(), encoded.size(),
+                  crc32(&zone, sizeof(zone), crc32(&block.count, 2 * sizeof(uint32_t)))) != block.crc) {
+            return false;
+        }
+        columns.clear();
+        if (!GorillaCodec::decode(encoded.data(), encoded.size(), block.count, columns)) {
+            return false;
+        }
+        deliver(true, count);
+        return true;
+    };
+
+    if (index) {
+        uint64_t remaining = std::min<uint64_t>(index->records, maxRecords);
+        for (const auto& block : index->blocks) {
+            if (remaining == 0) {
+                break;
+            }
+            const size_t count = static_cast<size_t>(std::min<uint64_t>(remaining, block.count));
+            remaining -= count;
+            if (filter && !filter->mayMatch(block.zone)) {
+                skipped();
+                continue;
+            }
+            uint64_t next = 0;
+            if (index->encoding == Encoding::GORILLA) {
+                if (!readEncoded(block.offset, count, nullptr, next)) {
+                    return false;
+                }
+            } else if (!readRows(block.offset, count)) {
+                break;
+            }
+        }
+        return true;
+    }
+
+    uint64_t remaining = std::min<uint64_t>(layout.records, maxRecords);
+    if (layout.legacy) {
+        // No zone maps to skip by; read in blocks of the default size all the same
+        for (uint64_t offset = 0; remaining > 0;) {
+            const size_t count = static_cast<size_t>(std::min<uint64_t>(remaining, kDefaultBlockRecords));
+            legacyRows.resize(count);
+            if (!readAt(offset, reinterpret_cast<char*>(legacyRows.data()), count * sizeof(LegacyRecord))) {
+                break;
+            }
+            rows.resize(count);
+            for (size_t i = 0; i < count; ++i) {
+                const LegacyRecord& record = legacyRows[i];
+                rows[i] = SensorData{record.timestamp_ms, record.temperature, record.humidity, record.lightIntensity};
+            }
+            deliver(false, count);
+            offset += count * sizeof(LegacyRecord);
+            remaining -= count;
+        }
+        return true;
+    }
+
+    if (layout.encoding == Encoding::GORILLA) {
+        uint64_t offset = sizeof(Header);
+        while (remaining > 0 && offset < layout.validBytes) {
+            EncodedBlockHeader block;
+            if (!readAt(offset, reinterpret_cast<char*>(&block), sizeof(block))) {
+                break;
+            }
+            const size_t count = static_cast<size_t>(std::min<uint64_t>(remaining, block.count));
+            remaining -= count;
+            if (!readEncoded(offset, count, filter, offset)) {
+                return false; // Damaged
+            }
+        }
+        return true;
+    }
+
+    const uint64_t blockCount = layout.sealedBlocks + (layout.tailRecords > 0 ? 1 : 0);
+    for (uint64_t b = 0; b < blockCount && remaining > 0; ++b) {
+        const bool sealed = b < layout.sealedBlocks;
+        const size_t count = static_cast<size_t>(std::min<uint64_t>(remaining, sealed ? layout.blockRecords : layout.tailRecords));
+        remaining -= count;
+        if (filter && sealed) {
+            BlockZone zone;
+            if (readAt(layout.blockOffset(b) + layout.blockRecords * sizeof(SensorData), reinterpret_cast<char*>(&zone),
+                       sizeof(BlockZone)) && !filter->mayMatch(zone)) {
+                skipped();
+                continue;
+            }
+        }
+        if (!readRows(layout.blockOffset(b), count)) {
+            break;
+        }
+    }
+    return true;
+}
+
+BlockFileAppender::BlockFileAppender(const std::string& path, const AnomalyDetector& detector,
+                                     BlockFile::Encoding encoding, uint32_t blockRecords)
+    : path_(path), detector_(detector.withFreshRuleState()), encoding_(encoding), blockRecords_(blockRecords) {
+    if (blockRecords_ == 0) {
+        blockRecords_ = encoding == BlockFile::Encoding::GORILLA ? BlockFile::kDefaultEncodedBlockRecords
+                                                                  : BlockFile::kDefaultBlockRecords;
+    }
+}
+
+BlockFileAppender::~BlockFileAppender() {
+    if (fd_ >= 0) {
+        closeFile(fd_);
+    }
+}
+
+bool BlockFileAppender::open(bool truncate) {
+    if (fd_ >= 0) {
+        return true;
+    }
+    records_ = 0;
+    tailRecords_ = 0;
+    tailZone_ = BlockZone();
+    pending_.clear();
+    std::error_code error;
+    if (truncate) {
+        fs::remove(path_, error);
+    }
+    BlockFile::Layout layout;
+    if (!BlockFile::readLayout(path_, layout)) {
+        return false;
+    }
+    if (layout.legacy && layout.records > 0) {
+        return upgradeLegacy(layout.records) && open();
+    }
+
+    out_.clear();
+    if (layout.legacy || layout.validBytes < sizeof(BlockFile::Header)) {
+        // Missing, empty or holding nothing worth keeping: start a new file
+        fs::remove(path_, error);
+        BlockFile::Header header{};
+        std::memcpy(header.magic, BlockFile::kMagic, sizeof(header.magic));
+        header.version = BlockFile::kVersion;
+        header.headerSize = sizeof(BlockFile::Header);
+        header.recordSize = sizeof(SensorData);
+        header.blockRecords = blockRecords_;
+        header.encoding = encoding_;
+        out_.resize(sizeof(header));
+        std::memcpy(out_.data(), &header, sizeof(header));
+    } else {
+        encoding_ = layout.encoding;
+        blockRecords_ = layout.blockRecords;
+        if (fs::file_size(path_, error) > layout.validBytes) {
+            fs::resize_file(path_, layout.validBytes, error); // Cut what a crash tore
+            if (error) {
+                return false;
+            }
+        }
+        records_ = layout.records;
+        tailRecords_ = static_cast<uint32_t>(layout.tailRecords);
+        if (tailRecords_ > 0) {
+            // The tail's zone map is rebuilt from its rows
+            std::vector<SensorData> tail(tailRecords_);
+            std::ifstream in(path_, std::ios::binary);
+            in.seekg(static_cast<std::streamoff>(layout.blockOffset(layout.sealedBlocks)));
+            if (!in.read(reinterpret_cast<char*>(tail.data()), static_cast<std::streamsize>(tail.size() * sizeof(SensorData)))) {
+                return false;
+            }
+            for (const auto& data : tail) {
+                tailZone_.add(data);
+            }
+            tailZone_.anomalyCount = static_cast<uint32_t>(countIncoming(detector_, tail.data(), tail.size()));
+        }
+    }
+
+    fd_ = openForAppend(path_);
+    if (fd_ < 0) {
+        return false;
+    }
+    if (tailRecords_ == blockRecords_) {
+        sealTail(); // A crash came between the last record and the footer
+    }
+    return out_.empty() || writeAll(fd_, out_.data(), out_.size());
+}
+
+bool BlockFileAppender::upgradeLegacy(uint64_t records) {
+    const std::string tempPath = path_ + ".upgrade";
+    BlockFileAppender upgraded(tempPath, detector_, encoding_, blockRecords_);
+    bool ok = upgraded.open(true);
+    ok = ok && BlockFile::scan(path_, nullptr, records, [&](const SensorData* rows, size_t count) {
+        ok = ok && upgraded.append(rows, count);
+    });
+    ok = upgraded.close() && ok;
+    if (!ok) {
+        std::remove(tempPath.c_str());
+        return false;
+    }
+#ifdef _WIN32
+    std::remove(path_.c_str()); // rename does not replace existing files here
+#endif
+    return std::rename(tempPath.c_str(), path_.c_str()) == 0;
+}
+
+bool BlockFileAppender::append(const SensorData* rows, size_t count) {
+    if (fd_ < 0) {
+        return false;
+    }
+    out_.clear();
+    for (size_t i = 0; i < count;) {
+        // Up to the end of the current block
+        const size_t run = std::min<size_t>(count - i, blockRecords_ - tailRecords_);
+        if (encoding_ == BlockFile::Encoding::GORILLA) {
+            pending_.insert(pending_.end(), rows + i, rows + i + run); // Encoded once the block is full
+        } else {
+            const char* bytes = reinterpret_cast<const char*>(rows + i);
+            out_.insert(out_.end(), bytes, bytes + run * sizeof(SensorData));
+        }
+        for (size_t k = i; k < i + run; ++k) {
+            tailZone_.add(rows[k]);
+        }
+        tailZone_.anomalyCount += static_cast<uint32_t>(countIncoming(detector_, rows + i, run));
+        tailRecords_ += static_cast<uint32_t>(run);
+        records_ += run;
+        i += run;
+        if (tailRecords_ == blockRecords_) {
+            sealTail();
+        }
+    }
+    return out_.empty() || writeAll(fd_, out_.data(), out_.size());
+}
+
+void BlockFileAppender::sealTail() {
+    const char* zone = reinterpret_cast<const char*>(&tailZone_);
+    if (encoding_ == BlockFile::Encoding::GORILLA) {
+        const size_t start = out_.size();
+        out_.resize(start + sizeof(BlockFile::EncodedBlockHeader) + sizeof(BlockZone));
+        std::memcpy(out_.data() + start + sizeof(BlockFile::EncodedBlockHeader), zone, sizeof(BlockZone));
+        GorillaCodec::encode(pending_.data(), pending_.size(), out_);
+        BlockFile::EncodedBlockHeader block{BlockFile::kEncodedBlockMagic, tailRecords_,
+                                            static_cast<uint32_t>(out_.size() - start - sizeof(block) - sizeof(BlockZone)), 0};
+        block.crc = crc32(out_.data() + start + sizeof(block), out_.size() - start - sizeof(block),
+                          crc32(&block.count, 2 * sizeof(uint32_t)));
+        std::memcpy(out_.data() + start, &block, sizeof(block));
+        pending_.clear();
+    } else {
+        out_.insert(out_.end(), zone, zone + sizeof(BlockZone));
+    }
+    tailRecords_ = 0;
+    tailZone_ = BlockZone();
+}
+
+bool BlockFileAppender::close(std::vector<SensorData>* unsealed) {
+    if (fd_ < 0) {
+        return true;
+    }
+    bool ok = true;
+    if (unsealed && !pending_.empty()) {
+        records_ -= pending_.size();
+        *unsealed = std::move(pending_);
+        pending_.clear();
+        tailRecords_ = 0;
+        tailZone_ = BlockZone();
+    } else if (encoding_ == BlockFile::Encoding::GORILLA && tailRecords_ > 0) {
+        out_.clear();
+        sealTail(); // Short, as GORILLA blocks cannot be appended to
+        ok = writeAll(fd_, out_.data(), out_.size());
+    }
+    ok = syncFile(fd_) && ok;
+    closeFile(fd_);
+    fd_ = -1;
+    return ok;
+}
@@ -0,0 +1,196 @@
+#include "BufferedAppender.hpp"
+#include "Crc32.hpp"
+#include "FileIO.hpp"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+    BufferedAppender::Policy sanitized(BufferedAppender::Policy policy) {
+        policy.bufferRecords = std::max<size_t>(policy.bufferRecords, 1);
+        policy.flushInterval_ms = std::max<int64_t>(policy.flushInterval_ms, 0);
+        policy.syncInterval_ms = std::max<int64_t>(policy.syncInterval_ms, 1);
+        return policy;
+    }
+}
+
+BufferedAppender::BufferedAppender(const std::string& path, const Policy& policy, bool retain)
+    : path_(path), policy_(sanitized(policy)), retain_(retain), lastSync_(std::chrono::steady_clock::now()) {}
+
+BufferedAppender::~BufferedAppender() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeFlusher_.notify_all();
+    if (flusher_.joinable()) {
+        flusher_.join();
+    }
+    close();
+}
+
+bool BufferedAppender::openLocked() {
+    if (fd_ < 0) {
+        fd_ = openForAppend(path_);
+        if (fd_ < 0) {
+            return false;
+        }
+    }
+    if (!flusher_.joinable() && !stopping_) {
+        flusher_ = std::thread([this]() { flusherLoop(); });
+    }
+    return true;
+}
+
+bool BufferedAppender::append(const SensorData* rows, size_t count) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (failed_ || !openLocked()) {
+        return false;
+    }
+    buffer_.insert(buffer_.end(), rows, rows + count);
+    if (retain_) {
+        retained_.insert(retained_.end(), rows, rows + count);
+    }
+    appendedSeq_ += count;
+    stats_.appended += count;
+    if (policy_.durability == Durability::PER_BATCH) {
+        return commit(lock, appendedSeq_, true);
+    }
+    if (buffer_.size() >= policy_.bufferRecords) {
+        return commit(lock, appendedSeq_, false);
+    }
+    return true;
+}
+
+bool BufferedAppender::commit(std::unique_lock<std::mutex>& lock, uint64_t target, bool sync) {
+    while ((sync ? durableSeq_ : writtenSeq_) < target) {
+        if (failed_) {
+            return false;
+        }
+        if (writing_) {
+            // Another writer has the file; its batch may already cover target
+            committed_.wait(lock);
+            continue;
+        }
+        if (fd_ < 0 && !openLocked()) {
+            return false;
+        }
+
+        // Take everything buffered so far as one batch; appends go on into the other buffer
+        writing_ = true;
+        spare_.clear();
+        buffer_.swap(spare_);
+        const std::vector<SensorData>& batch = spare_;
+        const uint64_t batchEnd = appendedSeq_;
+        const bool syncBatch = sync || policy_.durability == Durability::PER_BATCH;
+        const int fd = fd_;
+        lock.unlock();
+        bool ok = true;
+        if (!batch.empty()) {
+            // Header and records go out in one write, so appends of other processes cannot interleave
+            const size_t size = batch.size() * sizeof(SensorData);
+            FrameHeader header{static_cast<uint32_t>(batch.size()), 0};
+            header.crc = crc32(batch.data(), size, crc32(&header.count, sizeof(header.count)));
+            frame_.resize(sizeof(FrameHeader) + size);
+            std::memcpy(frame_.data(), &header, sizeof(FrameHeader));
+            std::memcpy(frame_.data() + sizeof(FrameHeader), batch.data(), size);
+            ok = writeAll(fd, frame_.data(), frame_.size());
+        }
+        if (ok && syncBatch) {
+            ok = syncFile(fd);
+        }
+        lock.lock();
+
+        writing_ = false;
+        if (!ok) {
+            failed_ = true;
+        } else {
+            if (!batch.empty()) {
+                writtenSeq_ = batchEnd;
+                ++stats_.writes;
+            }
+            if (syncBatch) {
+                durableSeq_ = batchEnd;
+                ++stats_.syncs;
+                lastSync_ = std::chrono::steady_clock::now();
+            }
+        }
+        committed_.notify_all();
+    }
+    return !failed_;
+}
+
+bool BufferedAppender::flush(bool sync) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return commit(lock, appendedSeq_, sync);
+}
+
+bool BufferedAppender::close() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    bool ok = commit(lock, appendedSeq_, true);
+    while (writing_) {
+        committed_.wait(lock);
+    }
+    if (fd_ >= 0) {
+        closeFile(fd_);
+        fd_ = -1;
+    }
+    // Readings of a failed batch are lost; the next append retries with a fresh file handle
+    failed_ = false;
+    writtenSeq_ = durableSeq_ = appendedSeq_;
+    buffer_.clear();
+    std::vector<SensorData>().swap(retained_);
+    return ok;
+}
+
+void BufferedAppender::copyRetained(std::vector<SensorData>& rows) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    rows.insert(rows.end(), retained_.begin(), retained_.end());
+}
+
+size_t BufferedAppender::retainedCount() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return retained_.size();
+}
+
+void BufferedAppender::setPolicy(const Policy& policy) {
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        commit(lock, appendedSeq_, false);
+        policy_ = sanitized(policy);
+    }
+    wakeFlusher_.notify_all(); // Its timing may have changed
+}
+
+BufferedAppender::Policy BufferedAppender::policy() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return policy_;
+}
+
+BufferedAppender::Stats BufferedAppender::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_;
+}
+
+void BufferedAppender::flusherLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!stopping_) {
+        // Wake for whichever of the flush and sync deadlines comes first
+        int64_t interval = policy_.flushInterval_ms;
+        if (policy_.durability == Durability::PERIODIC) {
+            interval = interval > 0 ? std::min(interval, policy_.syncInterval_ms) : policy_.syncInterval_ms;
+        }
+        if (interval > 0) {
+            wakeFlusher_.wait_for(lock, std::chrono::milliseconds(interval));
+        } else {
+            wakeFlusher_.wait(lock);
+        }
+        if (stopping_ || failed_) {
+            continue;
+        }
+        const bool syncDue = policy_.durability == Durability::PERIODIC && durableSeq_ < appendedSeq_ &&
+                             std::chrono::steady_clock::now() - lastSync_ >= std::chrono::milliseconds(policy_.syncInterval_ms);
+        if (syncDue || (policy_.flushInterval_ms > 0 && writtenSeq_ < appendedSeq_)) {
+            commit(lock, appendedSeq_, syncDue);
+        }
+    }
+}
@@ -2,97 +2,466 @@
 #include <iostream> // For error logging, consider a more robust logging mechanism for production
 #include <iomanip> // For std::fixed and std::setprecision in JSON
 #include <sstream> // For JSON string building
+#include <cstdio>  // For std::rename and std::remove
+#include <cstring> // For std::memcpy and std::memcmp
+#include <algorithm> // For std::min
+#include <filesystem>
+
+namespace fs = std::filesystem;
+
+namespace {
+    // anomaly_report.json -> anomaly_report_episodes.json
+    std::string episodePathFor(const std::string& jsonReportPath) {
+        size_t dot = jsonReportPath.find_last_of('.');
+        size_t slash = jsonReportPath.find_last_of("/\\");
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+            return jsonReportPath + "_episodes";
+        }
+        return jsonReportPath.substr(0, dot) + "_episodes" + jsonReportPath.substr(dot);
+    }
+}
 
 DataStorage::DataStorage(const std::string& binaryFilePath, const std::string& jsonReportPath)
-    : binaryFilePath_(binaryFilePath), jsonReportPath_(jsonReportPath) {}
+    : binaryFilePath_(binaryFilePath), jsonReportPath_(jsonReportPath), episodeReportPath_(episodePathFor(jsonReportPath)),
+      rollupFilePath_(binaryFilePath + ".rollup"), coldCatalogPath_(binaryFilePath + ".cold"),
+      files_(std::make_unique<SegmentedFile>(binaryFilePath)),
+      wal_(std::make_unique<WriteAheadLog>(*files_, BufferedAppender::Policy())) {
+    renameOldColdFiles();
+}
 
 bool DataStorage::storeData(const SensorData& data) {
-    std::ofstream outFile(binaryFilePath_, std::ios::binary | std::ios::app);
-    if (!outFile) {
-        // std::cerr << "Error opening binary file for writing: " << binaryFilePath_ << std::endl;
+    return wal_->append(&data, 1);
+}
+
+bool DataStorage::storeDataBatch(const std::vector<SensorData>& dataBatch) {
+    return wal_->append(dataBatch.data(), dataBatch.size());
+}
+
+void DataStorage::setAppendPolicy(const BufferedAppender::Policy& policy) {
+    wal_->setPolicy(policy);
+}
+
+BufferedAppender::Policy DataStorage::appendPolicy() const {
+    return wal_->policy();
+}
+
+BufferedAppender::Stats DataStorage::appendStats() const {
+    return wal_->stats();
+}
+
+bool DataStorage::flush() {
+    return wal_->flush();
+}
+
+bool DataStorage::checkpoint() {
+    return wal_->checkpoint();
+}
+
+void DataStorage::setCheckpointRecords(size_t records) {
+    wal_->setCheckpointRecords(records);
+}
+
+uint64_t DataStorage::checkpointCount() const {
+    return wal_->checkpointCount();
+}
+
+bool DataStorage::replaceAllData(const std::vector<SensorData>& dataBatch) {
+    return replaceAllData(std::vector<SensorDataSpan>{{dataBatch.data(), dataBatch.size()}});
+}
+
+bool DataStorage::replaceAllData(const std::vector<SensorDataSpan>& spans) {
+    return wal_->replaceBase([&]() {
+        return files_->replace(spans);
+    });
+}
+
+bool DataStorage::setSegmentPolicy(const SegmentedFile::Policy& policy) {
+    return files_->setPolicy(policy);
+}
+
+SegmentedFile::Policy DataStorage::segmentPolicy() const {
+    return files_->policy();
+}
+
+SegmentedFile::Stats DataStorage::segmentStats() const {
+    return files_->stats();
+}
+
+bool DataStorage::compactSegments() {
+    return files_->compact();
+}
+
+void DataStorage::setAnomalyDetector(const AnomalyDetector& detector) {
+    files_->setAnomalyDetector(detector);
+    std::lock_guard<std::mutex> lock(detectorMutex_);
+    detector_ = detector;
+}
+
+void DataStorage::setStorageEncoding(BlockFile::Encoding encoding) {
+    files_->setEncoding(encoding);
+}
+
+BlockFile::Encoding DataStorage::storageEncoding() const {
+    return files_->encoding();
+}
+
+bool DataStorage::unsealedReadings(std::vector<SensorData>& rows, uint64_t& firstPosition) const {
+    return wal_->read([&](const std::vector<SensorData>& unsealed) {
+        rows = unsealed;
+        return files_->position(firstPosition);
+    });
+}
+
+size_t DataStorage::unsealedSkip(const std::vector<SensorData>& rows, uint64_t rowsPosition, uint64_t scannedEnd) {
+    // A checkpoint during the scan moved them to the binary file
+    return static_cast<size_t>(std::min<uint64_t>(scannedEnd > rowsPosition ? scannedEnd - rowsPosition : 0, rows.size()));
+}
+
+bool DataStorage::loadDataInChunks(size_t chunkRecords, const std::function<void(std::vector<SensorData>&)>& consumer,
+                                   size_t maxRecords, uint64_t* firstPosition) {
+    if (chunkRecords == 0) {
+        chunkRecords = 1;
+    }
+    // The log is read first and the file scanned without holding back checkpoints, which the
+    // consumer may wait on
+    std::vector<SensorData> unsealed;
+    uint64_t unsealedPosition = 0;
+    if (!unsealedReadings(unsealed, unsealedPosition)) {
         return false;
     }
-    outFile.write(reinterpret_cast<const char*>(&data), sizeof(SensorData));
-    outFile.close();
-    return !outFile.fail(); // Check if write was successful before closing
+    std::vector<SensorData> chunk;
+    chunk.reserve(chunkRecords);
+    size_t scanned = 0;
+    auto regroup = [&](const SensorData* rows, size_t count) {
+        // Blocks are regrouped into chunks of the requested size
+        while (count > 0) {
+            size_t take = std::min(count, chunkRecords - chunk.size());
+            chunk.insert(chunk.end(), rows, rows + take);
+            rows += take;
+            count -= take;
+            if (chunk.size() == chunkRecords) {
+                consumer(chunk);
+                chunk.clear();
+            }
+        }
+    };
+    uint64_t first = 0;
+    bool ok = files_->scan(nullptr, maxRecords, [&](const SensorData* rows, size_t count) {
+        scanned += count;
+        regroup(rows, count);
+    }, nullptr, firstPosition ? firstPosition : &first);
+    if (ok && scanned < maxRecords) {
+        const uint64_t scannedEnd = (firstPosition ? *firstPosition : first) + scanned;
+        const size_t skip = unsealedSkip(unsealed, unsealedPosition, scannedEnd);
+        regroup(unsealed.data() + skip, std::min(unsealed.size() - skip, maxRecords - scanned));
+    }
+    if (!chunk.empty()) {
+        consumer(chunk);
+    }
+    return ok;
 }
 
-bool DataStorage::storeDataBatch(const std::vector<SensorData>& dataBatch) {
-    std::ofstream outFile(binaryFilePath_, std::ios::binary | std::ios::app);
-    if (!outFile) {
-        // std::cerr << "Error opening binary file for writing batch: " << binaryFilePath_ << std::endl;
+bool DataStorage::loadColumns(const std::function<void(const ColumnBatch&)>& consumer, size_t maxRecords) {
+    std::vector<SensorData> unsealed;
+    uint64_t unsealedPosition = 0;
+    if (!unsealedReadings(unsealed, unsealedPosition)) {
         return false;
     }
-    for (const auto& data : dataBatch) {
-        outFile.write(reinterpret_cast<const char*>(&data), sizeof(SensorData));
-        if (outFile.fail()) { // Check after each write
-            // std::cerr << "Error writing data to binary file: " << binaryFilePath_ << std::endl;
-            outFile.close();
+    size_t scanned = 0;
+    uint64_t first = 0;
+    bool ok = files_->scanColumns(nullptr, maxRecords, [&](const ColumnBatch& columns) {
+        scanned += columns.size();
+        consumer(columns);
+    }, nullptr, &first);
+    if (ok && scanned < maxRecords) {
+        const size_t skip = unsealedSkip(unsealed, unsealedPosition, first + scanned);
+        ColumnBatch columns;
+        columns.append(unsealed.data() + skip, std::min(unsealed.size() - skip, maxRecords - scanned));
+        if (columns.size() > 0) {
+            consumer(columns);
+        }
+    }
+    return ok;
+}
+
+std::vector<SensorData> DataStorage::loadMatching(const ZoneFilter& filter, BlockFile::ScanStats* stats) {
+    std::vector<SensorData> matching;
+    wal_->read([&](const std::vector<SensorData>& unsealed) {
+        files_->scan(&filter, std::numeric_limits<size_t>::max(), [&](const SensorData* rows, size_t count) {
+            for (size_t i = 0; i < count; ++i) {
+                if (filter.matches(rows[i])) {
+                    matching.push_back(rows[i]);
+                }
+            }
+        }, stats);
+        for (const auto& data : unsealed) {
+            if (filter.matches(data)) {
+                matching.push_back(data);
+            }
+        }
+        return true;
+    });
+    return matching;
+}
+
+size_t DataStorage::recordCount() const {
+    uint64_t records = 0;
+    bool ok = wal_->readCount([&](uint64_t unsealed) {
+        if (!files_->records(records)) {
             return false;
         }
+        records += unsealed;
+        return true;
+    });
+    return ok ? static_cast<size_t>(records) : 0;
+}
+
+bool DataStorage::position(uint64_t& records) const {
+    return wal_->readCount([&](uint64_t unsealed) {
+        if (!files_->position(records)) {
+            return false;
+        }
+        records += unsealed;
+        return true;
+    });
+}
+
+std::vector<SensorData> DataStorage::loadAllData() {
+    std::vector<SensorData> allData;
+    wal_->read([&](const std::vector<SensorData>& unsealed) {
+        uint64_t records = 0;
+        if (!files_->records(records)) {
+            // std::cerr << "Error opening binary file for reading: " << binaryFilePath_ << std::endl;
+            return false; // Return empty vector
+        }
+        // Size the vector once and read the records block by block
+        allData.reserve(static_cast<size_t>(records) + unsealed.size());
+        files_->scan(nullptr, std::numeric_limits<size_t>::max(), [&](const SensorData* rows, size_t count) {
+            allData.insert(allData.end(), rows, rows + count);
+        });
+        allData.insert(allData.end(), unsealed.begin(), unsealed.end());
+        return true;
+    });
+    return allData;
+}
+
+MappedBlocks DataStorage::mapAllData() const {
+    MappedBlocks mapped;
+    bool ok = wal_->read([&](const std::vector<SensorData>& unsealed) {
+        for (const auto& segment : files_->snapshot(&mapped.firstPosition)) {
+            std::shared_ptr<const MappedFile> file = MappedFile::open(segment.path);
+            if (!file) {
+                continue; // Missing or empty
+            }
+            std::vector<BlockFile::Block> blocks = BlockFile::blocks(*file);
+            BlockFile::Layout layout;
+            if (blocks.empty() && (!BlockFile::readLayout(segment.path, layout) || layout.records > 0)) {
+                return false; // GORILLA encoded or 32-byte records, so the segments cannot all be viewed in place
+            }
+            for (const auto& block : blocks) {
+                mapped.blocks.push_back(block);
+                mapped.records += block.rows.size;
+            }
+            if (!blocks.empty()) {
+                mapped.files.push_back(file);
+            }
+        }
+        mapped.unsealed = unsealed;
+        return true;
+    });
+    return ok ? mapped : MappedBlocks();
+}
+
+bool DataStorage::replaceRollupData(const std::vector<RollupBucket>& buckets, std::optional<uint64_t> coveredRecords) {
+    std::ofstream outFile(rollupFilePath_, std::ios::binary | std::ios::trunc);
+    if (!outFile) {
+        return false;
+    }
+    RollupHeader header{};
+    std::memcpy(header.magic, kRollupMagic, sizeof(header.magic));
+    header.version = kRollupVersion;
+    header.hasCoveredRecords = coveredRecords ? 1 : 0;
+    header.coveredRecords = coveredRecords.value_or(0);
+    outFile.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    if (!buckets.empty()) {
+        outFile.write(reinterpret_cast<const char*>(buckets.data()), buckets.size() * sizeof(RollupBucket));
     }
     outFile.close();
-    return true;
+    return !outFile.fail();
 }
 
-bool DataStorage::replaceAllData(const std::vector<SensorData>& dataBatch) {
-    // Open file in truncate mode to replace all content
-    std::ofstream outFile(binaryFilePath_, std::ios::binary | std::ios::trunc);
+std::vector<RollupBucket> DataStorage::loadRollupData(std::optional<uint64_t>* coveredRecords) {
+    std::vector<RollupBucket> buckets;
+    if (coveredRecords) {
+        coveredRecords->reset();
+    }
+    std::ifstream inFile(rollupFilePath_, std::ios::binary);
+    if (!inFile) {
+        return buckets; // No rollups persisted yet
+    }
+    RollupHeader header{};
+    if (inFile.read(reinterpret_cast<char*>(&header), sizeof(header)) &&
+        std::memcmp(header.magic, kRollupMagic, sizeof(header.magic)) == 0) {
+        if (header.version != kRollupVersion) {
+            return buckets; // Written by a newer version; rebuilt from the raw readings
+        }
+        if (coveredRecords && header.hasCoveredRecords) {
+            *coveredRecords = header.coveredRecords;
+        }
+    } else {
+        // A headerless file: buckets from the start
+        inFile.clear();
+        inFile.seekg(0);
+    }
+    RollupBucket bucket;
+    while (inFile.read(reinterpret_cast<char*>(&bucket), sizeof(RollupBucket))) {
+        buckets.push_back(bucket);
+    }
+    inFile.close();
+    return buckets;
+}
+
+std::string DataStorage::coldFilePath(uint64_t fileId) const {
+    return binaryFilePath_ + ".cold" + std::to_string(fileId);
+}
+
+void DataStorage::renameOldColdFiles() {
+    const std::string oldCatalogPath = binaryFilePath_ + ".segments";
+    std::error_code error;
+    if (fs::exists(coldCatalogPath_, error) || !fs::exists(oldCatalogPath, error)) {
+        return;
+    }
+    std::ifstream inFile(oldCatalogPath, std::ios::binary);
+    ColdFile info;
+    while (inFile.read(reinterpret_cast<char*>(&info), sizeof(ColdFile))) {
+        fs::rename(binaryFilePath_ + ".seg" + std::to_string(info.id), coldFilePath(info.id), error);
+    }
+    inFile.close();
+    // The catalog goes last, so an interrupted rename is picked up again next time
+    fs::rename(oldCatalogPath, coldCatalogPath_, error);
+}
+
+bool DataStorage::writeRecords(const std::string& path, bool truncate, const std::vector<SensorData>& dataBatch) {
+    AnomalyDetector detector;
+    {
+        std::lock_guard<std::mutex> lock(detectorMutex_);
+        detector = detector_;
+    }
+    BlockFileAppender appender(path, detector);
+    bool ok = appender.open(truncate) && appender.append(dataBatch.data(), dataBatch.size());
+    return appender.close() && ok;
+}
+
+bool DataStorage::writeColdFile(uint64_t fileId, const std::vector<SensorData>& dataBatch) {
+    return writeRecords(coldFilePath(fileId), true, dataBatch);
+}
+
+bool DataStorage::appendToColdFile(uint64_t fileId, const std::vector<SensorData>& dataBatch) {
+    return writeRecords(coldFilePath(fileId), false, dataBatch);
+}
+
+std::vector<SensorData> DataStorage::loadColdFile(uint64_t fileId) {
+    std::vector<SensorData> data;
+    BlockFile::scan(coldFilePath(fileId), nullptr, std::numeric_limits<size_t>::max(),
+                    [&](const SensorData* rows, size_t count) {
+        data.insert(data.end(), rows, rows + count);
+    });
+    return data;
+}
+
+bool DataStorage::replaceColdCatalog(const std::vector<ColdFile>& files) {
+    std::ofstream outFile(coldCatalogPath_, std::ios::binary | std::ios::trunc);
     if (!outFile) {
-        // std::cerr << "Error opening binary file for writing batch: " << binaryFilePath_ << std::endl;
         return false;
     }
-    for (const auto& data : dataBatch) {
-        outFile.write(reinterpret_cast<const char*>(&data), sizeof(SensorData));
-        if (outFile.fail()) { // Check after each write
-            // std::cerr << "Error writing data to binary file: " << binaryFilePath_ << std::endl;
-            outFile.close();
-            return false;
-        }
+    if (!files.empty()) {
+        outFile.write(reinterpret_cast<const char*>(files.data()), files.size() * sizeof(ColdFile));
     }
     outFile.close();
-    return true;
+    return !outFile.fail();
 }
 
-std::vector<SensorData> DataStorage::loadAllData() {
-    std::vector<SensorData> allData;
-    std::ifstream inFile(binaryFilePath_, std::ios::binary);
+std::vector<DataStorage::ColdFile> DataStorage::loadColdCatalog() {
+    std::vector<ColdFile> files;
+    std::ifstream inFile(coldCatalogPath_, std::ios::binary);
     if (!inFile) {
-        // std::cerr << "Error opening binary file for reading: " << binaryFilePath_ << std::endl;
-        return allData; // Return empty vector
+        return files; // Nothing evicted yet
     }
-    SensorData dataPoint;
-    while (inFile.read(reinterpret_cast<char*>(&dataPoint), sizeof(SensorData))) {
-        allData.push_back(dataPoint);
+    ColdFile info;
+    while (inFile.read(reinterpret_cast<char*>(&info), sizeof(ColdFile))) {
+        files.push_back(info);
     }
-    inFile.close();
-    return allData;
+    return files;
 }
 
-std::string DataStorage::sensorDataToJson(const SensorData& data) const {
-    std::ostringstream oss;
-    oss << std::fixed << std::setprecision(2);
-    oss << "  {\n";
-    oss << "    \"timestamp_ms\": " << data.timestamp_ms << ",\n";
-    oss << "    \"temperature\": " << data.temperature << ",\n";
-    oss << "    \"humidity\": " << data.humidity << ",\n";
-    oss << "    \"lightIntensity\": " << data.lightIntensity << "\n";
-    oss << "  }";
-    return oss.str();
+void DataStorage::writeSensorDataJson(std::ostream& out, const SensorData& data) const {
+    out << "  {\n";
+    out << "    \"timestamp_ms\": " << data.timestamp_ms << ",\n";
+    out << "    \"temperature\": " << data.temperature << ",\n";
+    out << "    \"humidity\": " << data.humidity << ",\n";
+    out << "    \"lightIntensity\": " << data.lightIntensity;
+    if (data.sensorId != 0) {
+        out << ",\n    \"sensorId\": " << data.sensorId;
+    }
+    out << "\n  }";
 }
 
 bool DataStorage::exportAnomaliesToJson(const std::vector<SensorData>& anomalies) {
+    return exportAnomaliesToJson([&anomalies](const SensorDataSink& sink) {
+        for (const auto& data : anomalies) {
+            sink(data);
+        }
+    });
+}
+
+bool DataStorage::exportAnomaliesToJson(const std::function<void(const SensorDataSink&)>& source) {
     std::ofstream jsonFile(jsonReportPath_);
     if (!jsonFile) {
         // std::cerr << "Error opening JSON file for writing: " << jsonReportPath_ << std::endl;
         return false;
     }
+    jsonFile << std::fixed << std::setprecision(2);
     jsonFile << "[\n";
-    for (size_t i = 0; i < anomalies.size(); ++i) {
-        jsonFile << sensorDataToJson(anomalies[i]);
-        if (i < anomalies.size() - 1) {
+    bool first = true;
+    source([&](const SensorData& data) {
+        if (!first) {
             jsonFile << ",\n";
         }
+        first = false;
+        writeSensorDataJson(jsonFile, data);
+    });
+    jsonFile << "\n]\n";
+    jsonFile.close();
+    return !jsonFile.fail();
+}
+
+bool DataStorage::exportEpisodesToJson(const std::vector<AnomalyEpisode>& episodes,
+                                       const std::vector<std::string>& ruleNames) {
+    std::ofstream jsonFile(episodeReportPath_);
+    if (!jsonFile) {
+        return false;
+    }
+    jsonFile << std::fixed << std::setprecision(2);
+    jsonFile << "[";
+    for (size_t i = 0; i < episodes.size(); ++i) {
+        const AnomalyEpisode& episode = episodes[i];
+        jsonFile << (i == 0 ? "\n" : ",\n");
+        jsonFile << "  {\n";
+        jsonFile << "    \"sensorId\": " << episode.sensorId << ",\n";
+        if (episode.rule < 0) {
+            jsonFile << "    \"metric\": \"" << ruleMetricName(episode.metric) << "\",\n";
+        } else if (static_cast<size_t>(episode.rule) < ruleNames.size()) {
+            jsonFile << "    \"rule\": \"" << ruleNames[episode.rule] << "\",\n";
+        } else {
+            jsonFile << "    \"rule\": " << episode.rule << ",\n";
+        }
+        jsonFile << "    \"start_ms\": " << episode.start_ms << ",\n";
+        jsonFile << "    \"end_ms\": " << episode.end_ms << ",\n";
+        jsonFile << "    \"peakDeviation\": " << episode.peakDeviation << ",\n";
+        jsonFile << "    \"peakValue\": " << episode.peakValue << ",\n";
+        jsonFile << "    \"count\": " << episode.count << ",\n";
+        jsonFile << "    \"open\": " << (episode.open ? "true" : "false") << "\n";
+        jsonFile << "  }";
     }
     jsonFile << "\n]\n";
     jsonFile.close();
@@ -0,0 +1,77 @@
+#include "FileIO.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#include <sys/stat.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+int openForAppend(const std::string& path) {
+#ifdef _WIN32
+    return _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+    return ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+#endif
+}
+
+bool writeAll(int fd, const char* data, size_t size) {
+    while (size > 0) {
+#ifdef _WIN32
+        int written = _write(fd, data, static_cast<unsigned>(std::min<size_t>(size, 1u << 30)));
+#else
+        ssize_t written = ::write(fd, data, size);
+#endif
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        size -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+bool syncFile(int fd) {
+#ifdef _WIN32
+    return _commit(fd) == 0;
+#elif defined(__APPLE__)
+    return ::fsync(fd) == 0; // No fdatasync there
+#else
+    return ::fdatasync(fd) == 0;
+#endif
+}
+
+void closeFile(int fd) {
+#ifdef _WIN32
+    _close(fd);
+#else
+    ::close(fd);
+#endif
+}
+
+bool replaceFile(const std::string& path, const char* data, size_t size) {
+    const std::string tempPath = path + ".tmp";
+    std::remove(tempPath.c_str());
+    int fd = openForAppend(tempPath);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = writeAll(fd, data, size) && syncFile(fd);
+    closeFile(fd);
+#ifdef _WIN32
+    ok = ok && (std::remove(path.c_str()) == 0 || errno == ENOENT); // rename does not replace existing files here
+#endif
+    ok = ok && std::rename(tempPath.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        std::remove(tempPath.c_str());
+    }
+    return ok;
+}
@@ -0,0 +1,472 @@
+#include "GorillaCodec.hpp"
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+namespace {
+    uint64_t lowBits(uint64_t value, unsigned bits) {
+        return bits >= 64 ? value : value & ((uint64_t{1} << bits) - 1);
+    }
+
+    unsigned leadingZeros(uint64_t word) { // word != 0
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<unsigned>(__builtin_clzll(word));
+#else
+        unsigned n = 0;
+        for (uint64_t bit = uint64_t{1} << 63; (word & bit) == 0; bit >>= 1) {
+            ++n;
+        }
+        return n;
+#endif
+    }
+
+    unsigned trailingZeros(uint64_t word) { // word != 0
+#if defined(__GNUC__) || defined(__clang__)
+        return static_cast<unsigned>(__builtin_ctzll(word));
+#else
+        unsigned n = 0;
+        for (; (word & 1) == 0; word >>= 1) {
+            ++n;
+        }
+        return n;
+#endif
+    }
+
+    // Most significant bit first
+    class BitWriter {
+    public:
+        explicit BitWriter(std::vector<char>& out) : out_(out) {}
+
+        void write(uint64_t value, unsigned bits) {
+            while (bits > 0) {
+                const unsigned take = std::min(64 - used_, bits);
+                const uint64_t chunk = lowBits(value >> (bits - take), take);
+                acc_ = take == 64 ? chunk : (acc_ << take) | chunk;
+                used_ += take;
+                bits -= take;
+                if (used_ == 64) {
+                    emit(8);
+                }
+            }
+        }
+        // Pads the stream to a whole byte
+        void finish() {
+            if (used_ > 0) {
+                const unsigned bytes = (used_ + 7) / 8;
+                acc_ <<= 64 - used_;
+                emit(bytes);
+            }
+        }
+
+    private:
+        std::vector<char>& out_;
+        uint64_t acc_ = 0;
+        unsigned used_ = 0;
+
+        void emit(unsigned bytes) {
+            for (unsigned i = 0; i < bytes; ++i) {
+                out_.push_back(static_cast<char>(acc_ >> (56 - 8 * i)));
+            }
+            acc_ = 0;
+            used_ = 0;
+        }
+    };
+
+    class BitReader {
+    public:
+        BitReader(const unsigned char* data, size_t size) : data_(data), size_(size), bits_(uint64_t{size} * 8) {}
+
+        bool read(unsigned bits, uint64_t& value) {
+            if (bits_ - pos_ < bits) {
+                return false;
+            }
+            if (bits > 56) {
+                uint64_t high = 0;
+                uint64_t low = 0;
+                read(32, high);
+                read(bits - 32, low);
+                value = (high << (bits - 32)) | low;
+                return true;
+            }
+            value = bits == 0 ? 0 : window() >> (64 - bits);
+            pos_ += bits;
+            return true;
+        }
+        bool readBit(bool& bit) {
+            if (pos_ >= bits_) {
+                return false;
+            }
+            bit = (data_[pos_ >> 3] >> (7 - (pos_ & 7))) & 1;
+            ++pos_;
+            return true;
+        }
+        // Up to max one bits, ending at the first zero; how many ones were read
+        bool readOnes(unsigned max, unsigned& ones) {
+            ones = 0;
+            bool bit = true;
+            while (ones < max && readBit(bit) && bit) {
+                ++ones;
+            }
+            return ones == max || !bit;
+        }
+        // Bytes taken up to the end of the current one
+        size_t consumedBytes() const { return static_cast<size_t>((pos_ + 7) / 8); }
+
+    private:
+        const unsigned char* data_;
+        size_t size_;
+        uint64_t bits_;
+        uint64_t pos_ = 0;
+
+        // The next 57 or more bits, most significant first; zeros past the end
+        uint64_t window() const {
+            const size_t first = static_cast<size_t>(pos_ >> 3);
+            uint64_t word = 0;
+            for (size_t i = first; i < first + 8; ++i) {
+                word = (word << 8) | (i < size_ ? data_[i] : 0);
+            }
+            return word << (pos_ & 7);
+        }
+    };
+
+    // Delta-of-delta buckets: prefix of ones, then the value biased to be unsigned
+    struct DodBucket {
+        unsigned valueBits;
+        int64_t bias;
+    };
+    constexpr DodBucket kDodBuckets[3] = {{7, 63}, {9, 255}, {12, 2047}};
+
+    // The first value in full, then each one's change of delta: '0' for none, '10', '110' or
+    // '1110' and a small change, '1111' and any change. Unsigned arithmetic wraps alike in both
+    // directions, whatever the values.
+    template <typename Value>
+    void encodeDeltas(const SensorData* rows, size_t count, Value value, BitWriter& out) {
+        uint64_t previous = 0;
+        uint64_t previousDelta = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const uint64_t current = static_cast<uint64_t>(value(rows[i]));
+            if (i == 0) {
+                out.write(current, 64);
+            } else {
+                const uint64_t delta = current - previous;
+                const int64_t dod = static_cast<int64_t>(delta - previousDelta);
+                if (dod == 0) {
+                    out.write(0, 1);
+                } else {
+                    unsigned b = 0;
+                    while (b < 3 && (dod < -kDodBuckets[b].bias || dod > kDodBuckets[b].bias + 1)) {
+                        ++b;
+                    }
+                    if (b < 3) {
+                        out.write((uint64_t{1} << (b + 2)) - 2, b + 2);
+                        out.write(static_cast<uint64_t>(dod + kDodBuckets[b].bias), kDodBuckets[b].valueBits);
+                    } else {
+                        out.write(0xF, 4);
+                        out.write(static_cast<uint64_t>(dod), 64);
+                    }
+                }
+                previousDelta = delta;
+            }
+            previous = current;
+        }
+        out.finish();
+    }
+
+    template <typename T>
+    bool decodeDeltas(BitReader& in, size_t count, std::vector<T>& values) {
+        uint64_t previous = 0;
+        uint64_t previousDelta = 0;
+        for (size_t i = 0; i < count; ++i) {
+            uint64_t current = 0;
+            if (i == 0) {
+                if (!in.read(64, current)) {
+                    return false;
+                }
+            } else {
+                unsigned ones = 0;
+                if (!in.readOnes(4, ones)) {
+                    return false;
+                }
+                uint64_t dod = 0;
+                if (ones > 0) {
+                    uint64_t value = 0;
+                    const unsigned b = ones - 1;
+                    if (!in.read(b < 3 ? kDodBuckets[b].valueBits : 64, value)) {
+                        return false;
+                    }
+                    dod = b < 3 ? value - static_cast<uint64_t>(kDodBuckets[b].bias) : value;
+                }
+                previousDelta += dod;
+                current = previous + previousDelta;
+            }
+            values.push_back(static_cast<T>(current));
+            previous = current;
+        }
+        return true;
+    }
+
+    // Numbers the distinct sensors of a block in order of appearance; slots[i] is row i's
+    void sensorSlots(const SensorData* rows, size_t count, std::vector<uint32_t>& slots, std::vector<uint32_t>& sensorIds) {
+        std::unordered_map<uint32_t, uint32_t> slotOf;
+        slots.resize(count);
+        sensorIds.clear();
+        for (size_t i = 0; i < count; ++i) {
+            auto inserted = slotOf.emplace(rows[i].sensorId, static_cast<uint32_t>(sensorIds.size()));
+            if (inserted.second) {
+                sensorIds.push_back(rows[i].sensorId);
+            }
+            slots[i] = inserted.first->second;
+        }
+    }
+
+    unsigned bitsFor(size_t values) {
+        unsigned bits = 0;
+        while (bits < 32 && (uint64_t{1} << bits) < values) {
+            ++bits;
+        }
+        return bits;
+    }
+
+    // The distinct sensor ids, then each row's slot among them: '0' if it follows the previous
+    // row's slot (sensors reporting in turn, or a single sensor), else '1' and the slot
+    void encodeSensorSlots(const std::vector<uint32_t>& slots, const std::vector<uint32_t>& sensorIds, BitWriter& out) {
+        out.write(sensorIds.size(), 32);
+        for (uint32_t sensorId : sensorIds) {
+            out.write(sensorId, 32);
+        }
+        const unsigned slotBits = bitsFor(sensorIds.size());
+        uint32_t previous = static_cast<uint32_t>(sensorIds.size()) - 1;
+        for (uint32_t slot : slots) {
+            if (slot == (previous + 1) % sensorIds.size()) {
+                out.write(0, 1);
+            } else {
+                out.write(1, 1);
+                out.write(slot, slotBits);
+            }
+            previous = slot;
+        }
+        out.finish();
+    }
+
+    bool decodeSensorSlots(BitReader& in, size_t count, std::vector<uint32_t>& slots, size_t& sensors,
+                           std::vector<uint32_t>& rowSensorIds) {
+        uint64_t distinct = 0;
+        if (!in.read(32, distinct) || (count > 0 && (distinct == 0 || distinct > count))) {
+            return false;
+        }
+        std::vector<uint32_t> sensorIds(static_cast<size_t>(distinct));
+        for (auto& sensorId : sensorIds) {
+            uint64_t value = 0;
+            if (!in.read(32, value)) {
+                return false;
+            }
+            sensorId = static_cast<uint32_t>(value);
+        }
+        const unsigned slotBits = bitsFor(sensorIds.size());
+        uint64_t previous = distinct - 1;
+        slots.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            bool jump = false;
+            uint64_t slot = (previous + 1) % distinct;
+            if (!in.readBit(jump) || (jump && !in.read(slotBits, slot)) || slot >= distinct) {
+                return false;
+            }
+            slots[i] = static_cast<uint32_t>(slot);
+            rowSensorIds.push_back(sensorIds[slots[i]]);
+            previous = slot;
+        }
+        sensors = sensorIds.size();
+        return true;
+    }
+
+    // XOR state of one sensor's values in one column
+    struct XorState {
+        uint64_t previous = 0;
+        unsigned leading = 65; // No window yet
+        unsigned trailing = 0;
+        bool seen = false;
+    };
+
+    uint64_t bitsOf(double value) {
+        uint64_t bits;
+        std::memcpy(&bits, &value, sizeof(bits));
+        return bits;
+    }
+
+    // Each value is XORed with its sensor's previous one, so interleaved sensors compress as
+    // well as a single series; a sensor's first value is XORed with the value before it
+    void encodeValues(const SensorData* rows, size_t count, double SensorData::*column,
+                      const std::vector<uint32_t>& slots, size_t sensors, BitWriter& out) {
+        std::vector<XorState> states(sensors);
+        uint64_t last = 0;
+        for (size_t i = 0; i < count; ++i) {
+            XorState& state = states[slots[i]];
+            const uint64_t bits = bitsOf(rows[i].*column);
+            const uint64_t x = bits ^ (state.seen ? state.previous : last);
+            state.previous = last = bits;
+            state.seen = true;
+            if (x == 0) {
+                out.write(0, 1);
+                continue;
+            }
+            const unsigned lead = std::min(leadingZeros(x), 31u); // Stored in 5 bits
+            const unsigned trail = trailingZeros(x);
+            if (state.leading <= 64 && lead >= state.leading && trail >= state.trailing) {
+                // Fits the previous window: '10' and the bits inside it
+                out.write(0x2, 2);
+                out.write(x >> state.trailing, 64 - state.leading - state.trailing);
+            } else {
+                // '11', the new window and the bits inside it; 64 meaningful bits are stored as 0
+                const unsigned meaningful = 64 - lead - trail;
+                out.write(0x3, 2);
+                out.write(lead, 5);
+                out.write(meaningful & 63, 6);
+                out.write(x >> trail, meaningful);
+                state.leading = lead;
+                state.trailing = trail;
+            }
+        }
+        out.finish();
+    }
+
+    bool decodeValues(BitReader& in, size_t count, const std::vector<uint32_t>& slots, size_t sensors,
+                      std::vector<double>& values) {
+        std::vector<XorState> states(sensors);
+        uint64_t last = 0;
+        for (size_t i = 0; i < count; ++i) {
+            XorState& state = states[slots[i]];
+            uint64_t bits = state.seen ? state.previous : last;
+            bool changed = false;
+            if (!in.readBit(changed)) {
+                return false;
+            }
+            if (changed) {
+                bool newWindow = false;
+                if (!in.readBit(newWindow)) {
+                    return false;
+                }
+                if (newWindow) {
+                    uint64_t lead = 0;
+                    uint64_t meaningful = 0;
+                    if (!in.read(5, lead) || !in.read(6, meaningful)) {
+                        return false;
+                    }
+                    meaningful = meaningful == 0 ? 64 : meaningful;
+                    if (lead + meaningful > 64) {
+                        return false; // Corrupt
+                    }
+                    state.leading = static_cast<unsigned>(lead);
+                    state.trailing = static_cast<unsigned>(64 - lead - meaningful);
+                } else if (state.leading > 64) {
+                    return false; // No window to fit
+                }
+                uint64_t x = 0;
+                if (!in.read(64 - state.leading - state.trailing, x)) {
+                    return false;
+                }
+                bits ^= x << state.trailing;
+            }
+            state.previous = last = bits;
+            state.seen = true;
+            double value;
+            std::memcpy(&value, &bits, sizeof(value));
+            values.push_back(value);
+        }
+        return true;
+    }
+}
+
+void ColumnBatch::clear() {
+    timestamps.clear();
+    temperature.clear();
+    humidity.clear();
+    lightIntensity.clear();
+    sensorIds.clear();
+}
+
+void ColumnBatch::truncate(size_t count) {
+    if (count < size()) {
+        timestamps.resize(count);
+        temperature.resize(count);
+        humidity.resize(count);
+        lightIntensity.resize(count);
+        sensorIds.resize(count);
+    }
+}
+
+void ColumnBatch::reserve(size_t count) {
+    timestamps.reserve(count);
+    temperature.reserve(count);
+    humidity.reserve(count);
+    lightIntensity.reserve(count);
+    sensorIds.reserve(count);
+}
+
+void ColumnBatch::append(const SensorData* rows, size_t count) {
+    reserve(size() + count);
+    for (size_t i = 0; i < count; ++i) {
+        timestamps.push_back(rows[i].timestamp_ms);
+        temperature.push_back(rows[i].temperature);
+        humidity.push_back(rows[i].humidity);
+        lightIntensity.push_back(rows[i].lightIntensity);
+        sensorIds.push_back(rows[i].sensorId);
+    }
+}
+
+SensorData ColumnBatch::row(size_t i) const {
+    SensorData data{timestamps[i], temperature[i], humidity[i], lightIntensity[i]};
+    data.sensorId = sensorIds[i];
+    return data;
+}
+
+void ColumnBatch::appendRows(size_t first, size_t count, std::vector<SensorData>& rows) const {
+    rows.reserve(rows.size() + count);
+    for (size_t i = first; i < first + count; ++i) {
+        rows.push_back(row(i));
+    }
+}
+
+AnomalyDetector::SensorColumns ColumnBatch::columns(size_t first, size_t count) const {
+    return {temperature.data() + first, humidity.data() + first, lightIntensity.data() + first, count,
+            sensorIds.data() + first};
+}
+
+void GorillaCodec::encode(const SensorData* rows, size_t count, std::vector<char>& out) {
+    if (count == 0) {
+        return;
+    }
+    BitWriter writer(out);
+    encodeDeltas(rows, count, [](const SensorData& data) { return data.timestamp_ms; }, writer);
+    std::vector<uint32_t> slots;
+    std::vector<uint32_t> sensorIds;
+    sensorSlots(rows, count, slots, sensorIds);
+    encodeSensorSlots(slots, sensorIds, writer);
+    encodeValues(rows, count, &SensorData::temperature, slots, sensorIds.size(), writer);
+    encodeValues(rows, count, &SensorData::humidity, slots, sensorIds.size(), writer);
+    encodeValues(rows, count, &SensorData::lightIntensity, slots, sensorIds.size(), writer);
+}
+
+bool GorillaCodec::decode(const char* data, size_t size, size_t count, ColumnBatch& columns) {
+    if (count == 0) {
+        return true;
+    }
+    columns.reserve(columns.size() + count);
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data);
+    // Each column starts on the byte after the previous one ends
+    auto next = [&](const auto& decodeColumn) {
+        BitReader reader(bytes, size);
+        if (!decodeColumn(reader)) {
+            return false;
+        }
+        bytes += reader.consumedBytes();
+        size -= reader.consumedBytes();
+        return true;
+    };
+    std::vector<uint32_t> slots;
+    size_t sensors = 0;
+    return next([&](BitReader& in) { return decodeDeltas(in, count, columns.timestamps); }) &&
+           next([&](BitReader& in) { return decodeSensorSlots(in, count, slots, sensors, columns.sensorIds); }) &&
+           next([&](BitReader& in) { return decodeValues(in, count, slots, sensors, columns.temperature); }) &&
+           next([&](BitReader& in) { return decodeValues(in, count, slots, sensors, columns.humidity); }) &&
+           next([&](BitReader& in) { return decodeValues(in, count, slots, sensors, columns.lightIntensity); });
+}
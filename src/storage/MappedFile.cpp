@@ -0,0 +1,56 @@
+#include "MappedFile.hpp"
+#include <fstream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+std::shared_ptr<const MappedFile> MappedFile::open(const std::string& path) {
+    std::shared_ptr<MappedFile> file(new MappedFile());
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        struct stat info;
+        if (::fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* address = ::mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (address != MAP_FAILED) {
+                file->data_ = static_cast<const char*>(address);
+                file->size_ = static_cast<size_t>(info.st_size);
+                file->mapped_ = true;
+            }
+        }
+        ::close(fd); // The mapping keeps its own reference to the file
+        if (file->mapped_) {
+            return file;
+        }
+    }
+#endif
+    // Not mappable here: read the whole file at once
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        return nullptr;
+    }
+    std::streamoff length = in.tellg();
+    if (length <= 0) {
+        return nullptr;
+    }
+    file->buffer_.resize(static_cast<size_t>(length));
+    in.seekg(0);
+    if (!in.read(file->buffer_.data(), length)) {
+        return nullptr;
+    }
+    file->data_ = file->buffer_.data();
+    file->size_ = file->buffer_.size();
+    return file;
+}
+
+MappedFile::~MappedFile() {
+#ifndef _WIN32
+    if (mapped_) {
+        ::munmap(const_cast<char*>(data_), size_);
+    }
+#endif
+}
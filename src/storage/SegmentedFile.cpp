@@ -0,0 +1,672 @@
+#include "SegmentedFile.hpp"
+#include "Crc32.hpp"
+#include "FileIO.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <set>
+
+namespace fs = std::filesystem;
+
+namespace {
+    int64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    uint64_t fileSizeOr0(const std::string& path) {
+        std::error_code error;
+        const uint64_t size = fs::file_size(path, error);
+        return error ? 0 : size;
+    }
+
+    // Index file of a segment file
+    std::string indexPath(const std::string& segmentPath) {
+        return segmentPath + ".idx";
+    }
+}
+
+// A segment's file and its index file, removed from disk once the segment left the manifest and
+// the last snapshot holding it is gone
+class SegmentedFile::SegmentFile {
+public:
+    explicit SegmentFile(std::string path) : path_(std::move(path)) {}
+    ~SegmentFile() {
+        if (retired_) {
+            std::remove(path_.c_str());
+            std::remove(indexPath(path_).c_str());
+        }
+    }
+
+    const std::string& path() const { return path_; }
+    void retire() { retired_ = true; }
+
+private:
+    std::string path_;
+    std::atomic<bool> retired_{false};
+};
+
+SegmentedFile::SegmentedFile(const std::string& basePath)
+    : basePath_(basePath), manifestPath_(basePath + ".manifest") {
+    std::error_code error;
+    if (!fs::exists(manifestPath_, error)) {
+        slots_.push_back(newSlot(0)); // The base file alone
+        return;
+    }
+    segmented_ = true;
+    damaged_ = !loadManifest();
+    if (!damaged_) {
+        removeOrphans();
+    }
+}
+
+SegmentedFile::~SegmentedFile() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    wakeCompactor_.notify_one();
+    if (compactor_.joinable()) {
+        compactor_.join();
+    }
+}
+
+std::string SegmentedFile::segmentPath(uint64_t id) const {
+    if (id == 0) {
+        return basePath_;
+    }
+    char suffix[32];
+    std::snprintf(suffix, sizeof(suffix), ".%06llu", static_cast<unsigned long long>(id));
+    return basePath_ + suffix;
+}
+
+SegmentedFile::Slot SegmentedFile::newSlot(uint64_t id) const {
+    Slot slot{ManifestEntry{id, 0, 0, nowMs(), 0, 0, BlockZone()}, std::make_shared<SegmentFile>(segmentPath(id)), nullptr};
+    return slot;
+}
+
+bool SegmentedFile::setPolicy(const Policy& policy) {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (damaged_) {
+            return false;
+        }
+        if (!segmented_) {
+            // The base file becomes the first segment as it is, nothing is copied
+            segmented_ = true;
+            slots_.back().entry.created_ms = nowMs();
+            if (!writeManifestLocked()) {
+                segmented_ = false;
+                return false;
+            }
+        }
+        policy_ = policy;
+        if (policy_.backgroundCompaction && !compactor_.joinable()) {
+            compactor_ = std::thread(&SegmentedFile::compactorLoop, this);
+        }
+    }
+    wakeCompactor_.notify_one();
+    return true;
+}
+
+SegmentedFile::Policy SegmentedFile::policy() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return policy_;
+}
+
+bool SegmentedFile::segmented() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return segmented_;
+}
+
+SegmentedFile::Stats SegmentedFile::stats() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Stats stats = stats_;
+    stats.segments = slots_.size();
+    return stats;
+}
+
+void SegmentedFile::setAnomalyDetector(const AnomalyDetector& detector) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    detector_ = detector;
+}
+
+void SegmentedFile::setEncoding(BlockFile::Encoding encoding) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    encoding_ = encoding;
+}
+
+BlockFile::Encoding SegmentedFile::encoding() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return encoding_;
+}
+
+bool SegmentedFile::loadManifest() {
+    std::ifstream in(manifestPath_, std::ios::binary | std::ios::ate);
+    if (!in) {
+        return false;
+    }
+    const uint64_t size = static_cast<uint64_t>(in.tellg());
+    in.seekg(0);
+    ManifestHeader header;
+    if (size < sizeof(header) || !in.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, kManifestMagic, sizeof(kManifestMagic)) != 0 || header.version != kManifestVersion ||
+        header.entries == 0 || header.entries != (size - sizeof(header)) / sizeof(ManifestEntry)) {
+        return false;
+    }
+    std::vector<ManifestEntry> entries(static_cast<size_t>(header.entries));
+    const size_t entryBytes = entries.size() * sizeof(ManifestEntry);
+    if (!in.read(reinterpret_cast<char*>(entries.data()), static_cast<std::streamsize>(entryBytes)) ||
+        crc32(entries.data(), entryBytes,
+              crc32(&header.nextId, sizeof(header) - offsetof(ManifestHeader, nextId))) != header.crc) {
+        return false;
+    }
+    nextId_ = header.nextId;
+    droppedRecords_ = header.droppedRecords;
+    for (const auto& entry : entries) {
+        Slot slot{entry, std::make_shared<SegmentFile>(segmentPath(entry.id)), nullptr};
+        if (entry.indexed) {
+            auto index = std::make_shared<BlockFile::Index>();
+            if (BlockFile::readIndex(indexPath(slot.file->path()), *index)) {
+                slot.index = index;
+            } else {
+                slot.entry.indexed = 0; // Compaction writes it again
+            }
+        }
+        slots_.push_back(slot);
+    }
+    return true;
+}
+
+bool SegmentedFile::writeManifestLocked() {
+    ManifestHeader header{};
+    std::memcpy(header.magic, kManifestMagic, sizeof(header.magic));
+    header.version = kManifestVersion;
+    header.nextId = nextId_;
+    header.droppedRecords = droppedRecords_;
+    header.entries = slots_.size();
+    std::vector<char> out(sizeof(header) + slots_.size() * sizeof(ManifestEntry));
+    char* entries = out.data() + sizeof(header);
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        std::memcpy(entries + i * sizeof(ManifestEntry), &slots_[i].entry, sizeof(ManifestEntry));
+    }
+    header.crc = crc32(entries, out.size() - sizeof(header),
+                       crc32(&header.nextId, sizeof(header) - offsetof(ManifestHeader, nextId)));
+    std::memcpy(out.data(), &header, sizeof(header));
+    return replaceFile(manifestPath_, out.data(), out.size());
+}
+
+void SegmentedFile::removeOrphans() {
+    std::set<std::string> listed;
+    for (const auto& slot : slots_) {
+        listed.insert(fs::path(slot.file->path()).filename().string());
+    }
+    const fs::path base(basePath_);
+    const std::string prefix = base.filename().string() + ".";
+    std::error_code error;
+    fs::path dir = base.parent_path();
+    if (dir.empty()) {
+        dir = ".";
+    }
+    std::vector<fs::path> orphans;
+    for (const auto& item : fs::directory_iterator(dir, error)) {
+        const std::string name = item.path().filename().string();
+        std::string segment = name;
+        if (segment.size() > 4 && segment.compare(segment.size() - 4, 4, ".idx") == 0) {
+            segment.resize(segment.size() - 4);
+        }
+        const bool numbered = segment.size() > prefix.size() && segment.compare(0, prefix.size(), prefix) == 0 &&
+                              std::all_of(segment.begin() + static_cast<std::ptrdiff_t>(prefix.size()), segment.end(),
+                                          [](char c) { return c >= '0' && c <= '9'; });
+        // The base file is stale too once the manifest no longer lists it
+        if ((numbered || segment == base.filename().string()) && listed.count(segment) == 0) {
+            orphans.push_back(item.path());
+        }
+    }
+    for (const auto& orphan : orphans) {
+        fs::remove(orphan, error);
+    }
+}
+
+bool SegmentedFile::positionLocked(uint64_t& records) const {
+    records = droppedRecords_;
+    for (size_t i = 0; i + 1 < slots_.size(); ++i) {
+        records += slots_[i].entry.records;
+    }
+    BlockFile::Layout active;
+    if (!BlockFile::readLayout(slots_.back().file->path(), active)) {
+        return false;
+    }
+    records += active.records;
+    return true;
+}
+
+bool SegmentedFile::position(uint64_t& records) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return !damaged_ && positionLocked(records);
+}
+
+std::unique_ptr<BlockFileAppender> SegmentedFile::openActive(uint64_t& precedingRecords) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (damaged_) {
+        return nullptr;
+    }
+    if (segmented_) {
+        const std::string& path = slots_.back().file->path();
+        const uint64_t bytes = fileSizeOr0(path);
+        const bool due = (policy_.maxSegmentBytes && bytes >= *policy_.maxSegmentBytes) ||
+                         (policy_.maxSegmentAgeMs && nowMs() - slots_.back().entry.created_ms >= *policy_.maxSegmentAgeMs);
+        if (due && bytes > sizeof(BlockFile::Header) && !rollLocked()) {
+            return nullptr;
+        }
+    }
+    precedingRecords = droppedRecords_;
+    for (size_t i = 0; i + 1 < slots_.size(); ++i) {
+        precedingRecords += slots_[i].entry.records;
+    }
+    // The active segment is only written by the caller, so it is opened without the lock
+    const std::shared_ptr<SegmentFile> active = slots_.back().file;
+    auto appender = std::make_unique<BlockFileAppender>(active->path(), detector_, encoding_);
+    lock.unlock();
+    if (!appender->open()) {
+        return nullptr;
+    }
+    return appender;
+}
+
+bool SegmentedFile::rollLocked() {
+    const size_t active = slots_.size() - 1;
+    const std::string path = slots_[active].file->path();
+    // Cuts a torn end and seals a full tail first, so the sealed segment is final
+    BlockFileAppender appender(path, detector_, encoding_);
+    BlockFile::Layout layout;
+    if (!appender.open() || !appender.close() || !BlockFile::readLayout(path, layout)) {
+        return false;
+    }
+    Slot next = newSlot(nextId_);
+    std::remove(next.file->path().c_str()); // Left by a crash before the manifest listed it
+    std::remove(indexPath(next.file->path()).c_str());
+    const ManifestEntry before = slots_[active].entry;
+    slots_[active].entry.sealed = 1;
+    slots_[active].entry.records = layout.records;
+    slots_[active].entry.bytes = layout.validBytes;
+    slots_.push_back(next);
+    ++nextId_;
+    if (!writeManifestLocked()) {
+        slots_.pop_back();
+        --nextId_;
+        slots_[active].entry = before;
+        return false;
+    }
+    ++stats_.rolls;
+    wakeCompactor_.notify_one(); // To index the sealed segment
+    return true;
+}
+
+bool SegmentedFile::replace(const std::vector<SensorDataSpan>& spans) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (damaged_) {
+        return false;
+    }
+    const AnomalyDetector detector = detector_;
+    const BlockFile::Encoding encoding = encoding_;
+    const bool segmented = segmented_;
+    const uint64_t id = segmented ? nextId_++ : 0;
+    lock.unlock();
+
+    // Without segments the new content is written next to the file and renamed over it; with
+    // them it becomes a new segment that the manifest lists alone
+    const std::string path = segmented ? segmentPath(id) : basePath_ + ".tmp";
+    BlockFileAppender out(path, detector, encoding);
+    bool ok = out.open(true);
+    for (const auto& span : spans) {
+        ok = ok && out.append(span.data, span.size);
+    }
+    ok = out.close() && ok;
+    if (!ok) {
+        std::remove(path.c_str());
+        return false;
+    }
+    if (!segmented) {
+#ifdef _WIN32
+        std::remove(basePath_.c_str()); // rename does not replace existing files here
+#endif
+        return std::rename(path.c_str(), basePath_.c_str()) == 0;
+    }
+
+    lock.lock();
+    std::vector<Slot> old;
+    old.swap(slots_);
+    const uint64_t dropped = droppedRecords_;
+    slots_.push_back(newSlot(id));
+    droppedRecords_ = 0; // The log starts over from the new content
+    if (!writeManifestLocked()) {
+        slots_.swap(old);
+        droppedRecords_ = dropped;
+        std::remove(path.c_str());
+        return false;
+    }
+    for (auto& slot : old) {
+        slot.file->retire();
+    }
+    return true;
+}
+
+std::vector<SegmentedFile::Segment> SegmentedFile::snapshot(uint64_t* droppedRecords) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (droppedRecords) {
+        *droppedRecords = droppedRecords_;
+    }
+    std::vector<Segment> segments;
+    segments.reserve(slots_.size());
+    for (const auto& slot : slots_) {
+        segments.push_back({slot.entry, slot.file->path(), slot.index, slot.file});
+    }
+    return segments;
+}
+
+bool SegmentedFile::scanSegments(const ZoneFilter* filter, size_t maxRecords,
+                                 const std::function<bool(const Segment& segment, size_t maxRecords)>& scanOne,
+                                 BlockFile::ScanStats* stats, uint64_t* firstPosition) const {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (damaged_) {
+            return false;
+        }
+    }
+    std::vector<Segment> segments = snapshot(firstPosition);
+    size_t remaining = maxRecords;
+    for (const auto& segment : segments) {
+        if (remaining == 0) {
+            break;
+        }
+        const bool sealed = segment.entry.sealed != 0;
+        const size_t records = static_cast<size_t>(std::min<uint64_t>(remaining, segment.entry.records));
+        if (sealed && filter && segment.index && !filter->mayMatch(segment.entry.zone)) {
+            // Ruled out as a whole by its zone; its blocks count as skipped
+            if (stats) {
+                stats->blocksSkipped += segment.index->blocks.size();
+            }
+            remaining -= records;
+            continue;
+        }
+        std::error_code error;
+        if (!sealed && !fs::exists(segment.path, error)) {
+            continue; // Nothing checkpointed into it since it was started
+        }
+        if (!scanOne(segment, remaining)) {
+            return false;
+        }
+        if (sealed) {
+            remaining -= records;
+        }
+    }
+    return true;
+}
+
+bool SegmentedFile::scan(const ZoneFilter* filter, size_t maxRecords,
+                         const std::function<void(const SensorData* rows, size_t count)>& consumer,
+                         BlockFile::ScanStats* stats, uint64_t* firstPosition) const {
+    return scanSegments(filter, maxRecords, [&](const Segment& segment, size_t remaining) {
+        return BlockFile::scan(segment.path, filter, remaining, consumer, stats, segment.index.get());
+    }, stats, firstPosition);
+}
+
+bool SegmentedFile::scanColumns(const ZoneFilter* filter, size_t maxRecords,
+                                const std::function<void(const ColumnBatch& columns)>& consumer,
+                                BlockFile::ScanStats* stats, uint64_t* firstPosition) const {
+    return scanSegments(filter, maxRecords, [&](const Segment& segment, size_t remaining) {
+        return BlockFile::scanColumns(segment.path, filter, remaining, consumer, stats, segment.index.get());
+    }, stats, firstPosition);
+}
+
+bool SegmentedFile::records(uint64_t& records) const {
+    uint64_t dropped = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (damaged_ || !positionLocked(records)) {
+            return false;
+        }
+        dropped = droppedRecords_;
+    }
+    records -= dropped;
+    return true;
+}
+
+bool SegmentedFile::compact() {
+    std::lock_guard<std::mutex> pass(compactionMutex_);
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!segmented_ || damaged_) {
+            return !damaged_;
+        }
+    }
+    // Retention and merging go by the zones of indexed segments, so indexing comes first
+    bool ok = indexSealed();
+    ok = applyRetention() && ok;
+    return mergeSmall() && ok;
+}
+
+bool SegmentedFile::indexSealed() {
+    std::vector<Segment> pending;
+    AnomalyDetector detector;
+    BlockFile::Encoding encoding;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i + 1 < slots_.size(); ++i) {
+            if (!slots_[i].entry.indexed) {
+                pending.push_back({slots_[i].entry, slots_[i].file->path(), nullptr, slots_[i].file});
+            }
+        }
+        detector = detector_;
+        encoding = encoding_;
+    }
+    bool ok = true;
+    std::vector<std::pair<uint64_t, std::shared_ptr<const BlockFile::Index>>> built;
+    for (const auto& segment : pending) {
+        BlockFile::Layout layout;
+        if (!BlockFile::readLayout(segment.path, layout)) {
+            ok = false;
+            continue;
+        }
+        if (layout.legacy) {
+            // A base file from before blocks; opening rewrites it as blocks
+            BlockFileAppender upgrade(segment.path, detector, encoding);
+            if (!upgrade.open() || !upgrade.close()) {
+                ok = false;
+                continue;
+            }
+        }
+        auto index = std::make_shared<BlockFile::Index>();
+        if (!BlockFile::buildIndex(segment.path, *index) || !BlockFile::writeIndex(indexPath(segment.path), *index)) {
+            ok = false;
+            continue;
+        }
+        built.emplace_back(segment.entry.id, index);
+    }
+    if (built.empty()) {
+        return ok;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto& [id, index] : built) {
+        for (auto& slot : slots_) {
+            if (slot.entry.id == id) {
+                slot.entry.indexed = 1;
+                slot.entry.zone = index->zone;
+                slot.entry.bytes = index->fileBytes;
+                slot.index = index;
+                ++stats_.indexed;
+            }
+        }
+    }
+    return writeManifestLocked() && ok;
+}
+
+bool SegmentedFile::applyRetention() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!policy_.retainMs && !policy_.retainBytes) {
+        return true;
+    }
+    const int64_t cutoff = policy_.retainMs ? nowMs() - *policy_.retainMs : 0;
+    uint64_t total = fileSizeOr0(slots_.back().file->path());
+    for (size_t i = 0; i + 1 < slots_.size(); ++i) {
+        total += slots_[i].entry.bytes;
+    }
+    // Oldest first; the active segment always stays
+    std::vector<Slot> kept;
+    std::vector<Slot> dropped;
+    uint64_t droppedRecords = 0;
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        const Slot& slot = slots_[i];
+        const bool sealed = i + 1 < slots_.size();
+        const bool expired = policy_.retainMs && slot.entry.indexed && slot.entry.zone.maxTimestamp_ms < cutoff;
+        const bool overBudget = policy_.retainBytes && total > *policy_.retainBytes;
+        if (sealed && (expired || overBudget)) {
+            dropped.push_back(slot);
+            droppedRecords += slot.entry.records;
+            total -= slot.entry.bytes;
+        } else {
+            kept.push_back(slot);
+        }
+    }
+    if (dropped.empty()) {
+        return true;
+    }
+    slots_.swap(kept);
+    droppedRecords_ += droppedRecords;
+    if (!writeManifestLocked()) {
+        slots_.swap(kept);
+        droppedRecords_ -= droppedRecords;
+        return false;
+    }
+    for (auto& slot : dropped) {
+        slot.file->retire();
+    }
+    stats_.dropped += dropped.size();
+    return true;
+}
+
+bool SegmentedFile::mergeSmall() {
+    // Runs of adjacent small indexed segments, each to become one segment
+    std::vector<std::vector<Segment>> runs;
+    AnomalyDetector detector;
+    BlockFile::Encoding encoding;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const uint64_t maxBytes = policy_.maxSegmentBytes ? std::max(*policy_.maxSegmentBytes, policy_.mergeBelowBytes)
+                                                          : std::numeric_limits<uint64_t>::max();
+        std::vector<Segment> run;
+        uint64_t runBytes = 0;
+        auto endRun = [&]() {
+            if (run.size() > 1) {
+                runs.push_back(run);
+            }
+            run.clear();
+            runBytes = 0;
+        };
+        for (size_t i = 0; i + 1 < slots_.size(); ++i) {
+            const Slot& slot = slots_[i];
+            if (!slot.index || slot.entry.bytes >= policy_.mergeBelowBytes) {
+                endRun();
+                continue;
+            }
+            if (runBytes + slot.entry.bytes > maxBytes) {
+                endRun();
+            }
+            run.push_back({slot.entry, slot.file->path(), slot.index, slot.file});
+            runBytes += slot.entry.bytes;
+        }
+        endRun();
+        detector = detector_;
+        encoding = encoding_;
+    }
+
+    bool ok = true;
+    for (const auto& run : runs) {
+        uint64_t id = 0;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            id = nextId_++;
+        }
+        // Written and indexed whole before the manifest lists it; a crash leaves an orphan
+        const std::string path = segmentPath(id);
+        BlockFileAppender out(path, detector, encoding);
+        bool written = out.open(true);
+        uint64_t records = 0;
+        for (const auto& segment : run) {
+            records += segment.entry.records;
+            bool appended = written;
+            written = written && BlockFile::scan(segment.path, nullptr, std::numeric_limits<size_t>::max(),
+                                                 [&](const SensorData* rows, size_t count) {
+                appended = appended && out.append(rows, count);
+            }, nullptr, segment.index.get()) && appended;
+        }
+        written = out.close() && written;
+        auto index = std::make_shared<BlockFile::Index>();
+        written = written && BlockFile::buildIndex(path, *index) && index->records == records &&
+                  BlockFile::writeIndex(indexPath(path), *index);
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        // The run must still be in the manifest as it was; replace() may have swapped it out
+        size_t first = 0;
+        while (first < slots_.size() && slots_[first].entry.id != run.front().entry.id) {
+            ++first;
+        }
+        bool intact = first + run.size() < slots_.size();
+        for (size_t k = 0; intact && k < run.size(); ++k) {
+            intact = slots_[first + k].entry.id == run[k].entry.id;
+        }
+        if (!written || !intact) {
+            lock.unlock();
+            std::remove(path.c_str());
+            std::remove(indexPath(path).c_str());
+            ok = ok && written; // A run replaced meanwhile is no failure
+            continue;
+        }
+        Slot merged{ManifestEntry{id, records, index->fileBytes, run.front().entry.created_ms, 1, 1, index->zone},
+                    std::make_shared<SegmentFile>(path), index};
+        std::vector<Slot> old(slots_.begin() + static_cast<std::ptrdiff_t>(first),
+                              slots_.begin() + static_cast<std::ptrdiff_t>(first + run.size()));
+        slots_.erase(slots_.begin() + static_cast<std::ptrdiff_t>(first),
+                     slots_.begin() + static_cast<std::ptrdiff_t>(first + run.size()));
+        slots_.insert(slots_.begin() + static_cast<std::ptrdiff_t>(first), merged);
+        if (!writeManifestLocked()) {
+            slots_.erase(slots_.begin() + static_cast<std::ptrdiff_t>(first));
+            slots_.insert(slots_.begin() + static_cast<std::ptrdiff_t>(first), old.begin(), old.end());
+            merged.file->retire();
+            ok = false;
+            continue;
+        }
+        for (auto& slot : old) {
+            slot.file->retire();
+        }
+        stats_.merged += old.size();
+    }
+    return ok;
+}
+
+void SegmentedFile::compactorLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+        if (policy_.compactionInterval_ms > 0) {
+            wakeCompactor_.wait_for(lock, std::chrono::milliseconds(policy_.compactionInterval_ms));
+        } else {
+            wakeCompactor_.wait(lock);
+        }
+        if (stopping_) {
+            return;
+        }
+        if (!policy_.backgroundCompaction) {
+            continue;
+        }
+        lock.unlock();
+        compact();
+        lock.lock();
+    }
+}
@@ -0,0 +1,277 @@
+#include "WriteAheadLog.hpp"
+#include "BlockFile.hpp"
+#include "Crc32.hpp"
+#include "FileIO.hpp"
+#include <cstdio>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+    // Size of a file, 0 if it does not exist; false if it cannot be inspected
+    bool fileSize(const std::string& path, uint64_t& size) {
+        std::error_code error;
+        size = 0;
+        if (!fs::exists(path, error)) {
+            return !error;
+        }
+        size = fs::file_size(path, error);
+        return !error;
+    }
+}
+
+WriteAheadLog::WriteAheadLog(SegmentedFile& base, const BufferedAppender::Policy& policy, size_t checkpointRecords)
+    : base_(base), walPath_(base.path() + ".wal"), appender_(walPath_, policy, true),
+      checkpointRecords_(std::max<size_t>(checkpointRecords, 1)) {}
+
+WriteAheadLog::~WriteAheadLog() {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    checkpointLocked(false);
+}
+
+bool WriteAheadLog::append(const SensorData* rows, size_t count) {
+    if (count == 0) {
+        return true;
+    }
+    bool ok = false;
+    for (;;) {
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex_);
+            if (logOpen_) {
+                ok = appender_.append(rows, count);
+                break;
+            }
+        }
+        // The first append after a checkpoint starts a new log
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        if (!logOpen_ && !openLogLocked()) {
+            return false;
+        }
+    }
+
+    // The append that crosses the limit checkpoints, holding back appends meanwhile
+    const size_t limit = checkpointRecords_;
+    const uint64_t before = logged_.fetch_add(count);
+    if (ok && before < limit && before + count >= limit) {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        checkpointLocked(false);
+    }
+    return ok;
+}
+
+bool WriteAheadLog::flush() {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    return appender_.flush(true);
+}
+
+bool WriteAheadLog::checkpoint() {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    return checkpointLocked(true);
+}
+
+bool WriteAheadLog::replaceBase(const std::function<bool()>& replace) {
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    // Whatever was logged goes into the old base first, so a crash leaves either base complete
+    if (!checkpointLocked(true)) {
+        return false;
+    }
+    return replace();
+}
+
+bool WriteAheadLog::read(const std::function<bool(const std::vector<SensorData>& unsealed)>& read) {
+    std::shared_lock<std::shared_mutex> lock(mutex_, std::defer_lock);
+    uint64_t inBase = 0;
+    if (!lockForRead(lock, inBase)) {
+        return false;
+    }
+    std::vector<SensorData> unsealed;
+    if (logOpen_) {
+        unsealed = carried_;
+        appender_.copyRetained(unsealed);
+        unsealed.erase(unsealed.begin(), unsealed.begin() + static_cast<size_t>(std::min<uint64_t>(inBase, unsealed.size())));
+    }
+    return read(unsealed);
+}
+
+bool WriteAheadLog::readCount(const std::function<bool(uint64_t unsealed)>& read) {
+    std::shared_lock<std::shared_mutex> lock(mutex_, std::defer_lock);
+    uint64_t inBase = 0;
+    if (!lockForRead(lock, inBase)) {
+        return false;
+    }
+    const uint64_t logged = logOpen_ ? carried_.size() + appender_.retainedCount() : 0;
+    return read(logged - std::min(inBase, logged));
+}
+
+bool WriteAheadLog::lockForRead(std::shared_lock<std::shared_mutex>& lock, uint64_t& inBase) {
+    lock.lock();
+    while (!recovered_) {
+        // A log left by a crash comes first
+        lock.unlock();
+        {
+            std::unique_lock<std::shared_mutex> exclusive(mutex_);
+            if (!recovered_ && !checkpointLocked(false)) {
+                return false;
+            }
+        }
+        lock.lock();
+    }
+    inBase = 0;
+    if (logOpen_ && partlyInBase_) {
+        uint64_t position = 0;
+        if (!base_.position(position)) {
+            return false;
+        }
+        inBase = position > logPosition_ ? position - logPosition_ : 0;
+    }
+    return true;
+}
+
+bool WriteAheadLog::openLogLocked() {
+    if (!recovered_ && !checkpointLocked(false)) {
+        return false; // A log left by a crash comes first
+    }
+    if (logOpen_) {
+        return true; // Kept by a failed checkpoint; appends go on into it
+    }
+    uint64_t position = 0;
+    if (!base_.position(position)) {
+        return false;
+    }
+    Header header{kMagic, kVersion, position};
+    std::ofstream log(walPath_, std::ios::binary | std::ios::trunc);
+    log.write(reinterpret_cast<const char*>(&header), sizeof(Header));
+    log.close();
+    if (log.fail()) {
+        return false;
+    }
+    // The header reaches the disk with the first synced frame
+    logOpen_ = true;
+    logPosition_ = position;
+    partlyInBase_ = false;
+    carried_.clear();
+    return true;
+}
+
+bool WriteAheadLog::checkpointLocked(bool whole) {
+    if (recovered_ && !logOpen_) {
+        return true; // Nothing logged since the last checkpoint
+    }
+    logged_ = 0;
+    appender_.close(); // Writes and syncs the buffered frames; what failed to be written is lost
+
+    uint64_t logBytes = 0;
+    if (!fileSize(walPath_, logBytes)) {
+        return false;
+    }
+    std::ifstream log(walPath_, std::ios::binary);
+    Header header{};
+    bool replayed = false;
+    bool ok = true;
+    std::vector<SensorData> unsealed;
+    std::vector<SensorData> logRows; // Everything the log holds, kept if the checkpoint fails
+    uint64_t baseRecords = 0;
+    if (log && log.read(reinterpret_cast<char*>(&header), sizeof(Header)) && header.magic == kMagic &&
+        header.version == kVersion) {
+        // Opening repairs the end of the base if a checkpoint was cut short there
+        uint64_t preceding = 0;
+        std::unique_ptr<BlockFileAppender> base = base_.openActive(preceding);
+        ok = base != nullptr;
+        // Readings the base already has, from an earlier checkpoint that did not finish
+        const uint64_t position = ok ? preceding + base->records() : 0;
+        uint64_t skip = position > header.baseRecords ? position - header.baseRecords : 0;
+
+        uint64_t remaining = logBytes - sizeof(Header);
+        std::vector<SensorData> rows;
+        BufferedAppender::FrameHeader frame;
+        while (ok && remaining >= sizeof(frame) && log.read(reinterpret_cast<char*>(&frame), sizeof(frame))) {
+            remaining -= sizeof(frame);
+            const uint64_t frameBytes = static_cast<uint64_t>(frame.count) * sizeof(SensorData);
+            if (frame.count == 0 || frameBytes > remaining) {
+                break; // Cut short
+            }
+            rows.resize(frame.count);
+            if (!log.read(reinterpret_cast<char*>(rows.data()), static_cast<std::streamsize>(frameBytes)) ||
+                crc32(rows.data(), frameBytes, crc32(&frame.count, sizeof(frame.count))) != frame.crc) {
+                break;
+            }
+            remaining -= frameBytes;
+            logRows.insert(logRows.end(), rows.begin(), rows.end());
+            const size_t first = static_cast<size_t>(std::min<uint64_t>(skip, frame.count));
+            skip -= first;
+            if (first < rows.size() && !base->append(rows.data() + first, rows.size() - first)) {
+                ok = false;
+            }
+        }
+        if (base) {
+            ok = base->close(whole ? nullptr : &unsealed) && ok;
+            baseRecords = preceding + base->records();
+        }
+        replayed = true;
+    }
+    log.close();
+    recovered_ = true;
+    if (ok && !unsealed.empty()) {
+        // Readings short of a GORILLA block stay in the log, so the base gets no short block
+        ok = restartLog(baseRecords, unsealed);
+        if (ok) {
+            logOpen_ = true;
+            logPosition_ = baseRecords;
+            partlyInBase_ = false;
+            carried_ = std::move(unsealed);
+            logged_ = carried_.size();
+            ++checkpoints_;
+            return true;
+        }
+    }
+    if (!ok) {
+        // Keep the log; the next checkpoint skips what did reach the base
+        logOpen_ = true;
+        logPosition_ = header.baseRecords;
+        partlyInBase_ = true;
+        carried_ = std::move(logRows);
+        return false;
+    }
+
+    std::error_code error;
+    fs::remove(walPath_, error);
+    logOpen_ = false;
+    partlyInBase_ = false;
+    std::vector<SensorData>().swap(carried_);
+    if (replayed) {
+        ++checkpoints_;
+    }
+    return true;
+}
+
+bool WriteAheadLog::restartLog(uint64_t baseRecords, const std::vector<SensorData>& rows) {
+    // Written aside and renamed over the log, so a crash leaves either log, both of which replay
+    // to the same readings
+    const std::string tempPath = walPath_ + ".tmp";
+    std::remove(tempPath.c_str());
+    int fd = openForAppend(tempPath);
+    if (fd < 0) {
+        return false;
+    }
+    Header header{kMagic, kVersion, baseRecords};
+    BufferedAppender::FrameHeader frame{static_cast<uint32_t>(rows.size()), 0};
+    frame.crc = crc32(rows.data(), rows.size() * sizeof(SensorData), crc32(&frame.count, sizeof(frame.count)));
+    bool ok = writeAll(fd, reinterpret_cast<const char*>(&header), sizeof(header)) &&
+              writeAll(fd, reinterpret_cast<const char*>(&frame), sizeof(frame)) &&
+              writeAll(fd, reinterpret_cast<const char*>(rows.data()), rows.size() * sizeof(SensorData)) &&
+              syncFile(fd);
+    closeFile(fd);
+#ifdef _WIN32
+    ok = ok && std::remove(walPath_.c_str()) == 0; // rename does not replace existing files here
+#endif
+    ok = ok && std::rename(tempPath.c_str(), walPath_.c_str()) == 0;
+    if (!ok) {
+        std::remove(tempPath.c_str());
+    }
+    return ok;
+}
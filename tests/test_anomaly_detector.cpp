@@ -1,8 +1,13 @@
 #include "gtest/gtest.h"
 #include "AnomalyDetector.hpp"
+#include "StatisticalDetector.hpp"
+#include "ThresholdProfiles.hpp"
 #include "SensorData.hpp"
+#include "QueryCommon.hpp" // For calculate_deviation_metric
 #include <vector>
 #include <chrono>
+#include <cmath>   // For NAN
+#include <random>  // For batch kernel inputs
 
 // Test fixture for AnomalyDetector tests
 class AnomalyDetectorTest : public ::testing::Test {
@@ -100,3 +105,260 @@ TEST_F(AnomalyDetectorTest, CustomThresholds) {
     SensorData normalForCustom = createData(22.0, 50.0, 500.0);
     EXPECT_FALSE(customDetector.isAnomalous(normalForCustom));
 }
+
+// Readings around and on every threshold, plus NaNs, in a count that leaves a partial word
+static std::vector<SensorData> kernelInputs(const AnomalyDetector::AnomalyThresholds& t) {
+    std::mt19937 rng(42);
+    const double temps[] = {t.minTemp, t.maxTemp, t.minTemp - 0.5, t.maxTemp + 0.5, 22.0, NAN};
+    const double hums[] = {t.minHumidity, t.maxHumidity, t.minHumidity - 3.0, t.maxHumidity + 3.0, 50.0, NAN};
+    const double lights[] = {t.minLight, t.maxLight, t.minLight - 10.0, t.maxLight + 10.0, 500.0, NAN};
+    std::uniform_int_distribution<int> pick(0, 5);
+    std::uniform_real_distribution<double> noise(-1.0, 1.0);
+    std::vector<SensorData> rows;
+    for (int i = 0; i < 1003; ++i) {
+        bool exact = (i % 3 == 0); // Every third reading sits exactly on the picked values
+        rows.push_back({i, temps[pick(rng)] + (exact ? 0.0 : noise(rng)), hums[pick(rng)] + (exact ? 0.0 : noise(rng)),
+                        lights[pick(rng)] + (exact ? 0.0 : noise(rng))});
+    }
+    return rows;
+}
+
+TEST_F(AnomalyDetectorTest, BatchKernelsMatchPerReadingClassification) {
+    AnomalyDetector::AnomalyThresholds thresholds;
+    thresholds.minTemp = 18.0; // Bounds that are not all round numbers
+    thresholds.maxHumidity = 64.5;
+    AnomalyDetector detector(thresholds);
+    std::vector<SensorData> rows = kernelInputs(thresholds);
+
+    const AnomalyDetector::BatchKernel kernels[] = {AnomalyDetector::BatchKernel::SCALAR,
+                                                    AnomalyDetector::BatchKernel::SSE2,
+                                                    AnomalyDetector::BatchKernel::AVX2};
+    for (auto kernel : kernels) {
+        SCOPED_TRACE(AnomalyDetector::batchKernelName(kernel));
+        std::vector<uint64_t> bits((rows.size() + 63) / 64, ~uint64_t{0}); // Must be overwritten
+        std::vector<double> deviations(rows.size(), -1.0);
+        detector.classifyBatch(rows.data(), rows.size(), bits.data(), deviations.data(), kernel);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            ASSERT_EQ(((bits[i / 64] >> (i % 64)) & 1) != 0, detector.isAnomalous(rows[i])) << "row " << i;
+            ASSERT_EQ(deviations[i], calculate_deviation_metric(rows[i], thresholds)) << "row " << i;
+        }
+        EXPECT_EQ(bits.back() >> (rows.size() % 64), 0u); // Bits past the end stay clear
+
+        // Columnar input gives the same answers
+        std::vector<double> temps, hums, lights;
+        for (const auto& row : rows) {
+            temps.push_back(row.temperature);
+            hums.push_back(row.humidity);
+            lights.push_back(row.lightIntensity);
+        }
+        std::vector<uint64_t> columnBits(bits.size());
+        std::vector<double> columnDeviations(rows.size());
+        detector.classifyColumns({temps.data(), hums.data(), lights.data(), rows.size()}, columnBits.data(),
+                                 columnDeviations.data(), kernel);
+        EXPECT_EQ(columnBits, bits);
+        EXPECT_EQ(columnDeviations, deviations);
+    }
+}
+
+TEST_F(AnomalyDetectorTest, CountAndFindAnomaliesAgreeWithIsAnomalous) {
+    std::vector<SensorData> rows = kernelInputs(defaultThresholds_);
+    size_t expected = 0;
+    for (const auto& row : rows) {
+        expected += detector_.isAnomalous(row) ? 1 : 0;
+    }
+    EXPECT_EQ(detector_.countAnomalies(rows.data(), rows.size()), expected);
+    std::vector<SensorData> anomalies = detector_.findAnomalies(rows);
+    ASSERT_EQ(anomalies.size(), expected);
+    for (size_t i = 1; i < anomalies.size(); ++i) {
+        EXPECT_LT(anomalies[i - 1].timestamp_ms, anomalies[i].timestamp_ms); // Input order is kept
+    }
+}
+
+TEST(ThresholdProfilesTest, SetLookupAndEraseManySensors) {
+    AnomalyDetector::AnomalyThresholds defaults;
+    ThresholdProfiles profiles(defaults);
+    auto thresholdsFor = [](uint32_t id) {
+        AnomalyDetector::AnomalyThresholds t;
+        t.maxTemp = 30.0 + id; // Distinct per sensor
+        return t;
+    };
+    for (uint32_t id = 1; id <= 1000; ++id) {
+        profiles.set(id * 7919, thresholdsFor(id)); // Spread-out ids that share hash buckets
+    }
+    EXPECT_EQ(profiles.size(), 1000u);
+    for (uint32_t id = 1; id <= 1000; ++id) {
+        ASSERT_DOUBLE_EQ(profiles.lookup(id * 7919).maxTemp, 30.0 + id) << id;
+    }
+    EXPECT_DOUBLE_EQ(profiles.lookup(12345).maxTemp, defaults.maxTemp); // No profile of its own
+    EXPECT_EQ(profiles.profileIndex(0), 0u);
+
+    // Erase every odd sensor; the rest must stay reachable through the shifted probe runs
+    for (uint32_t id = 1; id <= 1000; id += 2) {
+        ASSERT_TRUE(profiles.erase(id * 7919));
+    }
+    EXPECT_FALSE(profiles.erase(7919));
+    EXPECT_EQ(profiles.size(), 500u);
+    for (uint32_t id = 1; id <= 1000; ++id) {
+        double expected = (id % 2 == 0) ? 30.0 + id : defaults.maxTemp;
+        ASSERT_DOUBLE_EQ(profiles.lookup(id * 7919).maxTemp, expected) << id;
+    }
+
+    // Sensor 0 is the default profile
+    AnomalyDetector::AnomalyThresholds warmer;
+    warmer.maxTemp = 33.0;
+    profiles.set(0, warmer);
+    EXPECT_DOUBLE_EQ(profiles.defaults().maxTemp, 33.0);
+    EXPECT_DOUBLE_EQ(profiles.lookup(7919).maxTemp, 33.0);
+    EXPECT_EQ(profiles.size(), 500u);
+}
+
+TEST_F(AnomalyDetectorTest, ReadingsUseTheProfileOfTheirSensor) {
+    ThresholdProfiles profiles;
+    AnomalyDetector::AnomalyThresholds serverCloset;
+    serverCloset.maxTemp = 40.0;
+    serverCloset.minLight = 0.0;
+    profiles.set(7, serverCloset);
+    AnomalyDetector detector(profiles);
+
+    SensorData classroom = createData(35.0, 50.0, 20.0);
+    SensorData closet = classroom;
+    closet.sensorId = 7;
+    EXPECT_TRUE(detector.isAnomalous(classroom));
+    EXPECT_FALSE(detector.isAnomalous(closet));
+    EXPECT_DOUBLE_EQ(detector.deviation(classroom), 5.0 + 80.0);
+    EXPECT_DOUBLE_EQ(detector.deviation(closet), 0.0);
+    EXPECT_DOUBLE_EQ(detector.thresholdsFor(7).maxTemp, 40.0);
+    EXPECT_DOUBLE_EQ(detector.thresholdsFor(8).maxTemp, defaultThresholds_.maxTemp);
+}
+
+TEST_F(AnomalyDetectorTest, BatchKernelsGroupReadingsByProfile) {
+    ThresholdProfiles profiles;
+    AnomalyDetector::AnomalyThresholds lab;
+    lab.minTemp = 18.5;
+    lab.maxHumidity = 55.0;
+    AnomalyDetector::AnomalyThresholds gym;
+    gym.maxTemp = 27.0;
+    gym.maxLight = 2000.0;
+    profiles.set(1, lab);
+    profiles.set(2, gym);
+    AnomalyDetector detector(profiles);
+
+    std::vector<SensorData> rows = kernelInputs(defaultThresholds_);
+    std::vector<uint32_t> sensorIds;
+    for (size_t i = 0; i < rows.size(); ++i) {
+        // A run from one sensor, then interleaved sensors (3 has no profile of its own)
+        rows[i].sensorId = (i < 300) ? 2 : static_cast<uint32_t>(i % 4);
+        sensorIds.push_back(rows[i].sensorId);
+    }
+
+    const AnomalyDetector::BatchKernel kernels[] = {AnomalyDetector::BatchKernel::SCALAR,
+                                                    AnomalyDetector::BatchKernel::SSE2,
+                                                    AnomalyDetector::BatchKernel::AVX2};
+    for (auto kernel : kernels) {
+        SCOPED_TRACE(AnomalyDetector::batchKernelName(kernel));
+        std::vector<uint64_t> bits((rows.size() + 63) / 64, ~uint64_t{0});
+        std::vector<double> deviations(rows.size(), -1.0);
+        detector.classifyBatch(rows.data(), rows.size(), bits.data(), deviations.data(), kernel);
+        for (size_t i = 0; i < rows.size(); ++i) {
+            ASSERT_EQ(((bits[i / 64] >> (i % 64)) & 1) != 0, detector.isAnomalous(rows[i])) << "row " << i;
+            ASSERT_EQ(deviations[i], detector.deviation(rows[i])) << "row " << i;
+            double deviation = -1.0;
+            ASSERT_EQ(detector.classify(rows[i], deviation), detector.isAnomalous(rows[i])) << "row " << i;
+            ASSERT_EQ(deviation, deviations[i]) << "row " << i;
+        }
+
+        std::vector<double> temps, hums, lights;
+        for (const auto& row : rows) {
+            temps.push_back(row.temperature);
+            hums.push_back(row.humidity);
+            lights.push_back(row.lightIntensity);
+        }
+        std::vector<uint64_t> columnBits(bits.size());
+        std::vector<double> columnDeviations(rows.size());
+        detector.classifyColumns({temps.data(), hums.data(), lights.data(), rows.size(), sensorIds.data()},
+                                 columnBits.data(), columnDeviations.data(), kernel);
+        EXPECT_EQ(columnBits, bits);
+        EXPECT_EQ(columnDeviations, deviations);
+    }
+    size_t expected = 0;
+    for (const auto& row : rows) {
+        expected += detector.isAnomalous(row) ? 1 : 0;
+    }
+    EXPECT_EQ(detector.countAnomalies(rows.data(), rows.size()), expected);
+}
+
+TEST(StatisticalDetectorTest, FlagsSuddenJumpButNotSlowDrift) {
+    StatisticalDetector detector;
+    int64_t ts = 0;
+    // A steady classroom around 20 C
+    for (int i = 0; i < 100; ++i) {
+        double wobble = (i % 2 == 0) ? 0.1 : -0.1;
+        EXPECT_FALSE(detector.update({ts++, 20.0 + wobble, 45.0, 500.0}).anomalous);
+    }
+    // A 6 C jump is flagged although it is well inside the fixed thresholds
+    StatisticalDetector::Assessment spike = detector.assess({ts, 26.0, 45.0, 500.0});
+    EXPECT_TRUE(spike.warmedUp);
+    EXPECT_TRUE(spike.anomalous);
+    EXPECT_GT(spike.zScores[0], 3.0);
+    EXPECT_DOUBLE_EQ(spike.zScores[1], 0.0);
+    EXPECT_NEAR(spike.mean[0], 20.0, 0.1);
+    EXPECT_EQ(detector.observedCount(), 100u); // assess() leaves the baseline alone
+
+    // Warming slowly all the way to 29.9 C is normal
+    for (int i = 1; i <= 500; ++i) {
+        EXPECT_FALSE(detector.update({ts++, 20.0 + 9.9 * i / 500.0, 45.0, 500.0}).anomalous) << i;
+    }
+    EXPECT_NEAR(detector.assess({ts, 29.9, 45.0, 500.0}).mean[0], 29.9, 0.5);
+}
+
+TEST(StatisticalDetectorTest, NoVerdictDuringWarmupAndNaNIsIgnored) {
+    StatisticalDetector::Config config;
+    config.warmupReadings = 5;
+    StatisticalDetector detector(config);
+    for (int64_t i = 0; i < 5; ++i) {
+        StatisticalDetector::Assessment a = detector.update({i, i == 3 ? 80.0 : 20.0, 45.0, 500.0});
+        EXPECT_FALSE(a.warmedUp);
+        EXPECT_FALSE(a.anomalous);
+    }
+    detector.reset();
+    EXPECT_EQ(detector.observedCount(), 0u);
+    for (int64_t i = 0; i < 10; ++i) {
+        detector.update({i, 20.0, 45.0, 500.0});
+    }
+    StatisticalDetector::Assessment a = detector.update({10, NAN, 45.0, 500.0});
+    EXPECT_FALSE(a.anomalous);
+    EXPECT_DOUBLE_EQ(a.zScores[0], 0.0);
+    EXPECT_DOUBLE_EQ(detector.assess({11, 20.0, 45.0, 500.0}).mean[0], 20.0); // NaN was not folded in
+}
+
+TEST(StatisticalDetectorTest, RollingWindowMatchesRecomputedStatistics) {
+    StatisticalDetector::Config config;
+    config.method = StatisticalDetector::Method::ROLLING_WINDOW;
+    config.windowSize = 10;
+    StatisticalDetector detector(config);
+    std::mt19937 rng(7);
+    std::normal_distribution<double> temperature(22.0, 2.0);
+    std::vector<double> seen;
+    for (int64_t i = 0; i < 200; ++i) {
+        double value = temperature(rng);
+        detector.update({i, value, 45.0, 500.0});
+        seen.push_back(value);
+
+        // Sample mean and standard deviation of the last windowSize values
+        size_t n = std::min<size_t>(seen.size(), config.windowSize);
+        double mean = 0.0;
+        for (size_t k = seen.size() - n; k < seen.size(); ++k) {
+            mean += seen[k];
+        }
+        mean /= static_cast<double>(n);
+        double squares = 0.0;
+        for (size_t k = seen.size() - n; k < seen.size(); ++k) {
+            squares += (seen[k] - mean) * (seen[k] - mean);
+        }
+        double stdDev = n > 1 ? std::sqrt(squares / static_cast<double>(n - 1)) : 0.0;
+
+        StatisticalDetector::Assessment a = detector.assess({i + 1, mean, 45.0, 500.0});
+        EXPECT_NEAR(a.mean[0], mean, 1e-9) << i;
+        EXPECT_NEAR(a.stdDev[0], stdDev, 1e-9) << i;
+    }
+}
@@ -0,0 +1,134 @@
+#include "gtest/gtest.h"
+#include "AnomalyEpisodes.hpp"
+#include <vector>
+
+namespace {
+    SensorData reading(int64_t seconds, double temp, double hum = 50.0, double light = 500.0, uint32_t sensorId = 0) {
+        SensorData data{1700000000000LL + seconds * 1000, temp, hum, light};
+        data.sensorId = sensorId;
+        return data;
+    }
+}
+
+TEST(AnomalyEpisodesTest, HoveringAtTheLimitIsOneEpisode) {
+    AnomalyDetector::AnomalyThresholds thresholds; // maxTemp 30
+    EpisodeTracker tracker;
+    // Flickers across 30 C for a thousand readings without settling below 29.5
+    for (int i = 0; i < 1000; ++i) {
+        tracker.update(reading(i, (i % 2) ? 30.2 : 29.8), thresholds);
+    }
+    tracker.update(reading(1000, 31.5), thresholds); // Peak
+    for (int i = 1001; i < 1004; ++i) {
+        tracker.update(reading(i, 25.0), thresholds);
+    }
+
+    ASSERT_EQ(tracker.closedCount(), 1u);
+    EXPECT_EQ(tracker.openCount(), 0u);
+    const AnomalyEpisode& episode = tracker.closedEpisodes().front();
+    EXPECT_EQ(episode.metric, RuleMetric::TEMPERATURE);
+    EXPECT_EQ(episode.start_ms, reading(1, 0).timestamp_ms);
+    EXPECT_EQ(episode.end_ms, reading(1000, 0).timestamp_ms);
+    EXPECT_EQ(episode.count, 501u);
+    EXPECT_DOUBLE_EQ(episode.peakValue, 31.5);
+    EXPECT_NEAR(episode.peakDeviation, 1.5, 1e-9);
+    EXPECT_FALSE(episode.open);
+}
+
+TEST(AnomalyEpisodesTest, MetricsAndSensorsHaveSeparateEpisodes) {
+    AnomalyDetector::AnomalyThresholds thresholds;
+    EpisodeTracker::Config config;
+    config.exitReadings = 1;
+    EpisodeTracker tracker(config);
+    tracker.update(reading(0, 35.0, 80.0, 500.0, 1), thresholds); // Hot and humid
+    tracker.update(reading(0, 20.0, 50.0, 10.0, 2), thresholds);  // Dark
+    tracker.update(reading(1, 20.0, 80.0, 500.0, 1), thresholds); // Temperature settles
+    tracker.update(reading(-120, 35.0, 50.0, 10.0, 2), thresholds); // Beyond the reorder window: ignored
+
+    std::vector<AnomalyEpisode> episodes = tracker.episodes();
+    ASSERT_EQ(episodes.size(), 3u);
+    EXPECT_EQ(episodes[0].metric, RuleMetric::TEMPERATURE); // Closed first
+    EXPECT_FALSE(episodes[0].open);
+    EXPECT_EQ(episodes[1].sensorId, 1u); // Then the open ones, by start and sensor
+    EXPECT_EQ(episodes[1].metric, RuleMetric::HUMIDITY);
+    EXPECT_EQ(episodes[1].count, 2u);
+    EXPECT_EQ(episodes[2].sensorId, 2u);
+    EXPECT_EQ(episodes[2].metric, RuleMetric::LIGHT_INTENSITY);
+    EXPECT_EQ(episodes[2].count, 1u);
+}
+
+TEST(AnomalyEpisodesTest, EntryHysteresisIgnoresBriefExcursions) {
+    AnomalyDetector::AnomalyThresholds thresholds; // maxTemp 30
+    EpisodeTracker::Config config;
+    config.entryMargin[0] = 1.0;
+    config.entryReadings = 3;
+    config.exitReadings = 1;
+    EpisodeTracker tracker(config);
+    // Past the threshold but not the entry band, then two readings past it: no episode
+    tracker.update(reading(0, 30.5), thresholds);
+    tracker.update(reading(1, 31.5), thresholds);
+    tracker.update(reading(2, 31.5), thresholds);
+    tracker.update(reading(3, 30.5), thresholds); // Breaks the run
+    tracker.update(reading(4, 31.5), thresholds);
+    EXPECT_EQ(tracker.openCount(), 0u);
+    EXPECT_TRUE(tracker.episodes().empty());
+
+    // Three in a row open it, reaching back to the first of them
+    tracker.update(reading(5, 32.0), thresholds);
+    tracker.update(reading(6, 31.2), thresholds);
+    ASSERT_EQ(tracker.openCount(), 1u);
+    tracker.update(reading(7, 30.5), thresholds); // Once open, anything past the threshold extends it
+    tracker.update(reading(8, 25.0), thresholds);
+    ASSERT_EQ(tracker.closedCount(), 1u);
+    const AnomalyEpisode& episode = tracker.closedEpisodes().front();
+    EXPECT_EQ(episode.start_ms, reading(4, 0).timestamp_ms);
+    EXPECT_EQ(episode.end_ms, reading(7, 0).timestamp_ms);
+    EXPECT_EQ(episode.count, 4u);
+    EXPECT_DOUBLE_EQ(episode.peakValue, 32.0);
+
+    // Rules need the same run of firing readings
+    tracker.update(reading(9, 20.0), thresholds, 1u);
+    tracker.update(reading(10, 20.0), thresholds, 1u);
+    tracker.update(reading(11, 20.0), thresholds, 0u);
+    EXPECT_EQ(tracker.openCount(), 0u);
+    for (int i = 12; i < 15; ++i) {
+        tracker.update(reading(i, 20.0), thresholds, 1u);
+    }
+    ASSERT_EQ(tracker.openCount(), 1u);
+    EXPECT_EQ(tracker.episodes().back().rule, 0);
+    EXPECT_EQ(tracker.episodes().back().start_ms, reading(12, 0).timestamp_ms);
+}
+
+TEST(AnomalyEpisodesTest, LateAndInterleavedReadingsAreCounted) {
+    AnomalyDetector::AnomalyThresholds thresholds;
+    EpisodeTracker tracker; // One minute reorder window
+    // Two legacy sensors sharing id 0 with skewed clocks, both hot
+    for (int i = 0; i < 10; ++i) {
+        tracker.update(reading(i * 10, 35.0), thresholds);
+        tracker.update(reading(i * 10 - 4, 34.0), thresholds);
+    }
+    tracker.update(reading(90, 36.0), thresholds); // Same timestamp as the newest
+    tracker.update(reading(50, 37.0), thresholds); // Late, within the window
+    tracker.update(reading(-100, 38.0), thresholds); // Beyond it
+
+    ASSERT_EQ(tracker.openCount(), 1u);
+    const AnomalyEpisode episode = tracker.episodes().front();
+    EXPECT_EQ(episode.start_ms, reading(-4, 0).timestamp_ms);
+    EXPECT_EQ(episode.end_ms, reading(90, 0).timestamp_ms);
+    EXPECT_EQ(episode.count, 22u);
+    EXPECT_DOUBLE_EQ(episode.peakValue, 37.0);
+}
+
+TEST(AnomalyEpisodesTest, SilentSensorEndsItsEpisode) {
+    AnomalyDetector::AnomalyThresholds thresholds;
+    EpisodeTracker tracker; // 10 minute gap limit
+    tracker.update(reading(0, 35.0), thresholds);
+    tracker.update(reading(60, 35.0), thresholds);
+    tracker.update(reading(60 + 3600, 35.0), thresholds); // An hour later: a new episode
+    ASSERT_EQ(tracker.closedCount(), 1u);
+    EXPECT_EQ(tracker.closedEpisodes().front().count, 2u);
+    EXPECT_EQ(tracker.openCount(), 1u);
+
+    tracker.reset();
+    EXPECT_TRUE(tracker.episodes().empty());
+    EXPECT_EQ(tracker.closedCount(), 0u);
+}
@@ -0,0 +1,222 @@
+#include "gtest/gtest.h"
+#include "AnomalyRules.hpp"
+#include "ThresholdProfiles.hpp"
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace {
+    SensorData reading(int64_t seconds, double temp, double hum, double light, uint32_t sensorId = 0) {
+        SensorData data{1700000000000LL + seconds * 1000, temp, hum, light};
+        data.sensorId = sensorId;
+        return data;
+    }
+}
+
+TEST(AnomalyRulesTest, RateOfChangeComparesEachSensorWithItsPreviousReading) {
+    RateOfChangeRule rule; // 2 C per minute
+    RateOfChangeRule::State a, b;
+    EXPECT_FALSE(rule.check(reading(0, 20.0, 45.0, 500.0), a));  // Nothing to compare with
+    EXPECT_FALSE(rule.check(reading(60, 21.5, 45.0, 500.0), a)); // 1.5 C in a minute
+    EXPECT_TRUE(rule.check(reading(90, 23.0, 45.0, 500.0), a));  // 1.5 C in half a minute
+    EXPECT_FALSE(rule.check(reading(0, 30.0, 45.0, 500.0), b));  // Other sensor, own history
+    EXPECT_FALSE(rule.check(reading(80, 40.0, 45.0, 500.0), a)); // Older than the last one: ignored
+    EXPECT_DOUBLE_EQ(a.previous.temperature, 23.0);
+    EXPECT_TRUE(rule.check(reading(90, 60.0, 45.0, 500.0), b)); // Jumps fire...
+    EXPECT_TRUE(rule.check(reading(91, 20.0, 45.0, 500.0), b)); // ...both ways
+}
+
+TEST(AnomalyRulesTest, StuckSensorFiresAfterRepeatedValues) {
+    StuckSensorRule rule;
+    rule.maxRepeats = 3;
+    StuckSensorRule::State state;
+    for (int i = 0; i <= 3; ++i) {
+        EXPECT_FALSE(rule.check(reading(i, 21.0 + i, 45.0, 500.0 + i), state)) << i; // Humidity repeats 3 times
+    }
+    EXPECT_TRUE(rule.check(reading(4, 30.0, 45.0, 600.0), state));
+    EXPECT_FALSE(rule.check(reading(5, 30.5, 46.0, 601.0), state)); // Moving again
+    for (int i = 0; i < 10; ++i) {
+        EXPECT_FALSE(rule.check(reading(6 + i, NAN, 46.0 + i, 601.0 + i), state)); // NaN is not a repeat
+    }
+}
+
+TEST(AnomalyRulesTest, CrossMetricNeedsBothConditions) {
+    CrossMetricRule rule; // Above 28 C and above 65 % humidity
+    std::monostate none;
+    EXPECT_TRUE(rule.check(reading(0, 29.0, 68.0, 500.0), none));
+    EXPECT_FALSE(rule.check(reading(0, 29.0, 60.0, 500.0), none));
+    EXPECT_FALSE(rule.check(reading(0, 25.0, 68.0, 500.0), none));
+
+    CrossMetricRule darkAndCold{{RuleMetric::LIGHT_INTENSITY, false, 50.0}, {RuleMetric::TEMPERATURE, false, 17.0}};
+    EXPECT_TRUE(darkAndCold.check(reading(0, 16.0, 50.0, 10.0), none));
+    EXPECT_FALSE(darkAndCold.check(reading(0, 18.0, 50.0, 10.0), none));
+}
+
+TEST(AnomalyRulesTest, PipelineReportsEachFiredRuleAndKeepsStatePerSensor) {
+    RulePipeline pipeline(ThresholdRule{AnomalyDetector()}, RateOfChangeRule{}, CrossMetricRule{});
+    EXPECT_EQ(pipeline.size(), 3u);
+    EXPECT_EQ(pipeline.ruleNames(), (std::vector<std::string>{"threshold", "rate_of_change", "cross_metric"}));
+
+    EXPECT_EQ(pipeline.evaluate(reading(0, 20.0, 45.0, 500.0, 1)), 0u);
+    EXPECT_EQ(pipeline.evaluate(reading(0, 29.0, 69.0, 500.0, 2)), 0b100u); // Hot and humid only
+    EXPECT_EQ(pipeline.evaluate(reading(10, 35.0, 45.0, 500.0, 1)), 0b011u); // Too hot, and too fast
+    EXPECT_EQ(pipeline.evaluate(reading(10, 29.0, 69.0, 500.0, 2)), 0b100u); // Sensor 2 did not jump
+
+    pipeline.reset();
+    EXPECT_EQ(pipeline.evaluate(reading(20, 20.0, 45.0, 500.0, 1)), 0u); // No previous reading any more
+}
+
+TEST(AnomalyRulesTest, CompiledAndRuntimePipelinesAgree) {
+    AnomalyDetector::AnomalyThresholds thresholds;
+    StuckSensorRule stuck;
+    stuck.maxRepeats = 4;
+    CrossMetricRule darkAndWarm{{RuleMetric::LIGHT_INTENSITY, false, 150.0}, {RuleMetric::TEMPERATURE, true, 26.0}};
+    RulePipeline compiled(ThresholdRule{AnomalyDetector(thresholds)}, RateOfChangeRule{}, stuck, CrossMetricRule{},
+                          darkAndWarm);
+    DynamicRulePipeline runtime;
+    runtime.addRule(ThresholdRule{AnomalyDetector(thresholds)});
+    runtime.addRule(RateOfChangeRule{});
+    runtime.addRule(stuck);
+    runtime.addRule(CrossMetricRule{});
+    runtime.addRule(darkAndWarm);
+    EXPECT_EQ(runtime.ruleNames(), compiled.ruleNames());
+
+    // Four interleaved sensors with drifts, jumps, frozen stretches and out-of-order timestamps
+    std::mt19937 rng(11);
+    std::uniform_int_distribution<int> sensorPick(1, 4), event(0, 19);
+    std::normal_distribution<double> step(0.0, 0.3);
+    std::vector<SensorData> stream;
+    SensorData last[5] = {};
+    for (auto& l : last) {
+        l = reading(0, 22.0, 55.0, 400.0);
+    }
+    for (int i = 0; i < 20000; ++i) {
+        uint32_t sensor = static_cast<uint32_t>(sensorPick(rng));
+        SensorData next = last[sensor];
+        next.sensorId = sensor;
+        next.timestamp_ms += 5000;
+        switch (event(rng)) {
+            case 0: next.temperature += 8.0; break;             // Jump
+            case 1: next.timestamp_ms -= 20000; break;          // Late reading
+            case 2: case 3: case 4: break;                      // Frozen values
+            case 5: next.lightIntensity = 100.0; break;         // Lights off
+            default:
+                next.temperature += step(rng);
+                next.humidity += 3.0 * step(rng);
+                next.lightIntensity += 50.0 * step(rng);
+                break;
+        }
+        last[sensor] = next;
+        stream.push_back(next);
+    }
+
+    std::vector<uint32_t> compiledFired(stream.size()), runtimeFired(stream.size());
+    compiled.evaluate(stream.data(), stream.size(), compiledFired.data());
+    runtime.evaluate(stream.data(), stream.size(), runtimeFired.data());
+    EXPECT_EQ(compiledFired, runtimeFired);
+
+    // Every rule fired somewhere, so the comparison covers all of them
+    uint32_t seen = 0;
+    for (uint32_t fired : compiledFired) {
+        seen |= fired;
+    }
+    EXPECT_EQ(seen, 0b11111u);
+}
+
+TEST(AnomalyRulesTest, RuntimePipelineHoldsAtMost32Rules) {
+    DynamicRulePipeline pipeline;
+    for (int i = 0; i < 32; ++i) {
+        ASSERT_TRUE(pipeline.addRule(StuckSensorRule{}));
+    }
+    EXPECT_FALSE(pipeline.addRule(StuckSensorRule{}));
+    EXPECT_EQ(pipeline.size(), 32u);
+}
+
+TEST(AnomalyRulesTest, ShardedPipelineMatchesOnePipelineAcrossConcurrentWriters) {
+    auto rules = std::make_shared<const DynamicRulePipeline>(
+        std::vector<DynamicRulePipeline::Rule>{RateOfChangeRule{}, StuckSensorRule{}, CrossMetricRule{}});
+    ShardedRulePipeline sharded(rules, 4);
+    EXPECT_EQ(sharded.statefulMask(), 0b011u);
+    EXPECT_EQ(sharded.statelessMask(), 0b100u);
+
+    // Each writer owns some sensors, several of them sharing a shard with other writers' sensors
+    const int kWriters = 8;
+    const int kReadings = 2000;
+    auto streamOf = [](int writer) {
+        std::mt19937 rng(writer);
+        std::uniform_real_distribution<double> step(-1.5, 1.5);
+        std::vector<SensorData> stream;
+        double temp = 22.0;
+        for (int i = 0; i < kReadings; ++i) {
+            temp += (i % 97 == 0) ? 8.0 : step(rng);   // The odd jump trips the rate of change
+            const double hum = (i / 50) % 2 ? 50.0 : 66.0; // Runs of a repeated value get stuck
+            stream.push_back(reading(i * 20, temp, hum, 500.0 + i, static_cast<uint32_t>(writer * 3 + i % 3)));
+        }
+        return stream;
+    };
+    std::vector<std::vector<uint32_t>> fired(kWriters, std::vector<uint32_t>(kReadings));
+    std::vector<std::thread> writers;
+    for (int w = 0; w < kWriters; ++w) {
+        writers.emplace_back([&, w]() {
+            const std::vector<SensorData> stream = streamOf(w);
+            for (int i = 0; i < kReadings; ++i) {
+                fired[w][i] = sharded.evaluate(stream[i]);
+            }
+        });
+    }
+    for (auto& writer : writers) {
+        writer.join();
+    }
+
+    uint32_t seen = 0;
+    for (int w = 0; w < kWriters; ++w) {
+        DynamicRulePipeline single = *rules;
+        const std::vector<SensorData> stream = streamOf(w);
+        for (int i = 0; i < kReadings; ++i) {
+            ASSERT_EQ(fired[w][i], single.evaluate(stream[i])) << "writer " << w << ", reading " << i;
+            EXPECT_EQ(sharded.evaluateStateless(stream[i]), fired[w][i] & 0b100u);
+            seen |= fired[w][i];
+        }
+    }
+    EXPECT_EQ(seen, 0b111u);
+}
+
+TEST(AnomalyRulesTest, DetectorRunsStatelessRulesEverywhereAndStatefulOnesOnArrival) {
+    StuckSensorRule stuck;
+    stuck.maxRepeats = 2;
+    const AnomalyDetector detector = AnomalyDetector().withRules(DynamicRulePipeline({stuck, CrossMetricRule{}}));
+    EXPECT_EQ(detector.ruleNames(), (std::vector<std::string>{"stuck_sensor", "cross_metric"}));
+    EXPECT_EQ(detector.statefulRuleMask(), 0b01u);
+
+    // Hot and humid but inside the thresholds: the cross-metric rule flags it however it is judged
+    const SensorData humid = reading(0, 29.0, 68.0, 500.0);
+    double deviation = -1.0;
+    EXPECT_FALSE(AnomalyDetector().isAnomalous(humid));
+    EXPECT_TRUE(detector.isAnomalous(humid));
+    EXPECT_TRUE(detector.classify(humid, deviation));
+    EXPECT_DOUBLE_EQ(deviation, 0.0);
+    uint64_t bits = 0;
+    detector.classifyBatch(&humid, 1, &bits, nullptr);
+    EXPECT_EQ(bits, 1u);
+    EXPECT_EQ(detector.countAnomalies(&humid, 1), 1u);
+
+    // A frozen reading only counts when it arrives in its sensor's stream
+    uint32_t firedRules = 0;
+    const SensorData frozen = reading(1, 21.0, 45.0, 500.0, 7);
+    for (int i = 0; i < 3; ++i) {
+        EXPECT_FALSE(detector.classifyIncoming(frozen, deviation, &firedRules)) << i;
+    }
+    EXPECT_TRUE(detector.classifyIncoming(frozen, deviation, &firedRules));
+    EXPECT_EQ(firedRules, 0b01u);
+    EXPECT_FALSE(detector.isAnomalous(frozen));
+
+    // Copies share the state; a fresh copy starts over, yet still classifies alike
+    const AnomalyDetector copy = detector;
+    EXPECT_TRUE(copy.classifyIncoming(frozen, deviation));
+    const AnomalyDetector replay = detector.withFreshRuleState();
+    EXPECT_FALSE(replay.classifyIncoming(frozen, deviation));
+    EXPECT_TRUE(replay.sharesThresholdsWith(detector));
+    EXPECT_FALSE(AnomalyDetector().sharesThresholdsWith(detector));
+    EXPECT_TRUE(detector.withThresholds(ThresholdProfiles()).sharesRulesWith(detector));
+}
@@ -268,3 +268,14 @@ TEST_F(ClientTest, SendDataFailsIfReconnectFails) {
     ASSERT_FALSE(client.sendData(test_data));
 }
 
+
+TEST(SensorDataTest, StringFormatRoundTripsSensorId) {
+    SensorData tagged{1640995200000, 22.5, 45.3, 500.0};
+    tagged.sensorId = 42;
+    EXPECT_EQ(SensorData::fromString(tagged.toString()), tagged);
+
+    // Readings without a sensor id keep the original format
+    SensorData untagged{1640995200000, 22.5, 45.3, 500.0};
+    EXPECT_EQ(untagged.toString().find("Sensor"), std::string::npos);
+    EXPECT_EQ(SensorData::fromString(untagged.toString()), untagged);
+}
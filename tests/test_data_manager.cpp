@@ -3,11 +3,16 @@
 #include "SensorData.hpp"     // For creating SensorData objects
 #include "QueryCommon.hpp"    // For QueryResult, SortCriteria
 #include "AnomalyDetector.hpp"// For AnomalyThresholds
+#include "DataStorage.hpp"    // For persistence round trips
 
 #include <vector>
 #include <memory>      // For std::unique_ptr
 #include <algorithm>   // For std::all_of, std::find_if etc.
 #include <chrono>      // For creating timestamps for test data
+#include <cstdio>      // For std::remove
+#include <thread>      // For concurrent ingest during queries
+#include <atomic>      // For stopping concurrent readers
+#include <fstream>     // For writing fixture files
 
 // Test Fixture for DataManager tests
 class DataManagerTest : public ::testing::Test {
@@ -177,4 +182,1556 @@ TEST_F(DataManagerTest, FilterAnomalousAndSortByLightAscending) {
     for (const auto& res : results) {
         EXPECT_TRUE(res.isAnomalousFlag);
     }
-}
\ No newline at end of file
+}
+
+// Test case: Range queries at hourly resolution are served from the 1 hour tier
+TEST_F(DataManagerTest, RollupQueryUsesCoarsestMatchingTier) {
+    const int64_t hour = 60LL * 60 * 1000;
+    // Base time 1700000000s is 22:13:20 UTC, so keep offsets inside two aligned hours
+    int64_t firstHour = RollupTier::alignTimestamp(createData(0, 0, 0, 0).timestamp_ms, hour) + hour;
+    dm->addSensorData({firstHour + 1000, 20.0, 50.0, 300.0});
+    dm->addSensorData({firstHour + 2000, 24.0, 50.0, 300.0});
+    dm->addSensorData({firstHour + hour + 5000, 10.0, 50.0, 300.0}); // Anomalous, next hour
+
+    std::vector<RollupBucket> buckets = dm->queryRollups(firstHour, firstHour + 2 * hour, 2 * hour);
+
+    ASSERT_EQ(buckets.size(), 2);
+    EXPECT_EQ(buckets[0].bucketWidth_ms, hour);
+    EXPECT_EQ(buckets[0].bucketStart_ms, firstHour);
+    EXPECT_EQ(buckets[0].count, 2u);
+    EXPECT_DOUBLE_EQ(buckets[0].averageTemperature(), 22.0);
+    EXPECT_DOUBLE_EQ(buckets[0].temperature.max, 24.0);
+    EXPECT_EQ(buckets[1].count, 1u);
+    EXPECT_EQ(buckets[1].anomalyCount, 1u);
+}
+
+// Test case: A resolution finer than every tier is aggregated from raw history
+TEST_F(DataManagerTest, RollupQueryFallsBackToRawForFineResolution) {
+    dm->addSensorData(createData(0, 20.0, 50.0, 300.0));
+    dm->addSensorData(createData(100, 22.0, 50.0, 300.0));
+    dm->addSensorData(createData(20000, 24.0, 50.0, 300.0));
+
+    int64_t start = createData(0, 0, 0, 0).timestamp_ms;
+    std::vector<RollupBucket> buckets = dm->queryRollups(start, start + 60000, 10000);
+
+    ASSERT_EQ(buckets.size(), 2);
+    EXPECT_EQ(buckets[0].bucketWidth_ms, 10000);
+    EXPECT_EQ(buckets[0].count, 2u);
+    EXPECT_EQ(buckets[1].count, 1u);
+}
+
+// Test case: Rollup tiers are persisted and survive a save/load cycle
+TEST_F(DataManagerTest, RollupsPersistAcrossSaveAndLoad) {
+    const std::string binaryFile = "test_dm_rollup.bin";
+    const std::string rollupFile = binaryFile + ".rollup";
+    std::remove(binaryFile.c_str());
+    std::remove(rollupFile.c_str());
+    DataStorage storage(binaryFile, "test_dm_rollup.json");
+
+    dm->addSensorData(createData(0, 20.0, 50.0, 300.0));
+    dm->addSensorData(createData(1000, 30.5, 50.0, 300.0)); // Anomalous (temp high)
+    dm->saveToStorage(storage);
+
+    // A reading appended directly to storage after the save must still be folded in on load
+    storage.storeData(createData(2000, 25.0, 50.0, 300.0));
+
+    DataManager reloaded(defaultThresholds);
+    reloaded.loadFromStorage(storage);
+    const int64_t day = 24LL * 60 * 60 * 1000;
+    std::vector<RollupBucket> buckets = reloaded.queryRollups(0, createData(0, 0, 0, 0).timestamp_ms + day, day);
+
+    ASSERT_EQ(buckets.size(), 1);
+    EXPECT_EQ(buckets[0].count, 3u);
+    EXPECT_EQ(buckets[0].anomalyCount, 1u);
+    EXPECT_DOUBLE_EQ(buckets[0].temperature.max, 30.5);
+
+    std::remove(binaryFile.c_str());
+    std::remove(rollupFile.c_str());
+}
+
+// Test case: Readings stored after the rollups were saved are folded in on load even when they
+// are older than every bucket, as late readings are
+TEST_F(DataManagerTest, LateReadingsStoredAfterRollupSaveAreFolded) {
+    const std::string binaryFile = "test_dm_rollup_late.bin";
+    const std::string rollupFile = binaryFile + ".rollup";
+    std::remove(binaryFile.c_str());
+    std::remove(rollupFile.c_str());
+    DataStorage storage(binaryFile, "test_dm_rollup_late.json");
+    const int64_t day = 24LL * 60 * 60 * 1000;
+    const int64_t start = createData(0, 0, 0, 0).timestamp_ms;
+
+    dm->addSensorData(createData(0, 20.0, 50.0, 300.0));
+    dm->addSensorData(createData(2000, 21.0, 50.0, 300.0));
+    dm->saveToStorage(storage);
+    storage.storeData(createData(1000, 30.5, 50.0, 300.0)); // Late and anomalous
+
+    DataManager loaded(defaultThresholds);
+    loaded.loadFromStorage(storage);
+    std::vector<RollupBucket> buckets = loaded.queryRollups(start, start + day, day);
+    ASSERT_EQ(buckets.size(), 1u);
+    EXPECT_EQ(buckets[0].count, 3u);
+    EXPECT_EQ(buckets[0].anomalyCount, 1u);
+
+    // The server adds a reading before storing it; a checkpoint covers what was stored by then
+    loaded.addSensorData(createData(3000, 22.0, 50.0, 300.0));
+    storage.storeData(createData(3000, 22.0, 50.0, 300.0));
+    loaded.checkpointToStorage(storage);
+    storage.storeData(createData(1500, 23.0, 50.0, 300.0)); // Late again
+
+    DataManager reloaded(defaultThresholds);
+    reloaded.loadFromStorage(storage);
+    buckets = reloaded.queryRollups(start, start + day, day);
+    ASSERT_EQ(buckets.size(), 1u);
+    EXPECT_EQ(buckets[0].count, 5u);
+    EXPECT_EQ(buckets[0].anomalyCount, 1u);
+
+    DataManager mapped(defaultThresholds);
+    EXPECT_TRUE(mapped.mapFromStorage(storage));
+    buckets = mapped.queryRollups(start, start + day, day);
+    ASSERT_EQ(buckets.size(), 1u);
+    EXPECT_EQ(buckets[0].count, 5u);
+    EXPECT_EQ(buckets[0].anomalyCount, 1u);
+
+    std::remove(binaryFile.c_str());
+    std::remove(rollupFile.c_str());
+}
+
+TEST_F(DataManagerTest, CheckpointsDuringStoringIngestCountEveryReadingOnce) {
+    const std::string binaryFile = "test_dm_rollup_ingest.bin";
+    const std::string rollupFile = binaryFile + ".rollup";
+    std::remove(binaryFile.c_str());
+    std::remove(rollupFile.c_str());
+    const int64_t day = 24LL * 60 * 60 * 1000;
+    const int64_t start = createData(0, 0, 0, 0).timestamp_ms;
+    {
+        DataStorage storage(binaryFile, "test_dm_rollup_ingest.json");
+        std::atomic<bool> done{false};
+        std::thread writer([&]() {
+            for (int i = 0; i < 2000; ++i) {
+                // Stored and added the way the server does, every tenth one late
+                const int64_t offset = i % 10 == 9 ? (i - 50) * 10 : i * 10;
+                const std::shared_ptr<const AnomalyDetector> detector = dm->getAnomalyDetector();
+                const SensorData data = createData(offset, 20.0, 50.0, 300.0);
+                double deviation = 0.0;
+                const bool isAnomalous = detector->classify(data, deviation);
+                dm->addEnrichedData(QueryResult(data, isAnomalous, deviation), *detector, &storage);
+            }
+            done = true;
+        });
+        while (!done) {
+            dm->checkpointToStorage(storage);
+        }
+        writer.join();
+        dm->checkpointToStorage(storage);
+    }
+
+    DataStorage storage(binaryFile, "test_dm_rollup_ingest.json");
+    DataManager loaded(defaultThresholds);
+    loaded.loadFromStorage(storage);
+    std::vector<RollupBucket> buckets = loaded.queryRollups(start - day, start + day, day);
+    uint64_t count = 0;
+    for (const auto& bucket : buckets) {
+        count += bucket.count;
+    }
+    EXPECT_EQ(count, 2000u);
+
+    std::remove(binaryFile.c_str());
+    std::remove(rollupFile.c_str());
+}
+
+// Test case: Value-range filters work on the plain scan path
+TEST_F(DataManagerTest, FilterByValueRange) {
+    dm->addSensorData(createData(0, 36.0, 50.0, 300.0));
+    dm->addSensorData(createData(10, 22.0, 50.0, 60.0));
+    dm->addSensorData(createData(20, 38.5, 50.0, 90.0));
+    dm->addSensorData(createData(30, 20.0, 50.0, 120.0));
+
+    DataManager::QueryParams params;
+    params.temperatureRange = DataManager::ValueRange{35.0, std::numeric_limits<double>::infinity()};
+    std::vector<QueryResult> results = dm->queryData(params);
+    ASSERT_EQ(results.size(), 2);
+    EXPECT_DOUBLE_EQ(results[0].temperature, 36.0);
+    EXPECT_DOUBLE_EQ(results[1].temperature, 38.5);
+
+    params.lightRange = DataManager::ValueRange{50.0, 100.0};
+    results = dm->queryData(params);
+    ASSERT_EQ(results.size(), 1);
+    EXPECT_DOUBLE_EQ(results[0].temperature, 38.5);
+}
+
+// Test case: Index-served queries return exactly what the scan path returns
+TEST_F(DataManagerTest, IndexedQueriesMatchScanResults) {
+    DataManager scanOnly(defaultThresholds);
+    auto addBoth = [&](const SensorData& sd) {
+        dm->addSensorData(sd);
+        scanOnly.addSensorData(sd);
+    };
+    addBoth(createData(0, 25.0, 50.0, 300.0));
+    addBoth(createData(10, 10.0, 55.0, 80.0));
+    addBoth(createData(20, 31.0, 80.0, 60.0));
+    dm->setValueIndexesEnabled(true); // Built from existing history...
+    EXPECT_TRUE(dm->valueIndexesEnabled());
+    addBoth(createData(30, 22.0, 20.0, 1500.0)); // ...and maintained incrementally afterwards
+    addBoth(createData(40, 28.0, 65.0, 95.0));
+    addBoth(createData(50, 35.5, 40.0, 500.0));
+
+    std::vector<DataManager::QueryParams> queries(5);
+    queries[0].sortBy = SortCriteria::TEMP_DESC;
+    queries[1].sortBy = SortCriteria::LIGHT_ASC;
+    queries[1].lightRange = DataManager::ValueRange{50.0, 100.0};
+    queries[2].humidityRange = DataManager::ValueRange{30.0, 60.0};
+    queries[2].sortBy = SortCriteria::TIMESTAMP_DESC;
+    queries[3].filterAnomalousOnly = true;
+    queries[3].sortBy = SortCriteria::DEVIATION_DESC;
+    queries[4].temperatureRange = DataManager::ValueRange{40.0, 20.0}; // Empty range
+
+    for (const auto& params : queries) {
+        std::vector<QueryResult> indexed = dm->queryData(params);
+        std::vector<QueryResult> scanned = scanOnly.queryData(params);
+        ASSERT_EQ(indexed.size(), scanned.size());
+        for (size_t i = 0; i < indexed.size(); ++i) {
+            EXPECT_EQ(static_cast<SensorData>(indexed[i]), static_cast<SensorData>(scanned[i]));
+            EXPECT_EQ(indexed[i].isAnomalousFlag, scanned[i].isAnomalousFlag);
+        }
+    }
+}
+
+// Test case: Disabling indexes falls back to the scan path with identical results
+TEST_F(DataManagerTest, DisablingIndexesKeepsResults) {
+    dm->setValueIndexesEnabled(true);
+    dm->addSensorData(createData(0, 20.0, 50.0, 300.0));
+    dm->addSensorData(createData(10, 28.0, 50.0, 300.0));
+    dm->addSensorData(createData(20, 16.0, 50.0, 300.0));
+    dm->setValueIndexesEnabled(false);
+    EXPECT_FALSE(dm->valueIndexesEnabled());
+
+    DataManager::QueryParams params;
+    params.sortBy = SortCriteria::TEMP_ASC;
+    std::vector<QueryResult> results = dm->queryData(params);
+    ASSERT_EQ(results.size(), 3);
+    EXPECT_DOUBLE_EQ(results[0].temperature, 16.0);
+    EXPECT_DOUBLE_EQ(results[2].temperature, 28.0);
+}
+
+// Test case: The parallel query path returns the same rows in the same order as the serial one
+TEST_F(DataManagerTest, ParallelQueryMatchesSerialQuery) {
+    DataManager serial(defaultThresholds);
+    dm->setParallelQueryThreshold(1); // Force the parallel path even for a small history
+    dm->setQueryThreadCount(3);       // Odd thread count exercises the carried-over merge run
+
+    for (int i = 0; i < 1000; ++i) {
+        // Distinct values per metric keep the expected order unambiguous
+        SensorData sd = createData((i * 7919) % 1000, 10.0 + (i * 37 % 1000) * 0.03,
+                                   20.0 + (i * 53 % 1000) * 0.07, 50.0 + (i * 71 % 1000) * 1.1);
+        dm->addSensorData(sd);
+        serial.addSensorData(sd);
+    }
+
+    const SortCriteria criteria[] = {SortCriteria::TIMESTAMP_ASC, SortCriteria::TIMESTAMP_DESC,
+                                     SortCriteria::TEMP_ASC, SortCriteria::HUMIDITY_DESC,
+                                     SortCriteria::LIGHT_ASC};
+    for (SortCriteria sortBy : criteria) {
+        for (int filter = 0; filter < 3; ++filter) {
+            DataManager::QueryParams params;
+            params.sortBy = sortBy;
+            if (filter == 1) params.filterAnomalousOnly = true;
+            if (filter == 2) params.filterAnomalousOnly = false;
+
+            std::vector<QueryResult> parallelResults = dm->queryData(params);
+            std::vector<QueryResult> serialResults = serial.queryData(params);
+            ASSERT_EQ(parallelResults.size(), serialResults.size());
+            for (size_t i = 0; i < serialResults.size(); ++i) {
+                EXPECT_EQ(static_cast<SensorData>(parallelResults[i]), static_cast<SensorData>(serialResults[i]));
+            }
+        }
+    }
+}
+
+// Test case: visitQuery streams the same rows, in the same order, as queryData
+TEST_F(DataManagerTest, IndexedQueriesMatchScansAcrossSegmentsAndReloads) {
+    DataManager scanOnly(defaultThresholds);
+    dm->setSegmentLayout(32, 1000);
+    dm->setReorderBufferCapacity(8);
+    dm->setValueIndexesEnabled(true);
+    dm->setQueryCacheLimits(0, 0);
+    scanOnly.setQueryCacheLimits(0, 0);
+    auto addBoth = [&](const SensorData& sd) {
+        dm->addSensorData(sd);
+        scanOnly.addSensorData(sd);
+    };
+    for (int i = 0; i < 500; ++i) {
+        addBoth(createData(i * 10, 15.0 + (i * 37 % 200) * 0.1, 25.0 + (i * 53 % 30), 40.0 + (i * 71 % 500)));
+        if (i % 40 == 39) {
+            addBoth(createData((i - 30) * 10 + 5, 31.5, 90.0, 20.0)); // Late; some stay in the reorder buffer
+        }
+    }
+    ASSERT_GT(dm->getSegmentCount(), 10u);
+
+    const int64_t base = createData(0, 0, 0, 0).timestamp_ms;
+    std::vector<DataManager::QueryParams> queries(6);
+    queries[0].sortBy = SortCriteria::TEMP_ASC;
+    queries[1].sortBy = SortCriteria::HUMIDITY_DESC;
+    queries[1].timeRangeFilterMs = std::make_pair(base + 1234, base + 3456);
+    queries[2].lightRange = DataManager::ValueRange{100.0, 200.0};
+    queries[2].sortBy = SortCriteria::LIGHT_DESC;
+    queries[3].deviationRange = DataManager::ValueRange{0.5, 100.0};
+    queries[3].sortBy = SortCriteria::TIMESTAMP_ASC;
+    queries[4].filterAnomalousOnly = true;
+    queries[4].sortBy = SortCriteria::DEVIATION_DESC;
+    queries[5].temperatureRange = DataManager::ValueRange{20.0, 25.0};
+    queries[5].timeRangeFilterMs = std::make_pair(base + 2000, base + 4000);
+
+    // Equal keys may come out in another order, so rows are compared by their sort key and as sets
+    auto sortKey = [](const QueryResult& r, SortCriteria sortBy) {
+        switch (sortBy) {
+            case SortCriteria::TEMP_ASC:       return r.temperature;
+            case SortCriteria::HUMIDITY_DESC:  return r.humidity;
+            case SortCriteria::LIGHT_DESC:     return r.lightIntensity;
+            case SortCriteria::DEVIATION_DESC: return r.deviationValue;
+            default:                           return static_cast<double>(r.timestamp_ms);
+        }
+    };
+    auto expectSameResults = [&]() {
+        for (const auto& params : queries) {
+            std::vector<QueryResult> indexed = dm->queryData(params);
+            std::vector<QueryResult> scanned = scanOnly.queryData(params);
+            ASSERT_EQ(indexed.size(), scanned.size());
+            ASSERT_GT(indexed.size(), 0u);
+            for (size_t i = 0; i < indexed.size(); ++i) {
+                EXPECT_DOUBLE_EQ(sortKey(indexed[i], params.sortBy), sortKey(scanned[i], params.sortBy));
+            }
+            auto earlier = [](const QueryResult& a, const QueryResult& b) { return a.timestamp_ms < b.timestamp_ms; };
+            std::sort(indexed.begin(), indexed.end(), earlier);
+            std::sort(scanned.begin(), scanned.end(), earlier);
+            for (size_t i = 0; i < indexed.size(); ++i) {
+                EXPECT_EQ(static_cast<SensorData>(indexed[i]), static_cast<SensorData>(scanned[i]));
+                EXPECT_EQ(indexed[i].isAnomalousFlag, scanned[i].isAnomalousFlag);
+                EXPECT_DOUBLE_EQ(indexed[i].deviationValue, scanned[i].deviationValue);
+            }
+            EXPECT_EQ(dm->visitQuery(params, [](const QueryResult&) { return true; }), scanned.size());
+        }
+    };
+    expectSameResults();
+
+    // Reclassified segments carry their orders, the deviation one sorted again
+    AnomalyDetector::AnomalyThresholds strict = defaultThresholds;
+    strict.maxTemp = 26.0;
+    dm->setThresholdProfiles(ThresholdProfiles(strict));
+    scanOnly.setThresholdProfiles(ThresholdProfiles(strict));
+    expectSameResults();
+
+    // Disabling and enabling again swaps the orders out and back in
+    dm->setValueIndexesEnabled(false);
+    dm->setValueIndexesEnabled(true);
+    expectSameResults();
+}
+
+TEST_F(DataManagerTest, IndexWalksVisitWithoutHoldingTheLock) {
+    dm->setSegmentLayout(16, 1000);
+    dm->setValueIndexesEnabled(true);
+    for (int i = 0; i < 100; ++i) {
+        dm->addSensorData(createData(i * 10, 15.0 + i * 0.2, 50.0, 300.0));
+    }
+    std::vector<DataManager::QueryParams> queries(2);
+    queries[0].sortBy = SortCriteria::TEMP_DESC; // Walks an index in order
+    queries[1].temperatureRange = DataManager::ValueRange{20.0, 30.0}; // Narrows by an index, then sorts
+
+    for (const auto& params : queries) {
+        size_t before = dm->getDataCount();
+        // The visitor calls back into the manager, and ingest goes on meanwhile
+        size_t visited = dm->visitQuery(params, [&](const QueryResult& qr) {
+            dm->addSensorData(createData(100000 + static_cast<int64_t>(dm->getDataCount()), qr.temperature, 50.0, 300.0));
+            return true;
+        });
+        EXPECT_GT(visited, 0u);
+        EXPECT_EQ(dm->getDataCount(), before + visited);
+    }
+}
+
+TEST_F(DataManagerTest, VisitQueryMatchesQueryData) {
+    dm->addSensorData(createData(30, 25.0, 50.0, 300.0));
+    dm->addSensorData(createData(10, 10.0, 55.0, 80.0));
+    dm->addSensorData(createData(20, 31.0, 80.0, 60.0));
+    dm->addSensorData(createData(0, 22.0, 20.0, 1500.0));
+
+    std::vector<DataManager::QueryParams> queries(4);
+    queries[1].filterAnomalousOnly = true;
+    queries[1].sortBy = SortCriteria::DEVIATION_DESC;
+    queries[2].sortBy = SortCriteria::HUMIDITY_ASC;
+    queries[3].lightRange = DataManager::ValueRange{50.0, 400.0};
+    queries[3].sortBy = SortCriteria::TIMESTAMP_DESC;
+
+    for (bool indexed : {false, true}) {
+        dm->setValueIndexesEnabled(indexed);
+        for (const auto& params : queries) {
+            std::vector<QueryResult> expected = dm->queryData(params);
+            std::vector<SensorData> visited;
+            size_t count = dm->visitQuery(params, [&](const QueryResult& qr) {
+                visited.push_back(qr);
+                return true;
+            });
+            ASSERT_EQ(count, expected.size());
+            ASSERT_EQ(visited.size(), expected.size());
+            for (size_t i = 0; i < expected.size(); ++i) {
+                EXPECT_EQ(visited[i], static_cast<SensorData>(expected[i]));
+            }
+        }
+    }
+}
+
+// Test case: Returning false from the visitor stops the walk early
+TEST_F(DataManagerTest, VisitQueryStopsEarly) {
+    for (int i = 0; i < 10; ++i) {
+        dm->addSensorData(createData(i, 20.0 + i, 50.0, 300.0));
+    }
+    DataManager::QueryParams params;
+    params.sortBy = SortCriteria::TEMP_DESC;
+    std::vector<double> temps;
+    size_t count = dm->visitQuery(params, [&](const QueryResult& qr) {
+        temps.push_back(qr.temperature);
+        return temps.size() < 3;
+    });
+    EXPECT_EQ(count, 3u);
+    ASSERT_EQ(temps.size(), 3u);
+    EXPECT_DOUBLE_EQ(temps[0], 29.0);
+    EXPECT_DOUBLE_EQ(temps[2], 27.0);
+}
+
+// Test case: visitAllData exposes the raw history as spans without copying
+TEST_F(DataManagerTest, VisitAllDataYieldsSpans) {
+    dm->addSensorData(createData(0, 20.0, 50.0, 300.0));
+    dm->addSensorData(createData(10, 21.0, 51.0, 301.0));
+
+    size_t seen = 0;
+    size_t total = dm->visitAllData([&](const SensorData* rows, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            EXPECT_DOUBLE_EQ(rows[i].temperature, 20.0 + static_cast<double>(seen + i));
+        }
+        seen += count;
+        return true;
+    });
+    EXPECT_EQ(total, 2u);
+    EXPECT_EQ(seen, 2u);
+}
+
+TEST_F(DataManagerTest, SegmentsSealOnCapacityAndPartition) {
+    dm->setSegmentLayout(4, 1000);
+
+    for (int64_t ts = 0; ts < 10; ++ts) { // Fills two segments and starts a third
+        dm->addSensorData(createData(ts, 20.0, 50.0, 300.0));
+    }
+    EXPECT_EQ(dm->getSegmentCount(), 3u);
+
+    dm->addSensorData(createData(1500, 21.0, 51.0, 301.0)); // New partition seals the head early
+    EXPECT_EQ(dm->getSegmentCount(), 4u);
+    EXPECT_EQ(dm->getDataCount(), 11u);
+
+    std::vector<size_t> spanSizes;
+    dm->visitAllData([&](const SensorData*, size_t count) {
+        spanSizes.push_back(count);
+        return true;
+    });
+    EXPECT_EQ(spanSizes, (std::vector<size_t>{4, 4, 2, 1}));
+}
+
+TEST_F(DataManagerTest, LateReadingsRebuildOnlyTheSegmentsTheyFallInto) {
+    dm->setSegmentLayout(4, 1000);
+    dm->setReorderBufferCapacity(2);
+    for (int64_t ts = 0; ts < 20; ts += 2) {
+        dm->addSensorData(createData(ts, 20.0, 50.0, 300.0));
+    }
+    // Older than every segment but the first, and inside the head
+    dm->addSensorData(createData(3, 21.0, 50.0, 300.0));
+    dm->addSensorData(createData(17, 21.0, 50.0, 300.0));
+    EXPECT_EQ(dm->getReorderBufferSize(), 0u);
+
+    std::vector<size_t> spanSizes;
+    std::vector<int64_t> timestamps;
+    dm->visitAllData([&](const SensorData* rows, size_t count) {
+        spanSizes.push_back(count);
+        for (size_t i = 0; i < count; ++i) {
+            timestamps.push_back(rows[i].timestamp_ms);
+        }
+        return true;
+    });
+    // The first segment is split to stay within capacity, the middle one is left as it was and
+    // the head refills through the usual appends
+    EXPECT_EQ(spanSizes, (std::vector<size_t>{2, 3, 4, 3}));
+    EXPECT_TRUE(std::is_sorted(timestamps.begin(), timestamps.end()));
+    EXPECT_EQ(timestamps.size(), 12u);
+}
+
+TEST_F(DataManagerTest, SegmentsLateReadingsKeepFallingIntoStayWithinCapacity) {
+    dm->setSegmentLayout(64, 1000000);
+    dm->setReorderBufferCapacity(4);
+    for (int64_t ts = 0; ts < 2560; ts += 10) { // Four full segments
+        dm->addSensorData(createData(ts, 20.0, 50.0, 300.0));
+    }
+    // A sensor whose clock lags keeps reporting into the time range of the first segment
+    for (int i = 0; i < 1000; ++i) {
+        dm->addSensorData(createData(1 + (i * 7) % 630, 21.0, 50.0, 300.0));
+    }
+    EXPECT_EQ(dm->getReorderBufferSize(), 0u);
+
+    std::vector<size_t> spanSizes;
+    std::vector<int64_t> timestamps;
+    dm->visitAllData([&](const SensorData* rows, size_t count) {
+        spanSizes.push_back(count);
+        for (size_t i = 0; i < count; ++i) {
+            timestamps.push_back(rows[i].timestamp_ms);
+        }
+        return true;
+    });
+    for (size_t size : spanSizes) {
+        EXPECT_LE(size, 64u);
+    }
+    EXPECT_GE(dm->getSegmentCount(), 1256u / 64);
+    EXPECT_EQ(timestamps.size(), 1256u);
+    EXPECT_TRUE(std::is_sorted(timestamps.begin(), timestamps.end()));
+}
+
+TEST_F(DataManagerTest, SegmentedQueriesMatchAcrossPartitions) {
+    dm->setSegmentLayout(3, 100);
+    for (int64_t ts = 0; ts < 50; ++ts) {
+        dm->addSensorData(createData(ts * 10, 20.0 + (ts % 7), 50.0, 300.0));
+    }
+
+    const int64_t base = createData(0, 0, 0, 0).timestamp_ms;
+    DataManager::QueryParams params;
+    params.timeRangeFilterMs = std::make_pair(base + 95, base + 205);
+    params.sortBy = SortCriteria::TEMP_DESC;
+    std::vector<QueryResult> results = dm->queryData(params);
+    ASSERT_EQ(results.size(), 11u); // 100..200
+    for (const auto& r : results) {
+        EXPECT_GE(r.timestamp_ms, base + 100);
+        EXPECT_LE(r.timestamp_ms, base + 200);
+    }
+    EXPECT_TRUE(std::is_sorted(results.begin(), results.end(),
+        [](const QueryResult& a, const QueryResult& b) { return a.temperature > b.temperature; }));
+
+    std::vector<SensorData> all = dm->getAllData();
+    ASSERT_EQ(all.size(), 50u);
+    for (size_t i = 0; i < all.size(); ++i) {
+        EXPECT_EQ(all[i].timestamp_ms, base + static_cast<int64_t>(i) * 10);
+    }
+}
+
+TEST_F(DataManagerTest, QueriesSeeConsistentSnapshotsDuringIngest) {
+    dm->setSegmentLayout(64, 1000);
+    const int64_t total = 5000;
+    std::thread writer([&] {
+        for (int64_t ts = 0; ts < total; ++ts) {
+            dm->addSensorData(createData(ts, 20.0, 50.0, 300.0));
+        }
+    });
+
+    // Every snapshot must be a gap-free prefix of the ingested history
+    const int64_t base = createData(0, 0, 0, 0).timestamp_ms;
+    size_t lastCount = 0;
+    bool consistent = true;
+    while (consistent && lastCount < static_cast<size_t>(total)) {
+        std::vector<QueryResult> results = dm->queryData(DataManager::QueryParams{});
+        consistent = results.size() >= lastCount;
+        for (size_t i = 0; consistent && i < results.size(); ++i) {
+            consistent = (results[i].timestamp_ms == base + static_cast<int64_t>(i));
+        }
+        lastCount = results.size();
+    }
+    writer.join();
+    EXPECT_TRUE(consistent);
+    EXPECT_EQ(dm->getDataCount(), static_cast<size_t>(total));
+}
+
+TEST_F(DataManagerTest, QueryCacheHitsAndMergesAppendedTail) {
+    DataManager uncached(defaultThresholds);
+    uncached.setQueryCacheLimits(0, 0);
+    auto addBoth = [&](const SensorData& sd) {
+        dm->addSensorData(sd);
+        uncached.addSensorData(sd);
+    };
+    addBoth(createData(0, 35.0, 50.0, 300.0));
+    addBoth(createData(10, 20.0, 50.0, 300.0));
+    addBoth(createData(20, 10.0, 50.0, 300.0));
+
+    DataManager::QueryParams params;
+    params.filterAnomalousOnly = true;
+    params.sortBy = SortCriteria::DEVIATION_DESC;
+    EXPECT_EQ(dm->queryData(params).size(), 2u);
+    EXPECT_EQ(dm->queryData(params).size(), 2u);
+
+    // An unbounded range is normalized away, so this is the same cache entry
+    DataManager::QueryParams equivalent = params;
+    equivalent.humidityRange = DataManager::ValueRange{};
+    EXPECT_EQ(dm->queryData(equivalent).size(), 2u);
+
+    addBoth(createData(30, 40.0, 50.0, 300.0));
+    addBoth(createData(40, 22.0, 50.0, 300.0));
+    std::vector<QueryResult> patched = dm->queryData(params);
+    std::vector<QueryResult> expected = uncached.queryData(params);
+    ASSERT_EQ(patched.size(), expected.size());
+    for (size_t i = 0; i < patched.size(); ++i) {
+        EXPECT_EQ(patched[i].timestamp_ms, expected[i].timestamp_ms);
+    }
+
+    QueryCache::Stats stats = dm->getQueryCacheStats();
+    EXPECT_EQ(stats.misses, 1u);
+    EXPECT_EQ(stats.hits, 2u);
+    EXPECT_EQ(stats.incrementalHits, 1u);
+    EXPECT_EQ(stats.entries, 1u);
+    EXPECT_EQ(uncached.getQueryCacheStats().entries, 0u);
+
+    // Hits hand out the cached rows themselves, and so does a patch that adds no rows
+    std::shared_ptr<const std::vector<QueryResult>> shared = dm->querySharedData(params);
+    EXPECT_EQ(dm->querySharedData(params), shared);
+    dm->addSensorData(createData(50, 21.0, 50.0, 300.0)); // Not anomalous
+    EXPECT_EQ(dm->querySharedData(params), shared);
+    dm->addSensorData(createData(60, 41.0, 50.0, 300.0));
+    std::shared_ptr<const std::vector<QueryResult>> grown = dm->querySharedData(params);
+    EXPECT_NE(grown, shared);
+    EXPECT_EQ(grown->size(), shared->size() + 1);
+    EXPECT_EQ(dm->getQueryCacheStats().incrementalHits, 3u);
+}
+
+TEST_F(DataManagerTest, QueryCacheRecomputesBeyondTailWindowAndStaysBounded) {
+    dm->setQueryCacheLimits(2, 1000000);
+    DataManager::QueryParams params;
+    dm->addSensorData(createData(0, 20.0, 50.0, 300.0));
+    dm->queryData(params);
+
+    for (size_t i = 1; i <= DataManager::kQueryCacheTailWindow + 1; ++i) {
+        dm->addSensorData(createData(static_cast<int64_t>(i), 20.0, 50.0, 300.0));
+    }
+    EXPECT_EQ(dm->queryData(params).size(), DataManager::kQueryCacheTailWindow + 2);
+    EXPECT_EQ(dm->getQueryCacheStats().misses, 2u); // Too many appends to patch
+
+    for (int sort = 0; sort < 4; ++sort) {
+        params.sortBy = static_cast<SortCriteria>(sort);
+        dm->queryData(params);
+    }
+    QueryCache::Stats stats = dm->getQueryCacheStats();
+    EXPECT_EQ(stats.entries, 2u);
+    EXPECT_GE(stats.evictions, 2u);
+}
+
+TEST_F(DataManagerTest, ApproximatePercentilesOverallAndPerDay) {
+    EXPECT_FALSE(dm->approximateQuantile(DataManager::SensorMetric::TEMPERATURE, 0.95).has_value());
+
+    const int64_t day = DataManager::kQuantileWindowMs;
+    for (int i = 0; i < 1000; ++i) {
+        // Day 0 has temperatures 0..99.9, day 1 has 100..199.9
+        dm->addSensorData(createData(i % 10, (i % 1000) * 0.1, 50.0, 300.0));
+        dm->addSensorData(createData(day + i % 10, 100.0 + (i % 1000) * 0.1, 40.0, 300.0));
+    }
+
+    std::optional<double> p95 = dm->approximateQuantile(DataManager::SensorMetric::TEMPERATURE, 0.95);
+    ASSERT_TRUE(p95.has_value());
+    EXPECT_NEAR(*p95, 190.0, 4.0);
+
+    const int64_t base = createData(0, 0, 0, 0).timestamp_ms;
+    std::optional<double> firstDayMedian = dm->approximateQuantile(
+        DataManager::SensorMetric::TEMPERATURE, 0.5, std::make_pair(base, base + 10));
+    ASSERT_TRUE(firstDayMedian.has_value());
+    EXPECT_NEAR(*firstDayMedian, 50.0, 2.0);
+
+    auto daily = dm->approximateQuantileByWindow(DataManager::SensorMetric::HUMIDITY, 0.99,
+                                                 base, base + day + 10);
+    ASSERT_EQ(daily.size(), 2u);
+    EXPECT_DOUBLE_EQ(daily[0].second, 50.0);
+    EXPECT_DOUBLE_EQ(daily[1].second, 40.0);
+    EXPECT_LT(daily[0].first, daily[1].first);
+}
+
+TEST_F(DataManagerTest, FilterExpressionQueriesMatchOnEveryPath) {
+    for (int i = 0; i < 3000; ++i) {
+        dm->addSensorData(createData(i, 15.0 + (i * 37 % 200) * 0.1, 25.0 + (i * 53 % 300) * 0.1, 40.0 + (i * 71 % 500)));
+    }
+    std::string error;
+    DataManager::QueryParams params;
+    params.filter = FilterExpression::compile("temp > 28 AND (hum < 35 OR light < 80)", error);
+    ASSERT_TRUE(params.filter) << error;
+    params.sortBy = SortCriteria::TEMP_DESC;
+
+    size_t expected = 0;
+    for (const auto& sd : dm->getAllData()) {
+        expected += sd.temperature > 28 && (sd.humidity < 35 || sd.lightIntensity < 80);
+    }
+    ASSERT_GT(expected, 0u);
+
+    std::vector<QueryResult> scanned = dm->queryData(params);
+    EXPECT_EQ(scanned.size(), expected);
+    for (const auto& r : scanned) {
+        EXPECT_TRUE(r.temperature > 28 && (r.humidity < 35 || r.lightIntensity < 80));
+    }
+    EXPECT_EQ(dm->visitQuery(params, [](const QueryResult&) { return true; }), expected);
+
+    dm->setQueryCacheLimits(0, 0);
+    dm->setValueIndexesEnabled(true);
+    EXPECT_EQ(dm->queryData(params).size(), expected);
+    dm->setValueIndexesEnabled(false);
+    dm->setParallelQueryThreshold(1);
+    EXPECT_EQ(dm->queryData(params).size(), expected);
+}
+
+TEST_F(DataManagerTest, AggregateByTimeMatchesManualGrouping) {
+    dm->setSegmentLayout(7, 1000000); // Runs have to continue across segment boundaries
+    const int64_t base = createData(0, 0, 0, 0).timestamp_ms;
+    for (int i = 0; i < 100; ++i) {
+        dm->addSensorData(createData(i * 10, 10.0 + i, 50.0 - i * 0.1, 300.0 + (i % 3)));
+    }
+    dm->addSensorData(createData(5, 100.0, 50.0, 300.0)); // Late reading into the first bucket
+
+    DataManager::QueryParams params;
+    params.timeRangeFilterMs = std::make_pair(base, base + 499);
+    std::vector<RollupBucket> buckets = dm->aggregateByTime(params, 100);
+    ASSERT_EQ(buckets.size(), 5u);
+    EXPECT_EQ(buckets[0].bucketStart_ms, base);
+    EXPECT_EQ(buckets[0].count, 11u);
+    EXPECT_DOUBLE_EQ(buckets[0].temperature.max, 100.0);
+    EXPECT_DOUBLE_EQ(buckets[0].temperature.sum, 10.0 * 10 + 45.0 + 100.0);
+    EXPECT_EQ(buckets[0].anomalyCount, 6u); // Temperatures 10..14 are below minTemp, plus the late one
+    for (size_t b = 1; b < buckets.size(); ++b) {
+        EXPECT_EQ(buckets[b].count, 10u);
+        EXPECT_DOUBLE_EQ(buckets[b].temperature.min, 10.0 + b * 10);
+        EXPECT_DOUBLE_EQ(buckets[b].temperature.max, 19.0 + b * 10);
+        EXPECT_DOUBLE_EQ(buckets[b].lightIntensity.max, 302.0);
+        EXPECT_DOUBLE_EQ(buckets[b].averageTemperature(), 14.5 + b * 10);
+    }
+
+    // Row filters go through the same buckets
+    std::string error;
+    params.filter = FilterExpression::compile("temp >= 30 AND temp < 35", error);
+    buckets = dm->aggregateByTime(params, 100);
+    ASSERT_EQ(buckets.size(), 1u);
+    EXPECT_EQ(buckets[0].bucketStart_ms, base + 200);
+    EXPECT_EQ(buckets[0].count, 5u);
+    EXPECT_DOUBLE_EQ(buckets[0].averageTemperature(), 32.0);
+}
+
+// Test case: Interleaved readings are kept in timestamp order via the reorder buffer
+TEST_F(DataManagerTest, OutOfOrderReadingsAreMergedIntoTimestampOrder) {
+    dm->setSegmentLayout(16, 1000000);
+    dm->setReorderBufferCapacity(8);
+    const int64_t base = createData(0, 0, 0, 0).timestamp_ms;
+    // Two clients whose readings arrive slightly out of order
+    for (int i = 0; i < 200; ++i) {
+        int64_t offset = (i % 2 == 0) ? (i + 1) * 10 : (i - 1) * 10 + (i % 7 == 0 ? 5 : 0);
+        dm->addSensorData(createData(offset, 20.0 + (i % 5), 50.0, 300.0));
+    }
+    EXPECT_EQ(dm->getDataCount(), 200u);
+    EXPECT_LT(dm->getReorderBufferSize(), 8u);
+
+    auto isSortedBy = [](const std::vector<QueryResult>& results, bool ascending) {
+        for (size_t i = 1; i < results.size(); ++i) {
+            if (ascending ? results[i - 1].timestamp_ms > results[i].timestamp_ms
+                          : results[i - 1].timestamp_ms < results[i].timestamp_ms) {
+                return false;
+            }
+        }
+        return true;
+    };
+    DataManager::QueryParams params;
+    std::vector<QueryResult> ascending = dm->queryData(params);
+    ASSERT_EQ(ascending.size(), 200u);
+    EXPECT_TRUE(isSortedBy(ascending, true));
+    params.sortBy = SortCriteria::TIMESTAMP_DESC;
+    EXPECT_TRUE(isSortedBy(dm->queryData(params), false));
+
+    std::vector<int64_t> visited;
+    params.sortBy = SortCriteria::TIMESTAMP_ASC;
+    dm->visitQuery(params, [&](const QueryResult& r) { visited.push_back(r.timestamp_ms); return true; });
+    EXPECT_EQ(visited.size(), 200u);
+    EXPECT_TRUE(std::is_sorted(visited.begin(), visited.end()));
+
+    // Outside the reorder buffer the stored rows themselves are in order
+    std::vector<int64_t> stored;
+    dm->visitAllData([&](const SensorData* rows, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            stored.push_back(rows[i].timestamp_ms);
+        }
+        return true;
+    });
+    ASSERT_EQ(stored.size(), 200u);
+    EXPECT_TRUE(std::is_sorted(stored.begin(), stored.end() - dm->getReorderBufferSize()));
+
+    // Time ranges are answered from the sorted rows and the buffer alike
+    params.timeRangeFilterMs = std::make_pair(base + 500, base + 999);
+    size_t expected = 0;
+    for (int64_t ts : stored) {
+        expected += (ts >= base + 500 && ts <= base + 999) ? 1 : 0;
+    }
+    std::vector<QueryResult> ranged = dm->queryData(params);
+    EXPECT_EQ(ranged.size(), expected);
+    EXPECT_TRUE(isSortedBy(ranged, true));
+
+    // A parallel scan merges the same runs
+    params.timeRangeFilterMs.reset();
+    dm->setQueryCacheLimits(0, 0);
+    dm->setParallelQueryThreshold(1);
+    dm->setQueryThreadCount(3);
+    params.sortBy = SortCriteria::TIMESTAMP_DESC;
+    std::vector<QueryResult> parallel = dm->queryData(params);
+    EXPECT_EQ(parallel.size(), 200u);
+    EXPECT_TRUE(isSortedBy(parallel, false));
+}
+
+// Fixture for retention tests: owns the storage files evicted readings are written to
+class DataManagerRetentionTest : public DataManagerTest {
+protected:
+    const std::string binaryFile_ = "test_dm_retention.bin";
+    DataStorage storage_{binaryFile_, "test_dm_retention.json"};
+
+    void SetUp() override {
+        DataManagerTest::SetUp();
+        removeFiles();
+    }
+
+    void TearDown() override {
+        removeFiles();
+    }
+
+    void removeFiles() {
+        std::remove(binaryFile_.c_str());
+        std::remove((binaryFile_ + ".rollup").c_str());
+        std::remove((binaryFile_ + ".cold").c_str());
+        std::remove((binaryFile_ + ".segments").c_str());
+        std::remove((binaryFile_ + ".wal").c_str());
+        for (int i = 0; i < 64; ++i) {
+            std::remove((binaryFile_ + ".cold" + std::to_string(i)).c_str());
+            std::remove((binaryFile_ + ".seg" + std::to_string(i)).c_str());
+        }
+    }
+};
+
+// Test case: Count-based retention bounds memory while queries still see the whole history
+TEST_F(DataManagerRetentionTest, CountRetentionEvictsToDiskTransparently) {
+    DataManager::RetentionPolicy policy;
+    policy.maxCount = 10;
+    dm->setRetentionPolicy(policy, storage_);
+    for (int i = 0; i < 30; ++i) {
+        dm->addSensorData(createData(i * 1000, 20.0 + i * 0.1, 50.0, 300.0));
+    }
+
+    EXPECT_LE(dm->getDataCount(), 10u);
+    EXPECT_EQ(dm->getTotalDataCount(), 30u);
+
+    DataManager::QueryParams params;
+    std::vector<QueryResult> all = dm->queryData(params);
+    ASSERT_EQ(all.size(), 30u);
+    for (size_t i = 1; i < all.size(); ++i) {
+        EXPECT_LT(all[i - 1].timestamp_ms, all[i].timestamp_ms);
+    }
+
+    // A time range that lies entirely in evicted history is answered from disk
+    int64_t base = createData(0, 0, 0, 0).timestamp_ms;
+    params.timeRangeFilterMs = std::make_pair(base + 2000, base + 4000);
+    std::vector<QueryResult> old = dm->queryData(params);
+    ASSERT_EQ(old.size(), 3u);
+    EXPECT_EQ(old[0].timestamp_ms, base + 2000);
+
+    size_t streamed = 0;
+    EXPECT_EQ(dm->visitAllData([&](const SensorData*, size_t count) { streamed += count; return true; }), 30u);
+    EXPECT_EQ(streamed, 30u);
+    EXPECT_EQ(dm->getAllData().size(), 30u);
+}
+
+// Test case: Count retention evicts the oldest timestamps even when readings arrived late
+TEST_F(DataManagerRetentionTest, CountRetentionWithLateReadingsEvictsOldestTimestamps) {
+    dm->setReorderBufferCapacity(64); // Late readings are still buffered when eviction starts
+    DataManager::RetentionPolicy policy;
+    policy.maxCount = 20;
+    dm->setRetentionPolicy(policy, storage_);
+    for (int i = 0; i < 40; ++i) {
+        int64_t offset = (i % 3 == 2) ? (i - 2) * 1000 + 500 : i * 1000; // Every third one is late
+        dm->addSensorData(createData(offset, 22.0, 50.0, 300.0));
+    }
+    EXPECT_LE(dm->getDataCount(), 20u);
+    EXPECT_EQ(dm->getTotalDataCount(), 40u);
+
+    DataManager::QueryParams params;
+    std::vector<QueryResult> all = dm->queryData(params);
+    ASSERT_EQ(all.size(), 40u);
+    for (size_t i = 1; i < all.size(); ++i) {
+        EXPECT_LE(all[i - 1].timestamp_ms, all[i].timestamp_ms);
+    }
+}
+
+// Test case: Age-based retention keeps only the most recent window resident
+TEST_F(DataManagerRetentionTest, AgeRetentionAndLateReadings) {
+    DataManager::RetentionPolicy policy;
+    policy.maxAgeMs = 2000;
+    dm->setRetentionPolicy(policy, storage_);
+    for (int i = 0; i <= 10; ++i) {
+        dm->addSensorData(createData(i * 1000, 22.0, 50.0, 300.0));
+    }
+    EXPECT_EQ(dm->getDataCount(), 3u); // 8000, 9000 and 10000 ms
+
+    // A late reading inside the evicted range goes straight to disk
+    dm->addSensorData(createData(500, 10.0, 50.0, 300.0));
+    EXPECT_EQ(dm->getDataCount(), 3u);
+    EXPECT_EQ(dm->getTotalDataCount(), 12u);
+
+    DataManager::QueryParams params;
+    params.filterAnomalousOnly = true;
+    std::vector<QueryResult> anomalies = dm->queryData(params);
+    ASSERT_EQ(anomalies.size(), 1u);
+    EXPECT_DOUBLE_EQ(anomalies[0].temperature, 10.0);
+}
+
+// Test case: Evicted history is neither lost nor duplicated across a save/load cycle
+TEST_F(DataManagerRetentionTest, EvictedHistorySurvivesReload) {
+    DataManager::RetentionPolicy policy;
+    policy.maxCount = 5;
+    dm->setRetentionPolicy(policy, storage_);
+    for (int i = 0; i < 20; ++i) {
+        SensorData sd = createData(i * 1000, 20.0, 50.0, 300.0);
+        dm->addSensorData(sd);
+        storage_.storeData(sd); // Like the server, which appends every reading to the binary file
+    }
+
+    // Without a save the binary file still holds evicted readings; they must not be counted twice
+    DataManager unsaved(defaultThresholds);
+    unsaved.loadFromStorage(storage_);
+    EXPECT_EQ(unsaved.getTotalDataCount(), 20u);
+
+    dm->saveToStorage(storage_);
+
+    DataManager reloaded(defaultThresholds);
+    reloaded.setRetentionPolicy(policy, storage_);
+    reloaded.loadFromStorage(storage_);
+    EXPECT_LE(reloaded.getDataCount(), 5u);
+    EXPECT_EQ(reloaded.getTotalDataCount(), 20u);
+    EXPECT_EQ(reloaded.queryData(DataManager::QueryParams{}).size(), 20u);
+}
+
+// Test case: Cold files from before they were block files and had their own names (<binary>.seg<id>
+// listed in <binary>.segments, 32-byte records) are renamed and read, and the first late reading
+// appended to one rewrites it as blocks
+TEST_F(DataManagerRetentionTest, BaselineColdFilesAreRenamedReadAndAppendedTo) {
+    struct BaselineRecord {
+        int64_t timestamp_ms;
+        double temperature;
+        double humidity;
+        double lightIntensity;
+    };
+    static_assert(sizeof(BaselineRecord) == 32, "BaselineRecord is the baseline record layout");
+    const int64_t base = createData(0, 0, 0, 0).timestamp_ms;
+    std::vector<BaselineRecord> evicted;
+    for (int i = 0; i < 10; ++i) {
+        evicted.push_back({base + i * 1000, 22.0, 50.0, 300.0});
+    }
+    {
+        std::ofstream f(binaryFile_ + ".seg0", std::ios::binary);
+        f.write(reinterpret_cast<const char*>(evicted.data()), static_cast<std::streamsize>(evicted.size() * sizeof(BaselineRecord)));
+        const DataStorage::ColdFile catalog{0, base, base + 9000, 10};
+        std::ofstream c(binaryFile_ + ".segments", std::ios::binary);
+        c.write(reinterpret_cast<const char*>(&catalog), sizeof(catalog));
+    }
+
+    DataStorage storage(binaryFile_, "test_dm_retention.json");
+    EXPECT_FALSE(std::ifstream(binaryFile_ + ".segments").good());
+    EXPECT_FALSE(std::ifstream(binaryFile_ + ".seg0").good());
+    ASSERT_EQ(storage.loadColdCatalog().size(), 1u);
+
+    DataManager manager(defaultThresholds);
+    DataManager::RetentionPolicy policy;
+    policy.maxCount = 5;
+    manager.setRetentionPolicy(policy, storage);
+    manager.loadFromStorage(storage);
+    EXPECT_EQ(manager.getTotalDataCount(), 10u);
+    for (int i = 10; i < 13; ++i) {
+        manager.addSensorData(createData(i * 1000, 22.0, 50.0, 300.0));
+    }
+    manager.addSensorData(createData(4500, 10.0, 50.0, 300.0)); // Late, into the evicted range
+
+    std::vector<QueryResult> all = manager.queryData(DataManager::QueryParams{});
+    ASSERT_EQ(all.size(), 14u);
+    for (size_t i = 1; i < all.size(); ++i) {
+        EXPECT_LE(all[i - 1].timestamp_ms, all[i].timestamp_ms);
+    }
+    EXPECT_EQ(all[0].timestamp_ms, base);
+    EXPECT_DOUBLE_EQ(all[0].temperature, 22.0);
+    DataManager::QueryParams anomalous;
+    anomalous.filterAnomalousOnly = true;
+    std::vector<QueryResult> anomalies = manager.queryData(anomalous);
+    ASSERT_EQ(anomalies.size(), 1u);
+    EXPECT_EQ(anomalies[0].timestamp_ms, base + 4500);
+
+    BlockFile::Layout layout;
+    ASSERT_TRUE(BlockFile::readLayout(binaryFile_ + ".cold0", layout));
+    EXPECT_FALSE(layout.legacy);
+    EXPECT_EQ(storage.loadColdFile(0).size(), 11u);
+}
+
+// Test case: A shutdown checkpoint keeps the readings logged on arrival without rewriting the file
+TEST_F(DataManagerRetentionTest, CheckpointToStorageKeepsLoggedHistory) {
+    std::vector<SensorData> arrived;
+    for (int i = 0; i < 40; ++i) {
+        // Every tenth reading arrives late
+        SensorData sd = createData(i * 1000 - (i % 10 == 9 ? 4500 : 0), 20.0 + (i % 15), 50.0, 300.0);
+        dm->addSensorData(sd);
+        storage_.storeData(sd); // Like the server
+        arrived.push_back(sd);
+    }
+    dm->checkpointToStorage(storage_);
+    EXPECT_FALSE(storage_.loadRollupData().empty());
+    // Still in arrival order: the file was appended to, not rewritten from the sorted history
+    EXPECT_EQ(storage_.loadAllData(), arrived);
+
+    DataManager reloaded(defaultThresholds);
+    reloaded.loadFromStorage(storage_);
+    EXPECT_EQ(reloaded.getTotalDataCount(), 40u);
+    int64_t start = createData(0, 0, 0, 0).timestamp_ms;
+    std::vector<RollupBucket> expected = dm->queryRollups(start, start + 60000, 60000);
+    std::vector<RollupBucket> restored = reloaded.queryRollups(start, start + 60000, 60000);
+    ASSERT_EQ(restored.size(), expected.size());
+    for (size_t i = 0; i < expected.size(); ++i) {
+        EXPECT_EQ(restored[i].count, expected[i].count);
+        EXPECT_EQ(restored[i].anomalyCount, expected[i].anomalyCount);
+    }
+}
+
+// Test case: Readings arriving during a background load are neither lost nor counted twice
+TEST_F(DataManagerRetentionTest, BackgroundLoadHoldsBackLiveReadings) {
+    for (int i = 0; i < 3000; ++i) {
+        SensorData sd = createData(i * 10, 20.0 + (i % 10), 50.0, 300.0);
+        dm->addSensorData(sd);
+        storage_.storeData(sd);
+    }
+
+    auto runLoad = [&](DataManager& loading, int64_t liveOffset) {
+        loading.loadFromStorageInBackground(storage_);
+        for (int i = 0; i < 50; ++i) {
+            // Like the server: appended to the file and handed to the DataManager
+            SensorData live = createData(liveOffset + i * 10, 22.0, 50.0, 300.0);
+            storage_.storeData(live);
+            loading.addSensorData(live);
+            DataManager::LoadStatus status = loading.getLoadStatus();
+            if (status.loading) {
+                EXPECT_LE(status.loadedReadings, status.totalReadings);
+            }
+            loading.queryData(DataManager::QueryParams{}); // Partial results while loading
+        }
+        loading.waitForLoad();
+        DataManager::LoadStatus status = loading.getLoadStatus();
+        EXPECT_FALSE(status.loading);
+        EXPECT_EQ(status.pendingReadings, 0u);
+        EXPECT_EQ(status.loadedReadings, status.totalReadings);
+    };
+
+    // Mapped path
+    DataManager mapped(defaultThresholds);
+    runLoad(mapped, 100000);
+    EXPECT_EQ(mapped.getTotalDataCount(), 3050u);
+    EXPECT_EQ(mapped.queryData(DataManager::QueryParams{}).size(), 3050u);
+
+    // Streaming path: retention rules out mapping, and the file now holds the live readings too
+    DataManager streamed(defaultThresholds);
+    DataManager::RetentionPolicy policy;
+    policy.maxCount = 1000;
+    streamed.setRetentionPolicy(policy, storage_);
+    runLoad(streamed, 200000);
+    EXPECT_LE(streamed.getDataCount(), 1000u);
+    EXPECT_EQ(streamed.getTotalDataCount(), 3100u);
+    std::vector<QueryResult> all = streamed.queryData(DataManager::QueryParams{});
+    ASSERT_EQ(all.size(), 3100u);
+    for (size_t i = 1; i < all.size(); ++i) {
+        EXPECT_LT(all[i - 1].timestamp_ms, all[i].timestamp_ms);
+    }
+}
+
+// Test case: A mapped history file serves queries in place, with new readings on top
+TEST_F(DataManagerRetentionTest, MappedHistoryServesQueriesAndSummariesLazily) {
+    for (int i = 0; i < 50; ++i) {
+        dm->addSensorData(createData(i * 1000, 20.0 + (i % 10), 50.0, 300.0));
+    }
+    dm->saveToStorage(storage_);
+    std::vector<RollupBucket> savedMinutes = dm->queryRollups(createData(0, 0, 0, 0).timestamp_ms,
+                                                              createData(100000, 0, 0, 0).timestamp_ms, 60000);
+
+    DataManager mapped(defaultThresholds);
+    ASSERT_TRUE(mapped.mapFromStorage(storage_));
+    EXPECT_EQ(mapped.getDataCount(), 50u);
+
+    // New readings, including late ones, go on top of the mapped rows
+    mapped.addSensorData(createData(60000, 25.0, 50.0, 300.0));
+    mapped.addSensorData(createData(55000, 10.0, 50.0, 300.0));
+    mapped.addSensorData(createData(20500, 26.0, 50.0, 300.0));
+    EXPECT_EQ(mapped.getDataCount(), 53u);
+
+    DataManager::QueryParams params;
+    std::vector<QueryResult> all = mapped.queryData(params);
+    ASSERT_EQ(all.size(), 53u);
+    for (size_t i = 1; i < all.size(); ++i) {
+        EXPECT_LE(all[i - 1].timestamp_ms, all[i].timestamp_ms);
+    }
+    params.filterAnomalousOnly = true;
+    EXPECT_EQ(mapped.queryData(params).size(), 1u); // Only the 10 degree reading
+
+    // Rollups and percentiles include the base rows once they are asked for
+    std::vector<RollupBucket> minutes = mapped.queryRollups(createData(0, 0, 0, 0).timestamp_ms,
+                                                            createData(100000, 0, 0, 0).timestamp_ms, 60000);
+    uint64_t counted = 0;
+    for (const auto& bucket : minutes) {
+        counted += bucket.count;
+    }
+    uint64_t savedCount = 0;
+    for (const auto& bucket : savedMinutes) {
+        savedCount += bucket.count;
+    }
+    EXPECT_EQ(counted, savedCount + 3);
+    std::optional<double> maxTemp = mapped.approximateQuantile(DataManager::SensorMetric::TEMPERATURE, 1.0);
+    ASSERT_TRUE(maxTemp.has_value());
+    EXPECT_DOUBLE_EQ(*maxTemp, 29.0);
+
+    // Saving while mapped replaces the file underneath the mapping; both stay intact
+    mapped.saveToStorage(storage_);
+    EXPECT_EQ(mapped.queryData(DataManager::QueryParams{}).size(), 53u);
+    DataManager reloaded(defaultThresholds);
+    reloaded.loadFromStorage(storage_);
+    EXPECT_EQ(reloaded.getDataCount(), 53u);
+
+    // A retention policy copies the base into segments before evicting from it
+    DataManager::RetentionPolicy policy;
+    policy.maxCount = 20;
+    mapped.setRetentionPolicy(policy, storage_);
+    EXPECT_LE(mapped.getDataCount(), 20u);
+    EXPECT_EQ(mapped.getTotalDataCount(), 53u);
+    EXPECT_EQ(mapped.queryData(DataManager::QueryParams{}).size(), 53u);
+}
+
+// Test case: Queries over a mapped history leave out the blocks whose zone maps rule them out
+TEST_F(DataManagerRetentionTest, MappedHistoryQueriesMatchAStreamedLoad) {
+    for (int i = 0; i < 3000; ++i) {
+        // A hot spell in the middle of the history
+        storage_.storeData(createData(i * 1000, (i >= 1200 && i < 1300) ? 33.0 : 20.0 + (i % 5), 50.0, 300.0));
+    }
+    // Reads do not checkpoint, so the readings stored after this one stay in the log and are
+    // added to the mapped ones
+    ASSERT_TRUE(storage_.checkpoint());
+    for (int i = 3000; i < 3020; ++i) {
+        storage_.storeData(createData(i * 1000, 20.0, 50.0, 300.0));
+    }
+
+    DataManager mapped(defaultThresholds);
+    ASSERT_TRUE(mapped.mapFromStorage(storage_));
+    DataManager streamed(defaultThresholds);
+    streamed.loadFromStorage(storage_);
+
+    int64_t start = createData(0, 0, 0, 0).timestamp_ms;
+    std::vector<DataManager::QueryParams> queries(4);
+    queries[0].timeRangeFilterMs = std::make_pair(start + 2500000, start + 2600000);
+    queries[1].filterAnomalousOnly = true;
+    queries[2].temperatureRange = DataManager::ValueRange{32.0, 40.0};
+    queries[3].filterAnomalousOnly = false;
+    queries[3].timeRangeFilterMs = std::make_pair(start + 1000000, start + 1400000);
+    for (const auto& params : queries) {
+        std::vector<QueryResult> expected = streamed.queryData(params);
+        std::vector<QueryResult> actual = mapped.queryData(params);
+        ASSERT_EQ(actual.size(), expected.size());
+        for (size_t i = 0; i < expected.size(); ++i) {
+            EXPECT_EQ(actual[i].timestamp_ms, expected[i].timestamp_ms);
+            EXPECT_EQ(actual[i].isAnomalousFlag, expected[i].isAnomalousFlag);
+        }
+    }
+    EXPECT_EQ(mapped.queryData(queries[1]).size(), 100u);
+    EXPECT_EQ(mapped.getTotalDataCount(), 3020u);
+}
+
+// Test case: A compressed history file cannot be mapped, so it is loaded instead
+TEST_F(DataManagerRetentionTest, CompressedHistoryLoadsInsteadOfMapping) {
+    storage_.setStorageEncoding(BlockFile::Encoding::GORILLA);
+    for (int i = 0; i < 500; ++i) {
+        dm->addSensorData(createData(i * 1000, 20.0 + (i % 10), 50.0, 300.0));
+    }
+    dm->saveToStorage(storage_);
+
+    DataManager reloaded(defaultThresholds);
+    EXPECT_FALSE(reloaded.mapFromStorage(storage_));
+    EXPECT_EQ(reloaded.getDataCount(), 500u);
+    DataManager::QueryParams params;
+    params.filterAnomalousOnly = true;
+    EXPECT_EQ(reloaded.queryData(params).size(), dm->queryData(params).size());
+}
+
+TEST_F(DataManagerTest, StatisticalDetectionScoresLiveReadings) {
+    // History from storage is not replayed; only readings added afterwards are scored
+    dm->setStatisticalDetection(StatisticalDetector::Config());
+    for (int i = 0; i < 60; ++i) {
+        dm->addSensorData(createData(i * 1000, 20.0 + (i % 2) * 0.2, 45.0, 500.0));
+    }
+    dm->addSensorData(createData(60000, 26.5, 45.0, 500.0)); // Normal by the thresholds
+    dm->addSensorData(createData(61000, 20.1, 45.0, 500.0));
+
+    EXPECT_EQ(dm->getStatisticalAnomalyCount(), 1u);
+    std::vector<DataManager::StatisticalAnomaly> anomalies = dm->getStatisticalAnomalies();
+    ASSERT_EQ(anomalies.size(), 1u);
+    EXPECT_DOUBLE_EQ(anomalies[0].reading.temperature, 26.5);
+    EXPECT_GT(anomalies[0].assessment.zScores[0], 3.0);
+
+    // Threshold classification of the stored readings is unchanged
+    DataManager::QueryParams params;
+    params.filterAnomalousOnly = true;
+    EXPECT_TRUE(dm->queryData(params).empty());
+
+    dm->setStatisticalDetection(std::nullopt);
+    dm->addSensorData(createData(62000, 40.0, 45.0, 500.0));
+    EXPECT_EQ(dm->getStatisticalAnomalyCount(), 0u);
+    EXPECT_TRUE(dm->getStatisticalAnomalies().empty());
+}
+
+TEST_F(DataManagerTest, ThresholdProfilesClassifyPerSensor) {
+    SensorData classroom = createData(0, 34.0, 50.0, 500.0);
+    SensorData gym = createData(1000, 34.0, 50.0, 500.0);
+    gym.sensorId = 9;
+    dm->addSensorData(classroom);
+    dm->addSensorData(gym);
+    dm->setValueIndexesEnabled(true);
+
+    DataManager::QueryParams anomalous;
+    anomalous.filterAnomalousOnly = true;
+    EXPECT_EQ(dm->queryData(anomalous).size(), 2u); // Cached now; the profile change must drop it
+
+    ThresholdProfiles profiles(defaultThresholds);
+    AnomalyDetector::AnomalyThresholds gymThresholds = defaultThresholds;
+    gymThresholds.maxTemp = 36.0;
+    profiles.set(9, gymThresholds);
+    dm->setThresholdProfiles(profiles);
+    EXPECT_DOUBLE_EQ(dm->getThresholdProfiles().lookup(9).maxTemp, 36.0);
+
+    std::vector<QueryResult> results = dm->queryData(anomalous);
+    ASSERT_EQ(results.size(), 1u);
+    EXPECT_EQ(results[0].sensorId, 0u);
+    EXPECT_DOUBLE_EQ(results[0].deviationValue, 4.0);
+
+    // Filter expressions and the deviation index use the profiles as well
+    std::string error;
+    DataManager::QueryParams deviating;
+    deviating.filter = FilterExpression::compile("dev > 1", error);
+    ASSERT_TRUE(deviating.filter) << error;
+    EXPECT_EQ(dm->queryData(deviating).size(), 1u);
+    DataManager::QueryParams byDeviation;
+    byDeviation.deviationRange = DataManager::ValueRange{0.0, 0.0};
+    results = dm->queryData(byDeviation);
+    ASSERT_EQ(results.size(), 1u);
+    EXPECT_EQ(results[0].sensorId, 9u);
+}
+
+TEST_F(DataManagerTest, EnrichedReadingsKeepTheirClassificationOnlyWithSharedThresholds) {
+    const int64_t hour = 60LL * 60 * 1000;
+    int64_t firstHour = RollupTier::alignTimestamp(createData(0, 0, 0, 0).timestamp_ms, hour) + hour;
+    SensorData reading{firstHour + 1000, 20.0, 50.0, 300.0}; // Normal by the thresholds
+
+    // Classified by the manager's own detector: the flag is taken as given, not recomputed
+    dm->addEnrichedData(QueryResult(reading, true, 1.5), *dm->getAnomalyDetector());
+    // Classified with other thresholds: recomputed
+    AnomalyDetector::AnomalyThresholds strict = defaultThresholds;
+    strict.maxTemp = 18.0;
+    reading.timestamp_ms += 1000;
+    dm->addEnrichedData(QueryResult(reading, true, 2.0), AnomalyDetector(strict));
+
+    std::vector<RollupBucket> buckets = dm->queryRollups(firstHour, firstHour + hour, hour);
+    ASSERT_EQ(buckets.size(), 1u);
+    EXPECT_EQ(buckets[0].count, 2u);
+    EXPECT_EQ(buckets[0].anomalyCount, 1u);
+}
+
+TEST_F(DataManagerTest, AnomalyEpisodesAreTrackedAtIngestAndRebuiltOnLoad) {
+    // Two separate hot spells of many readings each
+    for (int i = 0; i < 200; ++i) {
+        double temp = (i < 50 || (i >= 100 && i < 150)) ? 31.0 + (i % 3) : 22.0;
+        dm->addSensorData(createData(i * 1000, temp, 50.0, 500.0));
+    }
+    EXPECT_EQ(dm->getAnomalyEpisodeCount(), 2u);
+    std::vector<AnomalyEpisode> episodes = dm->getAnomalyEpisodes();
+    ASSERT_EQ(episodes.size(), 2u);
+    EXPECT_EQ(episodes[0].count, 50u);
+    EXPECT_DOUBLE_EQ(episodes[0].peakValue, 33.0);
+    EXPECT_EQ(episodes[1].start_ms, createData(100000, 0, 0, 0).timestamp_ms);
+    EXPECT_EQ(dm->getAnomalyEpisodes(std::make_pair(createData(120000, 0, 0, 0).timestamp_ms,
+                                                    createData(130000, 0, 0, 0).timestamp_ms)).size(), 1u);
+
+    DataStorage storage("test_dm_episodes.bin", "test_dm_episodes.json");
+    dm->saveToStorage(storage);
+    DataManager reloaded(defaultThresholds);
+    reloaded.loadFromStorage(storage);
+    std::vector<AnomalyEpisode> replayed = reloaded.getAnomalyEpisodes();
+    ASSERT_EQ(replayed.size(), 2u);
+    EXPECT_EQ(replayed[1].count, episodes[1].count);
+    EXPECT_EQ(replayed[1].end_ms, episodes[1].end_ms);
+    std::remove("test_dm_episodes.bin");
+    std::remove("test_dm_episodes.bin.rollup");
+}
+
+TEST_F(DataManagerTest, ThresholdReloadReclassifiesHistoryAndRollups) {
+    const int64_t day = 24LL * 60 * 60 * 1000;
+    for (int i = 0; i < 100; ++i) {
+        dm->addSensorData(createData(i * 1000, 20.0 + i * 0.1, 50.0, 500.0)); // 20.0 .. 29.9 C
+    }
+    dm->setValueIndexesEnabled(true);
+    DataManager::QueryParams anomalous;
+    anomalous.filterAnomalousOnly = true;
+    EXPECT_TRUE(dm->queryData(anomalous).empty());
+    EXPECT_EQ(dm->getThresholdGeneration(), 0u);
+
+    AnomalyDetector::AnomalyThresholds strict = defaultThresholds;
+    strict.maxTemp = 25.0;
+    EXPECT_EQ(dm->reloadThresholdProfiles(ThresholdProfiles(strict)), 1u);
+    dm->waitForReclassification();
+    EXPECT_FALSE(dm->reclassificationPending());
+    EXPECT_EQ(dm->getThresholdGeneration(), 1u);
+    EXPECT_DOUBLE_EQ(dm->getAnomalyDetector()->thresholdsFor(0).maxTemp, 25.0);
+
+    EXPECT_EQ(dm->queryData(anomalous).size(), 49u); // 25.1 .. 29.9 C
+    // Rollup anomaly counts were rebuilt, not just the raw classification
+    uint64_t rollupAnomalies = 0;
+    for (const auto& bucket : dm->queryRollups(0, createData(0, 0, 0, 0).timestamp_ms + day, day)) {
+        rollupAnomalies += bucket.anomalyCount;
+    }
+    EXPECT_EQ(rollupAnomalies, 49u);
+    // So was the deviation index: the hottest reading now deviates most
+    DataManager::QueryParams byDeviation;
+    byDeviation.sortBy = SortCriteria::DEVIATION_DESC;
+    std::vector<QueryResult> sorted = dm->queryData(byDeviation);
+    ASSERT_EQ(sorted.size(), 100u);
+    EXPECT_NEAR(sorted[0].temperature, 29.9, 1e-9);
+    EXPECT_NEAR(sorted[0].deviationValue, 4.9, 1e-9);
+}
+
+TEST_F(DataManagerTest, ThresholdReloadKeepsRollupsOfReadingsNoLongerStored) {
+    const std::string binaryFile = "test_dm_reload_rollup.bin";
+    std::remove(binaryFile.c_str());
+    std::remove((binaryFile + ".rollup").c_str());
+    DataStorage storage(binaryFile, "test_dm_reload_rollup.json");
+    const int64_t day = 24LL * 60 * 60 * 1000;
+    const int64_t start = createData(0, 0, 0, 0).timestamp_ms;
+
+    dm->addSensorData(createData(-2 * day, 30.5, 50.0, 300.0)); // Anomalous
+    dm->addSensorData(createData(0, 25.2, 50.0, 300.0));
+    dm->addSensorData(createData(1000, 26.0, 50.0, 300.0));
+    dm->saveToStorage(storage);
+    // Only the newest reading is still stored, as after retention dropped the others
+    ASSERT_TRUE(storage.replaceAllData(std::vector<SensorData>{createData(1000, 26.0, 50.0, 300.0)}));
+
+    DataManager loaded(defaultThresholds);
+    loaded.loadFromStorage(storage);
+    AnomalyDetector::AnomalyThresholds strict = defaultThresholds;
+    strict.maxTemp = 25.5;
+    loaded.reloadThresholdProfiles(ThresholdProfiles(strict));
+    loaded.waitForReclassification();
+
+    std::vector<RollupBucket> buckets = loaded.queryRollups(start - 3 * day, start + day, day);
+    ASSERT_EQ(buckets.size(), 2u);
+    // No reading of the older day is at hand, so its bucket is kept as it was
+    EXPECT_EQ(buckets[0].count, 1u);
+    EXPECT_EQ(buckets[0].anomalyCount, 1u);
+    // The reading at hand is reclassified; the one gone keeps its verdict
+    EXPECT_EQ(buckets[1].count, 2u);
+    EXPECT_EQ(buckets[1].anomalyCount, 1u);
+    EXPECT_DOUBLE_EQ(buckets[1].temperature.min, 25.2);
+
+    std::remove(binaryFile.c_str());
+    std::remove((binaryFile + ".rollup").c_str());
+}
+
+TEST_F(DataManagerTest, ReplacedDetectorsAreFreedOnceReleased) {
+    dm->addSensorData(createData(0, 26.0, 50.0, 500.0));
+    std::shared_ptr<const AnomalyDetector> held = dm->getAnomalyDetector();
+    std::weak_ptr<const AnomalyDetector> released = dm->getAnomalyDetector();
+    AnomalyDetector::AnomalyThresholds strict = defaultThresholds;
+    for (int i = 0; i < 50; ++i) {
+        strict.maxTemp = 25.0 + i * 0.1;
+        dm->setThresholdProfiles(ThresholdProfiles(strict));
+        // Only the current generation is kept alive by the manager
+        EXPECT_EQ(dm->getAnomalyDetector().use_count(), 2) << i;
+    }
+    // A reader still holding the first generation keeps it intact; nothing else does
+    EXPECT_DOUBLE_EQ(held->thresholdsFor(0).maxTemp, defaultThresholds.maxTemp);
+    EXPECT_FALSE(released.expired());
+    held.reset();
+    EXPECT_TRUE(released.expired());
+    EXPECT_DOUBLE_EQ(dm->getAnomalyDetector()->thresholdsFor(0).maxTemp, strict.maxTemp);
+}
+
+TEST_F(DataManagerTest, StoredVerdictsFollowThresholdReloads) {
+    dm->setSegmentLayout(64, 100000);
+    dm->setReorderBufferCapacity(4);
+    dm->setQueryCacheLimits(0, 0);
+    for (int i = 0; i < 1000; ++i) {
+        dm->addSensorData(createData(i * 10, 22.0 + (i % 100) * 0.1, 50.0, 500.0));
+        if (i % 150 == 149) {
+            dm->addSensorData(createData((i - 100) * 10 + 5, 31.0, 50.0, 500.0)); // Late reading
+        }
+    }
+    std::string error;
+    DataManager::QueryParams params;
+    params.filter = FilterExpression::compile("anomalous OR dev > 3", error);
+    ASSERT_TRUE(params.filter) << error;
+
+    // Every path answers as a fresh classification under the thresholds in force
+    auto expectMatches = [&](double maxTemp) {
+        AnomalyDetector::AnomalyThresholds thresholds = defaultThresholds;
+        thresholds.maxTemp = maxTemp;
+        AnomalyDetector reference(thresholds);
+        size_t expected = 0;
+        for (const auto& sd : dm->getAllData()) {
+            double deviation = 0.0;
+            const bool isAnomalous = reference.classify(sd, deviation);
+            expected += isAnomalous || deviation > 3;
+        }
+        ASSERT_GT(expected, 0u);
+        dm->setParallelQueryThreshold(1000000);
+        std::vector<QueryResult> results = dm->queryData(params);
+        EXPECT_EQ(results.size(), expected);
+        for (const auto& r : results) {
+            double deviation = 0.0;
+            EXPECT_EQ(r.isAnomalousFlag, reference.classify(r, deviation));
+            EXPECT_DOUBLE_EQ(r.deviationValue, deviation);
+        }
+        dm->setParallelQueryThreshold(1);
+        EXPECT_EQ(dm->queryData(params).size(), expected);
+    };
+    expectMatches(defaultThresholds.maxTemp);
+
+    AnomalyDetector::AnomalyThresholds strict = defaultThresholds;
+    strict.maxTemp = 25.0;
+    dm->reloadThresholdProfiles(ThresholdProfiles(strict));
+    dm->waitForReclassification();
+    expectMatches(25.0);
+
+    // Readings appended after the reload are classified with the new thresholds as well
+    for (int i = 1000; i < 1100; ++i) {
+        dm->addSensorData(createData(i * 10, 22.0 + (i % 100) * 0.1, 50.0, 500.0));
+    }
+    expectMatches(25.0);
+}
+
+// Test case: Hits of the anomaly rules are stored with the readings, like threshold verdicts
+TEST_F(DataManagerTest, RuleHitsReachQueriesRollupsAndEpisodes) {
+    const std::string binaryFile = "test_dm_rules.bin";
+    std::remove(binaryFile.c_str());
+    std::remove((binaryFile + ".rollup").c_str());
+    dm->setSegmentLayout(64, 100000);
+    dm->setQueryCacheLimits(0, 0);
+    StuckSensorRule stuck;
+    stuck.maxRepeats = 3;
+    const DynamicRulePipeline rules({stuck, CrossMetricRule{}});
+    dm->setAnomalyRules(rules);
+
+    // Every reading is inside the thresholds. Humidity freezes for 20 readings (the last 16 are
+    // stuck), then 5 hot and humid ones follow later (the last of them stuck as well).
+    for (int i = 0; i < 300; ++i) {
+        double temp = 20.0 + (i % 10) * 0.1;
+        double hum = 40.0 + i % 7;
+        if (i >= 100 && i < 120) {
+            hum = 50.0;
+        } else if (i >= 200 && i < 205) {
+            temp = 29.0;
+            hum = 68.0;
+        }
+        dm->addSensorData(createData(i * 60000LL, temp, hum, 500.0 + i));
+    }
+    const size_t kRuleHits = 16 + 5;
+
+    auto expectRuleHits = [&](DataManager& manager) {
+        DataManager::QueryParams params;
+        params.filterAnomalousOnly = true;
+        std::vector<QueryResult> results = manager.queryData(params);
+        EXPECT_EQ(results.size(), kRuleHits);
+        EXPECT_EQ(manager.visitQuery(params, [](const QueryResult& r) { return r.isAnomalousFlag; }), kRuleHits);
+        params.sortBy = SortCriteria::TEMP_DESC;
+        EXPECT_EQ(manager.visitQuery(params, [](const QueryResult& r) { return r.isAnomalousFlag; }), kRuleHits);
+        uint64_t anomalies = 0;
+        for (const auto& bucket : manager.queryRollups(0, createData(300 * 60000LL, 0, 0, 0).timestamp_ms, 60000)) {
+            anomalies += bucket.anomalyCount;
+        }
+        EXPECT_EQ(anomalies, kRuleHits);
+    };
+    expectRuleHits(*dm);
+
+    // One episode per run of each rule
+    std::vector<AnomalyEpisode> episodes = dm->getAnomalyEpisodes();
+    ASSERT_EQ(episodes.size(), 3u);
+    EXPECT_EQ(std::count_if(episodes.begin(), episodes.end(), [](const AnomalyEpisode& e) { return e.rule == 0; }), 2);
+    auto crossMetric = std::find_if(episodes.begin(), episodes.end(), [](const AnomalyEpisode& e) { return e.rule == 1; });
+    ASSERT_NE(crossMetric, episodes.end());
+    EXPECT_EQ(crossMetric->count, 5u);
+
+    // A threshold reload replays the stateful rules over the history, so it keeps their hits
+    AnomalyDetector::AnomalyThresholds lenient = defaultThresholds;
+    lenient.maxTemp = 35.0;
+    dm->setThresholdProfiles(ThresholdProfiles(lenient));
+    EXPECT_EQ(dm->getAnomalyDetector()->ruleNames(), rules.ruleNames());
+    expectRuleHits(*dm);
+
+    // And so does loading the readings back
+    DataStorage storage(binaryFile, "test_dm_rules.json");
+    dm->saveToStorage(storage);
+    DataManager loaded(defaultThresholds);
+    loaded.setAnomalyRules(rules);
+    loaded.loadFromStorage(storage);
+    expectRuleHits(loaded);
+    EXPECT_EQ(loaded.getAnomalyEpisodeCount(), 3u);
+
+    std::remove(binaryFile.c_str());
+    std::remove((binaryFile + ".rollup").c_str());
+}
+
+TEST_F(DataManagerTest, ThresholdReloadsDuringIngestAndQueriesConverge) {
+    dm->setValueIndexesEnabled(true);
+    for (int i = 0; i < 20000; ++i) {
+        dm->addSensorData(createData(i * 1000, 15.0 + (i % 200) * 0.1, 50.0, 500.0));
+    }
+
+    std::atomic<bool> done{false};
+    std::thread writer([&]() {
+        for (int i = 20000; i < 30000; ++i) {
+            dm->addSensorData(createData(i * 1000, 15.0 + (i % 200) * 0.1, 50.0, 500.0));
+            if (i % 2000 == 0) {
+                dm->addSensorData(createData((i - 15000) * 1000 + 500, 40.0, 50.0, 500.0)); // Late reading
+            }
+        }
+        done = true;
+    });
+    std::thread reader([&]() {
+        DataManager::QueryParams anomalous;
+        anomalous.filterAnomalousOnly = true;
+        while (!done) {
+            std::vector<QueryResult> results = dm->queryData(anomalous);
+            for (const auto& result : results) {
+                ASSERT_TRUE(result.isAnomalousFlag);
+            }
+        }
+    });
+    for (double maxTemp = 30.0; maxTemp >= 26.0; maxTemp -= 1.0) {
+        AnomalyDetector::AnomalyThresholds thresholds = defaultThresholds;
+        thresholds.maxTemp = maxTemp;
+        dm->reloadThresholdProfiles(ThresholdProfiles(thresholds));
+        std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+    writer.join();
+    reader.join();
+    dm->waitForReclassification();
+    EXPECT_EQ(dm->getThresholdGeneration(), 5u);
+
+    // Every derived structure agrees with a fresh classification under the last thresholds
+    AnomalyDetector::AnomalyThresholds last = defaultThresholds;
+    last.maxTemp = 26.0;
+    AnomalyDetector reference(last);
+    size_t expected = 0;
+    for (const auto& sd : dm->getAllData()) {
+        expected += reference.isAnomalous(sd) ? 1 : 0;
+    }
+    DataManager::QueryParams anomalous;
+    anomalous.filterAnomalousOnly = true;
+    EXPECT_EQ(dm->queryData(anomalous).size(), expected);
+    uint64_t rollupAnomalies = 0;
+    for (const auto& bucket : dm->queryRollups(std::numeric_limits<int64_t>::min() / 2,
+                                               std::numeric_limits<int64_t>::max() / 2, 24LL * 60 * 60 * 1000)) {
+        rollupAnomalies += bucket.anomalyCount;
+    }
+    EXPECT_EQ(rollupAnomalies, expected);
+    DataManager::QueryParams byDeviation;
+    byDeviation.sortBy = SortCriteria::DEVIATION_DESC;
+    byDeviation.deviationRange = DataManager::ValueRange{0.001, std::numeric_limits<double>::infinity()};
+    EXPECT_EQ(dm->queryData(byDeviation).size(), expected);
+}
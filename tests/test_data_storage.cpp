@@ -1,10 +1,18 @@
 #include "gtest/gtest.h"
 #include "DataStorage.hpp"
+#include "GorillaCodec.hpp"
 #include "SensorData.hpp"
 #include <vector>
 #include <fstream>
+#include <optional>
 #include <cstdio> // For std::remove
 #include <chrono>
+#include <thread>
+#include <iterator>
+#include <filesystem>
+#include <cctype>
+#include <cmath>
+#include <random>
 #include <nlohmann/json.hpp> // For parsing JSON for verification
 
 // Helper to create SensorData for tests
@@ -29,12 +37,60 @@ protected:
         // Ensure files are clean before each test
         std::remove(testBinaryFile_.c_str());
         std::remove(testJsonReportFile_.c_str());
+        std::remove((testBinaryFile_ + ".rollup").c_str());
+        std::remove((testBinaryFile_ + ".wal").c_str());
+        removeSegmentFiles();
     }
 
     void TearDown() override {
         // Clean up files after each test
         std::remove(testBinaryFile_.c_str());
         std::remove(testJsonReportFile_.c_str());
+        std::remove((testBinaryFile_ + ".rollup").c_str());
+        std::remove((testBinaryFile_ + ".wal").c_str());
+        removeSegmentFiles();
+    }
+
+    // The manifest, segment files and their indexes of a split binary file (see SegmentedFile)
+    void removeSegmentFiles() {
+        std::remove((testBinaryFile_ + ".manifest").c_str());
+        std::remove((testBinaryFile_ + ".idx").c_str());
+        std::error_code error;
+        std::vector<std::filesystem::path> segments;
+        for (const auto& item : std::filesystem::directory_iterator(".", error)) {
+            const std::string name = item.path().filename().string();
+            if (name.rfind(testBinaryFile_ + ".", 0) == 0 &&
+                std::isdigit(static_cast<unsigned char>(name[testBinaryFile_.size() + 1]))) {
+                segments.push_back(item.path());
+            }
+        }
+        for (const auto& segment : segments) {
+            std::filesystem::remove(segment, error);
+        }
+    }
+
+    static SegmentedFile::Policy rollEvery(uint64_t bytes) {
+        SegmentedFile::Policy policy;
+        policy.maxSegmentBytes = bytes;
+        policy.mergeBelowBytes = 0;
+        policy.backgroundCompaction = false; // Tests compact when they choose to
+        return policy;
+    }
+
+    // Writes readings as they were stored before blocks and sensor ids: 32 bytes each, no header
+    void writeBaselineFile(const std::vector<SensorData>& readings) {
+        struct BaselineRecord {
+            int64_t timestamp_ms;
+            double temperature;
+            double humidity;
+            double lightIntensity;
+        };
+        static_assert(sizeof(BaselineRecord) == 32, "BaselineRecord is the baseline record layout");
+        std::ofstream f(testBinaryFile_, std::ios::binary);
+        for (const auto& data : readings) {
+            const BaselineRecord record{data.timestamp_ms, data.temperature, data.humidity, data.lightIntensity};
+            f.write(reinterpret_cast<const char*>(&record), sizeof(record));
+        }
     }
 
     // Helper to check if file exists
@@ -42,14 +98,25 @@ protected:
         std::ifstream f(filename.c_str());
         return f.good();
     }
+
+    static std::vector<char> readBytes(const std::string& filename) {
+        std::ifstream f(filename, std::ios::binary);
+        return std::vector<char>(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+    }
+
+    static void writeBytes(const std::string& filename, const std::vector<char>& bytes) {
+        std::ofstream f(filename, std::ios::binary | std::ios::trunc);
+        f.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    }
 };
 
 TEST_F(DataStorageTest, StoreSingleDataPoint) {
     SensorData data1 = createTestData(0, 22.5, 45.5, 300.0);
     EXPECT_TRUE(storage_.storeData(data1));
-    EXPECT_TRUE(fileExists(testBinaryFile_));
+    EXPECT_TRUE(fileExists(testBinaryFile_ + ".wal")); // Logged until the next checkpoint
 
     std::vector<SensorData> loadedData = storage_.loadAllData();
+    EXPECT_FALSE(fileExists(testBinaryFile_)); // Read from the log; reads do not checkpoint
     ASSERT_EQ(loadedData.size(), 1);
     EXPECT_EQ(loadedData[0], data1);
 }
@@ -61,15 +128,31 @@ TEST_F(DataStorageTest, StoreDataBatch) {
         createTestData(2000, 21.5, 45.0, 290.0)
     };
     EXPECT_TRUE(storage_.storeDataBatch(batch));
-    EXPECT_TRUE(fileExists(testBinaryFile_));
+    EXPECT_TRUE(fileExists(testBinaryFile_ + ".wal"));
 
     std::vector<SensorData> loadedData = storage_.loadAllData();
+    EXPECT_FALSE(fileExists(testBinaryFile_)); // Read from the log; reads do not checkpoint
     ASSERT_EQ(loadedData.size(), batch.size());
     for (size_t i = 0; i < batch.size(); ++i) {
         EXPECT_EQ(loadedData[i], batch[i]);
     }
 }
 
+TEST_F(DataStorageTest, SensorIdsArePersisted) {
+    std::vector<SensorData> batch = {createTestData(0, 22.5, 45.5, 300.0), createTestData(1000, 23.0, 46.0, 310.0)};
+    batch[0].sensorId = 3;
+    batch[1].sensorId = 4000000000u;
+    ASSERT_TRUE(storage_.storeDataBatch(batch));
+    EXPECT_EQ(storage_.loadAllData(), batch);
+
+    ASSERT_TRUE(storage_.exportAnomaliesToJson(batch));
+    std::ifstream jsonFile(testJsonReportFile_);
+    nlohmann::json report = nlohmann::json::parse(jsonFile);
+    ASSERT_EQ(report.size(), 2u);
+    EXPECT_EQ(report[0]["sensorId"].get<uint32_t>(), 3u);
+    EXPECT_EQ(report[1]["sensorId"].get<uint32_t>(), 4000000000u);
+}
+
 TEST_F(DataStorageTest, LoadAllDataEmptyFile) {
     std::vector<SensorData> loadedData = storage_.loadAllData();
     EXPECT_TRUE(loadedData.empty());
@@ -181,3 +264,735 @@ TEST_F(DataStorageTest, StoreToNonWritableBinaryPath) {
     EXPECT_FALSE(protectedStorage.storeData(data));
     std::remove("/hopefully_non_writable_path/data.bin");
 }
+
+TEST_F(DataStorageTest, ReplaceAndLoadRollupData) {
+    EXPECT_TRUE(storage_.loadRollupData().empty());
+
+    RollupTier tier(60000);
+    tier.add({120000, 20.0, 40.0, 300.0}, false);
+    tier.add({125000, 26.0, 50.0, 500.0}, true);
+    tier.add({185000, 22.0, 45.0, 400.0}, false);
+    EXPECT_TRUE(storage_.replaceRollupData(tier.allBuckets()));
+
+    std::vector<RollupBucket> loaded = storage_.loadRollupData();
+    ASSERT_EQ(loaded.size(), 2);
+    EXPECT_EQ(loaded[0].bucketStart_ms, 120000);
+    EXPECT_EQ(loaded[0].count, 2u);
+    EXPECT_EQ(loaded[0].anomalyCount, 1u);
+    EXPECT_DOUBLE_EQ(loaded[0].humidity.min, 40.0);
+    EXPECT_DOUBLE_EQ(loaded[0].humidity.max, 50.0);
+    EXPECT_EQ(loaded[1].bucketStart_ms, 180000);
+
+    // Replacing overwrites instead of appending
+    EXPECT_TRUE(storage_.replaceRollupData({}));
+    EXPECT_TRUE(storage_.loadRollupData().empty());
+}
+
+TEST_F(DataStorageTest, RollupDataKeepsCoveredPosition) {
+    RollupTier tier(60000);
+    tier.add({120000, 20.0, 40.0, 300.0}, false);
+    std::optional<uint64_t> covered;
+    EXPECT_TRUE(storage_.replaceRollupData(tier.allBuckets(), 7));
+    ASSERT_EQ(storage_.loadRollupData(&covered).size(), 1u);
+    ASSERT_TRUE(covered.has_value());
+    EXPECT_EQ(*covered, 7u);
+
+    EXPECT_TRUE(storage_.replaceRollupData(tier.allBuckets()));
+    ASSERT_EQ(storage_.loadRollupData(&covered).size(), 1u);
+    EXPECT_FALSE(covered.has_value());
+
+    // Files from before the header are a bare array of buckets, with no position
+    std::vector<RollupBucket> buckets = tier.allBuckets();
+    {
+        std::ofstream out(testBinaryFile_ + ".rollup", std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<const char*>(buckets.data()), buckets.size() * sizeof(RollupBucket));
+    }
+    std::vector<RollupBucket> loaded = storage_.loadRollupData(&covered);
+    ASSERT_EQ(loaded.size(), 1u);
+    EXPECT_EQ(loaded[0].bucketStart_ms, 120000);
+    EXPECT_EQ(loaded[0].count, 1u);
+    EXPECT_FALSE(covered.has_value());
+}
+
+TEST_F(DataStorageTest, MappedFileKeepsContentAcrossReplace) {
+    EXPECT_TRUE(storage_.mapAllData().files.empty()); // Nothing to map yet
+
+    std::vector<SensorData> original = {createTestData(0, 20.0, 40.0, 300.0), createTestData(1000, 21.0, 41.0, 310.0)};
+    ASSERT_TRUE(storage_.storeDataBatch(original));
+    ASSERT_TRUE(storage_.checkpoint());
+    MappedBlocks mapped = storage_.mapAllData();
+    ASSERT_FALSE(mapped.files.empty());
+    ASSERT_EQ(mapped.records, 2u);
+    ASSERT_EQ(mapped.blocks.size(), 1u);
+    const SensorData* rows = mapped.blocks[0].rows.data;
+    EXPECT_EQ(rows[0], original[0]);
+    EXPECT_EQ(rows[1], original[1]);
+
+    // Replacing the file swaps in a new one; the existing mapping still sees the old content
+    std::vector<SensorData> replacement = {createTestData(5000, 30.0, 60.0, 900.0)};
+    ASSERT_TRUE(storage_.replaceAllData(replacement));
+    EXPECT_EQ(rows[1], original[1]);
+    std::vector<SensorData> loaded = storage_.loadAllData();
+    ASSERT_EQ(loaded.size(), 1u);
+    EXPECT_EQ(loaded[0], replacement[0]);
+}
+
+TEST_F(DataStorageTest, ExportAnomaliesToJsonStreaming) {
+    std::vector<SensorData> anomalies = {
+        createTestData(0, 35.0, 80.0, 50.0),
+        createTestData(1000, 10.0, 20.0, 1500.0),
+        createTestData(2000, 12.0, 75.0, 90.0)
+    };
+    EXPECT_TRUE(storage_.exportAnomaliesToJson([&](const DataStorage::SensorDataSink& sink) {
+        for (const auto& data : anomalies) {
+            sink(data);
+        }
+    }));
+
+    std::ifstream jsonFile(testJsonReportFile_);
+    nlohmann::json j;
+    jsonFile >> j;
+    ASSERT_TRUE(j.is_array());
+    ASSERT_EQ(j.size(), 3);
+    for (size_t i = 0; i < anomalies.size(); ++i) {
+        EXPECT_EQ(j[i]["timestamp_ms"].get<int64_t>(), anomalies[i].timestamp_ms);
+        EXPECT_EQ(j[i]["temperature"].get<double>(), anomalies[i].temperature);
+    }
+}
+
+TEST_F(DataStorageTest, ExportEpisodesToJson) {
+    AnomalyEpisode episode;
+    episode.sensorId = 4;
+    episode.metric = RuleMetric::HUMIDITY;
+    episode.start_ms = 1000;
+    episode.end_ms = 61000;
+    episode.peakDeviation = 12.5;
+    episode.peakValue = 82.5;
+    episode.count = 40;
+    EXPECT_EQ(storage_.episodeReportPath(), "test_anomalies_episodes.json");
+    EXPECT_TRUE(storage_.exportEpisodesToJson({episode}));
+
+    std::ifstream jsonFile(storage_.episodeReportPath());
+    nlohmann::json j;
+    jsonFile >> j;
+    jsonFile.close();
+    std::remove(storage_.episodeReportPath().c_str());
+    ASSERT_TRUE(j.is_array());
+    ASSERT_EQ(j.size(), 1u);
+    EXPECT_EQ(j[0]["sensorId"].get<uint32_t>(), 4u);
+    EXPECT_EQ(j[0]["metric"].get<std::string>(), "humidity");
+    EXPECT_EQ(j[0]["end_ms"].get<int64_t>(), 61000);
+    EXPECT_DOUBLE_EQ(j[0]["peakValue"].get<double>(), 82.5);
+    EXPECT_EQ(j[0]["count"].get<uint64_t>(), 40u);
+    EXPECT_FALSE(j[0]["open"].get<bool>());
+}
+
+TEST_F(DataStorageTest, BufferedAppendsAreReadBackAndWrittenInBatches) {
+    BufferedAppender::Policy policy;
+    policy.durability = BufferedAppender::Durability::NONE;
+    policy.bufferRecords = 64;
+    policy.flushInterval_ms = 0; // Only full buffers and flushes write
+    storage_.setAppendPolicy(policy);
+
+    std::vector<SensorData> stored;
+    for (int i = 0; i < 100; ++i) {
+        stored.push_back(createTestData(i * 1000, 20.0 + i * 0.01, 45.0, 300.0));
+        ASSERT_TRUE(storage_.storeData(stored.back()));
+    }
+    BufferedAppender::Stats stats = storage_.appendStats();
+    EXPECT_EQ(stats.appended, 100u);
+    EXPECT_EQ(stats.writes, 1u); // The first 64 readings; the rest is still buffered
+    EXPECT_EQ(stats.syncs, 0u);
+
+    // Reads take the buffered readings from memory, writing nothing
+    EXPECT_EQ(storage_.recordCount(), 100u);
+    EXPECT_EQ(storage_.loadAllData(), stored);
+    stats = storage_.appendStats();
+    EXPECT_EQ(stats.writes, 1u);
+    EXPECT_EQ(stats.syncs, 0u);
+    EXPECT_TRUE(storage_.flush()); // Writes and syncs the rest
+    stats = storage_.appendStats();
+    EXPECT_EQ(stats.writes, 2u);
+    EXPECT_EQ(stats.syncs, 1u);
+}
+
+TEST_F(DataStorageTest, ConcurrentAppendsAreAllStored) {
+    BufferedAppender::Policy policy;
+    policy.durability = BufferedAppender::Durability::PER_BATCH;
+    storage_.setAppendPolicy(policy);
+
+    const int writers = 8;
+    const int perWriter = 250;
+    std::vector<std::thread> threads;
+    for (int w = 0; w < writers; ++w) {
+        threads.emplace_back([&, w]() {
+            for (int i = 0; i < perWriter; ++i) {
+                SensorData data{i, 20.0, 45.0, 300.0};
+                data.sensorId = static_cast<uint32_t>(w);
+                EXPECT_TRUE(storage_.storeData(data));
+            }
+        });
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    std::vector<SensorData> loaded = storage_.loadAllData();
+    ASSERT_EQ(loaded.size(), static_cast<size_t>(writers * perWriter));
+    std::vector<int64_t> next(writers, 0);
+    for (const auto& data : loaded) {
+        ASSERT_LT(data.sensorId, static_cast<uint32_t>(writers));
+        EXPECT_EQ(data.timestamp_ms, next[data.sensorId]++); // Each writer's readings stay in order
+    }
+    // Every batch was synced before storeData returned; waiting writers were committed together
+    BufferedAppender::Stats stats = storage_.appendStats();
+    EXPECT_EQ(stats.appended, static_cast<uint64_t>(writers * perWriter));
+    EXPECT_LE(stats.syncs, stats.appended);
+    EXPECT_EQ(stats.writes, stats.syncs);
+}
+
+TEST_F(DataStorageTest, PeriodicFlusherWritesIdleBuffers) {
+    BufferedAppender::Policy policy;
+    policy.flushInterval_ms = 10;
+    policy.syncInterval_ms = 10;
+    storage_.setAppendPolicy(policy);
+    ASSERT_TRUE(storage_.storeData(createTestData(0, 22.5, 45.5, 300.0)));
+
+    for (int i = 0; i < 200 && storage_.appendStats().syncs == 0; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    BufferedAppender::Stats stats = storage_.appendStats();
+    EXPECT_EQ(stats.writes, 1u);
+    EXPECT_EQ(stats.syncs, 1u);
+}
+
+TEST_F(DataStorageTest, LogReplaysOnlyWhatTheBaseIsMissingAfterACrash) {
+    BufferedAppender::Policy policy;
+    policy.durability = BufferedAppender::Durability::PER_BATCH; // One frame per batch
+    storage_.setAppendPolicy(policy);
+    const std::string logFile = testBinaryFile_ + ".wal";
+
+    std::vector<SensorData> checkpointed = {createTestData(0, 20.0, 40.0, 300.0), createTestData(1000, 21.0, 41.0, 310.0)};
+    ASSERT_TRUE(storage_.storeDataBatch(checkpointed));
+    ASSERT_TRUE(storage_.checkpoint());
+    EXPECT_FALSE(fileExists(logFile));
+
+    std::vector<SensorData> tail = {createTestData(2000, 22.0, 42.0, 320.0)};
+    std::vector<SensorData> last = {createTestData(3000, 23.0, 43.0, 330.0), createTestData(4000, 24.0, 44.0, 340.0)};
+    ASSERT_TRUE(storage_.storeDataBatch(tail));
+    ASSERT_TRUE(storage_.storeDataBatch(last));
+    const std::vector<char> log = readBytes(logFile); // The log as a crash would have left it
+    ASSERT_TRUE(storage_.checkpoint());
+    EXPECT_EQ(storage_.checkpointCount(), 2u);
+    std::vector<SensorData> all = checkpointed;
+    all.insert(all.end(), tail.begin(), tail.end());
+    all.insert(all.end(), last.begin(), last.end());
+    const std::vector<char> base = readBytes(testBinaryFile_);
+    const size_t header = sizeof(BlockFile::Header);
+    ASSERT_EQ(base.size(), header + all.size() * sizeof(SensorData));
+
+    // Crash before the checkpoint: the base lacks the tail, which is replayed
+    std::vector<char> oldBase(base.begin(), base.begin() + header + checkpointed.size() * sizeof(SensorData));
+    writeBytes(testBinaryFile_, oldBase);
+    writeBytes(logFile, log);
+    EXPECT_EQ(DataStorage(testBinaryFile_, testJsonReportFile_).loadAllData(), all);
+    EXPECT_FALSE(fileExists(logFile));
+
+    // Crash after the base was appended to, before the log was removed: nothing is added twice
+    writeBytes(logFile, log);
+    EXPECT_EQ(DataStorage(testBinaryFile_, testJsonReportFile_).loadAllData(), all);
+
+    // Crash halfway through appending to the base: the partial record is cut and the rest replayed
+    std::vector<char> partBase(base.begin(), base.begin() + header + 3 * sizeof(SensorData) + 7);
+    writeBytes(testBinaryFile_, partBase);
+    writeBytes(logFile, log);
+    EXPECT_EQ(DataStorage(testBinaryFile_, testJsonReportFile_).loadAllData(), all);
+
+    // A torn or corrupted frame ends the log
+    std::vector<char> corrupted = log;
+    corrupted[corrupted.size() - 3] ^= 0x40; // Inside the last frame
+    writeBytes(testBinaryFile_, oldBase);
+    writeBytes(logFile, corrupted);
+    std::vector<SensorData> upToTail = checkpointed;
+    upToTail.insert(upToTail.end(), tail.begin(), tail.end());
+    EXPECT_EQ(DataStorage(testBinaryFile_, testJsonReportFile_).loadAllData(), upToTail);
+
+    std::vector<char> torn(log.begin(), log.end() - 5);
+    writeBytes(testBinaryFile_, oldBase);
+    writeBytes(logFile, torn);
+    EXPECT_EQ(DataStorage(testBinaryFile_, testJsonReportFile_).loadAllData(), upToTail);
+}
+
+TEST_F(DataStorageTest, CheckpointsAppendToTheBaseInsteadOfRewritingIt) {
+    storage_.setCheckpointRecords(100);
+    std::vector<SensorData> stored;
+    for (int i = 0; i < 150; ++i) {
+        stored.push_back(createTestData(i * 1000, 20.0, 45.0, 300.0 + i));
+        ASSERT_TRUE(storage_.storeData(stored.back()));
+    }
+    EXPECT_EQ(storage_.checkpointCount(), 1u);
+    const size_t header = sizeof(BlockFile::Header);
+    EXPECT_EQ(readBytes(testBinaryFile_).size(), header + 100 * sizeof(SensorData));
+    std::shared_ptr<const MappedFile> before = MappedFile::open(testBinaryFile_);
+    ASSERT_NE(before, nullptr);
+
+    for (int i = 150; i < 250; ++i) {
+        stored.push_back(createTestData(i * 1000, 20.0, 45.0, 300.0 + i));
+        ASSERT_TRUE(storage_.storeData(stored.back()));
+    }
+    EXPECT_EQ(storage_.checkpointCount(), 2u);
+    EXPECT_EQ(readBytes(testBinaryFile_).size(), header + 200 * sizeof(SensorData));
+    // The earlier records were left in place
+    const SensorData* rows = reinterpret_cast<const SensorData*>(before->data() + header);
+    EXPECT_EQ(rows[99], stored[99]);
+    EXPECT_EQ(storage_.loadAllData(), stored);
+    EXPECT_EQ(storage_.checkpointCount(), 2u); // Reads do not checkpoint
+}
+
+TEST_F(DataStorageTest, LegacyFilesAreReadAndUpgradedToBlocks) {
+    // A file from before blocks: the records and nothing else
+    std::vector<SensorData> legacy;
+    for (int i = 0; i < 1500; ++i) {
+        legacy.push_back(createTestData(i * 1000, 20.0 + (i % 5), 45.0, 300.0));
+    }
+    writeBaselineFile(legacy);
+    EXPECT_EQ(storage_.recordCount(), legacy.size());
+    EXPECT_EQ(storage_.loadAllData(), legacy);
+    EXPECT_TRUE(storage_.mapAllData().files.empty()); // Cannot be viewed in place
+
+    // The first checkpoint that adds to it rewrites it as blocks
+    SensorData added = createTestData(2000000, 22.0, 45.0, 300.0);
+    ASSERT_TRUE(storage_.storeData(added));
+    ASSERT_TRUE(storage_.checkpoint());
+    legacy.push_back(added);
+    BlockFile::Layout layout;
+    ASSERT_TRUE(BlockFile::readLayout(testBinaryFile_, layout));
+    EXPECT_FALSE(layout.legacy);
+    EXPECT_EQ(layout.sealedBlocks, 1u);
+    EXPECT_EQ(layout.tailRecords, legacy.size() - BlockFile::kDefaultBlockRecords);
+    EXPECT_EQ(storage_.loadAllData(), legacy);
+    MappedBlocks mapped = storage_.mapAllData();
+    ASSERT_EQ(mapped.blocks.size(), 2u);
+    EXPECT_TRUE(mapped.blocks[0].zoned);
+    EXPECT_EQ(mapped.blocks[0].zone.count, BlockFile::kDefaultBlockRecords);
+    EXPECT_EQ(mapped.blocks[0].zone.minTimestamp_ms, legacy.front().timestamp_ms);
+    EXPECT_DOUBLE_EQ(mapped.blocks[0].zone.maxValue[0], 24.0);
+}
+
+TEST_F(DataStorageTest, BaselineFilesOf32ByteRecordsAreWidenedWhenUpgraded) {
+    std::vector<SensorData> expected;
+    for (int i = 0; i < 10; ++i) {
+        expected.push_back(createTestData(i * 1000, 20.0 + i, 45.0 - i, 300.0 + i));
+    }
+    writeBaselineFile(expected);
+    BlockFile::Layout layout;
+    ASSERT_TRUE(BlockFile::readLayout(testBinaryFile_, layout));
+    EXPECT_TRUE(layout.legacy);
+    EXPECT_EQ(layout.records, expected.size());
+    EXPECT_EQ(layout.validBytes, expected.size() * BlockFile::kLegacyRecordSize);
+    EXPECT_EQ(storage_.recordCount(), expected.size());
+    EXPECT_EQ(storage_.loadAllData(), expected);
+    EXPECT_TRUE(storage_.mapAllData().files.empty()); // Cannot be viewed in place
+
+    // The first checkpoint that adds to it rewrites every record as a SensorData
+    SensorData added = createTestData(20000, 22.0, 45.0, 300.0);
+    added.sensorId = 7;
+    ASSERT_TRUE(storage_.storeData(added));
+    ASSERT_TRUE(storage_.checkpoint());
+    expected.push_back(added);
+    ASSERT_TRUE(BlockFile::readLayout(testBinaryFile_, layout));
+    EXPECT_FALSE(layout.legacy);
+    EXPECT_EQ(layout.records, expected.size());
+    EXPECT_EQ(storage_.loadAllData(), expected);
+    MappedBlocks mapped = storage_.mapAllData();
+    ASSERT_EQ(mapped.blocks.size(), 1u);
+    EXPECT_EQ(mapped.blocks[0].rows.data[0], expected[0]);
+}
+
+TEST_F(DataStorageTest, LoadMatchingSkipsBlocksByTheirZoneMaps) {
+    // Three sealed blocks and a tail: normal, too hot, normal again, then a humid tail
+    std::vector<SensorData> stored;
+    for (int i = 0; i < 3500; ++i) {
+        const size_t block = i / BlockFile::kDefaultBlockRecords;
+        stored.push_back(createTestData(i * 1000, block == 1 ? 35.0 : 22.0, block == 3 ? 90.0 : 45.0, 300.0));
+    }
+    ASSERT_TRUE(storage_.storeDataBatch(stored));
+    ASSERT_TRUE(storage_.checkpoint());
+
+    AnomalyDetector detector;
+    ZoneFilter anomalous;
+    anomalous.anomalousOnly = &detector;
+    BlockFile::ScanStats stats;
+    std::vector<SensorData> matching = storage_.loadMatching(anomalous, &stats);
+    EXPECT_EQ(matching.size(), 1024u + 428u); // The hot block and the humid tail
+    EXPECT_EQ(stats.blocksRead, 2u);
+    EXPECT_EQ(stats.blocksSkipped, 2u);
+
+    ZoneFilter window;
+    window.timeRange = std::make_pair(stored[1100].timestamp_ms, stored[1200].timestamp_ms);
+    window.valueRange[0] = std::make_pair(30.0, 40.0);
+    stats = BlockFile::ScanStats();
+    matching = storage_.loadMatching(window, &stats);
+    EXPECT_EQ(matching, std::vector<SensorData>(stored.begin() + 1100, stored.begin() + 1201));
+    EXPECT_EQ(stats.blocksRead, 2u); // The tail has no footer yet, so it is always read
+    EXPECT_EQ(stats.blocksSkipped, 2u);
+
+    // Nothing this hot anywhere: every sealed block is skipped
+    ZoneFilter none;
+    none.valueRange[0] = std::make_pair(50.0, 60.0);
+    stats = BlockFile::ScanStats();
+    EXPECT_TRUE(storage_.loadMatching(none, &stats).empty());
+    EXPECT_EQ(stats.blocksRead, 1u);
+    EXPECT_EQ(stats.blocksSkipped, 3u);
+}
+
+TEST_F(DataStorageTest, GorillaKeepsItsRatioOnNoisyDataReadWhileStored) {
+    storage_.setStorageEncoding(BlockFile::Encoding::GORILLA);
+    // 40 sensors once a second with a few ms of jitter, every value moving on every reading:
+    // temperature and humidity random walks on a 0.1 grid, light a few lux of noise
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> step(-2, 2);
+    std::uniform_int_distribution<int> jitter(0, 3);
+    const uint32_t sensors = 40;
+    std::vector<double> temps(sensors, 22.0);
+    std::vector<double> hums(sensors, 45.0);
+    std::vector<SensorData> stored;
+    int64_t now = 1700000000000;
+    for (int t = 0; t < 5000; ++t) {
+        std::vector<SensorData> second;
+        for (uint32_t id = 1; id <= sensors; ++id) {
+            now += jitter(rng);
+            temps[id - 1] = std::round(temps[id - 1] * 10 + step(rng)) / 10;
+            hums[id - 1] = std::round(hums[id - 1] * 10 + step(rng)) / 10;
+            SensorData data{now, temps[id - 1], hums[id - 1], 400.0 + step(rng)};
+            data.sensorId = id;
+            second.push_back(data);
+        }
+        ASSERT_TRUE(storage_.storeDataBatch(second));
+        stored.insert(stored.end(), second.begin(), second.end());
+        // Read between appends, as the server's queries and load status do
+        if (t % 10 == 0) {
+            ASSERT_EQ(storage_.recordCount(), stored.size());
+        }
+        if (t % 1000 == 999) {
+            uint64_t position = 0;
+            ASSERT_TRUE(storage_.position(position));
+            EXPECT_EQ(position, stored.size());
+            EXPECT_EQ(storage_.loadAllData().size(), stored.size());
+        }
+    }
+    EXPECT_EQ(storage_.loadAllData(), stored);
+
+    // Only the checkpoints every 65536 readings wrote to the file, each a whole block
+    EXPECT_EQ(storage_.checkpointCount(), 3u);
+    BlockFile::Layout layout;
+    ASSERT_TRUE(BlockFile::readLayout(testBinaryFile_, layout));
+    EXPECT_EQ(layout.sealedBlocks, 3u);
+    EXPECT_EQ(layout.tailRecords, 0u);
+    EXPECT_EQ(layout.records, 3u * BlockFile::kDefaultEncodedBlockRecords);
+    // ...compressed as well as the codec does it in one go
+    size_t encodedBytes = sizeof(BlockFile::Header);
+    for (size_t first = 0; first < layout.records; first += BlockFile::kDefaultEncodedBlockRecords) {
+        std::vector<char> encoded;
+        GorillaCodec::encode(stored.data() + first, BlockFile::kDefaultEncodedBlockRecords, encoded);
+        encodedBytes += sizeof(BlockFile::EncodedBlockHeader) + sizeof(BlockZone) + encoded.size();
+    }
+    const size_t fileBytes = readBytes(testBinaryFile_).size();
+    EXPECT_EQ(fileBytes, encodedBytes);
+    EXPECT_LE(fileBytes * 3, layout.records * sizeof(SensorData)); // Noisy data: not the tenfold of steady readings
+}
+
+TEST_F(DataStorageTest, BlockMissingItsFooterIsSealedOnTheNextCheckpoint) {
+    std::vector<SensorData> stored;
+    for (size_t i = 0; i < BlockFile::kDefaultBlockRecords; ++i) {
+        stored.push_back(createTestData(static_cast<int64_t>(i) * 1000, 22.0, 45.0, 300.0));
+    }
+    ASSERT_TRUE(storage_.storeDataBatch(stored));
+    ASSERT_TRUE(storage_.checkpoint());
+
+    // A crash between the last record of the block and its footer, the footer half written
+    std::vector<char> bytes = readBytes(testBinaryFile_);
+    ASSERT_EQ(bytes.size(), sizeof(BlockFile::Header) + stored.size() * sizeof(SensorData) + sizeof(BlockZone));
+    bytes.resize(bytes.size() - sizeof(BlockZone) / 2);
+    writeBytes(testBinaryFile_, bytes);
+    EXPECT_EQ(storage_.loadAllData(), stored);
+
+    stored.push_back(createTestData(2000000, 35.0, 45.0, 300.0));
+    ASSERT_TRUE(storage_.storeData(stored.back()));
+    ASSERT_TRUE(storage_.checkpoint());
+    BlockFile::Layout layout;
+    ASSERT_TRUE(BlockFile::readLayout(testBinaryFile_, layout));
+    EXPECT_EQ(layout.sealedBlocks, 1u);
+    EXPECT_EQ(layout.tailRecords, 1u);
+    EXPECT_EQ(storage_.loadAllData(), stored);
+}
+
+TEST_F(DataStorageTest, GorillaFilesRoundTripCompressedAndSkipBlocks) {
+    storage_.setStorageEncoding(BlockFile::Encoding::GORILLA);
+    EXPECT_EQ(storage_.storageEncoding(), BlockFile::Encoding::GORILLA);
+    {
+        // Small blocks, which the file keeps, so a few thousand readings make several
+        BlockFileAppender base(testBinaryFile_, AnomalyDetector(), BlockFile::Encoding::GORILLA, 1000);
+        ASSERT_TRUE(base.open());
+        ASSERT_TRUE(base.close());
+    }
+    std::vector<SensorData> stored;
+    for (int i = 0; i < 3500; ++i) {
+        // A hot spell in the second block; values on a 0.1 grid, as sensors report them
+        const double temp = (i >= 1200 && i < 1300) ? 33.0 : 22.0 + (i / 100 % 5) / 10.0;
+        stored.push_back(createTestData(i * 1000, temp, 45.0, 300.0));
+    }
+    ASSERT_TRUE(storage_.storeDataBatch(stored));
+    EXPECT_EQ(storage_.loadAllData(), stored);
+    ASSERT_TRUE(storage_.checkpoint());
+
+    BlockFile::Layout layout;
+    ASSERT_TRUE(BlockFile::readLayout(testBinaryFile_, layout));
+    EXPECT_EQ(layout.encoding, BlockFile::Encoding::GORILLA);
+    EXPECT_EQ(layout.sealedBlocks, 4u); // The last one short
+    EXPECT_EQ(layout.records, stored.size());
+    EXPECT_LT(readBytes(testBinaryFile_).size() * 10, stored.size() * sizeof(SensorData));
+    EXPECT_TRUE(storage_.mapAllData().files.empty()); // Nothing to view in place
+
+    AnomalyDetector detector;
+    ZoneFilter anomalous;
+    anomalous.anomalousOnly = &detector;
+    BlockFile::ScanStats stats;
+    EXPECT_EQ(storage_.loadMatching(anomalous, &stats), std::vector<SensorData>(stored.begin() + 1200, stored.begin() + 1300));
+    EXPECT_EQ(stats.blocksRead, 1u);
+    EXPECT_EQ(stats.blocksSkipped, 3u);
+
+    size_t loaded = 0;
+    EXPECT_TRUE(storage_.loadColumns([&](const ColumnBatch& columns) {
+        EXPECT_EQ(columns.row(0), stored[loaded]);
+        loaded += columns.size();
+    }));
+    EXPECT_EQ(loaded, stored.size());
+
+    // Replacing writes a new file in the current encoding
+    storage_.setStorageEncoding(BlockFile::Encoding::RAW);
+    ASSERT_TRUE(storage_.replaceAllData(stored));
+    ASSERT_TRUE(BlockFile::readLayout(testBinaryFile_, layout));
+    EXPECT_EQ(layout.encoding, BlockFile::Encoding::RAW);
+    EXPECT_EQ(storage_.loadAllData(), stored);
+}
+
+TEST_F(DataStorageTest, AutomaticCheckpointsKeepPartialGorillaBlocksInTheLog) {
+    BufferedAppender::Policy policy;
+    policy.durability = BufferedAppender::Durability::PER_BATCH; // The log is complete at every step
+    storage_.setAppendPolicy(policy);
+    storage_.setCheckpointRecords(250);
+    {
+        BlockFileAppender base(testBinaryFile_, AnomalyDetector(), BlockFile::Encoding::GORILLA, 100);
+        ASSERT_TRUE(base.open());
+        ASSERT_TRUE(base.close());
+    }
+    const std::string logFile = testBinaryFile_ + ".wal";
+    std::vector<SensorData> stored;
+    std::vector<char> logBefore;
+    for (int i = 0; i < 250; ++i) {
+        stored.push_back(createTestData(i * 1000, 22.0 + (i % 3) / 10.0, 45.0, 300.0));
+        ASSERT_TRUE(storage_.storeData(stored.back()));
+        if (i == 248) {
+            logBefore = readBytes(logFile); // As a crash during the checkpoint would leave it
+        }
+    }
+    // Only whole blocks went to the base; the rest was logged again
+    EXPECT_EQ(storage_.checkpointCount(), 1u);
+    BlockFile::Layout layout;
+    ASSERT_TRUE(BlockFile::readLayout(testBinaryFile_, layout));
+    EXPECT_EQ(layout.sealedBlocks, 2u);
+    EXPECT_EQ(layout.records, 200u);
+    EXPECT_TRUE(fileExists(logFile));
+    const std::vector<char> base = readBytes(testBinaryFile_);
+    const std::vector<char> logAfter = readBytes(logFile);
+
+    // A restart replays the rest from either log
+    writeBytes(logFile, logAfter);
+    EXPECT_EQ(DataStorage(testBinaryFile_, testJsonReportFile_).loadAllData(), stored);
+    writeBytes(testBinaryFile_, base);
+    writeBytes(logFile, logBefore);
+    std::vector<SensorData> first249(stored.begin(), stored.end() - 1);
+    EXPECT_EQ(DataStorage(testBinaryFile_, testJsonReportFile_).loadAllData(), first249);
+
+    // A block cut short is dropped and replayed from the log that still holds it
+    std::vector<char> torn(base.begin(), base.end() - 10);
+    writeBytes(testBinaryFile_, torn);
+    writeBytes(logFile, logBefore);
+    EXPECT_EQ(DataStorage(testBinaryFile_, testJsonReportFile_).loadAllData(), first249);
+}
+
+TEST_F(DataStorageTest, RollingSegmentsKeepEveryReadingAcrossRestarts) {
+    std::vector<SensorData> stored;
+    for (int i = 0; i < 50; ++i) {
+        stored.push_back(createTestData(i * 1000, 20.0 + i / 10.0, 45.0, 300.0));
+    }
+    ASSERT_TRUE(storage_.storeDataBatch(stored)); // Before the split, into the binary file
+    ASSERT_TRUE(storage_.checkpoint());
+    ASSERT_TRUE(storage_.setSegmentPolicy(rollEvery(2000)));
+    EXPECT_TRUE(fileExists(testBinaryFile_ + ".manifest"));
+
+    storage_.setCheckpointRecords(100);
+    for (int i = 50; i < 550; ++i) {
+        stored.push_back(createTestData(i * 1000, 20.0 + i / 10.0, 45.0, 300.0));
+        ASSERT_TRUE(storage_.storeData(stored.back()));
+    }
+    // Every checkpoint found the active segment past 2000 bytes and started a new one
+    EXPECT_EQ(storage_.loadAllData(), stored);
+    EXPECT_EQ(storage_.segmentStats().rolls, 5u);
+    EXPECT_EQ(storage_.segmentStats().segments, 6u);
+    EXPECT_TRUE(fileExists(testBinaryFile_)); // Still the first segment
+    EXPECT_TRUE(fileExists(testBinaryFile_ + ".000005"));
+    EXPECT_EQ(storage_.recordCount(), stored.size());
+    ASSERT_TRUE(storage_.checkpoint()); // As on shutdown
+
+    // The manifest is read back without the policy being set again; appends go to the last segment
+    DataStorage reopened(testBinaryFile_, testJsonReportFile_);
+    EXPECT_EQ(reopened.loadAllData(), stored);
+    stored.push_back(createTestData(600000, 25.0, 45.0, 300.0));
+    ASSERT_TRUE(reopened.storeData(stored.back()));
+    EXPECT_EQ(reopened.loadAllData(), stored);
+    EXPECT_EQ(reopened.segmentStats().segments, 6u);
+    MappedBlocks mapped = reopened.mapAllData();
+    EXPECT_EQ(mapped.files.size(), 6u);
+    EXPECT_EQ(mapped.records, stored.size() - 1);
+    ASSERT_EQ(mapped.unsealed.size(), 1u); // Still in the log
+    EXPECT_EQ(mapped.unsealed[0], stored.back());
+}
+
+TEST_F(DataStorageTest, CompactionIndexesAndMergesSmallSegments) {
+    SegmentedFile::Policy policy = rollEvery(2000);
+    policy.mergeBelowBytes = 1 << 20;
+    ASSERT_TRUE(storage_.setSegmentPolicy(policy));
+    storage_.setCheckpointRecords(100);
+    std::vector<SensorData> stored;
+    for (int i = 0; i < 500; ++i) {
+        // Warm early on, cooler later, so the segments' zones tell them apart
+        stored.push_back(createTestData(i * 1000, i < 400 ? 26.0 : 19.0, 45.0, 300.0));
+        ASSERT_TRUE(storage_.storeData(stored.back()));
+    }
+    ASSERT_TRUE(storage_.checkpoint());
+    ASSERT_EQ(storage_.segmentStats().segments, 5u);
+
+    // The four sealed segments become one, indexed; the active one is left alone
+    ASSERT_TRUE(storage_.compactSegments());
+    SegmentedFile::Stats stats = storage_.segmentStats();
+    EXPECT_EQ(stats.indexed, 4u);
+    EXPECT_EQ(stats.merged, 4u);
+    EXPECT_EQ(stats.segments, 2u);
+    EXPECT_FALSE(fileExists(testBinaryFile_)); // Merged away
+    EXPECT_FALSE(fileExists(testBinaryFile_ + ".000001"));
+    EXPECT_TRUE(fileExists(testBinaryFile_ + ".000005.idx"));
+    EXPECT_EQ(storage_.loadAllData(), stored);
+
+    // A filter ruling out the merged segment's zone skips it unopened
+    ZoneFilter filter;
+    filter.valueRange[0] = std::make_pair(18.0, 20.0);
+    BlockFile::ScanStats scanStats;
+    std::vector<SensorData> cool(stored.begin() + 400, stored.end());
+    EXPECT_EQ(storage_.loadMatching(filter, &scanStats), cool);
+    EXPECT_GE(scanStats.blocksSkipped, 1u);
+
+    // Appends after compaction land after the merged readings, also after a restart
+    stored.push_back(createTestData(900000, 21.0, 45.0, 300.0));
+    ASSERT_TRUE(storage_.storeData(stored.back()));
+    EXPECT_EQ(storage_.loadAllData(), stored);
+    ASSERT_TRUE(storage_.checkpoint()); // As on shutdown
+    EXPECT_EQ(DataStorage(testBinaryFile_, testJsonReportFile_).loadAllData(), stored);
+}
+
+TEST_F(DataStorageTest, RetentionDropsOldSegmentsAndTheLogStillReplaysOnce) {
+    SegmentedFile::Policy policy = rollEvery(2000);
+    policy.retainMs = 24 * 3600 * 1000; // A day
+    ASSERT_TRUE(storage_.setSegmentPolicy(policy));
+    BufferedAppender::Policy appendPolicy;
+    appendPolicy.durability = BufferedAppender::Durability::PER_BATCH;
+    storage_.setAppendPolicy(appendPolicy);
+    storage_.setCheckpointRecords(100);
+    const int64_t weekAgo = -7 * 24 * 3600 * 1000LL;
+    std::vector<SensorData> recent;
+    for (int i = 0; i < 300; ++i) {
+        SensorData data = createTestData((i < 200 ? weekAgo : 0) + i * 1000, 22.0, 45.0, 300.0);
+        ASSERT_TRUE(storage_.storeData(data));
+        if (i >= 200) {
+            recent.push_back(data);
+        }
+    }
+    ASSERT_TRUE(storage_.checkpoint());
+    ASSERT_TRUE(storage_.compactSegments());
+    EXPECT_EQ(storage_.segmentStats().dropped, 2u);
+    EXPECT_EQ(storage_.loadAllData(), recent);
+    EXPECT_EQ(storage_.recordCount(), recent.size());
+
+    // A log left by a crash after its readings reached the base is not replayed again
+    const std::string logFile = testBinaryFile_ + ".wal";
+    std::vector<char> log;
+    for (int i = 0; i < 50; ++i) {
+        recent.push_back(createTestData(400000 + i * 1000, 23.0, 45.0, 300.0));
+        ASSERT_TRUE(storage_.storeData(recent.back()));
+    }
+    log = readBytes(logFile);
+    ASSERT_TRUE(storage_.checkpoint());
+    writeBytes(logFile, log);
+    EXPECT_EQ(DataStorage(testBinaryFile_, testJsonReportFile_).loadAllData(), recent);
+}
+
+TEST_F(DataStorageTest, ReplacingSegmentedDataLeavesOneSegment) {
+    ASSERT_TRUE(storage_.setSegmentPolicy(rollEvery(2000)));
+    storage_.setCheckpointRecords(100);
+    for (int i = 0; i < 300; ++i) {
+        ASSERT_TRUE(storage_.storeData(createTestData(i * 1000, 22.0, 45.0, 300.0)));
+    }
+    MappedBlocks before = storage_.mapAllData();
+    ASSERT_EQ(before.records, 300u);
+
+    std::vector<SensorData> replacement = {createTestData(0, 30.0, 60.0, 900.0)};
+    ASSERT_TRUE(storage_.replaceAllData(replacement));
+    EXPECT_EQ(storage_.segmentStats().segments, 1u);
+    EXPECT_EQ(storage_.loadAllData(), replacement);
+    EXPECT_EQ(before.blocks.back().rows.data[0].temperature, 22.0); // Mapped content outlives its files
+    EXPECT_FALSE(fileExists(testBinaryFile_ + ".000001"));
+    EXPECT_EQ(DataStorage(testBinaryFile_, testJsonReportFile_).loadAllData(), replacement);
+}
+
+TEST_F(DataStorageTest, BackgroundCompactionRunsBesideAppendsAndReads) {
+    std::vector<SensorData> stored;
+    {
+        DataStorage storage(testBinaryFile_, testJsonReportFile_);
+        SegmentedFile::Policy policy = rollEvery(4000);
+        policy.mergeBelowBytes = 1 << 20;
+        policy.maxSegmentBytes = 4000;
+        policy.backgroundCompaction = true;
+        policy.compactionInterval_ms = 1;
+        ASSERT_TRUE(storage.setSegmentPolicy(policy));
+        storage.setCheckpointRecords(100);
+
+        std::vector<std::thread> writers;
+        for (int w = 0; w < 4; ++w) {
+            writers.emplace_back([&storage, w]() {
+                for (int i = 0; i < 500; ++i) {
+                    SensorData data = createTestData(i * 1000, 22.0, 45.0, 300.0);
+                    data.sensorId = static_cast<uint32_t>(w + 1);
+                    storage.storeData(data);
+                }
+            });
+        }
+        size_t lastCount = 0;
+        for (int r = 0; r < 20; ++r) {
+            const size_t count = storage.loadAllData().size(); // Never loses what it saw before
+            EXPECT_GE(count, lastCount);
+            lastCount = count;
+        }
+        for (auto& writer : writers) {
+            writer.join();
+        }
+        ASSERT_TRUE(storage.checkpoint());
+        for (int wait = 0; wait < 200 && storage.segmentStats().merged == 0; ++wait) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        EXPECT_GT(storage.segmentStats().merged, 0u);
+        stored = storage.loadAllData();
+        EXPECT_EQ(stored.size(), 2000u);
+    }
+    EXPECT_EQ(DataStorage(testBinaryFile_, testJsonReportFile_).loadAllData(), stored);
+}
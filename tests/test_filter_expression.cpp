@@ -0,0 +1,69 @@
+#include "gtest/gtest.h"
+#include "FilterExpression.hpp"
+#include "AnomalyDetector.hpp"
+#include <string>
+#include <vector>
+
+class FilterExpressionTest : public ::testing::Test {
+protected:
+    AnomalyDetector::AnomalyThresholds thresholds;
+    AnomalyDetector detector{thresholds};
+    FilterExpression::Context context{detector};
+
+    std::shared_ptr<const FilterExpression> compile(const std::string& text) {
+        std::string error;
+        auto expression = FilterExpression::compile(text, error);
+        EXPECT_TRUE(expression) << text << ": " << error;
+        return expression;
+    }
+};
+
+TEST_F(FilterExpressionTest, PrecedenceAndCanonicalForm) {
+    auto a = compile("temp > 28 AND (humidity < 35 OR light < 80)");
+    auto b = compile("TEMPERATURE>28 && (hum<35 || light<80.0)");
+    ASSERT_TRUE(a && b);
+    EXPECT_EQ(a->canonical(), "(temperature > 28 AND (humidity < 35 OR light < 80))");
+    EXPECT_EQ(a->canonical(), b->canonical());
+
+    // AND binds tighter than OR
+    auto c = compile("temp > 28 and hum < 35 or normal");
+    ASSERT_TRUE(c);
+    EXPECT_EQ(c->canonical(), "((temperature > 28 AND humidity < 35) OR NOT anomalous)");
+
+    SensorData hotDry{0, 30.0, 30.0, 500.0};
+    SensorData hotHumid{0, 30.0, 50.0, 500.0};
+    EXPECT_TRUE(a->matches(hotDry, context));
+    EXPECT_FALSE(a->matches(hotHumid, context));
+}
+
+TEST_F(FilterExpressionTest, ReportsSyntaxErrors) {
+    for (const char* text : {"", "temp >", "temp > 28 AND", "(temp > 1", "pressure > 3", "temp ~ 3", "temp > 1 1"}) {
+        std::string error;
+        EXPECT_FALSE(FilterExpression::compile(text, error)) << text;
+        EXPECT_FALSE(error.empty()) << text;
+    }
+}
+
+TEST_F(FilterExpressionTest, BitmapEvaluationMatchesRowEvaluation) {
+    auto expression = compile("NOT (temp >= 20 AND temp <= 25) AND (dev > 5 OR anomalous) OR ts == 777");
+    ASSERT_TRUE(expression);
+
+    // More rows than one block, and not a multiple of 64, to cover block and tail handling
+    std::vector<SensorData> rows;
+    for (int i = 0; i < 5000; ++i) {
+        rows.push_back({i, 10.0 + (i * 37 % 250) * 0.1, 20.0 + (i * 53 % 600) * 0.1, 50.0 + (i * 71 % 1200)});
+    }
+    std::vector<uint64_t> selection;
+    expression->evaluate(rows.data(), rows.size(), context, selection);
+    ASSERT_EQ(selection.size(), (rows.size() + 63) / 64);
+
+    size_t selected = 0;
+    for (size_t i = 0; i < rows.size(); ++i) {
+        bool bit = (selection[i / 64] >> (i % 64)) & 1;
+        EXPECT_EQ(bit, expression->matches(rows[i], context)) << "row " << i;
+        selected += bit;
+    }
+    EXPECT_GT(selected, 0u);
+    EXPECT_LT(selected, rows.size());
+    EXPECT_EQ(selection.back() >> (rows.size() % 64), 0u); // No bits past the last row
+}
@@ -0,0 +1,136 @@
+#include "gtest/gtest.h"
+#include "GorillaCodec.hpp"
+#include "AnomalyDetector.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <vector>
+
+namespace {
+    SensorData reading(int64_t timestamp, double temp, double hum, double light, uint32_t sensorId) {
+        SensorData data{timestamp, temp, hum, light};
+        data.sensorId = sensorId;
+        return data;
+    }
+
+    // Bit for bit, so NaN payloads and negative zero count
+    bool sameBits(double a, double b) {
+        return std::memcmp(&a, &b, sizeof(double)) == 0;
+    }
+
+    void expectRoundTrip(const std::vector<SensorData>& rows) {
+        std::vector<char> encoded;
+        GorillaCodec::encode(rows.data(), rows.size(), encoded);
+        ColumnBatch columns;
+        ASSERT_TRUE(GorillaCodec::decode(encoded.data(), encoded.size(), rows.size(), columns));
+        ASSERT_EQ(columns.size(), rows.size());
+        for (size_t i = 0; i < rows.size(); ++i) {
+            EXPECT_EQ(columns.timestamps[i], rows[i].timestamp_ms) << "row " << i;
+            EXPECT_EQ(columns.sensorIds[i], rows[i].sensorId) << "row " << i;
+            EXPECT_TRUE(sameBits(columns.temperature[i], rows[i].temperature)) << "row " << i;
+            EXPECT_TRUE(sameBits(columns.humidity[i], rows[i].humidity)) << "row " << i;
+            EXPECT_TRUE(sameBits(columns.lightIntensity[i], rows[i].lightIntensity)) << "row " << i;
+        }
+    }
+
+    // sensors sampled once a second for seconds, in a shuffled order each second with a few ms of
+    // jitter; values on a 0.1 grid drifting slowly, as a room's would
+    std::vector<SensorData> classroomReadings(uint32_t sensors, int seconds) {
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> jitter(0, 3);
+        std::uniform_int_distribution<int> step(-1, 1);
+        std::vector<double> temps(sensors, 22.0);
+        std::vector<double> hums(sensors, 45.0);
+        std::vector<uint32_t> order(sensors);
+        for (uint32_t s = 0; s < sensors; ++s) {
+            order[s] = s + 1;
+        }
+        std::vector<SensorData> rows;
+        int64_t now = 1700000000000;
+        for (int t = 0; t < seconds; ++t) {
+            std::shuffle(order.begin(), order.end(), rng);
+            for (uint32_t id : order) {
+                now += jitter(rng);
+                if (t % 10 == 0) {
+                    temps[id - 1] = std::round(temps[id - 1] * 10 + step(rng)) / 10;
+                    hums[id - 1] = std::round(hums[id - 1] * 10 + step(rng)) / 10;
+                }
+                rows.push_back(reading(now, temps[id - 1], hums[id - 1], 400.0 + (t / 60) * 10, id));
+            }
+        }
+        return rows;
+    }
+}
+
+TEST(GorillaCodecTest, RoundTripsAnyValues) {
+    const double nan = std::numeric_limits<double>::quiet_NaN();
+    const double inf = std::numeric_limits<double>::infinity();
+    std::vector<SensorData> rows = {
+        reading(0, 0.0, -0.0, 1.0, 0),
+        reading(std::numeric_limits<int64_t>::max(), nan, inf, -inf, std::numeric_limits<uint32_t>::max()),
+        reading(std::numeric_limits<int64_t>::min(), std::numeric_limits<double>::denorm_min(),
+                std::numeric_limits<double>::max(), std::numeric_limits<double>::lowest(), 7),
+        reading(-5, 21.5, 40.0, 300.0, 7),
+        reading(-5, 21.5, 40.0, 300.0, 7), // Repeated exactly
+        reading(1000, 21.6, 40.1, 300.0, 8),
+        reading(999, 21.4, 39.9, 299.5, 7), // Out of order
+    };
+    expectRoundTrip(rows);
+    expectRoundTrip({rows[1]});
+    expectRoundTrip({});
+
+    std::mt19937_64 rng(7);
+    std::vector<SensorData> random;
+    for (int i = 0; i < 5000; ++i) {
+        uint64_t bits[3] = {rng(), rng(), rng()};
+        double values[3];
+        std::memcpy(values, bits, sizeof(values));
+        random.push_back(reading(static_cast<int64_t>(rng()), values[0], values[1], values[2], static_cast<uint32_t>(rng() % 5)));
+    }
+    expectRoundTrip(random);
+}
+
+TEST(GorillaCodecTest, CompressesInterleavedSensorsTenfold) {
+    std::vector<SensorData> rows = classroomReadings(200, 300);
+    expectRoundTrip(rows);
+
+    // One encoded block per 65536 readings, as the block file stores them
+    size_t encodedBytes = 0;
+    for (size_t first = 0; first < rows.size(); first += 65536) {
+        std::vector<char> encoded;
+        GorillaCodec::encode(rows.data() + first, std::min<size_t>(65536, rows.size() - first), encoded);
+        encodedBytes += encoded.size();
+    }
+    EXPECT_LE(encodedBytes * 10, rows.size() * sizeof(SensorData));
+}
+
+TEST(GorillaCodecTest, TruncatedInputFailsToDecode) {
+    std::vector<SensorData> rows = classroomReadings(5, 20);
+    std::vector<char> encoded;
+    GorillaCodec::encode(rows.data(), rows.size(), encoded);
+    for (size_t cut : {size_t{0}, size_t{7}, encoded.size() / 2, encoded.size() - 1}) {
+        ColumnBatch columns;
+        EXPECT_FALSE(GorillaCodec::decode(encoded.data(), cut, rows.size(), columns)) << "cut at " << cut;
+    }
+}
+
+TEST(GorillaCodecTest, DecodedColumnsFeedTheDetector) {
+    std::vector<SensorData> rows = classroomReadings(10, 50);
+    for (size_t i = 0; i < rows.size(); i += 37) {
+        rows[i].temperature = 35.0; // Too hot
+    }
+    std::vector<char> encoded;
+    GorillaCodec::encode(rows.data(), rows.size(), encoded);
+    ColumnBatch columns;
+    ASSERT_TRUE(GorillaCodec::decode(encoded.data(), encoded.size(), rows.size(), columns));
+
+    AnomalyDetector detector;
+    std::vector<uint64_t> fromRows((rows.size() + 63) / 64);
+    std::vector<uint64_t> fromColumns(fromRows.size());
+    detector.classifyBatch(rows.data(), rows.size(), fromRows.data(), nullptr);
+    detector.classifyColumns(columns.columns(0, columns.size()), fromColumns.data(), nullptr);
+    EXPECT_EQ(fromColumns, fromRows);
+    EXPECT_EQ(columns.row(37), rows[37]);
+}
@@ -0,0 +1,65 @@
+#include "gtest/gtest.h"
+#include "QuantileSketch.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+namespace {
+    // Fraction of values strictly below v, i.e. the rank the sketch's answer actually has
+    double rankOf(const std::vector<double>& sorted, double v) {
+        return static_cast<double>(std::lower_bound(sorted.begin(), sorted.end(), v) - sorted.begin()) / sorted.size();
+    }
+}
+
+TEST(QuantileSketchTest, EmptyAndExtremes) {
+    QuantileSketch sketch;
+    EXPECT_TRUE(std::isnan(sketch.quantile(0.5)));
+
+    for (int i = 1; i <= 10; ++i) {
+        sketch.add(i);
+    }
+    EXPECT_EQ(sketch.count(), 10u);
+    EXPECT_DOUBLE_EQ(sketch.quantile(0.0), 1.0);
+    EXPECT_DOUBLE_EQ(sketch.quantile(1.0), 10.0);
+    EXPECT_DOUBLE_EQ(sketch.quantile(0.5), 5.0); // Exact while nothing has been compacted
+}
+
+TEST(QuantileSketchTest, BoundedMemoryAndRankError) {
+    QuantileSketch sketch;
+    std::vector<double> values;
+    for (int i = 0; i < 200000; ++i) {
+        double v = static_cast<double>((i * 7919LL) % 200000); // A permutation of 0..199999
+        values.push_back(v);
+        sketch.add(v);
+    }
+    std::sort(values.begin(), values.end());
+
+    EXPECT_LT(sketch.retainedSamples(), 4u * QuantileSketch::kDefaultK);
+    for (double q : {0.01, 0.25, 0.5, 0.95, 0.99}) {
+        EXPECT_NEAR(rankOf(values, sketch.quantile(q)), q, 0.02) << "q=" << q;
+    }
+}
+
+TEST(QuantileSketchTest, MergeMatchesSingleStream) {
+    QuantileSketch low, high, all;
+    std::vector<double> values;
+    for (int i = 0; i < 50000; ++i) {
+        double a = i * 0.001;
+        double b = 100.0 + i * 0.002;
+        low.add(a);
+        high.add(b);
+        all.add(a);
+        all.add(b);
+        values.push_back(a);
+        values.push_back(b);
+    }
+    std::sort(values.begin(), values.end());
+    low.merge(high);
+
+    EXPECT_EQ(low.count(), all.count());
+    EXPECT_DOUBLE_EQ(low.min(), 0.0);
+    EXPECT_DOUBLE_EQ(low.max(), all.max());
+    for (double q : {0.1, 0.5, 0.9}) {
+        EXPECT_NEAR(rankOf(values, low.quantile(q)), q, 0.02) << "q=" << q;
+    }
+}
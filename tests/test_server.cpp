@@ -6,6 +6,7 @@
 #include <thread>
 #include <chrono>
 #include <atomic>
+#include <mutex>
 #ifdef _WIN32
 #include <winsock2.h>
 #pragma comment(lib, "ws2_32.lib")
@@ -172,6 +173,36 @@ TEST(ServerTest, ParsesRealSensorDataFormat) {
     EXPECT_GT(anomalies.size(), 0); // Should have at least one anomaly
 }
 
+// The callback gets the reading already classified, and the DataManager takes the same verdict
+TEST(ServerTest, CallbackReceivesClassifiedReadings) {
+    int port = 9094;
+    DataManager dataManager(AnomalyDetector::AnomalyThresholds{});
+    Server server(port, &dataManager, nullptr);
+
+    std::mutex resultsMutex;
+    std::vector<QueryResult> received;
+    server.setDataCallback([&](const QueryResult& data) {
+        std::lock_guard<std::mutex> lock(resultsMutex);
+        received.push_back(data);
+    });
+
+    server.start();
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    client_send_message("Timestamp (ms): 1640995200000, Temp: 35.00 C, Humidity: 45.00 %, Light: 500.00 lux", port);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    server.stop();
+
+    ASSERT_EQ(received.size(), 1u);
+    EXPECT_TRUE(received[0].isAnomalousFlag);
+    EXPECT_DOUBLE_EQ(received[0].deviationValue, 5.0); // 35 C against the 30 C limit
+
+    DataManager::QueryParams params;
+    params.filterAnomalousOnly = true;
+    std::vector<QueryResult> anomalies = dataManager.queryData(params);
+    ASSERT_EQ(anomalies.size(), 1u);
+    EXPECT_DOUBLE_EQ(anomalies[0].deviationValue, 5.0);
+}
+
 // More tests can be added for edge cases, stress, etc.
 
 int main(int argc, char **argv) {
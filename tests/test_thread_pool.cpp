@@ -0,0 +1,38 @@
+#include "gtest/gtest.h"
+#include "ThreadPool.hpp"
+#include <atomic>
+#include <stdexcept>
+#include <vector>
+
+TEST(ThreadPoolTest, RunsEveryIndexExactlyOnce) {
+    ThreadPool pool(4);
+    EXPECT_EQ(pool.size(), 4u);
+
+    std::vector<std::atomic<int>> hits(1000);
+    pool.parallelFor(hits.size(), [&](size_t i) { hits[i]++; });
+
+    for (const auto& hit : hits) {
+        EXPECT_EQ(hit.load(), 1);
+    }
+}
+
+TEST(ThreadPoolTest, DefaultSizeUsesAtLeastOneThread) {
+    ThreadPool pool;
+    EXPECT_GE(pool.size(), 1u);
+
+    std::atomic<int> sum{0};
+    pool.parallelFor(10, [&](size_t i) { sum += static_cast<int>(i); });
+    EXPECT_EQ(sum.load(), 45);
+}
+
+TEST(ThreadPoolTest, RethrowsTaskExceptions) {
+    ThreadPool pool(2);
+    EXPECT_THROW(pool.parallelFor(8, [](size_t i) {
+        if (i == 5) throw std::runtime_error("task failed");
+    }), std::runtime_error);
+
+    // The pool stays usable afterwards
+    std::atomic<int> count{0};
+    pool.parallelFor(3, [&](size_t) { count++; });
+    EXPECT_EQ(count.load(), 3);
+}